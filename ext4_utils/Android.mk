@@ -85,6 +85,18 @@ LOCAL_STATIC_LIBRARIES += \
 include $(BUILD_HOST_EXECUTABLE)
 
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := test_bitmap.c
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_MODULE := ext4_test_bitmap
+LOCAL_MODULE_TAGS := optional
+LOCAL_STATIC_LIBRARIES += \
+    libext4_utils \
+    libsparse \
+    libz
+include $(BUILD_HOST_EXECUTABLE)
+
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := mkuserimg.sh
 LOCAL_SRC_FILES := mkuserimg.sh
@@ -29,6 +29,27 @@ struct xattr_list_element {
 	struct xattr_list_element *next;
 };
 
+/* The free space between two consecutive chunks of a block group. Non-empty
+   holes are kept in a treap ordered by length and then by position, so that
+   best fit queries don't have to scan every chunk of every block group. The
+   holes of all block groups share one array in block group and chunk order,
+   which makes their addresses usable as the position. A binary tree over the
+   array keeps the longest hole under each node, to find holes in that order. */
+struct free_extent {
+	u32 len;
+	u32 priority;
+	int bg;
+	int chunk; /* the chunk preceding the hole */
+	struct free_extent *left;
+	struct free_extent *right;
+};
+
+static struct free_extent *free_extents;
+static struct free_extent *free_extent_root;
+static int free_extents_valid;
+static u32 *hole_max;
+static int hole_leaves;
+
 struct block_allocation *create_allocation()
 {
 	struct block_allocation *alloc = malloc(sizeof(struct block_allocation));
@@ -179,50 +200,220 @@ static void allocate_bg_inode_table(struct block_group_info *bg)
 	bg->flags &= ~EXT4_BG_INODE_UNINIT;
 }
 
-static int bitmap_set_bit(u8 *bitmap, u32 bit)
+static u32 hole_size(struct block_group_info *bg, int chunk)
 {
-	if (bitmap[bit / 8] & 1 << (bit % 8))
-		return 1;
+	u32 hole_start = bg->chunks[chunk].block + bg->chunks[chunk].len;
+	return bg->chunks[chunk + 1].block - hole_start;
+}
 
-	bitmap[bit / 8] |= 1 << (bit % 8);
-	return 0;
+static int free_extent_less(struct free_extent *a, struct free_extent *b)
+{
+	return a->len < b->len || (a->len == b->len && a < b);
+}
+
+static struct free_extent *free_extent_insert(struct free_extent *root,
+		struct free_extent *ext)
+{
+	struct free_extent *child;
+
+	if (root == NULL)
+		return ext;
+
+	if (free_extent_less(ext, root)) {
+		child = root->left = free_extent_insert(root->left, ext);
+		if (child->priority > root->priority) {
+			root->left = child->right;
+			child->right = root;
+			return child;
+		}
+	} else {
+		child = root->right = free_extent_insert(root->right, ext);
+		if (child->priority > root->priority) {
+			root->right = child->left;
+			child->left = root;
+			return child;
+		}
+	}
+
+	return root;
 }
 
-static int bitmap_set_8_bits(u8 *bitmap, u32 bit)
+static struct free_extent *free_extent_merge(struct free_extent *a,
+		struct free_extent *b)
 {
-	int ret = bitmap[bit / 8];
-	bitmap[bit / 8] = 0xFF;
-	return ret;
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+
+	if (a->priority > b->priority) {
+		a->right = free_extent_merge(a->right, b);
+		return a;
+	}
+
+	b->left = free_extent_merge(a, b->left);
+	return b;
 }
 
-/* Marks a the first num_blocks blocks in a block group as used, and accounts
- for them in the block group free block info. */
-static int reserve_blocks(struct block_group_info *bg, u32 bg_num, u32 start, u32 num)
+static struct free_extent *free_extent_remove(struct free_extent *root,
+		struct free_extent *ext)
 {
-	unsigned int i = 0;
+	if (root == ext)
+		return free_extent_merge(ext->left, ext->right);
 
-	u32 block = start;
-	for (i = 0; i < num && block % 8 != 0; i++, block++) {
-		if (bitmap_set_bit(bg->block_bitmap, block)) {
-			error("attempted to reserve already reserved block %d in block group %d", block, bg_num);
-			return -1;
+	if (free_extent_less(ext, root))
+		root->left = free_extent_remove(root->left, ext);
+	else
+		root->right = free_extent_remove(root->right, ext);
+
+	return root;
+}
+
+/* Returns the shortest hole of at least len blocks, the first one if there
+   are several, or NULL if there is none */
+static struct free_extent *free_extent_find(u32 len)
+{
+	struct free_extent *ext = free_extent_root;
+	struct free_extent *best = NULL;
+
+	while (ext) {
+		if (ext->len >= len) {
+			best = ext;
+			ext = ext->left;
+		} else {
+			ext = ext->right;
 		}
 	}
 
-	for (; i + 8 <= (num & ~7); i += 8, block += 8) {
-		if (bitmap_set_8_bits(bg->block_bitmap, block)) {
-			error("attempted to reserve already reserved block %d in block group %d", block, bg_num);
-			return -1;
+	return best;
+}
+
+/* Returns the hole after the given one in the treap order, or NULL */
+static struct free_extent *free_extent_next(struct free_extent *prev)
+{
+	struct free_extent *ext = free_extent_root;
+	struct free_extent *next = NULL;
+
+	while (ext) {
+		if (free_extent_less(prev, ext)) {
+			next = ext;
+			ext = ext->left;
+		} else {
+			ext = ext->right;
 		}
 	}
 
-	for (; i < num; i++, block++) {
-		if (bitmap_set_bit(bg->block_bitmap, block)) {
-			error("attempted to reserve already reserved block %d in block group %d", block, bg_num);
+	return next;
+}
+
+static void hole_max_update(int hole, u32 len)
+{
+	int i = hole + hole_leaves;
+
+	hole_max[i] = len;
+	for (i /= 2; i > 0; i /= 2) {
+		hole_max[i] = hole_max[2 * i];
+		if (hole_max[2 * i + 1] > hole_max[i])
+			hole_max[i] = hole_max[2 * i + 1];
+	}
+}
+
+/* Returns the index of the first hole at or after hole that is longer than
+   len blocks, or -1 if there is none */
+static int hole_find_longer(int hole, u32 len)
+{
+	int i = hole + hole_leaves;
+
+	if (hole >= hole_leaves)
+		return -1;
+
+	/* climb to the first subtree to the right that has one */
+	while (hole_max[i] <= len) {
+		while (i & 1)
+			i /= 2;
+		if (i == 0)
 			return -1;
+		i++;
+	}
+
+	while (i < hole_leaves)
+		i = hole_max[2 * i] > len ? 2 * i : 2 * i + 1;
+
+	return i - hole_leaves;
+}
+
+/* Recomputes the size of the hole after a chunk whose boundaries changed */
+static void update_free_extent(struct block_group_info *bg, int chunk)
+{
+	struct free_extent *ext;
+
+	if (!free_extents_valid || chunk < 0 || chunk >= bg->chunk_count - 1)
+		return;
+
+	ext = &bg->holes[chunk];
+	if (ext->len)
+		free_extent_root = free_extent_remove(free_extent_root, ext);
+
+	ext->len = hole_size(bg, chunk);
+	ext->left = NULL;
+	ext->right = NULL;
+	if (ext->len)
+		free_extent_root = free_extent_insert(free_extent_root, ext);
+	hole_max_update(ext - free_extents, ext->len);
+}
+
+/* Indexes the holes between the chunks of every block group, once the chunks
+   are known and sorted */
+static void init_free_extents(void)
+{
+	struct block_group_info *bgs = aux_info.bgs;
+	struct free_extent *ext;
+	unsigned int i;
+	size_t count = 0;
+	int j;
+
+	for (i = 0; i < aux_info.groups; i++)
+		count += bgs[i].chunk_count;
+
+	free(free_extents);
+	free_extents = calloc(count, sizeof(struct free_extent));
+	if (free_extents == NULL)
+		critical_error_errno("calloc");
+
+	for (hole_leaves = 1; (size_t)hole_leaves < count; hole_leaves *= 2)
+		;
+	free(hole_max);
+	hole_max = calloc(2 * hole_leaves, sizeof(u32));
+	if (hole_max == NULL)
+		critical_error_errno("calloc");
+
+	free_extent_root = NULL;
+	free_extents_valid = 1;
+	ext = free_extents;
+
+	for (i = 0; i < aux_info.groups; i++) {
+		bgs[i].holes = ext;
+		for (j = 0; j < bgs[i].chunk_count; j++, ext++) {
+			ext->bg = i;
+			ext->chunk = j;
+			/* deterministic, so that images are reproducible */
+			ext->priority = (u32)(ext - free_extents + 1) * 2654435761U;
+			update_free_extent(&bgs[i], j);
 		}
 	}
+}
 
+/* Marks a the first num_blocks blocks in a block group as used, and accounts
+ for them in the block group free block info. */
+static int reserve_blocks(struct block_group_info *bg, u32 bg_num, u32 start, u32 num)
+{
+	u32 block = bitmap_find_next_set(bg->block_bitmap, start, start + num);
+	if (block < start + num) {
+		error("attempted to reserve already reserved block %d in block group %d", block, bg_num);
+		return -1;
+	}
+
+	bitmap_set_range(bg->block_bitmap, start, num);
 	bg->free_blocks -= num;
 
 	return 0;
@@ -234,10 +425,9 @@ static void free_blocks(struct block_group_info *bg, u32 block, u32 num_blocks)
 
 	if (num_blocks == 0)
 		return;
-	for (i = 0; i < num_blocks; i++, block--)
-		bg->block_bitmap[block / 8] &= ~(1 << (block % 8));
+	block -= num_blocks - 1;
+	bitmap_clear_range(bg->block_bitmap, block, num_blocks);
 	bg->free_blocks += num_blocks;
-	block++;
 	for (i = bg->chunk_count; i > 0 ;) {
 		--i;
 		if (bg->chunks[i].len >= num_blocks && bg->chunks[i].block <= block) {
@@ -247,6 +437,8 @@ static void free_blocks(struct block_group_info *bg, u32 block, u32 num_blocks)
 			} else if (bg->chunks[i].block + bg->chunks[i].len == block + num_blocks) {
 				bg->chunks[i].len -= num_blocks;
 			}
+			update_free_extent(bg, i - 1);
+			update_free_extent(bg, i);
 			break;
 		}
 	}
@@ -352,6 +544,13 @@ void block_allocator_free()
 		free(aux_info.bgs[i].inode_table);
 	}
 	free(aux_info.bgs);
+
+	free(free_extents);
+	free_extents = NULL;
+	free_extent_root = NULL;
+	free_extents_valid = 0;
+	free(hole_max);
+	hole_max = NULL;
 }
 
 /* Allocate a single block and return its block number */
@@ -367,53 +566,83 @@ u32 allocate_block()
 	return block;
 }
 
+/* Returns the hole that a scan of all holes in block group and chunk order
+   picks for len blocks: the first hole of exactly len blocks. Failing that,
+   if the first non-empty hole is longer than len, the shortest hole longer
+   than len. Otherwise the scan keeps the longest hole seen, until it meets a
+   hole longer than len but shorter than that one, and from there on it keeps
+   the shortest hole longer than len. Ties go to the first hole. */
+static struct free_extent *free_extent_select(u32 len)
+{
+	struct free_extent *fit = free_extent_find(len);
+	struct free_extent *ext;
+	int first, hole, next;
+
+	if (fit && fit->len == len)
+		return fit;
+
+	first = hole_find_longer(0, 0);
+	if (first < 0)
+		return NULL;
+	if (free_extents[first].len > len)
+		return fit;
+
+	hole = hole_find_longer(first, len);
+	if (hole < 0) {
+		/* the longest hole, then the first one of that length */
+		for (ext = free_extent_root; ext->right; ext = ext->right)
+			;
+		return free_extent_find(ext->len);
+	}
+
+	ext = &free_extents[hole];
+	for (;;) {
+		next = hole_find_longer(hole + 1, len);
+		if (next < 0)
+			return ext;
+		if (free_extents[next].len < ext->len)
+			break;
+		if (free_extents[next].len > ext->len)
+			ext = &free_extents[next];
+		hole = next;
+	}
+
+	/* the shortest hole from next on; the ones skipped are the few longest
+	   so far that were passed above */
+	for (ext = fit; ext < &free_extents[next]; ext = free_extent_next(ext))
+		;
+	return ext;
+}
+
+/* Allocates from the hole picked by free_extent_select(), as much of len
+   blocks as fits */
 static struct region *ext4_allocate_best_fit_partial(u32 len)
 {
-	unsigned int i;
-	int j;
 	unsigned int found_bg = 0, found_prev_chunk = 0, found_block = 0;
 	u32 found_allocate_len = 0;
-	bool minimize = false;
 	struct block_group_info *bgs = aux_info.bgs;
+	struct free_extent *ext;
 	struct region *reg;
 
-	for (i = 0; i < aux_info.groups; i++) {
-		for (j = 1; j < bgs[i].chunk_count; j++) {
-			u32 hole_start, hole_size;
-			hole_start = bgs[i].chunks[j-1].block + bgs[i].chunks[j-1].len;
-			hole_size =  bgs[i].chunks[j].block - hole_start;
-			if (hole_size == len) {
-				// Perfect fit i.e. right between 2 chunks no need to keep searching
-				found_bg = i;
-				found_prev_chunk = j - 1;
-				found_block = hole_start;
-				found_allocate_len = hole_size;
-				goto done;
-			} else if (hole_size > len && (found_allocate_len == 0 || (found_allocate_len > hole_size))) {
-				found_bg = i;
-				found_prev_chunk = j - 1;
-				found_block = hole_start;
-				found_allocate_len = hole_size;
-				minimize = true;
-			} else if (!minimize) {
-				if (found_allocate_len < hole_size) {
-					found_bg = i;
-					found_prev_chunk = j - 1;
-					found_block = hole_start;
-					found_allocate_len = hole_size;
-				}
-			}
-		}
-	}
+	if (!free_extents_valid)
+		init_free_extents();
 
-	if (found_allocate_len == 0) {
+	ext = free_extent_select(len);
+	if (ext == NULL) {
 		error("failed to allocate %u blocks, out of space?", len);
 		return NULL;
 	}
+
+	found_bg = ext->bg;
+	found_prev_chunk = ext->chunk;
+	found_block = bgs[found_bg].chunks[found_prev_chunk].block +
+			bgs[found_bg].chunks[found_prev_chunk].len;
+	found_allocate_len = ext->len;
 	if (found_allocate_len > len) found_allocate_len = len;
-done:
+
 	// reclaim allocated space in chunk
 	bgs[found_bg].chunks[found_prev_chunk].len += found_allocate_len;
+	update_free_extent(&bgs[found_bg], found_prev_chunk);
 	if (reserve_blocks(&bgs[found_bg],
 				found_bg,
 				found_block,
@@ -721,18 +950,13 @@ struct ext4_xattr_header *get_xattr_block_for_inode(struct ext4_inode *inode)
 /* Mark the first len inodes in a block group as used */
 u32 reserve_inodes(int bg, u32 num)
 {
-	unsigned int i;
 	u32 inode;
 
 	if (get_free_inodes(bg) < num)
 		return EXT4_ALLOCATE_FAILED;
 
-	for (i = 0; i < num; i++) {
-		inode = aux_info.bgs[bg].first_free_inode + i - 1;
-		aux_info.bgs[bg].inode_bitmap[inode / 8] |= 1 << (inode % 8);
-	}
-
 	inode = aux_info.bgs[bg].first_free_inode;
+	bitmap_set_range(aux_info.bgs[bg].inode_bitmap, inode - 1, num);
 
 	aux_info.bgs[bg].first_free_inode += num;
 	aux_info.bgs[bg].free_inodes -= num;
@@ -812,6 +1036,8 @@ void reserve_bg_chunk(int bg, u32 start_block, u32 size) {
 		if (!bgs[bg].chunks)
 			critical_error("realloc failed");
 	}
+	/* the holes are indexed again on the next allocation */
+	free_extents_valid = 0;
 	chunk_count = bgs[bg].chunk_count;
 	bgs[bg].chunks[chunk_count].block = start_block;
 	bgs[bg].chunks[chunk_count].len = size;
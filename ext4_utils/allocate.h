@@ -43,6 +43,8 @@ struct block_allocation {
 	struct block_allocation* next;
 };
 
+struct free_extent;
+
 struct block_group_info {
 	u32 first_block;
 	int header_blocks;
@@ -60,6 +62,7 @@ struct block_group_info {
 	int chunk_count;
 	int max_chunk_count;
 	struct region *chunks;
+	struct free_extent *holes; /* free space after each chunk */
 };
 
 void block_allocator_init();
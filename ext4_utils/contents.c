@@ -21,6 +21,7 @@
 #include <stdio.h>
 
 #include "allocate.h"
+#include "dedup.h"
 #include "ext4_utils/ext4_utils.h"
 #include "ext4_utils/make_ext4fs.h"
 #include "extent.h"
@@ -91,11 +92,290 @@ static struct ext4_dir_entry_2 *add_dentry(u8 *data, u32 *offset,
 	return dentry;
 }
 
+/* On-disk htree index, see Documentation/filesystems/ext4 in the kernel.  The
+   root block starts with the . and .. entries, and each interior block with
+   an empty entry spanning the block, so the index is skipped by code that
+   reads the directory linearly */
+struct dx_root_info {
+	u32 reserved_zero;
+	u8 hash_version;
+	u8 info_length;
+	u8 indirect_levels;
+	u8 unused_flags;
+};
+
+struct dx_countlimit {
+	u16 limit;
+	u16 count;
+};
+
+struct dx_entry {
+	u32 hash;
+	u32 block;
+};
+
+/* A directory entry in hash order */
+struct dx_dentry {
+	u32 hash;
+	u32 minor_hash;
+	u32 index;
+};
+
+#define DX_HASH_DELTA 0x9E3779B9
+#define DX_HTREE_EOF 0x7FFFFFFF
+#define DX_ROOT_OFFSET 24
+#define DX_NODE_OFFSET 8
+
+static void dx_tea_transform(u32 buf[4], const u32 in[4])
+{
+	u32 sum = 0;
+	u32 b0 = buf[0], b1 = buf[1];
+	u32 a = in[0], b = in[1], c = in[2], d = in[3];
+	int n = 16;
+
+	do {
+		sum += DX_HASH_DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	} while (--n);
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+/* Packs up to num words of a name into buf the way the kernel does, padding
+   with the length of the name */
+static void dx_str2hashbuf(const char *msg, int len, u32 *buf, int num,
+	int unsigned_chars)
+{
+	u32 pad, val;
+	int i, c;
+
+	pad = (u32)len | ((u32)len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++) {
+		if (unsigned_chars)
+			c = (unsigned char)msg[i];
+		else
+			c = (signed char)msg[i];
+		val = c + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+/* Computes the TEA hash of a name with the filesystem's hash seed, the same
+   way the kernel does for a lookup */
+static u32 dx_hash(const char *name, u32 *minor_hash)
+{
+	u32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	u32 in[4];
+	int unsigned_chars = aux_info.sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH;
+	int len = strlen(name);
+	u32 hash;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (aux_info.sb->s_hash_seed[i]) {
+			memcpy(buf, aux_info.sb->s_hash_seed, sizeof(buf));
+			break;
+		}
+	}
+
+	while (len > 0) {
+		dx_str2hashbuf(name, len, in, 4, unsigned_chars);
+		dx_tea_transform(buf, in);
+		len -= 16;
+		name += 16;
+	}
+
+	hash = buf[0] & ~1;
+	if (hash == (DX_HTREE_EOF << 1))
+		hash = (DX_HTREE_EOF - 1) << 1;
+	*minor_hash = buf[1];
+
+	return hash;
+}
+
+static int dx_compare(const void *a, const void *b)
+{
+	const struct dx_dentry *da = a;
+	const struct dx_dentry *db = b;
+
+	if (da->hash != db->hash)
+		return da->hash < db->hash ? -1 : 1;
+	if (da->minor_hash != db->minor_hash)
+		return da->minor_hash < db->minor_hash ? -1 : 1;
+	return da->index < db->index ? -1 : da->index > db->index;
+}
+
+static u32 dx_root_limit(void)
+{
+	return (info.block_size - DX_ROOT_OFFSET - sizeof(struct dx_root_info)) /
+		sizeof(struct dx_entry);
+}
+
+static u32 dx_node_limit(void)
+{
+	return (info.block_size - DX_NODE_OFFSET) / sizeof(struct dx_entry);
+}
+
+/* Returns the directory entries sorted by hash */
+static struct dx_dentry *dx_sort_dentries(u32 entries, struct dentry *dentries)
+{
+	struct dx_dentry *hashed;
+	u32 i;
+
+	hashed = malloc(entries * sizeof(struct dx_dentry));
+	if (!hashed)
+		critical_error_errno("malloc");
+
+	for (i = 0; i < entries; i++) {
+		hashed[i].hash = dx_hash(dentries[i].filename, &hashed[i].minor_hash);
+		hashed[i].index = i;
+	}
+	qsort(hashed, entries, sizeof(struct dx_dentry), dx_compare);
+
+	return hashed;
+}
+
+/* Returns the number of leaf blocks needed for the entries in hash order,
+   packed the same way add_dentry packs them */
+static u32 dx_leaf_blocks(u32 entries, struct dentry *dentries,
+	struct dx_dentry *hashed)
+{
+	u32 len = 0;
+	u32 i;
+	u32 dentry_len;
+
+	for (i = 0; i < entries; i++) {
+		dentry_len = 8 + EXT4_ALIGN(strlen(dentries[hashed[i].index].filename), 4);
+		if (len % info.block_size + dentry_len > info.block_size)
+			len += info.block_size - (len % info.block_size);
+		len += dentry_len;
+	}
+
+	return DIV_ROUND_UP(len, info.block_size);
+}
+
+/* Fills in an indexed directory: the root block, then nodes interior
+   blocks if the index needs a second level, then the leaf blocks holding
+   the entries in hash order */
+static void dx_fill_directory(u8 *data, u32 inode_num, u32 dir_inode_num,
+	u32 entries, struct dentry *dentries, struct dx_dentry *hashed,
+	u32 leaves, u32 nodes)
+{
+	struct ext4_dir_entry_2 *dentry;
+	struct dx_root_info *root_info;
+	struct dx_countlimit *countlimit;
+	struct dx_entry *dx_entries;
+	u32 first_leaf = 1 + nodes;
+	u32 *leaf_hash;
+	u32 offset = 0;
+	u32 leaf;
+	u32 i, j;
+
+	leaf_hash = calloc(leaves, sizeof(u32));
+	if (!leaf_hash)
+		critical_error_errno("calloc");
+
+	dentry = add_dentry(data, &offset, NULL, inode_num, ".", EXT4_FT_DIR);
+	dentry = add_dentry(data, &offset, dentry, dir_inode_num, "..", EXT4_FT_DIR);
+	dentry->rec_len += info.block_size - offset;
+
+	/* Leaves.  A leaf that starts in the middle of a run of equal hashes
+	   has the low bit of its hash set, so lookups continue into it */
+	offset = first_leaf * info.block_size;
+	dentry = NULL;
+	for (i = 0; i < entries; i++) {
+		struct dentry *d = &dentries[hashed[i].index];
+
+		dentry = add_dentry(data, &offset, dentry, 0, d->filename, d->file_type);
+		d->inode = &dentry->inode;
+
+		leaf = ((u8 *)dentry - data) / info.block_size - first_leaf;
+		if ((u8 *)dentry - data == (first_leaf + leaf) * info.block_size) {
+			leaf_hash[leaf] = hashed[i].hash;
+			if (i > 0 && hashed[i - 1].hash == hashed[i].hash)
+				leaf_hash[leaf] |= 1;
+		}
+	}
+	if (offset > (first_leaf + leaves) * info.block_size)
+		critical_error("internal error: htree leaves end at %d, past %d\n",
+			offset, (first_leaf + leaves) * info.block_size);
+	dentry->rec_len += (first_leaf + leaves) * info.block_size - offset;
+
+	root_info = (struct dx_root_info *)(data + DX_ROOT_OFFSET);
+	root_info->reserved_zero = 0;
+	root_info->hash_version = aux_info.sb->s_def_hash_version;
+	root_info->info_length = sizeof(struct dx_root_info);
+	root_info->indirect_levels = nodes ? 1 : 0;
+	root_info->unused_flags = 0;
+
+	dx_entries = (struct dx_entry *)(root_info + 1);
+	countlimit = (struct dx_countlimit *)dx_entries;
+	countlimit->limit = dx_root_limit();
+
+	if (!nodes) {
+		countlimit->count = leaves;
+		for (i = 0; i < leaves; i++) {
+			if (i)
+				dx_entries[i].hash = leaf_hash[i];
+			dx_entries[i].block = first_leaf + i;
+		}
+		free(leaf_hash);
+		return;
+	}
+
+	countlimit->count = nodes;
+	for (i = 0; i < nodes; i++) {
+		u32 first = i * dx_node_limit();
+		u32 count = min(leaves - first, dx_node_limit());
+		u8 *node = data + (1 + i) * info.block_size;
+		struct dx_entry *node_entries;
+
+		if (i)
+			dx_entries[i].hash = leaf_hash[first];
+		dx_entries[i].block = 1 + i;
+
+		dentry = (struct ext4_dir_entry_2 *)node;
+		dentry->inode = 0;
+		dentry->rec_len = info.block_size;
+		dentry->name_len = 0;
+		dentry->file_type = 0;
+
+		node_entries = (struct dx_entry *)(node + DX_NODE_OFFSET);
+		countlimit = (struct dx_countlimit *)node_entries;
+		countlimit->limit = dx_node_limit();
+		countlimit->count = count;
+		for (j = 0; j < count; j++) {
+			if (j)
+				node_entries[j].hash = leaf_hash[first + j];
+			node_entries[j].block = first_leaf + first + j;
+		}
+	}
+
+	free(leaf_hash);
+}
+
 /* Creates a directory structure for an array of directory entries, dentries,
    and stores the location of the structure in an inode.  The new inode's
    .. link is set to dir_inode_num.  Stores the location of the inode number
    of each directory entry into dentries[i].inode, to be filled in later
-   when the inode for the entry is allocated.  Returns the inode number of the
+   when the inode for the entry is allocated.  Directories that need more than
+   one block are indexed with an htree, as the kernel would do when the
+   directory grew past its first block.  Returns the inode number of the
    new directory */
 u32 make_directory(u32 dir_inode_num, u32 entries, struct dentry *dentries,
 	u32 dirs)
@@ -108,8 +388,25 @@ u32 make_directory(u32 dir_inode_num, u32 entries, struct dentry *dentries,
 	u8 *data;
 	unsigned int i;
 	struct ext4_dir_entry_2 *dentry;
+	struct dx_dentry *hashed = NULL;
+	u32 leaves = 0;
+	u32 nodes = 0;
 
 	blocks = DIV_ROUND_UP(dentry_size(entries, dentries), info.block_size);
+	if (blocks > 1 && (info.feat_compat & EXT4_FEATURE_COMPAT_DIR_INDEX) &&
+			aux_info.sb->s_def_hash_version == DX_HASH_TEA) {
+		hashed = dx_sort_dentries(entries, dentries);
+		leaves = dx_leaf_blocks(entries, dentries, hashed);
+		if (leaves > dx_root_limit())
+			nodes = DIV_ROUND_UP(leaves, dx_node_limit());
+		if (nodes > dx_root_limit()) {
+			/* too large for a two level index, leave it linear */
+			free(hashed);
+			hashed = NULL;
+		} else {
+			blocks = 1 + nodes + leaves;
+		}
+	}
 	len = blocks * info.block_size;
 
 	if (dir_inode_num) {
@@ -142,6 +439,14 @@ u32 make_directory(u32 dir_inode_num, u32 entries, struct dentry *dentries,
 	inode->i_links_count = dirs + 2;
 	inode->i_flags |= aux_info.default_i_flags;
 
+	if (hashed) {
+		inode->i_flags |= EXT4_INDEX_FL;
+		dx_fill_directory(data, inode_num, dir_inode_num, entries, dentries,
+				hashed, leaves, nodes);
+		free(hashed);
+		return inode_num;
+	}
+
 	dentry = NULL;
 
 	dentry = add_dentry(data, &offset, NULL, inode_num, ".", EXT4_FT_DIR);
@@ -175,11 +480,14 @@ u32 make_directory(u32 dir_inode_num, u32 entries, struct dentry *dentries,
 	return inode_num;
 }
 
-/* Creates a file on disk.  Returns the inode number of the new file */
-u32 make_file(const char *filename, u64 len)
+/* Creates a file on disk.  Returns the inode number of the new file.  In
+   dedup mode the file shares the blocks of an earlier file with the same
+   contents; digest is the SHA-1 of its first block if already hashed */
+u32 make_file(const char *filename, u64 len, const u8 *digest)
 {
 	struct ext4_inode *inode;
 	u32 inode_num;
+	u32 shared_inode_num = 0;
 
 	inode_num = allocate_inode(info);
 	if (inode_num == EXT4_ALLOCATE_FAILED) {
@@ -193,12 +501,21 @@ u32 make_file(const char *filename, u64 len)
 		return EXT4_ALLOCATE_FAILED;
 	}
 
-	if (len > 0) {
+	if (len > 0 && info.dedup)
+		shared_inode_num = dedup_find(filename, len, digest);
+
+	if (shared_inode_num) {
+		/* Shared files are left out of the saved allocations, their blocks
+		   are already listed under the file that owns them */
+		inode_share_extents(inode, get_inode(shared_inode_num));
+	} else if (len > 0) {
 		struct block_allocation* alloc = inode_allocate_file_extents(inode, len, filename);
 		if (alloc) {
 			alloc->filename = strdup(filename);
 			alloc->next = saved_allocation_head;
 			saved_allocation_head = alloc;
+			if (info.dedup)
+				dedup_add(filename, len, digest, inode_num);
 		}
 	}
 
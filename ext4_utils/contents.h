@@ -33,11 +33,12 @@ struct dentry {
 	u32 mtime;
 	char *secon;
 	uint64_t capabilities;
+	u8 *digest;
 };
 
 u32 make_directory(u32 dir_inode_num, u32 entries, struct dentry *dentries,
 	u32 dirs);
-u32 make_file(const char *filename, u64 len);
+u32 make_file(const char *filename, u64 len, const u8 *digest);
 u32 make_link(const char *link);
 int inode_set_permissions(u32 inode_num, u16 mode, u16 uid, u16 gid, u32 mtime);
 int inode_set_selinux(u32 inode_num, const char *secon);
@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dedup.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "contents.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define DEDUP_READ_SIZE (64 * 1024)
+#define DEDUP_MAX_THREADS 8
+
+/* A file whose blocks can be shared by later files with the same contents.
+   Files are indexed by length, and their first block is only hashed once
+   another file of the same length turns up */
+struct dedup_entry {
+	u8 digest[DEDUP_DIGEST_LENGTH];
+	int hashed;
+	u64 len;
+	char *filename;
+	u32 inode_num;
+	struct dedup_entry *next;
+};
+
+static struct dedup_entry **dedup_table;
+static u32 dedup_table_size;
+static u32 dedup_count;
+
+/* Reads exactly len bytes unless the file ends first */
+static ssize_t read_full(int fd, u8 *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = read(fd, buf + done, len - done);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+/* Computes the SHA-1 of the first block of a file that is len bytes long.
+   Returns 0 on success, or -1 if the file could not be read or is shorter
+   than expected.  Runs on the hashing threads, so failures are returned
+   rather than reported */
+static int hash_file(const char *filename, u64 len, u8 *digest)
+{
+	SHA1_CTX ctx;
+	size_t hash_len = min(len, info.block_size);
+	u8 *buf;
+	int fd;
+	int ret = -1;
+
+	buf = malloc(hash_len);
+	if (!buf)
+		return -1;
+
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		goto out;
+
+	if (read_full(fd, buf, hash_len) == (ssize_t)hash_len) {
+		SHA1Init(&ctx);
+		SHA1Update(&ctx, buf, hash_len);
+		SHA1Final(digest, &ctx);
+		ret = 0;
+	}
+
+	close(fd);
+out:
+	free(buf);
+	return ret;
+}
+
+/* Compares the first len bytes of two files.  Files are only compared once
+   their lengths and first block digests match, so a mismatch is rare */
+static int files_equal(const char *a, const char *b, u64 len)
+{
+	u8 *buf_a, *buf_b;
+	int fd_a, fd_b;
+	int equal = 0;
+
+	buf_a = malloc(2 * DEDUP_READ_SIZE);
+	if (!buf_a)
+		critical_error_errno("malloc");
+	buf_b = buf_a + DEDUP_READ_SIZE;
+
+	fd_a = open(a, O_RDONLY | O_BINARY);
+	fd_b = open(b, O_RDONLY | O_BINARY);
+	if (fd_a < 0 || fd_b < 0)
+		goto out;
+
+	while (len > 0) {
+		size_t chunk = min(len, DEDUP_READ_SIZE);
+		if (read_full(fd_a, buf_a, chunk) != (ssize_t)chunk ||
+				read_full(fd_b, buf_b, chunk) != (ssize_t)chunk ||
+				memcmp(buf_a, buf_b, chunk))
+			goto out;
+		len -= chunk;
+	}
+	equal = 1;
+
+out:
+	if (fd_a >= 0)
+		close(fd_a);
+	if (fd_b >= 0)
+		close(fd_b);
+	free(buf_a);
+	return equal;
+}
+
+static int compare_size(const void *a, const void *b)
+{
+	const struct dentry *da = *(const struct dentry **)a;
+	const struct dentry *db = *(const struct dentry **)b;
+
+	if (da->size != db->size)
+		return da->size < db->size ? -1 : 1;
+	return 0;
+}
+
+static void hash_dentry(struct dentry *d)
+{
+	d->digest = malloc(DEDUP_DIGEST_LENGTH);
+	if (d->digest && hash_file(d->full_path, d->size, d->digest) < 0) {
+		free(d->digest);
+		d->digest = NULL;
+	}
+}
+
+#ifndef _WIN32
+struct hash_job {
+	struct dentry **files;
+	u32 count;
+	u32 next;
+	pthread_mutex_t lock;
+};
+
+static void *hash_worker(void *arg)
+{
+	struct hash_job *job = arg;
+	u32 i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+
+		if (i >= job->count)
+			break;
+		hash_dentry(job->files[i]);
+	}
+
+	return NULL;
+}
+#endif
+
+/* Hashes the first block of every regular file in the tree that has the
+   same length as another file, spreading them across up to
+   DEDUP_MAX_THREADS threads.  Files that cannot be read are left without a
+   digest; dedup_find hashes them again if it needs to */
+void dedup_hash_files(struct dentry **tree_files, u32 tree_count)
+{
+	struct dentry **files;
+	u32 count = 0;
+	u32 i, j;
+
+	files = malloc(tree_count * sizeof(*files));
+	if (tree_count && !files)
+		critical_error_errno("malloc");
+
+	memcpy(files, tree_files, tree_count * sizeof(*files));
+	qsort(files, tree_count, sizeof(*files), compare_size);
+	for (i = 0; i < tree_count; i = j) {
+		for (j = i + 1; j < tree_count && files[j]->size == files[i]->size; j++)
+			;
+		if (files[i]->size > 0 && j - i > 1)
+			while (i < j)
+				files[count++] = files[i++];
+	}
+
+#ifndef _WIN32
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	u32 threads = min(count, DEDUP_MAX_THREADS);
+	if (cpus > 0 && (u32)cpus < threads)
+		threads = cpus;
+
+	if (threads > 1) {
+		pthread_t tids[DEDUP_MAX_THREADS];
+		struct hash_job job;
+		u32 started = 0;
+
+		job.files = files;
+		job.count = count;
+		job.next = 0;
+		pthread_mutex_init(&job.lock, NULL);
+
+		/* the calling thread is one of the workers */
+		for (i = 1; i < threads; i++)
+			if (pthread_create(&tids[started], NULL, hash_worker, &job) == 0)
+				started++;
+
+		hash_worker(&job);
+
+		for (i = 0; i < started; i++)
+			pthread_join(tids[i], NULL);
+		pthread_mutex_destroy(&job.lock);
+		count = 0;
+	}
+#endif
+
+	for (i = 0; i < count; i++)
+		hash_dentry(files[i]);
+
+	free(files);
+}
+
+static u32 dedup_bucket(u64 len)
+{
+	return (u32)((len * 0x9E3779B97F4A7C15ULL) >> 32) & (dedup_table_size - 1);
+}
+
+/* Returns true if an earlier file has the same length as len */
+static int dedup_candidate(u64 len)
+{
+	struct dedup_entry *e;
+
+	if (!dedup_table)
+		return 0;
+
+	for (e = dedup_table[dedup_bucket(len)]; e; e = e->next)
+		if (e->len == len)
+			return 1;
+
+	return 0;
+}
+
+/* Returns the inode of an earlier file with the same contents, or 0.  The
+   digest of the file is computed here if the caller does not have one */
+u32 dedup_find(const char *filename, u64 len, const u8 *digest)
+{
+	u8 file_digest[DEDUP_DIGEST_LENGTH];
+	struct dedup_entry *e;
+
+	if (!dedup_candidate(len))
+		return 0;
+
+	if (!digest) {
+		if (hash_file(filename, len, file_digest) < 0)
+			return 0;
+		digest = file_digest;
+	}
+
+	for (e = dedup_table[dedup_bucket(len)]; e; e = e->next) {
+		if (e->len != len)
+			continue;
+		if (!e->hashed) {
+			if (hash_file(e->filename, len, e->digest) < 0)
+				continue;
+			e->hashed = 1;
+		}
+		if (!memcmp(e->digest, digest, DEDUP_DIGEST_LENGTH) &&
+				files_equal(e->filename, filename, len))
+			return e->inode_num;
+	}
+
+	return 0;
+}
+
+static void dedup_grow(void)
+{
+	struct dedup_entry **table;
+	u32 old_size = dedup_table_size;
+	u32 i;
+
+	dedup_table_size = old_size ? old_size * 2 : 1024;
+	table = calloc(dedup_table_size, sizeof(*table));
+	if (!table)
+		critical_error_errno("calloc");
+
+	for (i = 0; i < old_size; i++) {
+		struct dedup_entry *e = dedup_table[i];
+		while (e) {
+			struct dedup_entry *next = e->next;
+			u32 bucket = dedup_bucket(e->len);
+			e->next = table[bucket];
+			table[bucket] = e;
+			e = next;
+		}
+	}
+
+	free(dedup_table);
+	dedup_table = table;
+}
+
+/* Records a file whose extents can be shared by later identical files.
+   digest may be NULL if the file has not been hashed yet */
+void dedup_add(const char *filename, u64 len, const u8 *digest, u32 inode_num)
+{
+	struct dedup_entry *e;
+	u32 bucket;
+
+	if (dedup_count >= dedup_table_size)
+		dedup_grow();
+
+	e = malloc(sizeof(*e));
+	if (!e)
+		critical_error_errno("malloc");
+
+	e->hashed = digest != NULL;
+	if (digest)
+		memcpy(e->digest, digest, DEDUP_DIGEST_LENGTH);
+	e->len = len;
+	e->filename = strdup(filename);
+	if (!e->filename)
+		critical_error_errno("strdup");
+	e->inode_num = inode_num;
+
+	bucket = dedup_bucket(len);
+	e->next = dedup_table[bucket];
+	dedup_table[bucket] = e;
+	dedup_count++;
+}
+
+void dedup_free(void)
+{
+	u32 i;
+
+	for (i = 0; i < dedup_table_size; i++) {
+		struct dedup_entry *e = dedup_table[i];
+		while (e) {
+			struct dedup_entry *next = e->next;
+			free(e->filename);
+			free(e);
+			e = next;
+		}
+	}
+
+	free(dedup_table);
+	dedup_table = NULL;
+	dedup_table_size = 0;
+	dedup_count = 0;
+}
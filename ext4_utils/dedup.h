@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "ext4_utils/ext4_utils.h"
+#include "sha1.h"
+
+struct dentry;
+
+#define DEDUP_DIGEST_LENGTH SHA1_DIGEST_LENGTH
+
+void dedup_hash_files(struct dentry **files, u32 count);
+u32 dedup_find(const char *filename, u64 len, const u8 *digest);
+void dedup_add(const char *filename, u64 len, const u8 *digest, u32 inode_num);
+void dedup_free(void);
+
+#endif
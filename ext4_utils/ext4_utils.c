@@ -120,6 +120,91 @@ void bitmap_clear_bit(u8 *bitmap, u32 bit)
 	return;
 }
 
+/* Returns the bits of a byte from bit start up to, but not including, bit
+   end, both counted from the start of the byte */
+static u8 bitmap_byte_mask(u32 start, u32 end)
+{
+	return (u8)((0xFF << start) & (0xFF >> (8 - end)));
+}
+
+/* Sets or clears len bits from bit start. Whole bytes are filled with
+   memset, so long ranges are handled a word or vector at a time */
+static void bitmap_fill_range(u8 *bitmap, u32 start, u32 len, int set)
+{
+	u32 end = start + len;
+	u8 mask;
+
+	if (len == 0)
+		return;
+
+	if (start / 8 == (end - 1) / 8) {
+		mask = bitmap_byte_mask(start % 8, (end - 1) % 8 + 1);
+		if (set)
+			bitmap[start / 8] |= mask;
+		else
+			bitmap[start / 8] &= ~mask;
+		return;
+	}
+
+	if (start % 8) {
+		mask = bitmap_byte_mask(start % 8, 8);
+		if (set)
+			bitmap[start / 8] |= mask;
+		else
+			bitmap[start / 8] &= ~mask;
+		start = EXT4_ALIGN(start, 8);
+	}
+
+	memset(&bitmap[start / 8], set ? 0xFF : 0, end / 8 - start / 8);
+
+	if (end % 8) {
+		mask = bitmap_byte_mask(0, end % 8);
+		if (set)
+			bitmap[end / 8] |= mask;
+		else
+			bitmap[end / 8] &= ~mask;
+	}
+}
+
+void bitmap_set_range(u8 *bitmap, u32 start, u32 len)
+{
+	bitmap_fill_range(bitmap, start, len, 1);
+}
+
+void bitmap_clear_range(u8 *bitmap, u32 start, u32 len)
+{
+	bitmap_fill_range(bitmap, start, len, 0);
+}
+
+/* Returns the first set bit from bit start up to, but not including, bit
+   end, or end if there is none. Aligned bytes are checked 64 bits at a
+   time */
+u32 bitmap_find_next_set(const u8 *bitmap, u32 start, u32 end)
+{
+	u32 bit = start;
+	u8 byte;
+
+	while (bit < end) {
+		if (bit % 64 == 0 && end - bit >= 64) {
+			u64 word;
+			memcpy(&word, &bitmap[bit / 8], sizeof(word));
+			if (word == 0) {
+				bit += 64;
+				continue;
+			}
+		}
+
+		byte = bitmap[bit / 8] & bitmap_byte_mask(bit % 8, 8);
+		if (byte) {
+			bit = (bit & ~7) + __builtin_ctz(byte);
+			return bit < end ? bit : end;
+		}
+		bit = (bit & ~7) + 8;
+	}
+
+	return end;
+}
+
 /* Returns 1 if the bg contains a backup superblock.  On filesystems with
    the sparse_super feature, only block groups 0, 1, and powers of 3, 5,
    and 7 have backup superblocks.  Otherwise, all block groups have backup
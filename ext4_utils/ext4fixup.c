@@ -238,7 +238,7 @@ static void check_inode_bitmap(int fd, unsigned int bg_num)
 {
     unsigned int inode_bitmap_block_num;
     unsigned char block[MAX_EXT4_BLOCK_SIZE];
-    int i, bitmap_updated = 0;
+    int bitmap_updated = 0;
 
     /* Using the bg_num, aux_info.bg_desc[], info.inodes_per_group and
      * new_inodes_per_group, retrieve the inode bitmap, and make sure
@@ -248,11 +248,11 @@ static void check_inode_bitmap(int fd, unsigned int bg_num)
 
     read_block(fd, inode_bitmap_block_num, block);
 
-    for (i = info.inodes_per_group; i < new_inodes_per_group; i++) {
-        if (bitmap_get_bit(block, i)) {
-            bitmap_clear_bit(block, i);
-            bitmap_updated = 1;
-        }
+    if (bitmap_find_next_set(block, info.inodes_per_group, new_inodes_per_group) <
+            (u32)new_inodes_per_group) {
+        bitmap_clear_range(block, info.inodes_per_group,
+                new_inodes_per_group - info.inodes_per_group);
+        bitmap_updated = 1;
     }
 
     if (bitmap_updated) {
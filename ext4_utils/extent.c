@@ -268,3 +268,18 @@ void inode_allocate_extents(struct ext4_inode *inode, u64 len)
 
 	free_alloc(alloc);
 }
+
+/* Points an inode at the extents of another inode with identical contents.
+   The data blocks and any extent block are shared rather than copied, which
+   is only valid on images with the shared_blocks feature */
+void inode_share_extents(struct ext4_inode *inode,
+	const struct ext4_inode *src)
+{
+	memcpy(inode->i_block, src->i_block, sizeof(inode->i_block));
+
+	inode->i_flags |= EXT4_EXTENTS_FL;
+	inode->i_size_lo = src->i_size_lo;
+	inode->i_size_high = src->i_size_high;
+	inode->i_blocks_lo = src->i_blocks_lo;
+	inode->osd2.linux2.l_i_blocks_high = src->osd2.linux2.l_i_blocks_high;
+}
@@ -27,6 +27,8 @@ struct block_allocation* inode_allocate_file_extents(
 	struct ext4_inode *inode, u64 len, const char *filename);
 u8 *inode_allocate_data_extents(struct ext4_inode *inode, u64 len,
 	u64 backing_len);
+void inode_share_extents(struct ext4_inode *inode,
+	const struct ext4_inode *src);
 void free_extent_blocks();
 
 #endif
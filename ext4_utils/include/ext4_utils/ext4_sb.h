@@ -46,6 +46,7 @@ struct fs_info {
 	const char *label;
 	uint8_t no_journal;
 	bool block_device;	/* target fd is a block device? */
+	bool dedup;		/* share blocks between identical files? */
 };
 
 int ext4_parse_sb(struct ext4_super_block *sb, struct fs_info *info);
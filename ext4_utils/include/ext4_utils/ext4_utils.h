@@ -141,6 +141,9 @@ static inline int log_2(int j)
 
 int bitmap_get_bit(u8 *bitmap, u32 bit);
 void bitmap_clear_bit(u8 *bitmap, u32 bit);
+void bitmap_set_range(u8 *bitmap, u32 start, u32 len);
+void bitmap_clear_range(u8 *bitmap, u32 start, u32 len);
+u32 bitmap_find_next_set(const u8 *bitmap, u32 start, u32 end);
 int ext4_bg_has_super_block(int bg);
 void read_sb(int fd, struct ext4_super_block *sb);
 void write_sb(int fd, unsigned long long offset, struct ext4_super_block *sb);
@@ -25,6 +25,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,6 +37,7 @@
 
 #include "allocate.h"
 #include "contents.h"
+#include "dedup.h"
 #include "ext4_utils/ext4_utils.h"
 #include "ext4_utils/wipe.h"
 
@@ -77,6 +79,7 @@
 
 #else
 
+#include <pthread.h>
 #include <selinux/selinux.h>
 #include <selinux/label.h>
 
@@ -87,6 +90,7 @@
 #undef MAX_PATH
 #define MAX_PATH 4096
 #define MAX_BLK_MAPPING_STR 1000
+#define SCAN_THREADS 16
 
 const int blk_file_major_ver = 1;
 const int blk_file_minor_ver = 0;
@@ -94,7 +98,6 @@ const char *blk_file_header_fmt = "Base EXT4 version %d.%d";
 
 /* TODO: Not implemented:
    Allocating blocks in the same block group as the file inode
-   Hash or binary tree directories
    Special files: sockets, devices, fifos
  */
 
@@ -142,16 +145,109 @@ static u32 build_default_directory_structure(const char *dir_path,
 }
 
 #ifndef _WIN32
-/* Read a local directory and create the same tree in the generated filesystem.
-   Calls itself recursively with each directory in the given directory.
-   full_path is an absolute or relative path, with a trailing slash, to the
-   directory on disk that should be copied, or NULL if this is a directory
-   that does not exist on disk (e.g. lost+found).
-   dir_path is an absolute path, with trailing slash, to the same directory
-   if the image were mounted at the specified mount point */
-static u32 build_directory_structure(const char *full_path, const char *dir_path, const char *target_out_path,
-		u32 dir_inode, fs_config_func_t fs_config_func,
-		struct selabel_handle *sehnd, int verbose, time_t fixed_time)
+/* A directory read from disk by the scanner.  The entries are sorted by name,
+   and subdirs[i] is the scanned contents of dentries[i] if that entry is a
+   directory */
+struct scan_dir {
+	char *full_path;
+	char *dir_path;
+	int root;
+	struct dentry *dentries;
+	int entries;
+	u32 dirs;
+	struct scan_dir **subdirs;
+	char **errors;
+	int error_count;
+	int failed;
+};
+
+/* State shared by the scanner threads.  Directories waiting to be read are
+   kept on a stack, and the walk is over once it is empty and no thread is
+   still reading a directory */
+struct scan_pool {
+	const char *target_out_path;
+	fs_config_func_t fs_config_func;
+	struct selabel_handle *sehnd;
+	time_t fixed_time;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct scan_dir **stack;
+	int stack_len;
+	int stack_size;
+	int busy;
+
+	/* fs_config and selabel_lookup are not known to be thread safe */
+	pthread_mutex_t label_lock;
+};
+
+/* Records an error found by a scanner thread.  Errors are reported in tree
+   order by build_scanned_directory, since error() can longjmp out of the
+   build.  If failed is set the directory could not be read */
+static void scan_error(struct scan_dir *sd, int failed, const char *fmt, ...)
+{
+	va_list ap;
+	char *msg = NULL;
+	char **errors;
+
+	va_start(ap, fmt);
+	if (vasprintf(&msg, fmt, ap) < 0)
+		msg = NULL;
+	va_end(ap);
+
+	errors = realloc(sd->errors, (sd->error_count + 1) * sizeof(*errors));
+	if (errors) {
+		sd->errors = errors;
+		sd->errors[sd->error_count++] = msg;
+	} else {
+		free(msg);
+	}
+	if (failed)
+		sd->failed = 1;
+}
+
+static struct scan_dir *scan_dir_new(char *full_path, char *dir_path, int root)
+{
+	struct scan_dir *sd = calloc(1, sizeof(struct scan_dir));
+	if (sd) {
+		sd->full_path = full_path;
+		sd->dir_path = dir_path;
+		sd->root = root;
+	}
+	return sd;
+}
+
+static void scan_dir_free(struct scan_dir *sd)
+{
+	int i;
+
+	if (!sd)
+		return;
+
+	for (i = 0; i < sd->entries; i++) {
+		if (sd->subdirs)
+			scan_dir_free(sd->subdirs[i]);
+		free(sd->dentries[i].path);
+		free(sd->dentries[i].full_path);
+		free(sd->dentries[i].link);
+		free((void *)sd->dentries[i].filename);
+		free(sd->dentries[i].secon);
+		free(sd->dentries[i].digest);
+	}
+	for (i = 0; i < sd->error_count; i++)
+		free(sd->errors[i]);
+
+	free(sd->errors);
+	free(sd->subdirs);
+	free(sd->dentries);
+	free(sd->full_path);
+	free(sd->dir_path);
+	free(sd);
+}
+
+/* Reads one directory: its entries, their stats, permissions and SELinux
+   labels.  Subdirectories are added to sd->subdirs for the pool to read */
+static void scan_directory(struct scan_pool *pool, struct scan_dir *sd)
 {
 	int entries = 0;
 	struct dentry *dentries;
@@ -159,13 +255,10 @@ static u32 build_directory_structure(const char *full_path, const char *dir_path
 	struct stat stat;
 	int ret;
 	int i, j;
-	u32 inode;
-	u32 entry_inode;
-	u32 dirs = 0;
 	bool needs_lost_and_found = false;
 
-	if (full_path) {
-		entries = scandir(full_path, &namelist, filter_dot, (void*)alphasort);
+	if (sd->full_path) {
+		entries = scandir(sd->full_path, &namelist, filter_dot, (void*)alphasort);
 		if (entries < 0) {
 #ifdef __GLIBC__
 			/* The scandir function implemented in glibc has a bug that makes it
@@ -173,16 +266,16 @@ static u32 build_directory_structure(const char *full_path, const char *dir_path
 			   As a workaround we can retry the scandir call with the same arguments.
 			   GLIBC BZ: https://sourceware.org/bugzilla/show_bug.cgi?id=17804 */
 			if (errno == ENOMEM)
-				entries = scandir(full_path, &namelist, filter_dot, (void*)alphasort);
+				entries = scandir(sd->full_path, &namelist, filter_dot, (void*)alphasort);
 #endif
 			if (entries < 0) {
-				error_errno("scandir");
-				return EXT4_ALLOCATE_FAILED;
+				scan_error(sd, 1, "scandir: %s", strerror(errno));
+				return;
 			}
 		}
 	}
 
-	if (dir_inode == 0) {
+	if (sd->root) {
 		/* root directory, check if lost+found already exists */
 		for (i = 0; i < entries; i++)
 			if (strcmp(namelist[i]->d_name, "lost+found") == 0)
@@ -191,67 +284,79 @@ static u32 build_directory_structure(const char *full_path, const char *dir_path
 			needs_lost_and_found = true;
 	}
 
-	dentries = calloc(entries, sizeof(struct dentry));
-	if (dentries == NULL)
-		critical_error_errno("malloc");
+	dentries = calloc(entries + (needs_lost_and_found ? 1 : 0), sizeof(struct dentry));
+	if (dentries == NULL) {
+		scan_error(sd, 1, "malloc: %s", strerror(errno));
+		return;
+	}
+	sd->dentries = dentries;
+
+	if (needs_lost_and_found) {
+		/* insert a lost+found directory at the beginning of the dentries */
+		dentries++;
+	}
 
 	for (i = j = 0; i < entries; i++, j++) {
 		dentries[i].filename = strdup(namelist[j]->d_name);
-		if (dentries[i].filename == NULL)
-			critical_error_errno("strdup");
+		if (dentries[i].filename == NULL) {
+			scan_error(sd, 1, "strdup: %s", strerror(errno));
+			break;
+		}
 
-		asprintf(&dentries[i].path, "%s%s", dir_path, namelist[j]->d_name);
-		asprintf(&dentries[i].full_path, "%s%s", full_path, namelist[j]->d_name);
+		asprintf(&dentries[i].path, "%s%s", sd->dir_path, namelist[j]->d_name);
+		asprintf(&dentries[i].full_path, "%s%s", sd->full_path, namelist[j]->d_name);
 
 		free(namelist[j]);
 
 		ret = lstat(dentries[i].full_path, &stat);
 		if (ret < 0) {
-			error_errno("lstat");
-			free(dentries[i].filename);
+			scan_error(sd, 0, "lstat: %s", strerror(errno));
+			free((void *)dentries[i].filename);
+			free(dentries[i].path);
+			free(dentries[i].full_path);
 			i--;
 			continue;
 		}
 
 		dentries[i].size = stat.st_size;
 		dentries[i].mode = stat.st_mode & (S_ISUID|S_ISGID|S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO);
-		if (fixed_time == -1) {
+		if (pool->fixed_time == -1) {
 			dentries[i].mtime = stat.st_mtime;
 		} else {
-			dentries[i].mtime = fixed_time;
+			dentries[i].mtime = pool->fixed_time;
 		}
 		uint64_t capabilities;
-		if (fs_config_func != NULL) {
+		if (pool->fs_config_func != NULL) {
 #ifdef ANDROID
 			unsigned int mode = 0;
 			unsigned int uid = 0;
 			unsigned int gid = 0;
 			int dir = S_ISDIR(stat.st_mode);
-			fs_config_func(dentries[i].path, dir, target_out_path, &uid, &gid, &mode, &capabilities);
+			pthread_mutex_lock(&pool->label_lock);
+			pool->fs_config_func(dentries[i].path, dir, pool->target_out_path,
+					&uid, &gid, &mode, &capabilities);
+			pthread_mutex_unlock(&pool->label_lock);
 			dentries[i].mode = mode;
 			dentries[i].uid = uid;
 			dentries[i].gid = gid;
 			dentries[i].capabilities = capabilities;
 #else
-			error("can't set android permissions - built without android support");
+			scan_error(sd, 0, "can't set android permissions - built without android support");
 #endif
 		}
-#ifndef _WIN32
-		if (sehnd) {
-			if (selabel_lookup(sehnd, &dentries[i].secon, dentries[i].path, stat.st_mode) < 0) {
-				error("cannot lookup security context for %s", dentries[i].path);
-			}
-
-			if (dentries[i].secon && verbose)
-				printf("Labeling %s as %s\n", dentries[i].path, dentries[i].secon);
+		if (pool->sehnd) {
+			pthread_mutex_lock(&pool->label_lock);
+			ret = selabel_lookup(pool->sehnd, &dentries[i].secon, dentries[i].path, stat.st_mode);
+			pthread_mutex_unlock(&pool->label_lock);
+			if (ret < 0)
+				scan_error(sd, 0, "cannot lookup security context for %s", dentries[i].path);
 		}
-#endif
 
 		if (S_ISREG(stat.st_mode)) {
 			dentries[i].file_type = EXT4_FT_REG_FILE;
 		} else if (S_ISDIR(stat.st_mode)) {
 			dentries[i].file_type = EXT4_FT_DIR;
-			dirs++;
+			sd->dirs++;
 		} else if (S_ISCHR(stat.st_mode)) {
 			dentries[i].file_type = EXT4_FT_CHRDEV;
 		} else if (S_ISBLK(stat.st_mode)) {
@@ -265,57 +370,229 @@ static u32 build_directory_structure(const char *full_path, const char *dir_path
 			dentries[i].link = calloc(info.block_size, 1);
 			readlink(dentries[i].full_path, dentries[i].link, info.block_size - 1);
 		} else {
-			error("unknown file type on %s", dentries[i].path);
-			free(dentries[i].filename);
+			scan_error(sd, 0, "unknown file type on %s", dentries[i].path);
+			free((void *)dentries[i].filename);
+			free(dentries[i].path);
+			free(dentries[i].full_path);
+			free(dentries[i].secon);
+			memset(&dentries[i], 0, sizeof(struct dentry));
 			i--;
 		}
 	}
-	entries -= j - i;
+	/* only reached early if strdup failed */
+	for (; j < entries; j++)
+		free(namelist[j]);
 	free(namelist);
+	sd->entries = i;
 
 	if (needs_lost_and_found) {
-		/* insert a lost+found directory at the beginning of the dentries */
-		struct dentry *tmp = calloc(entries + 1, sizeof(struct dentry));
-		memset(tmp, 0, sizeof(struct dentry));
-		memcpy(tmp + 1, dentries, entries * sizeof(struct dentry));
-		dentries = tmp;
+		dentries = sd->dentries;
 
 		dentries[0].filename = strdup("lost+found");
-		asprintf(&dentries[0].path, "%slost+found", dir_path);
+		asprintf(&dentries[0].path, "%slost+found", sd->dir_path);
 		dentries[0].full_path = NULL;
 		dentries[0].size = 0;
 		dentries[0].mode = S_IRWXU;
 		dentries[0].file_type = EXT4_FT_DIR;
 		dentries[0].uid = 0;
 		dentries[0].gid = 0;
-		if (sehnd) {
-			if (selabel_lookup(sehnd, &dentries[0].secon, dentries[0].path, dentries[0].mode) < 0)
-				error("cannot lookup security context for %s", dentries[0].path);
+		if (pool->sehnd) {
+			pthread_mutex_lock(&pool->label_lock);
+			ret = selabel_lookup(pool->sehnd, &dentries[0].secon, dentries[0].path, dentries[0].mode);
+			pthread_mutex_unlock(&pool->label_lock);
+			if (ret < 0)
+				scan_error(sd, 0, "cannot lookup security context for %s", dentries[0].path);
 		}
-		entries++;
-		dirs++;
+		sd->entries++;
+		sd->dirs++;
 	}
 
-	inode = make_directory(dir_inode, entries, dentries, dirs);
+	if (sd->failed || !sd->dirs)
+		return;
 
-	for (i = 0; i < entries; i++) {
-		if (dentries[i].file_type == EXT4_FT_REG_FILE) {
-			entry_inode = make_file(dentries[i].full_path, dentries[i].size);
-		} else if (dentries[i].file_type == EXT4_FT_DIR) {
-			char *subdir_full_path = NULL;
-			char *subdir_dir_path;
-			if (dentries[i].full_path) {
-				ret = asprintf(&subdir_full_path, "%s/", dentries[i].full_path);
-				if (ret < 0)
-					critical_error_errno("asprintf");
+	sd->subdirs = calloc(sd->entries, sizeof(struct scan_dir *));
+	if (!sd->subdirs) {
+		scan_error(sd, 1, "malloc: %s", strerror(errno));
+		return;
+	}
+
+	dentries = sd->dentries;
+	for (i = 0; i < sd->entries; i++) {
+		char *subdir_full_path = NULL;
+		char *subdir_dir_path;
+
+		if (dentries[i].file_type != EXT4_FT_DIR)
+			continue;
+
+		if (dentries[i].full_path) {
+			ret = asprintf(&subdir_full_path, "%s/", dentries[i].full_path);
+			if (ret < 0) {
+				scan_error(sd, 1, "asprintf: %s", strerror(errno));
+				return;
 			}
-			ret = asprintf(&subdir_dir_path, "%s/", dentries[i].path);
-			if (ret < 0)
-				critical_error_errno("asprintf");
-			entry_inode = build_directory_structure(subdir_full_path, subdir_dir_path, target_out_path,
-					inode, fs_config_func, sehnd, verbose, fixed_time);
+		}
+		ret = asprintf(&subdir_dir_path, "%s/", dentries[i].path);
+		if (ret < 0) {
+			free(subdir_full_path);
+			scan_error(sd, 1, "asprintf: %s", strerror(errno));
+			return;
+		}
+		sd->subdirs[i] = scan_dir_new(subdir_full_path, subdir_dir_path, 0);
+		if (!sd->subdirs[i]) {
 			free(subdir_full_path);
 			free(subdir_dir_path);
+			scan_error(sd, 1, "malloc: %s", strerror(errno));
+			return;
+		}
+	}
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_pool *pool = arg;
+	struct scan_dir *sd;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stack_len && pool->busy)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (!pool->stack_len)
+			break;
+
+		sd = pool->stack[--pool->stack_len];
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+
+		scan_directory(pool, sd);
+
+		pthread_mutex_lock(&pool->lock);
+		if (sd->subdirs && pool->stack_len + (int)sd->dirs > pool->stack_size) {
+			int size = pool->stack_size * 2;
+			struct scan_dir **stack;
+
+			if (size < pool->stack_len + (int)sd->dirs)
+				size = pool->stack_len + sd->dirs;
+			stack = realloc(pool->stack, size * sizeof(*stack));
+			if (stack) {
+				pool->stack = stack;
+				pool->stack_size = size;
+			} else {
+				scan_error(sd, 1, "realloc: %s", strerror(errno));
+			}
+		}
+		for (i = sd->entries - 1; !sd->failed && sd->subdirs && i >= 0; i--)
+			if (sd->subdirs[i])
+				pool->stack[pool->stack_len++] = sd->subdirs[i];
+		pool->busy--;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* Reads the whole tree under full_path on a pool of threads.  The result
+   does not depend on the order the threads read directories in */
+static struct scan_dir *scan_tree(const char *full_path, const char *dir_path,
+		const char *target_out_path, fs_config_func_t fs_config_func,
+		struct selabel_handle *sehnd, time_t fixed_time)
+{
+	struct scan_pool pool;
+	struct scan_dir *root;
+	pthread_t tids[SCAN_THREADS];
+	int started = 0;
+	int i;
+
+	root = scan_dir_new(strdup(full_path), strdup(dir_path), 1);
+	if (!root || !root->full_path || !root->dir_path)
+		critical_error_errno("malloc");
+
+	memset(&pool, 0, sizeof(pool));
+	pool.target_out_path = target_out_path;
+	pool.fs_config_func = fs_config_func;
+	pool.sehnd = sehnd;
+	pool.fixed_time = fixed_time;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	pthread_mutex_init(&pool.label_lock, NULL);
+
+	pool.stack_size = 64;
+	pool.stack = malloc(pool.stack_size * sizeof(*pool.stack));
+	if (!pool.stack)
+		critical_error_errno("malloc");
+	pool.stack[pool.stack_len++] = root;
+
+	/* The scanners spend most of their time waiting on the filesystem, so
+	   the pool is not sized by the number of cpus.  The calling thread is
+	   one of the scanners */
+	for (i = 1; i < SCAN_THREADS; i++)
+		if (pthread_create(&tids[started], NULL, scan_worker, &pool) == 0)
+			started++;
+
+	scan_worker(&pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&pool.label_lock);
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.stack);
+
+	return root;
+}
+
+static void scan_collect_files(struct scan_dir *sd, struct dentry ***files,
+		u32 *count, u32 *size)
+{
+	int i;
+
+	for (i = 0; i < sd->entries; i++) {
+		if (sd->subdirs && sd->subdirs[i])
+			scan_collect_files(sd->subdirs[i], files, count, size);
+		if (sd->dentries[i].file_type != EXT4_FT_REG_FILE)
+			continue;
+		if (*count == *size) {
+			*size = *size ? *size * 2 : 1024;
+			*files = realloc(*files, *size * sizeof(**files));
+			if (!*files)
+				critical_error_errno("realloc");
+		}
+		(*files)[(*count)++] = &sd->dentries[i];
+	}
+}
+
+/* Creates the scanned tree in the generated filesystem, in the same order
+   the tree used to be read in.  Calls itself recursively with each
+   directory in the given directory */
+static u32 build_scanned_directory(struct scan_dir *sd, u32 dir_inode, int verbose)
+{
+	struct dentry *dentries = sd->dentries;
+	int ret;
+	int i;
+	u32 inode;
+	u32 entry_inode;
+
+	for (i = 0; i < sd->error_count; i++)
+		error("%s", sd->errors[i] ? sd->errors[i] : "out of memory");
+	if (sd->failed)
+		return EXT4_ALLOCATE_FAILED;
+
+	/* lost+found is not on disk, and was never reported as labeled */
+	if (verbose)
+		for (i = 0; i < sd->entries; i++)
+			if (dentries[i].secon && dentries[i].full_path)
+				printf("Labeling %s as %s\n", dentries[i].path, dentries[i].secon);
+
+	inode = make_directory(dir_inode, sd->entries, dentries, sd->dirs);
+
+	for (i = 0; i < sd->entries; i++) {
+		if (dentries[i].file_type == EXT4_FT_REG_FILE) {
+			entry_inode = make_file(dentries[i].full_path, dentries[i].size,
+					dentries[i].digest);
+		} else if (dentries[i].file_type == EXT4_FT_DIR) {
+			entry_inode = build_scanned_directory(sd->subdirs[i], inode, verbose);
 		} else if (dentries[i].file_type == EXT4_FT_SYMLINK) {
 			entry_inode = make_link(dentries[i].link);
 		} else {
@@ -343,15 +620,41 @@ static u32 build_directory_structure(const char *full_path, const char *dir_path
 		ret = inode_set_capabilities(entry_inode, dentries[i].capabilities);
 		if (ret)
 			error("failed to set capability on %s\n", dentries[i].path);
+	}
 
-		free(dentries[i].path);
-		free(dentries[i].full_path);
-		free(dentries[i].link);
-		free((void *)dentries[i].filename);
-		free(dentries[i].secon);
+	return inode;
+}
+
+/* Read a local directory and create the same tree in the generated filesystem.
+   full_path is an absolute or relative path, with a trailing slash, to the
+   directory on disk that should be copied.
+   dir_path is an absolute path, with trailing slash, to the same directory
+   if the image were mounted at the specified mount point.
+   The tree is read first, on a pool of threads, and then created in the
+   filesystem in order on this thread so the image does not depend on the
+   order the threads ran in */
+static u32 build_directory_structure(const char *full_path, const char *dir_path, const char *target_out_path,
+		fs_config_func_t fs_config_func, struct selabel_handle *sehnd,
+		int verbose, time_t fixed_time)
+{
+	struct scan_dir *root;
+	u32 inode;
+
+	root = scan_tree(full_path, dir_path, target_out_path, fs_config_func,
+			sehnd, fixed_time);
+
+	if (info.dedup) {
+		struct dentry **files = NULL;
+		u32 count = 0, size = 0;
+
+		scan_collect_files(root, &files, &count, &size);
+		dedup_hash_files(files, count);
+		free(files);
 	}
 
-	free(dentries);
+	inode = build_scanned_directory(root, 0, verbose);
+	scan_dir_free(root);
+
 	return inode;
 }
 #endif
@@ -798,13 +1101,19 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 
 	info.feat_compat |=
 			EXT4_FEATURE_COMPAT_RESIZE_INODE |
-			EXT4_FEATURE_COMPAT_EXT_ATTR;
+			EXT4_FEATURE_COMPAT_EXT_ATTR |
+			EXT4_FEATURE_COMPAT_DIR_INDEX;
 
 	info.feat_ro_compat |=
 			EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER |
 			EXT4_FEATURE_RO_COMPAT_LARGE_FILE |
 			EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
 
+	/* Identical files share blocks, so the image can only be mounted
+	   read-only */
+	if (info.dedup)
+		info.feat_ro_compat |= EXT4_FEATURE_RO_COMPAT_SHARED_BLOCKS;
+
 	info.feat_incompat |=
 			EXT4_FEATURE_INCOMPAT_EXTENTS |
 			EXT4_FEATURE_INCOMPAT_FILETYPE;
@@ -851,7 +1160,7 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 	root_inode_num = build_default_directory_structure(mountpoint, sehnd);
 #else
 	if (directory)
-		root_inode_num = build_directory_structure(directory, mountpoint, target_out_directory, 0,
+		root_inode_num = build_directory_structure(directory, mountpoint, target_out_directory,
 			fs_config_func, sehnd, verbose, fixed_time);
 	else
 		root_inode_num = build_default_directory_structure(mountpoint, sehnd);
@@ -923,6 +1232,7 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 		free_alloc(p);
 		p = pn;
 	}
+	dedup_free();
 
 	free(mountpoint);
 	free(directory);
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Checks the bitmap range helpers against bit at a time versions, and times
+   both on a block group sized bitmap */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ext4_utils/ext4_utils.h"
+
+#define BITMAP_BITS (8 * 4096)
+#define CHECK_OPS 2000000
+#define BENCH_ROUNDS 10000
+
+static void ref_fill_range(u8 *bitmap, u32 start, u32 len, int set)
+{
+	u32 bit;
+
+	for (bit = start; bit < start + len; bit++) {
+		if (set)
+			bitmap[bit / 8] |= 1 << (bit % 8);
+		else
+			bitmap[bit / 8] &= ~(1 << (bit % 8));
+	}
+}
+
+static u32 ref_find_next_set(u8 *bitmap, u32 start, u32 end)
+{
+	u32 bit;
+
+	for (bit = start; bit < end; bit++)
+		if (bitmap_get_bit(bitmap, bit))
+			return bit;
+
+	return end;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs random set, clear and find operations on both versions, and returns
+   the number of operations whose results differ */
+static int check(void)
+{
+	u8 bitmap[BITMAP_BITS / 8];
+	u8 ref[BITMAP_BITS / 8];
+	int failures = 0;
+	int i;
+
+	memset(bitmap, 0, sizeof(bitmap));
+	memset(ref, 0, sizeof(ref));
+	srand(1);
+
+	for (i = 0; i < CHECK_OPS; i++) {
+		u32 start = rand() % BITMAP_BITS;
+		/* mostly short ranges, so that finds see mixed bytes and words */
+		u32 len = rand() % (rand() % 8 ? 130 : BITMAP_BITS - start + 1);
+		u32 end;
+
+		if (len > BITMAP_BITS - start)
+			len = BITMAP_BITS - start;
+		end = start + len;
+
+		switch (rand() % 3) {
+		case 0:
+			bitmap_set_range(bitmap, start, len);
+			ref_fill_range(ref, start, len, 1);
+			break;
+		case 1:
+			bitmap_clear_range(bitmap, start, len);
+			ref_fill_range(ref, start, len, 0);
+			break;
+		default:
+			if (bitmap_find_next_set(bitmap, start, end) !=
+					ref_find_next_set(ref, start, end)) {
+				fprintf(stderr, "find %u-%u differs\n", start, end);
+				failures++;
+			}
+			break;
+		}
+
+		if (memcmp(bitmap, ref, sizeof(bitmap))) {
+			fprintf(stderr, "bitmaps differ after operation %d\n", i);
+			return failures + 1;
+		}
+	}
+
+	return failures;
+}
+
+static void bench(void)
+{
+	u8 bitmap[BITMAP_BITS / 8];
+	volatile u32 sink = 0;
+	double start;
+	int i;
+
+	/* reserving all but the first few blocks of a block group */
+	memset(bitmap, 0, sizeof(bitmap));
+	start = now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		sink += bitmap_find_next_set(bitmap, 3, BITMAP_BITS);
+		bitmap_set_range(bitmap, 3, BITMAP_BITS - 3);
+		bitmap_clear_range(bitmap, 3, BITMAP_BITS - 3);
+	}
+	printf("%-30s %8.2f us\n", "reserve a block group",
+		(now() - start) / BENCH_ROUNDS * 1e6);
+
+	start = now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		sink += ref_find_next_set(bitmap, 3, BITMAP_BITS);
+		ref_fill_range(bitmap, 3, BITMAP_BITS - 3, 1);
+		ref_fill_range(bitmap, 3, BITMAP_BITS - 3, 0);
+	}
+	printf("%-30s %8.2f us\n", "  bit at a time",
+		(now() - start) / BENCH_ROUNDS * 1e6);
+
+	/* finding the only set bit at the end of a block group */
+	bitmap[BITMAP_BITS / 8 - 1] = 0x80;
+	start = now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		sink += bitmap_find_next_set(bitmap, i % 8, BITMAP_BITS);
+	printf("%-30s %8.2f us\n", "find the last bit of a group",
+		(now() - start) / BENCH_ROUNDS * 1e6);
+
+	start = now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		sink += ref_find_next_set(bitmap, i % 8, BITMAP_BITS);
+	printf("%-30s %8.2f us\n", "  bit at a time",
+		(now() - start) / BENCH_ROUNDS * 1e6);
+}
+
+int main(void)
+{
+	int failures = check();
+
+	if (failures) {
+		fprintf(stderr, "%d of %d operations failed\n", failures, CHECK_OPS);
+		return 1;
+	}
+	printf("%d random operations match\n", CHECK_OPS);
+
+	bench();
+	return 0;
+}
@@ -403,6 +403,8 @@ static void reset_handle(fec_handle *f)
 
     memset(&f->ecc, 0, sizeof(f->ecc));
     memset(&f->verity, 0, sizeof(f->verity));
+    memset(&f->cache, 0, sizeof(f->cache));
+    f->pool = NULL;
 }
 
 /* closes and flushes `f->fd' and releases any memory allocated for `f' */
@@ -410,6 +412,9 @@ int fec_close(struct fec_handle *f)
 {
     check(f);
 
+    /* stop workers before releasing what they use */
+    process_free(f);
+
     if (f->fd != -1) {
         if (f->mode & O_RDWR && fdatasync(f->fd) == -1) {
             warn("fdatasync failed: %s", strerror(errno));
@@ -428,6 +433,8 @@ int fec_close(struct fec_handle *f)
         delete[] f->verity.table;
     }
 
+    verity_cache_free(f);
+
     pthread_mutex_destroy(&f->mutex);
 
     reset_handle(f);
@@ -504,6 +511,22 @@ int fec_get_status(struct fec_handle *f, struct fec_status *s)
     return 0;
 }
 
+/* returns the hit and miss counts of the verified block cache, which are zero
+   unless `f' was opened with `FEC_VERITY_CACHE_DATA' or trusts a known-good
+   bitmap */
+int fec_get_cache_status(struct fec_handle *f, struct fec_cache_status *s)
+{
+    check(f);
+    check(s);
+
+    pthread_mutex_lock(&f->mutex);
+    s->hits = f->cache.hits;
+    s->misses = f->cache.misses;
+    pthread_mutex_unlock(&f->mutex);
+
+    return 0;
+}
+
 /* opens `path' using given options and returns a fec_handle in `handle' if
    successful */
 int fec_open(struct fec_handle **handle, const char *path, int mode, int flags,
@@ -563,6 +586,9 @@ int fec_open(struct fec_handle **handle, const char *path, int mode, int flags,
 
     if (load_verity(f.get()) == -1) {
         debug("verity metadata not found from '%s'", path);
+    } else if (f->verity.hash && (flags & FEC_VERITY_CACHE_DATA) &&
+                verity_cache_init(f.get()) == -1) {
+        warn("failed to allocate verity cache: %s", strerror(errno));
     }
 
     *handle = f.release();
@@ -38,10 +38,18 @@
 /* processing parameters */
 #define WORK_MIN_THREADS 1
 #define WORK_MAX_THREADS 64
+#define WORK_MIN_BLOCKS 16 /* per thread; smaller reads are not split */
+
+/* ecc parameters */
+#define ECC_TILE_BLOCKS 16 /* blocks per tile when interleaving RS blocks */
+#define ECC_TILE_BYTES 64  /* bytes per block in a tile, one cache line */
 
 /* verity parameters */
 #define VERITY_CACHE_BLOCKS 4096
+#define VERITY_CACHE_WAYS 8
 #define VERITY_NO_CACHE UINT64_MAX
+#define VERITY_BATCH_BLOCKS 32 /* blocks read with a single call */
+#define VERITY_BITMAP_BITS 64 /* blocks per known-good bitmap word */
 
 /* verity definitions */
 #define VERITY_METADATA_SIZE (8 * FEC_BLOCKSIZE)
@@ -63,6 +71,19 @@ struct verity_header {
     uint32_t length;
 };
 
+/* known-good block bitmap side file, followed by the bitmap */
+#define VERITY_BITMAP_MAGIC 0xB0016009
+#define VERITY_BITMAP_VERSION 0
+
+struct verity_bitmap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t root[SHA256_DIGEST_LENGTH]; /* root hash the bits are valid for */
+    uint64_t data_blocks;
+    uint64_t verified; /* number of bits set */
+    uint8_t digest[SHA256_DIGEST_LENGTH]; /* SHA-256 of the bitmap */
+} __attribute__ ((packed));
+
 /* file handle */
 struct ecc_info {
     bool valid;
@@ -86,16 +107,35 @@ struct verity_info {
     uint8_t *salt;
     uint64_t data_blocks;
     uint64_t metadata_start; /* offset in file */
+    uint8_t root[SHA256_DIGEST_LENGTH];
     uint8_t zero_hash[SHA256_DIGEST_LENGTH];
     verity_header header;
     verity_header ecc_header;
 };
 
 struct verity_block_info {
-    uint64_t index;
+    uint64_t index; /* VERITY_NO_CACHE if unused */
+    uint64_t last_used;
     bool valid;
 };
 
+/* blocks that passed verification recently, VERITY_CACHE_WAYS-way set
+   associative by block index, and optionally every block verified against
+   `verity_info::root' since fec_verified_load; protected by
+   `fec_handle::mutex' */
+struct verity_cache {
+    verity_block_info *blocks; /* VERITY_CACHE_BLOCKS entries */
+    uint8_t *data; /* contents of the blocks */
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t *bitmap; /* one bit per data block, NULL if not tracked */
+    uint64_t bitmap_words;
+    uint64_t verified; /* number of bits set in `bitmap' */
+};
+
+struct process_pool;
+
 struct fec_handle {
     ecc_info ecc;
     int fd;
@@ -107,6 +147,8 @@ struct fec_handle {
     uint64_t pos;
     uint64_t size;
     verity_info verity;
+    verity_cache cache;
+    process_pool *pool; /* worker threads for process() */
 };
 
 /* I/O helpers */
@@ -122,6 +164,8 @@ typedef ssize_t (*read_func)(fec_handle *f, uint8_t *dest, size_t count,
 extern ssize_t process(fec_handle *f, uint8_t *buf, size_t count,
         uint64_t offset, read_func func);
 
+extern void process_free(fec_handle *f);
+
 /* verity functions */
 extern uint64_t verity_get_size(uint64_t file_size, uint32_t *verity_levels,
         uint32_t *level_hashes);
@@ -131,6 +175,26 @@ extern int verity_parse_header(fec_handle *f, uint64_t offset);
 extern bool verity_check_block(fec_handle *f, const uint8_t *expected,
         const uint8_t *block);
 
+/* verified block cache */
+enum verity_cache_result {
+    VERITY_CACHE_MISS,
+    VERITY_CACHE_VERIFIED, /* block trusted as verified, contents not cached */
+    VERITY_CACHE_DATA /* contents copied from the cache */
+};
+
+extern int verity_cache_init(fec_handle *f);
+
+extern void verity_cache_free(fec_handle *f);
+
+extern verity_cache_result verity_cache_lookup(fec_handle *f, uint64_t index,
+        uint8_t *data);
+
+extern void verity_cache_insert(fec_handle *f, uint64_t index,
+        const uint8_t *data);
+
+extern void verity_cache_invalidate(fec_handle *f, uint64_t offset,
+        size_t count);
+
 /* helper macros */
 #ifndef unlikely
     #define unlikely(x) __builtin_expect(!!(x), 0)
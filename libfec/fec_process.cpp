@@ -16,6 +16,8 @@
 
 #include "fec_private.h"
 
+struct process_batch;
+
 struct process_info {
     int id;
     fec_handle *f;
@@ -25,21 +27,161 @@ struct process_info {
     read_func func;
     ssize_t rc;
     size_t errors;
+    process_batch *batch;
 };
 
-/* thread function  */
-static void * __process(void *cookie)
-{
-    process_info *p = static_cast<process_info *>(cookie);
+/* the parts of one read handed to the pool */
+struct process_batch {
+    int pending; /* parts not yet completed */
+};
 
+/* worker threads owned by a fec_handle, created on the first read large
+   enough to be split; the calling thread always processes a part itself */
+struct process_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t work; /* signaled when parts are queued or on exit */
+    pthread_cond_t done; /* signaled when a batch completes */
+    std::vector<process_info *> queue;
+    std::vector<pthread_t> threads;
+    bool exiting;
+};
+
+/* runs a part of a read */
+static void __process(process_info *p)
+{
     debug("thread %d: [%" PRIu64 ", %" PRIu64 ")", p->id, p->offset,
         p->offset + p->count);
 
     p->rc = p->func(p->f, p->buf, p->count, p->offset, &p->errors);
-    return p;
 }
 
-/* launches a maximum number of threads to process a read */
+/* marks part `p' as completed, with `pool->mutex' held */
+static void __complete(process_pool *pool, process_info *p)
+{
+    if (--p->batch->pending == 0) {
+        pthread_cond_broadcast(&pool->done);
+    }
+}
+
+/* thread function */
+static void * __worker(void *cookie)
+{
+    process_pool *pool = static_cast<process_pool *>(cookie);
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (true) {
+        while (pool->queue.empty() && !pool->exiting) {
+            pthread_cond_wait(&pool->work, &pool->mutex);
+        }
+
+        if (pool->queue.empty()) {
+            break; /* exiting */
+        }
+
+        process_info *p = pool->queue.back();
+        pool->queue.pop_back();
+
+        pthread_mutex_unlock(&pool->mutex);
+        __process(p);
+        pthread_mutex_lock(&pool->mutex);
+
+        __complete(pool, p);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/* stops the worker threads of `pool' and releases it */
+static void destroy_pool(process_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->exiting = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (auto thread : pool->threads) {
+        if (pthread_join(thread, NULL) != 0) {
+            error("failed to join thread: %s", strerror(errno));
+        }
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->mutex);
+    delete pool;
+}
+
+/* returns the worker pool of `f', starting `threads' workers on first use */
+static process_pool *get_pool(fec_handle *f, int threads)
+{
+    pthread_mutex_lock(&f->mutex);
+
+    if (f->pool) {
+        pthread_mutex_unlock(&f->mutex);
+        return f->pool;
+    }
+
+    std::unique_ptr<process_pool> pool(new (std::nothrow) process_pool);
+
+    if (!pool) {
+        pthread_mutex_unlock(&f->mutex);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->exiting = false;
+
+    for (int i = 0; i < threads; ++i) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, __worker, pool.get()) != 0) {
+            error("failed to create thread: %s", strerror(errno));
+            break;
+        }
+
+        pool->threads.push_back(thread);
+    }
+
+    if (pool->threads.empty()) {
+        destroy_pool(pool.release());
+        pthread_mutex_unlock(&f->mutex);
+        return NULL;
+    }
+
+    f->pool = pool.release();
+    pthread_mutex_unlock(&f->mutex);
+
+    debug("started %zu worker threads", f->pool->threads.size());
+    return f->pool;
+}
+
+/* stops the worker threads started for `f' */
+void process_free(fec_handle *f)
+{
+    if (f->pool) {
+        destroy_pool(f->pool);
+        f->pool = NULL;
+    }
+}
+
+/* adds corrected errors to `f->errors', which reads from several threads
+   may update */
+static void add_errors(fec_handle *f, size_t errors)
+{
+    if (errors) {
+        pthread_mutex_lock(&f->mutex);
+        f->errors += errors;
+        pthread_mutex_unlock(&f->mutex);
+    }
+}
+
+/* processes a read in parts of at least WORK_MIN_BLOCKS blocks, on the
+   calling thread and the worker pool of `f' */
 ssize_t process(fec_handle *f, uint8_t *buf, size_t count, uint64_t offset,
         read_func func)
 {
@@ -60,10 +202,53 @@ ssize_t process(fec_handle *f, uint8_t *buf, size_t count, uint64_t offset,
     }
 
     uint64_t start = (offset / FEC_BLOCKSIZE) * FEC_BLOCKSIZE;
-    size_t blocks = fec_div_round_up(count, FEC_BLOCKSIZE);
+    size_t blocks = fec_div_round_up(offset + count - start, FEC_BLOCKSIZE);
+
+    /* splitting small reads costs more than it saves */
+    size_t max_parts = fec_div_round_up(blocks, WORK_MIN_BLOCKS);
+
+    if (threads == 1 || max_parts == 1) {
+        size_t errors = 0;
+        ssize_t rc = func(f, buf, count, offset, &errors);
+
+        if (rc == -1) {
+            errno = EIO;
+            return -1;
+        }
+
+        add_errors(f, errors);
+        return rc;
+    }
+
+    /* the pool is sized for the CPUs and lives as long as `f', only this
+       read is limited to `max_parts' */
+    process_pool *pool = get_pool(f, threads - 1);
+
+    if (!pool) {
+        /* fall back to reading on the calling thread */
+        size_t errors = 0;
+        ssize_t rc = func(f, buf, count, offset, &errors);
+
+        if (rc == -1) {
+            errno = EIO;
+            return -1;
+        }
+
+        add_errors(f, errors);
+        return rc;
+    }
+
+    if ((size_t)threads > max_parts) {
+        threads = (int)max_parts;
+    }
+
+    if ((size_t)threads > pool->threads.size() + 1) {
+        threads = (int)pool->threads.size() + 1;
+    }
 
     size_t count_per_thread = fec_div_round_up(blocks, threads) * FEC_BLOCKSIZE;
-    size_t max_threads = fec_div_round_up(count, count_per_thread);
+    size_t max_threads = fec_div_round_up(offset + count - start,
+                            count_per_thread);
 
     if ((size_t)threads > max_threads) {
         threads = (int)max_threads;
@@ -76,11 +261,10 @@ ssize_t process(fec_handle *f, uint8_t *buf, size_t count, uint64_t offset,
     debug("%d threads, %zu bytes per thread (total %zu)", threads,
         count_per_thread, count);
 
-    std::vector<pthread_t> handles;
     process_info info[threads];
-    ssize_t rc = 0;
+    process_batch batch;
+    batch.pending = threads - 1;
 
-    /* start threads to process queue */
     for (int i = 0; i < threads; ++i) {
         check(left > 0);
 
@@ -92,20 +276,12 @@ ssize_t process(fec_handle *f, uint8_t *buf, size_t count, uint64_t offset,
         info[i].func = func;
         info[i].rc = -1;
         info[i].errors = 0;
+        info[i].batch = &batch;
 
         if (info[i].count > left) {
             info[i].count = left;
         }
 
-        pthread_t thread;
-
-        if (pthread_create(&thread, NULL, __process, &info[i]) != 0) {
-            error("failed to create thread: %s", strerror(errno));
-            rc = -1;
-        } else {
-            handles.push_back(thread);
-        }
-
         pos = end;
         end  += count_per_thread;
         left -= info[i].count;
@@ -113,20 +289,54 @@ ssize_t process(fec_handle *f, uint8_t *buf, size_t count, uint64_t offset,
 
     check(left == 0);
 
-    ssize_t nread = 0;
+    /* queue all but the first part, which we process ourselves */
+    pthread_mutex_lock(&pool->mutex);
 
-    /* wait for all threads to complete */
-    for (auto thread : handles) {
-        process_info *p = NULL;
+    for (int i = threads - 1; i > 0; --i) {
+        pool->queue.push_back(&info[i]);
+    }
 
-        if (pthread_join(thread, (void **)&p) != 0) {
-            error("failed to join thread: %s", strerror(errno));
-            rc = -1;
-        } else if (!p || p->rc == -1) {
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+
+    __process(&info[0]);
+
+    pthread_mutex_lock(&pool->mutex);
+
+    /* help with our parts still queued, so that reads issued from several
+       threads, or from within a read, cannot wait on each other */
+    for (auto it = pool->queue.begin(); it != pool->queue.end();) {
+        if ((*it)->batch != &batch) {
+            ++it;
+            continue;
+        }
+
+        process_info *p = *it;
+        pool->queue.erase(it);
+
+        pthread_mutex_unlock(&pool->mutex);
+        __process(p);
+        pthread_mutex_lock(&pool->mutex);
+
+        __complete(pool, p);
+        it = pool->queue.begin();
+    }
+
+    while (batch.pending > 0) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    ssize_t rc = 0;
+    ssize_t nread = 0;
+
+    for (int i = 0; i < threads; ++i) {
+        if (info[i].rc == -1) {
             rc = -1;
         } else {
-            nread += p->rc;
-            f->errors += p->errors;
+            nread += info[i].rc;
+            add_errors(f, info[i].errors);
         }
     }
 
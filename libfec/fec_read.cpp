@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -102,6 +103,26 @@ static inline bool is_zero(fec_handle *f, uint64_t offset)
     return !memcmp(v->zero_hash, &v->hash[hash_offset], SHA256_DIGEST_LENGTH);
 }
 
+/* copies `rsn' data blocks from `staging' to the columns of `ecc_data', one
+   tile at a time to keep both the reads and the writes in cache */
+static void ecc_interleave(uint8_t *ecc_data, const uint8_t *staging, int rsn)
+{
+    for (int i0 = 0; i0 < rsn; i0 += ECC_TILE_BLOCKS) {
+        int i1 = std::min(i0 + ECC_TILE_BLOCKS, rsn);
+
+        for (int j0 = 0; j0 < FEC_BLOCKSIZE; j0 += ECC_TILE_BYTES) {
+            for (int i = i0; i < i1; ++i) {
+                const uint8_t *src = &staging[i * FEC_BLOCKSIZE + j0];
+                uint8_t *dst = &ecc_data[j0 * FEC_RSM + i];
+
+                for (int j = 0; j < ECC_TILE_BYTES; ++j) {
+                    dst[j * FEC_RSM] = src[j];
+                }
+            }
+        }
+    }
+}
+
 /* reads and decodes a single block starting from `offset', returns the number
    of bytes corrected in `errors' */
 static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
@@ -121,6 +142,17 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
     /* verity is required to check for erasures */
     check(!use_erasures || f->verity.hash);
 
+    /* the second half of the buffer holds the data blocks followed by the
+       parity bytes, which are stored contiguously for the entire RS block */
+    uint8_t *staging = &ecc_data[FEC_RSM * FEC_BLOCKSIZE];
+    uint8_t *parity = &staging[e->rsn * FEC_BLOCKSIZE];
+
+    if (!raw_pread(f, parity, e->roots * FEC_BLOCKSIZE,
+            e->start + rsb * e->roots)) {
+        error("failed to read ecc data: %s", strerror(errno));
+        return -1;
+    }
+
     for (int i = 0; i < e->rsn; ++i) {
         uint64_t interleaved = fec_ecc_interleave(rsb * e->rsn + i, e->rsn,
                                     e->rounds);
@@ -131,12 +163,16 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
 
         /* to improve our chances of correcting IO errors, initialize the
            buffer to zeros even if we are going to read to it later */
-        uint8_t bbuf[FEC_BLOCKSIZE] = {0};
+        uint8_t *bbuf = &staging[i * FEC_BLOCKSIZE];
+        memset(bbuf, 0, FEC_BLOCKSIZE);
 
+        /* the data blocks are spread across the image, so each one needs a
+           read of its own */
         if (likely(interleaved < e->start) && !is_zero(f, interleaved)) {
             /* copy raw data to reconstruct the RS block */
             if (!raw_pread(f, bbuf, FEC_BLOCKSIZE, interleaved)) {
                 warn("failed to read: %s", strerror(errno));
+                memset(bbuf, 0, FEC_BLOCKSIZE);
 
                 /* treat errors as corruption */
                 if (use_erasures && neras <= e->roots) {
@@ -147,10 +183,13 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
                 erasures[neras++] = i;
             }
         }
+    }
 
-        for (int j = 0; j < FEC_BLOCKSIZE; ++j) {
-            ecc_data[j * FEC_RSM + i] = bbuf[j];
-        }
+    ecc_interleave(ecc_data, staging, e->rsn);
+
+    for (int i = 0; i < FEC_BLOCKSIZE; ++i) {
+        memcpy(&ecc_data[i * FEC_RSM + e->rsn], &parity[i * e->roots],
+            e->roots);
     }
 
     check(data_index >= 0);
@@ -159,13 +198,6 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
     uint8_t copy[FEC_RSM];
 
     for (int i = 0; i < FEC_BLOCKSIZE; ++i) {
-        /* copy parity data */
-        if (!raw_pread(f, &ecc_data[i * FEC_RSM + e->rsn], e->roots,
-                e->start + (i + rsb) * e->roots)) {
-            error("failed to read ecc data: %s", strerror(errno));
-            return -1;
-        }
-
         /* for debugging decoding failures, because decode_rs_char can mangle
            ecc_data */
         if (unlikely(use_erasures)) {
@@ -204,7 +236,8 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
     return FEC_BLOCKSIZE;
 }
 
-/* initializes RS decoder and allocates memory for interleaving */
+/* initializes RS decoder and allocates memory for interleaving, with room
+   for staging the raw data and parity of an RS block */
 static int ecc_init(fec_handle *f, rs_unique_ptr& rs,
         std::unique_ptr<uint8_t[]>& ecc_data)
 {
@@ -218,7 +251,7 @@ static int ecc_init(fec_handle *f, rs_unique_ptr& rs,
         return -1;
     }
 
-    ecc_data.reset(new (std::nothrow) uint8_t[FEC_RSM * FEC_BLOCKSIZE]);
+    ecc_data.reset(new (std::nothrow) uint8_t[2 * FEC_RSM * FEC_BLOCKSIZE]);
 
     if (unlikely(!ecc_data)) {
         error("failed to allocate ecc buffer");
@@ -306,6 +339,23 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
     size_t left = count;
     uint8_t data[FEC_BLOCKSIZE];
 
+    /* consecutive blocks are read in runs of up to VERITY_BATCH_BLOCKS with
+       a single call, and verified in place */
+    uint64_t last = (offset + count - 1) / FEC_BLOCKSIZE;
+    size_t batch_blocks = (size_t)std::min<uint64_t>(last - curr + 1,
+                            VERITY_BATCH_BLOCKS);
+    std::unique_ptr<uint8_t[]> batch(
+        new (std::nothrow) uint8_t[batch_blocks * FEC_BLOCKSIZE]);
+
+    if (unlikely(!batch)) {
+        error("failed to allocate read buffer");
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint64_t batch_start = 0;
+    size_t batch_size = 0;
+
     uint64_t max_hash_block = (f->verity.hash_data_blocks * FEC_BLOCKSIZE -
                                 SHA256_DIGEST_LENGTH) / SHA256_DIGEST_LENGTH;
 
@@ -316,6 +366,8 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
         uint64_t curr_offset = curr * FEC_BLOCKSIZE;
 
         bool expect_zeros = is_zero(f, curr_offset);
+        verity_cache_result cached;
+        const uint8_t *block = data;
 
         /* if we are in read-only mode and expect to read a zero block,
            skip reading and just return zeros */
@@ -324,16 +376,43 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
             goto valid;
         }
 
-        /* copy raw data without error correction */
-        if (!raw_pread(f, data, FEC_BLOCKSIZE, curr_offset)) {
-            error("failed to read: %s", strerror(errno));
-            return -1;
+        /* blocks verified earlier don't need to be hashed again */
+        cached = verity_cache_lookup(f, curr, data);
+
+        if (cached == VERITY_CACHE_DATA) {
+            goto valid;
+        }
+
+        /* copy raw data without error correction, along with the blocks
+           that follow if they are not in the buffer yet */
+        if (curr < batch_start || curr >= batch_start + batch_size) {
+            batch_start = curr;
+            batch_size = (size_t)std::min<uint64_t>(last - curr + 1,
+                            batch_blocks);
+
+            if (!raw_pread(f, batch.get(), batch_size * FEC_BLOCKSIZE,
+                    curr_offset)) {
+                error("failed to read: %s", strerror(errno));
+                return -1;
+            }
         }
 
-        if (likely(verity_check_block(f, hash, data))) {
+        block = &batch[(curr - batch_start) * FEC_BLOCKSIZE];
+
+        if (cached == VERITY_CACHE_VERIFIED) {
             goto valid;
         }
 
+        if (likely(verity_check_block(f, hash, block))) {
+            verity_cache_insert(f, curr, block);
+            goto valid;
+        }
+
+        block = data;
+
+        /* the block is no longer known to be good */
+        verity_cache_invalidate(f, curr_offset, FEC_BLOCKSIZE);
+
         /* we know the block is supposed to contain zeros, so return zeros
            instead of trying to correct it */
         if (expect_zeros) {
@@ -382,6 +461,12 @@ corrected:
             return -1;
         }
 
+        /* in read-only mode, the block on disk is still corrupted and must be
+           verified again */
+        if (f->mode & O_RDWR) {
+            verity_cache_insert(f, curr, data);
+        }
+
 valid:
         size_t copy = FEC_BLOCKSIZE - coff;
 
@@ -389,7 +474,7 @@ valid:
             copy = left;
         }
 
-        memcpy(dest, &data[coff], copy);
+        memcpy(dest, &block[coff], copy);
 
         dest += copy;
         left -= copy;
@@ -498,6 +583,9 @@ bool raw_pwrite(fec_handle *f, const void *buf, size_t count, uint64_t offset)
     check(f);
     check(buf);
 
+    /* written blocks must be verified again */
+    verity_cache_invalidate(f, offset, count);
+
     const uint8_t *p = (const uint8_t *)buf;
     size_t remaining = count;
 
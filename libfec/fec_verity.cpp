@@ -16,6 +16,7 @@
 
 #include <ctype.h>
 #include <stdlib.h>
+#include <android-base/file.h>
 #include <android-base/strings.h>
 #include "fec_private.h"
 
@@ -154,6 +155,264 @@ bool verity_check_block(fec_handle *f, const uint8_t *expected,
     return !memcmp(expected, hash, SHA256_DIGEST_LENGTH);
 }
 
+/* allocates the verified block cache and space for the contents of its
+   blocks, used if `f->flags' has `FEC_VERITY_CACHE_DATA' set */
+int verity_cache_init(fec_handle *f)
+{
+    check(f);
+
+    verity_cache *c = &f->cache;
+    std::unique_ptr<verity_block_info[]> blocks(
+        new (std::nothrow) verity_block_info[VERITY_CACHE_BLOCKS]);
+
+    if (!blocks) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < VERITY_CACHE_BLOCKS; ++i) {
+        blocks[i].index = VERITY_NO_CACHE;
+        blocks[i].last_used = 0;
+        blocks[i].valid = false;
+    }
+
+    c->data = new (std::nothrow) uint8_t[VERITY_CACHE_BLOCKS *
+                                         (size_t)FEC_BLOCKSIZE];
+
+    if (!c->data) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    c->blocks = blocks.release();
+    c->clock = 0;
+    c->hits = 0;
+    c->misses = 0;
+    return 0;
+}
+
+/* releases memory allocated for the verified block cache */
+void verity_cache_free(fec_handle *f)
+{
+    if (f->cache.blocks) {
+        delete[] f->cache.blocks;
+        f->cache.blocks = NULL;
+    }
+    if (f->cache.data) {
+        delete[] f->cache.data;
+        f->cache.data = NULL;
+    }
+    if (f->cache.bitmap) {
+        delete[] f->cache.bitmap;
+        f->cache.bitmap = NULL;
+    }
+}
+
+/* returns true if block `index' is set in the known-good bitmap, with
+   `f->mutex' held */
+static inline bool bitmap_test(const verity_cache *c, uint64_t index)
+{
+    uint64_t word = index / VERITY_BITMAP_BITS;
+
+    return word < c->bitmap_words &&
+        (c->bitmap[word] >> (index % VERITY_BITMAP_BITS)) & 1;
+}
+
+/* sets block `index' in the known-good bitmap, with `f->mutex' held */
+static inline void bitmap_set(verity_cache *c, uint64_t index)
+{
+    uint64_t word = index / VERITY_BITMAP_BITS;
+    uint64_t bit = 1ULL << (index % VERITY_BITMAP_BITS);
+
+    if (word < c->bitmap_words && !(c->bitmap[word] & bit)) {
+        c->bitmap[word] |= bit;
+        ++c->verified;
+    }
+}
+
+/* clears blocks [`first', `last'] in the known-good bitmap, with `f->mutex'
+   held */
+static void bitmap_clear(verity_cache *c, uint64_t first, uint64_t last)
+{
+    for (uint64_t index = first; index <= last; ++index) {
+        uint64_t word = index / VERITY_BITMAP_BITS;
+
+        if (word >= c->bitmap_words) {
+            break;
+        }
+
+        if (index % VERITY_BITMAP_BITS == 0 &&
+                last - index >= VERITY_BITMAP_BITS - 1) {
+            /* whole word */
+            c->verified -= __builtin_popcountll(c->bitmap[word]);
+            c->bitmap[word] = 0;
+            index += VERITY_BITMAP_BITS - 1;
+        } else {
+            uint64_t bit = 1ULL << (index % VERITY_BITMAP_BITS);
+
+            if (c->bitmap[word] & bit) {
+                c->bitmap[word] &= ~bit;
+                --c->verified;
+            }
+        }
+    }
+}
+
+/* returns the first entry of the cache set for block `index' */
+static inline uint32_t verity_cache_set(uint64_t index)
+{
+    return (uint32_t)(index % (VERITY_CACHE_BLOCKS / VERITY_CACHE_WAYS)) *
+                VERITY_CACHE_WAYS;
+}
+
+/* checks if block `index' has been verified since it was last written, and
+   if its contents are cached, copies them to `data'; a block is only
+   returned without its contents if the caller trusts the known-good
+   bitmap */
+verity_cache_result verity_cache_lookup(fec_handle *f, uint64_t index,
+        uint8_t *data)
+{
+    verity_cache *c = &f->cache;
+    verity_cache_result rc = VERITY_CACHE_MISS;
+
+    if (!c->blocks && !c->bitmap) {
+        return rc;
+    }
+
+    uint32_t set = verity_cache_set(index);
+
+    pthread_mutex_lock(&f->mutex);
+
+    for (uint32_t i = set; c->blocks && i < set + VERITY_CACHE_WAYS; ++i) {
+        verity_block_info *b = &c->blocks[i];
+
+        if (b->valid && b->index == index) {
+            b->last_used = ++c->clock;
+            memcpy(data, &c->data[i * (size_t)FEC_BLOCKSIZE], FEC_BLOCKSIZE);
+            rc = VERITY_CACHE_DATA;
+            break;
+        }
+    }
+
+    /* blocks in a loaded bitmap are only trusted if the caller asked for it,
+       otherwise they are verified again */
+    if (rc == VERITY_CACHE_MISS && c->bitmap &&
+            (f->flags & FEC_VERITY_TRUST_VERIFIED) && bitmap_test(c, index)) {
+        rc = VERITY_CACHE_VERIFIED;
+    }
+
+    if (rc == VERITY_CACHE_MISS) {
+        ++c->misses;
+    } else {
+        ++c->hits;
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+    return rc;
+}
+
+/* remembers block `index' with contents `data' as verified, replacing the
+   least recently used entry in its set; `data' must match the block on disk,
+   so blocks corrected but not written back are never inserted */
+void verity_cache_insert(fec_handle *f, uint64_t index, const uint8_t *data)
+{
+    verity_cache *c = &f->cache;
+
+    if (!c->blocks && !c->bitmap) {
+        return;
+    }
+
+    uint32_t set = verity_cache_set(index);
+
+    pthread_mutex_lock(&f->mutex);
+
+    if (c->bitmap) {
+        bitmap_set(c, index);
+    }
+
+    if (!c->blocks) {
+        pthread_mutex_unlock(&f->mutex);
+        return;
+    }
+
+    verity_block_info *victim = &c->blocks[set];
+
+    for (uint32_t i = set; i < set + VERITY_CACHE_WAYS; ++i) {
+        verity_block_info *b = &c->blocks[i];
+
+        if (b->valid && b->index == index) {
+            victim = b;
+            break;
+        } else if (!b->valid) {
+            if (victim->valid) {
+                victim = b;
+            }
+        } else if (victim->valid && b->last_used < victim->last_used) {
+            victim = b;
+        }
+    }
+
+    victim->index = index;
+    victim->last_used = ++c->clock;
+    victim->valid = true;
+    memcpy(&c->data[(victim - c->blocks) * (size_t)FEC_BLOCKSIZE], data,
+        FEC_BLOCKSIZE);
+
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/* drops cached and known-good blocks overlapping `count' bytes written to
+   `offset' */
+void verity_cache_invalidate(fec_handle *f, uint64_t offset, size_t count)
+{
+    verity_cache *c = &f->cache;
+
+    if ((!c->blocks && !c->bitmap) || !count || offset >= f->data_size) {
+        return;
+    }
+
+    uint64_t first = offset / FEC_BLOCKSIZE;
+    uint64_t last = (offset + count - 1) / FEC_BLOCKSIZE;
+
+    pthread_mutex_lock(&f->mutex);
+
+    if (c->bitmap) {
+        bitmap_clear(c, first, last);
+    }
+
+    if (!c->blocks) {
+        pthread_mutex_unlock(&f->mutex);
+        return;
+    }
+
+    if (last - first >= VERITY_CACHE_BLOCKS / VERITY_CACHE_WAYS) {
+        /* every set is affected */
+        for (uint32_t i = 0; i < VERITY_CACHE_BLOCKS; ++i) {
+            verity_block_info *b = &c->blocks[i];
+
+            if (b->valid && b->index >= first && b->index <= last) {
+                b->valid = false;
+                b->index = VERITY_NO_CACHE;
+            }
+        }
+    } else {
+        for (uint64_t index = first; index <= last; ++index) {
+            uint32_t set = verity_cache_set(index);
+
+            for (uint32_t i = set; i < set + VERITY_CACHE_WAYS; ++i) {
+                verity_block_info *b = &c->blocks[i];
+
+                if (b->valid && b->index == index) {
+                    b->valid = false;
+                    b->index = VERITY_NO_CACHE;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+}
+
 /* reads a verity hash and the corresponding data block using error correction,
    if available */
 static bool ecc_read_hashes(fec_handle *f, uint64_t hash_offset,
@@ -460,6 +719,7 @@ static int parse_table(fec_handle *f, uint64_t offset, uint32_t size, bool useec
         }
 
         check(v->hash);
+        memcpy(v->root, root, SHA256_DIGEST_LENGTH);
 
         uint8_t zero_block[FEC_BLOCKSIZE];
         memset(zero_block, 0, FEC_BLOCKSIZE);
@@ -669,3 +929,259 @@ int fec_verity_set_status(struct fec_handle *f, bool enabled)
 
     return 0;
 }
+
+/* computes the SHA-256 digest of a known-good bitmap */
+static void bitmap_digest(const uint64_t *bitmap, uint64_t words,
+        uint8_t *digest)
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, bitmap, words * sizeof(uint64_t));
+    SHA256_Final(digest, &ctx);
+}
+
+/* reads a known-good bitmap for the current root hash from `path' into
+   `bitmap', returns false if the file is not usable */
+static bool bitmap_read(fec_handle *f, const char *path, uint64_t *bitmap,
+        uint64_t words, uint64_t *verified)
+{
+    int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC));
+
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            warn("failed to open '%s': %s", path, strerror(errno));
+        }
+        return false;
+    }
+
+    verity_bitmap_header header;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    bool ok = false;
+
+    if (!android::base::ReadFully(fd, &header, sizeof(header)) ||
+            !android::base::ReadFully(fd, bitmap, words * sizeof(uint64_t))) {
+        warn("failed to read '%s': %s", path, strerror(errno));
+    } else if (header.magic != VERITY_BITMAP_MAGIC ||
+                header.version != VERITY_BITMAP_VERSION) {
+        warn("'%s' is not a known-good bitmap", path);
+    } else if (memcmp(header.root, f->verity.root, SHA256_DIGEST_LENGTH) ||
+                header.data_blocks != f->verity.data_blocks) {
+        /* the image has changed since the bitmap was saved */
+        debug("'%s' is for a different root hash", path);
+    } else {
+        bitmap_digest(bitmap, words, digest);
+
+        if (memcmp(header.digest, digest, SHA256_DIGEST_LENGTH)) {
+            warn("'%s' is corrupted", path);
+        } else {
+            ok = true;
+        }
+    }
+
+    close(fd);
+
+    if (!ok) {
+        return false;
+    }
+
+    /* bits past the last data block are never set */
+    uint64_t tail = f->verity.data_blocks % VERITY_BITMAP_BITS;
+
+    if (tail) {
+        bitmap[words - 1] &= (1ULL << tail) - 1;
+    }
+
+    *verified = 0;
+
+    for (uint64_t i = 0; i < words; ++i) {
+        *verified += __builtin_popcountll(bitmap[i]);
+    }
+
+    if (*verified != header.verified) {
+        warn("'%s' has an invalid block count", path);
+        return false;
+    }
+
+    return true;
+}
+
+/* starts tracking blocks that pass verification against the current root
+   hash, beginning with those in the bitmap saved to `path' if it exists and
+   was saved for the same root hash; with FEC_VERITY_TRUST_VERIFIED, reads
+   skip hashing the blocks in the bitmap, which must only be used if nothing
+   else can write to the image */
+int fec_verified_load(struct fec_handle *f, const char *path)
+{
+    check(f);
+    check(path);
+
+    if (!f->verity.hash) {
+        error("cannot track verified blocks: no hash tree loaded");
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t words = fec_div_round_up(f->verity.data_blocks,
+                        VERITY_BITMAP_BITS);
+    std::unique_ptr<uint64_t[]> bitmap(new (std::nothrow) uint64_t[words]);
+
+    if (!bitmap) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint64_t verified = 0;
+
+    if (!bitmap_read(f, path, bitmap.get(), words, &verified)) {
+        memset(bitmap.get(), 0, words * sizeof(uint64_t));
+        verified = 0;
+    }
+
+    debug("%" PRIu64 " of %" PRIu64 " blocks known to be good", verified,
+        f->verity.data_blocks);
+
+    pthread_mutex_lock(&f->mutex);
+
+    if (f->cache.bitmap) {
+        delete[] f->cache.bitmap;
+    }
+
+    f->cache.bitmap = bitmap.release();
+    f->cache.bitmap_words = words;
+    f->cache.verified = verified;
+
+    pthread_mutex_unlock(&f->mutex);
+    return 0;
+}
+
+/* writes the known-good bitmap to `path', replacing the file atomically */
+int fec_verified_save(struct fec_handle *f, const char *path)
+{
+    check(f);
+    check(path);
+
+    if (!f->cache.bitmap) {
+        error("cannot save verified blocks: not tracked");
+        errno = EINVAL;
+        return -1;
+    }
+
+    verity_bitmap_header header;
+    memset(&header, 0, sizeof(header));
+
+    header.magic = VERITY_BITMAP_MAGIC;
+    header.version = VERITY_BITMAP_VERSION;
+    memcpy(header.root, f->verity.root, SHA256_DIGEST_LENGTH);
+    header.data_blocks = f->verity.data_blocks;
+
+    /* copy the bitmap so that reads can continue while we write */
+    uint64_t words = f->cache.bitmap_words;
+    std::unique_ptr<uint64_t[]> bitmap(new (std::nothrow) uint64_t[words]);
+
+    if (!bitmap) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&f->mutex);
+    memcpy(bitmap.get(), f->cache.bitmap, words * sizeof(uint64_t));
+    header.verified = f->cache.verified;
+    pthread_mutex_unlock(&f->mutex);
+
+    bitmap_digest(bitmap.get(), words, header.digest);
+
+    std::string temp = std::string(path) + ".tmp";
+    int fd = TEMP_FAILURE_RETRY(open(temp.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+
+    if (fd == -1) {
+        error("failed to open '%s': %s", temp.c_str(), strerror(errno));
+        return -1;
+    }
+
+    if (!android::base::WriteFully(fd, &header, sizeof(header)) ||
+            !android::base::WriteFully(fd, bitmap.get(),
+                words * sizeof(uint64_t)) ||
+            fsync(fd) == -1) {
+        error("failed to write '%s': %s", temp.c_str(), strerror(errno));
+        close(fd);
+        unlink(temp.c_str());
+        return -1;
+    }
+
+    close(fd);
+
+    if (rename(temp.c_str(), path) == -1) {
+        error("failed to rename '%s': %s", temp.c_str(), strerror(errno));
+        unlink(temp.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+/* finds the first block at or after `start' that is not known to be good,
+   skipping blocks that are expected to contain zeros, so that a background
+   verifier can visit the rest of the image; returns -1 with errno ENOENT
+   if there are none */
+int fec_verified_next(struct fec_handle *f, uint64_t start, uint64_t *block)
+{
+    check(f);
+    check(block);
+
+    if (!f->cache.bitmap) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    verity_cache *c = &f->cache;
+    verity_info *v = &f->verity;
+    uint64_t index = start;
+
+    pthread_mutex_lock(&f->mutex);
+
+    while (index < v->data_blocks) {
+        uint64_t word = c->bitmap[index / VERITY_BITMAP_BITS];
+
+        if (word == UINT64_MAX && index % VERITY_BITMAP_BITS == 0) {
+            index += VERITY_BITMAP_BITS; /* all good */
+            continue;
+        }
+
+        if (!((word >> (index % VERITY_BITMAP_BITS)) & 1) &&
+                memcmp(&v->hash[index * SHA256_DIGEST_LENGTH], v->zero_hash,
+                    SHA256_DIGEST_LENGTH)) {
+            break;
+        }
+
+        ++index;
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+
+    if (index >= v->data_blocks) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *block = index;
+    return 0;
+}
+
+/* returns the number of blocks set in the known-good bitmap in `blocks' */
+int fec_verified_count(struct fec_handle *f, uint64_t *blocks)
+{
+    check(f);
+    check(blocks);
+
+    if (!f->cache.bitmap) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&f->mutex);
+    *blocks = f->cache.verified;
+    pthread_mutex_unlock(&f->mutex);
+
+    return 0;
+}
@@ -60,6 +60,11 @@ struct fec_status {
     uint64_t size;
 };
 
+struct fec_cache_status {
+    uint64_t hits; /* reads of verified blocks that skipped hashing */
+    uint64_t misses;
+};
+
 struct fec_ecc_metadata {
     bool valid;
     uint32_t roots;
@@ -81,7 +86,10 @@ struct fec_verity_metadata {
 enum {
     FEC_FS_EXT4 = 1 << 0,
     FEC_FS_SQUASH = 1 << 1,
-    FEC_VERITY_DISABLE = 1 << 8
+    FEC_VERITY_DISABLE = 1 << 8,
+    FEC_VERITY_CACHE_DATA = 1 << 9, /* cache verified block contents */
+    FEC_VERITY_TRUST_VERIFIED = 1 << 10 /* skip hashing blocks in the
+                                           known-good bitmap */
 };
 
 struct fec_handle;
@@ -102,6 +110,20 @@ extern int fec_ecc_get_metadata(struct fec_handle *f,
 
 extern int fec_get_status(struct fec_handle *f, struct fec_status *s);
 
+extern int fec_get_cache_status(struct fec_handle *f,
+        struct fec_cache_status *s);
+
+/* bitmap of blocks verified against the current root hash, kept in a side
+   file */
+extern int fec_verified_load(struct fec_handle *f, const char *path);
+
+extern int fec_verified_save(struct fec_handle *f, const char *path);
+
+extern int fec_verified_next(struct fec_handle *f, uint64_t start,
+        uint64_t *block);
+
+extern int fec_verified_count(struct fec_handle *f, uint64_t *blocks);
+
 extern int fec_seek(struct fec_handle *f, int64_t offset, int whence);
 
 extern ssize_t fec_read(struct fec_handle *f, void *buf, size_t count);
@@ -163,6 +185,10 @@ namespace fec {
             return !fec_get_status(handle_.get(), &status);
         }
 
+        bool get_cache_status(fec_cache_status& status) {
+            return !fec_get_cache_status(handle_.get(), &status);
+        }
+
         bool get_verity_metadata(fec_verity_metadata& data) {
             return !fec_verity_get_metadata(handle_.get(), &data);
         }
@@ -185,6 +211,18 @@ namespace fec {
             return !fec_verity_set_status(handle_.get(), enabled);
         }
 
+        bool load_verified(const std::string& fn) {
+            return !fec_verified_load(handle_.get(), fn.c_str());
+        }
+
+        bool save_verified(const std::string& fn) {
+            return !fec_verified_save(handle_.get(), fn.c_str());
+        }
+
+        bool get_verified_count(uint64_t& blocks) {
+            return !fec_verified_count(handle_.get(), &blocks);
+        }
+
     private:
         handle handle_;
     };
@@ -28,4 +28,21 @@ LOCAL_CFLAGS := -Wall -Werror -D_GNU_SOURCE
 LOCAL_C_INCLUDES += external/fec
 include $(BUILD_HOST_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_MODULE := fec_benchmark
+LOCAL_SRC_FILES := fec_benchmark.cpp
+LOCAL_MODULE_TAGS := optional
+LOCAL_REQUIRED_MODULES := build_verity_tree fec
+LOCAL_STATIC_LIBRARIES := \
+    libfec \
+    libfec_rs \
+    libcrypto_utils \
+    libcrypto \
+    libext4_utils \
+    libsquashfs_utils \
+    libbase
+LOCAL_CFLAGS := -Wall -Werror -D_GNU_SOURCE -O2
+LOCAL_C_INCLUDES += external/fec
+include $(BUILD_HOST_EXECUTABLE)
+
 endif # HOST_OS == linux
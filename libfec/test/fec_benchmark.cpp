@@ -0,0 +1,673 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* generates a verity and ecc protected image with build_verity_tree and fec,
+   optionally corrupts it, and measures fec_pread throughput and latency */
+
+extern "C" {
+    #include <fec.h>
+}
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <fec/ecc.h>
+#include <fec/io.h>
+
+#define VERITY_METADATA_SIZE (8 * FEC_BLOCKSIZE)
+#define VERITY_MAGIC 0xB001B001
+#define VERITY_SALT_SIZE 32
+#define VERITY_SIGNATURE_SIZE 256
+
+#define FATAL(x...) { \
+    fprintf(stderr, x); \
+    exit(1); \
+}
+
+enum corruption {
+    CORRUPT_NONE,
+    CORRUPT_BYTES,  /* random bytes in random blocks */
+    CORRUPT_BLOCKS, /* entire random blocks */
+    CORRUPT_RUNS    /* runs of consecutive blocks */
+};
+
+struct options {
+    std::string image;
+    std::string verity_tool;
+    std::string fec_tool;
+    bool keep;
+    bool drop_cache;
+    uint64_t size;
+    int roots;
+    int zero_percent;
+    corruption pattern;
+    double rate;
+    int run_blocks;
+    std::vector<int> threads;
+    std::vector<size_t> read_sizes;
+    int reads;
+    int flags;
+    unsigned seed;
+};
+
+struct result {
+    double seconds;
+    uint64_t bytes;
+    uint64_t failed;
+    std::vector<double> latency_us;
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string to_hex(const uint8_t *data, size_t size)
+{
+    std::string hex;
+    char buf[3];
+
+    for (size_t i = 0; i < size; ++i) {
+        snprintf(buf, sizeof(buf), "%02x", data[i]);
+        hex += buf;
+    }
+
+    return hex;
+}
+
+/* runs a command and returns the first line it writes to stdout */
+static std::string run_tool(const std::string& command)
+{
+    FILE *p = popen(command.c_str(), "r");
+
+    if (!p) {
+        FATAL("failed to run '%s': %s\n", command.c_str(), strerror(errno));
+    }
+
+    char line[1024] = {0};
+
+    if (!fgets(line, sizeof(line), p)) {
+        line[0] = '\0';
+    }
+
+    while (fgetc(p) != EOF) {
+        ;
+    }
+
+    if (pclose(p) != 0) {
+        FATAL("'%s' failed\n", command.c_str());
+    }
+
+    return std::string(line, strcspn(line, "\n"));
+}
+
+static void append_file(int fd, const std::string& path)
+{
+    std::string content;
+
+    if (!android::base::ReadFileToString(path, &content) ||
+            !android::base::WriteFully(fd, content.data(), content.size())) {
+        FATAL("failed to append '%s': %s\n", path.c_str(), strerror(errno));
+    }
+
+    unlink(path.c_str());
+}
+
+/* builds the verity metadata block the same way as build_verity_metadata.py,
+   but with an empty signature, which libfec does not check */
+static void append_verity_metadata(int fd, uint64_t data_blocks,
+        const std::string& root_hash, const std::string& salt)
+{
+    char table[512];
+    int length = snprintf(table, sizeof(table),
+        "1 /dev/block/data /dev/block/data %u %u %" PRIu64 " %" PRIu64
+        " sha256 %s %s", FEC_BLOCKSIZE, FEC_BLOCKSIZE, data_blocks,
+        data_blocks, root_hash.c_str(), salt.c_str());
+
+    std::vector<uint8_t> metadata(VERITY_METADATA_SIZE);
+    uint32_t magic = VERITY_MAGIC;
+    uint32_t table_length = (uint32_t)length;
+
+    /* magic, version, signature and the table length precede the table */
+    size_t offset = 0;
+    memcpy(&metadata[offset], &magic, sizeof(magic));
+    offset += sizeof(magic) + sizeof(uint32_t) + VERITY_SIGNATURE_SIZE;
+    memcpy(&metadata[offset], &table_length, sizeof(table_length));
+    offset += sizeof(table_length);
+    memcpy(&metadata[offset], table, length);
+
+    if (!android::base::WriteFully(fd, metadata.data(), metadata.size())) {
+        FATAL("failed to write verity metadata: %s\n", strerror(errno));
+    }
+}
+
+/* writes random data blocks, and protects them with build_verity_tree and
+   fec like the build does for verified partitions */
+static void write_image(const options& opts)
+{
+    uint64_t data_blocks = opts.size / FEC_BLOCKSIZE;
+    std::mt19937_64 rng(opts.seed);
+    std::vector<uint64_t> block(FEC_BLOCKSIZE / sizeof(uint64_t));
+
+    int fd = TEMP_FAILURE_RETRY(open(opts.image.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC, 0666));
+
+    if (fd < 0) {
+        FATAL("failed to open '%s': %s\n", opts.image.c_str(),
+            strerror(errno));
+    }
+
+    for (uint64_t i = 0; i < data_blocks; ++i) {
+        if ((int)(rng() % 100) < opts.zero_percent) {
+            std::fill(block.begin(), block.end(), 0);
+        } else {
+            for (auto& word : block) {
+                word = rng();
+            }
+        }
+
+        if (!android::base::WriteFully(fd, block.data(), FEC_BLOCKSIZE)) {
+            FATAL("failed to write '%s': %s\n", opts.image.c_str(),
+                strerror(errno));
+        }
+    }
+
+    uint8_t salt[VERITY_SALT_SIZE];
+
+    for (auto& b : salt) {
+        b = (uint8_t)rng();
+    }
+
+    std::string tree = opts.image + ".verity";
+    std::string output = run_tool(opts.verity_tool + " -A " +
+        to_hex(salt, sizeof(salt)) + " '" + opts.image + "' '" + tree + "'");
+
+    /* build_verity_tree prints the root hash and the salt */
+    size_t space = output.find(' ');
+
+    if (space == std::string::npos) {
+        FATAL("unexpected output from build_verity_tree: '%s'\n",
+            output.c_str());
+    }
+
+    append_file(fd, tree);
+    append_verity_metadata(fd, data_blocks, output.substr(0, space),
+        output.substr(space + 1));
+
+    if (fsync(fd) != 0) {
+        FATAL("failed to sync '%s': %s\n", opts.image.c_str(),
+            strerror(errno));
+    }
+
+    std::string ecc = opts.image + ".fec";
+    run_tool(opts.fec_tool + " -e -r " + std::to_string(opts.roots) + " '" +
+        opts.image + "' '" + ecc + "'");
+
+    append_file(fd, ecc);
+    close(fd);
+}
+
+/* writes back dirty pages of the image and drops it from the page cache, so
+   the next reads come from the disk */
+static void drop_cache(const options& opts)
+{
+    int fd = TEMP_FAILURE_RETRY(open(opts.image.c_str(), O_RDONLY));
+
+    if (fd < 0 || fsync(fd) != 0 ||
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+        FATAL("failed to drop '%s' from the page cache: %s\n",
+            opts.image.c_str(), strerror(errno));
+    }
+
+    close(fd);
+}
+
+/* corrupts the data area of the image, returning the number of distinct
+   blocks affected; single blocks are picked without replacement, and
+   blocks where runs overlap are only corrupted once */
+static uint64_t corrupt_image(const options& opts, uint64_t data_size)
+{
+    int fd = TEMP_FAILURE_RETRY(open(opts.image.c_str(), O_RDWR));
+
+    if (fd < 0) {
+        FATAL("failed to open '%s': %s\n", opts.image.c_str(),
+            strerror(errno));
+    }
+
+    uint64_t blocks = data_size / FEC_BLOCKSIZE;
+    uint64_t count = (uint64_t)(blocks * opts.rate);
+    std::mt19937_64 rng(opts.seed + 1);
+    uint8_t block[FEC_BLOCKSIZE];
+    std::vector<bool> hit(blocks);
+    uint64_t corrupted = 0;
+
+    if (opts.pattern == CORRUPT_RUNS) {
+        count = std::max<uint64_t>(1, count / opts.run_blocks);
+    }
+
+    for (uint64_t n = 0; n < count; ++n) {
+        uint64_t first = rng() % blocks;
+        uint64_t length = 1;
+
+        if (opts.pattern == CORRUPT_RUNS) {
+            length = std::min<uint64_t>(opts.run_blocks, blocks - first);
+        } else {
+            /* count <= blocks, so there is always a block left */
+            while (hit[first]) {
+                first = rng() % blocks;
+            }
+        }
+
+        for (uint64_t b = first; b < first + length; ++b) {
+            if (hit[b]) {
+                continue;
+            }
+
+            hit[b] = true;
+            uint64_t offset = b * FEC_BLOCKSIZE;
+
+            if (pread(fd, block, sizeof(block), offset) != sizeof(block)) {
+                FATAL("failed to read: %s\n", strerror(errno));
+            }
+
+            if (opts.pattern == CORRUPT_BYTES) {
+                for (int i = 0; i < 8; ++i) {
+                    block[rng() % FEC_BLOCKSIZE] ^= (uint8_t)(1 + rng() % 255);
+                }
+            } else {
+                for (auto& byte : block) {
+                    byte ^= (uint8_t)(1 + rng() % 255);
+                }
+            }
+
+            if (pwrite(fd, block, sizeof(block), offset) != sizeof(block)) {
+                FATAL("failed to write: %s\n", strerror(errno));
+            }
+
+            ++corrupted;
+        }
+    }
+
+    close(fd);
+    return corrupted;
+}
+
+/* issues `reads' reads of `size' bytes from each of `threads' threads */
+static result run(fec::io& f, uint64_t data_size, size_t size, bool random,
+        int threads, int reads, unsigned seed)
+{
+    uint64_t slots = data_size / size;
+    std::vector<std::vector<double>> latency(threads);
+    std::vector<uint64_t> failed(threads);
+    std::vector<std::thread> workers;
+
+    double start = now();
+
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            std::vector<uint8_t> buf(size);
+            std::mt19937_64 rng(seed + t);
+
+            /* sequential readers each start from their own part of the
+               image */
+            uint64_t slot = slots * t / threads;
+
+            for (int i = 0; i < reads; ++i) {
+                uint64_t offset;
+
+                if (random) {
+                    offset = (rng() % slots) * size;
+                } else {
+                    offset = slot * size;
+                    slot = (slot + 1) % slots;
+                }
+
+                double begin = now();
+
+                if (f.pread(buf.data(), size, offset) != (ssize_t)size) {
+                    ++failed[t];
+                }
+
+                latency[t].push_back((now() - begin) * 1e6);
+            }
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    result r;
+    r.seconds = now() - start;
+    r.bytes = (uint64_t)size * reads * threads;
+    r.failed = 0;
+
+    for (int t = 0; t < threads; ++t) {
+        r.failed += failed[t];
+        r.latency_us.insert(r.latency_us.end(), latency[t].begin(),
+            latency[t].end());
+    }
+
+    std::sort(r.latency_us.begin(), r.latency_us.end());
+    return r;
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    size_t i = (size_t)(p / 100 * (sorted.size() - 1));
+    return sorted[i];
+}
+
+static void run_all(const options& opts, const char *state)
+{
+    fec::io f;
+
+    if (!f.open(opts.image, O_RDONLY, opts.flags, opts.roots)) {
+        FATAL("failed to open '%s'\n", opts.image.c_str());
+    }
+
+    fec_status status;
+    f.get_status(status);
+
+    for (int random = 0; random <= 1; ++random) {
+        for (int threads : opts.threads) {
+            for (size_t size : opts.read_sizes) {
+                if (size > status.data_size) {
+                    continue;
+                }
+
+                if (opts.drop_cache) {
+                    drop_cache(opts);
+                }
+
+                fec_status before;
+                f.get_status(before);
+
+                result r = run(f, status.data_size, size, random, threads,
+                    opts.reads, opts.seed);
+
+                fec_status after;
+                f.get_status(after);
+
+                printf("%-9s %-6s %7d %9zu %9.1f %9.1f %9.1f %9.1f %9.1f "
+                    "%9" PRIu64 " %6" PRIu64 "\n", state,
+                    random ? "random" : "seq", threads, size,
+                    r.bytes / r.seconds / 1e6,
+                    percentile(r.latency_us, 50), percentile(r.latency_us, 90),
+                    percentile(r.latency_us, 99), r.latency_us.back(),
+                    after.errors - before.errors, r.failed);
+            }
+        }
+    }
+}
+
+template <typename T>
+static std::vector<T> parse_list(const char *arg, const char *name)
+{
+    std::vector<T> values;
+    std::string s(arg);
+    size_t pos = 0;
+
+    while (pos <= s.size()) {
+        size_t end = s.find(',', pos);
+
+        if (end == std::string::npos) {
+            end = s.size();
+        }
+
+        char *endptr;
+        errno = 0;
+        unsigned long long value = strtoull(s.substr(pos, end - pos).c_str(),
+                                    &endptr, 0);
+
+        if (errno || *endptr || value == 0) {
+            FATAL("invalid value of %s\n", name);
+        }
+
+        values.push_back((T)value);
+        pos = end + 1;
+    }
+
+    return values;
+}
+
+static int usage()
+{
+    printf("fec_benchmark: measures fec_pread performance\n"
+           "\n"
+           "usage: fec_benchmark [ <options> ]\n"
+           "options:\n"
+           "  -h                       show this help\n"
+           "  -i, --image=<file>       image to generate (default: a temporary\n"
+           "                           file that is removed afterwards)\n"
+           "  -k, --keep               keep the generated image\n"
+           "  -T, --verity-tool=<path> build_verity_tree to use (default:\n"
+           "                           build_verity_tree from PATH)\n"
+           "  -F, --fec-tool=<path>    fec to use (default: fec from PATH)\n"
+           "  -s, --size=<MiB>         size of the data area (default 256)\n"
+           "  -r, --roots=<bytes>      number of parity bytes (default %d)\n"
+           "  -z, --zero=<percent>     share of zero blocks (default 10)\n"
+           "  -c, --corrupt=<pattern>  bytes, blocks or runs (default: none)\n"
+           "  -R, --rate=<fraction>    share of data blocks to corrupt\n"
+           "                           (default 0.0001)\n"
+           "  -l, --run-blocks=<n>     blocks in each corrupted run (default 8)\n"
+           "  -t, --threads=<list>     reader thread counts (default 1,4)\n"
+           "  -b, --read-sizes=<list>  read sizes in bytes\n"
+           "                           (default 4096,65536,1048576)\n"
+           "  -n, --reads=<n>          reads per thread (default 1000)\n"
+           "  -C, --cache              cache verified block contents\n"
+           "  -D, --drop-cache         drop the image from the page cache\n"
+           "                           before each measurement\n"
+           "  -S, --seed=<n>           random seed (default 1)\n"
+           "\n"
+           "Reads are measured first on the intact image, and again after\n"
+           "corrupting it if a pattern is given. Without -D, reads after the\n"
+           "first are served from the page cache.\n",
+           FEC_DEFAULT_ROOTS);
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    options opts;
+    opts.verity_tool = "build_verity_tree";
+    opts.fec_tool = "fec";
+    opts.keep = false;
+    opts.drop_cache = false;
+    opts.size = 256ULL << 20;
+    opts.roots = FEC_DEFAULT_ROOTS;
+    opts.zero_percent = 10;
+    opts.pattern = CORRUPT_NONE;
+    opts.rate = 0.0001;
+    opts.run_blocks = 8;
+    opts.threads = {1, 4};
+    opts.read_sizes = {4096, 65536, 1048576};
+    opts.reads = 1000;
+    opts.flags = 0;
+    opts.seed = 1;
+
+    while (1) {
+        const static struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"image", required_argument, 0, 'i'},
+            {"keep", no_argument, 0, 'k'},
+            {"verity-tool", required_argument, 0, 'T'},
+            {"fec-tool", required_argument, 0, 'F'},
+            {"size", required_argument, 0, 's'},
+            {"roots", required_argument, 0, 'r'},
+            {"zero", required_argument, 0, 'z'},
+            {"corrupt", required_argument, 0, 'c'},
+            {"rate", required_argument, 0, 'R'},
+            {"run-blocks", required_argument, 0, 'l'},
+            {"threads", required_argument, 0, 't'},
+            {"read-sizes", required_argument, 0, 'b'},
+            {"reads", required_argument, 0, 'n'},
+            {"cache", no_argument, 0, 'C'},
+            {"drop-cache", no_argument, 0, 'D'},
+            {"seed", required_argument, 0, 'S'},
+            {NULL, 0, 0, 0}
+        };
+        int c = getopt_long(argc, argv, "hi:kT:F:s:r:z:c:R:l:t:b:n:CDS:",
+                    long_options, NULL);
+        if (c < 0) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+            return usage();
+        case 'i':
+            opts.image = optarg;
+            break;
+        case 'k':
+            opts.keep = true;
+            break;
+        case 'T':
+            opts.verity_tool = optarg;
+            break;
+        case 'F':
+            opts.fec_tool = optarg;
+            break;
+        case 's':
+            opts.size = parse_list<uint64_t>(optarg, "size")[0] << 20;
+            break;
+        case 'r':
+            opts.roots = parse_list<int>(optarg, "roots")[0];
+            if (opts.roots >= FEC_RSM) {
+                FATAL("invalid value of roots\n");
+            }
+            break;
+        case 'z':
+            opts.zero_percent = atoi(optarg);
+            if (opts.zero_percent < 0 || opts.zero_percent > 100) {
+                FATAL("invalid value of zero\n");
+            }
+            break;
+        case 'c':
+            if (!strcmp(optarg, "bytes")) {
+                opts.pattern = CORRUPT_BYTES;
+            } else if (!strcmp(optarg, "blocks")) {
+                opts.pattern = CORRUPT_BLOCKS;
+            } else if (!strcmp(optarg, "runs")) {
+                opts.pattern = CORRUPT_RUNS;
+            } else {
+                FATAL("invalid corruption pattern '%s'\n", optarg);
+            }
+            break;
+        case 'R':
+            opts.rate = strtod(optarg, NULL);
+            if (opts.rate <= 0 || opts.rate > 1) {
+                FATAL("invalid value of rate\n");
+            }
+            break;
+        case 'l':
+            opts.run_blocks = parse_list<int>(optarg, "run-blocks")[0];
+            break;
+        case 't':
+            opts.threads = parse_list<int>(optarg, "threads");
+            break;
+        case 'b':
+            opts.read_sizes = parse_list<size_t>(optarg, "read-sizes");
+            break;
+        case 'n':
+            opts.reads = parse_list<int>(optarg, "reads")[0];
+            break;
+        case 'C':
+            opts.flags |= FEC_VERITY_CACHE_DATA;
+            break;
+        case 'D':
+            opts.drop_cache = true;
+            break;
+        case 'S':
+            opts.seed = parse_list<unsigned>(optarg, "seed")[0];
+            break;
+        default:
+            return usage();
+        }
+    }
+
+    if (optind != argc) {
+        return usage();
+    }
+
+    bool temporary = opts.image.empty();
+
+    if (temporary) {
+        char path[] = "/tmp/fec_benchmark.XXXXXX";
+        int fd = mkstemp(path);
+
+        if (fd < 0) {
+            FATAL("failed to create a temporary file: %s\n", strerror(errno));
+        }
+
+        close(fd);
+        opts.image = path;
+    }
+
+    for (size_t size : opts.read_sizes) {
+        if (size % FEC_BLOCKSIZE) {
+            FATAL("read sizes must be multiples of %u\n", FEC_BLOCKSIZE);
+        }
+    }
+
+    opts.size -= opts.size % FEC_BLOCKSIZE;
+
+    double start = now();
+    write_image(opts);
+
+    fprintf(stderr, "generated '%s' with %" PRIu64 " MiB of data and "
+        "%d roots in %.1f s\n", opts.image.c_str(), opts.size >> 20,
+        opts.roots, now() - start);
+
+    printf("%-9s %-6s %7s %9s %9s %9s %9s %9s %9s %9s %6s\n", "image", "access",
+        "threads", "size", "MB/s", "p50 us", "p90 us", "p99 us", "max us",
+        "corrected", "failed");
+
+    run_all(opts, "intact");
+
+    if (opts.pattern != CORRUPT_NONE) {
+        uint64_t blocks = corrupt_image(opts, opts.size);
+        fprintf(stderr, "corrupted %" PRIu64 " blocks\n", blocks);
+        run_all(opts, "corrupted");
+    }
+
+    if (!opts.keep) {
+        unlink(opts.image.c_str());
+    }
+
+    return 0;
+}
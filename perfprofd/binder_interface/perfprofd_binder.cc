@@ -215,6 +215,15 @@ Status PerfProfdNativeService::StartProfilingProtobuf(ProtoLoaderFn fn) {
     CHECK_AND_COPY_FROM_PROTO(use_elf_symbolizer)
     CHECK_AND_COPY_FROM_PROTO(send_to_dropbox)
     CHECK_AND_COPY_FROM_PROTO(compress)
+    CHECK_AND_COPY_FROM_PROTO(symbolizer_cache_size)
+    CHECK_AND_COPY_FROM_PROTO(compression_level)
+    CHECK_AND_COPY_FROM_PROTO(compression_threads)
+    CHECK_AND_COPY_FROM_PROTO(aggregation_cycles)
+    CHECK_AND_COPY_FROM_PROTO(aggregation_max_size_in_kb)
+    CHECK_AND_COPY_FROM_PROTO(adaptive_scheduling)
+    CHECK_AND_COPY_FROM_PROTO(min_cpu_utilization)
+    CHECK_AND_COPY_FROM_PROTO(max_memory_pressure)
+    CHECK_AND_COPY_FROM_PROTO(overhead_budget_permille)
 #undef CHECK_AND_COPY_FROM_PROTO
   };
   std::string error_msg;
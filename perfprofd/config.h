@@ -97,9 +97,46 @@ struct Config {
   // If true, use an ELF symbolizer to on-device symbolize.
   bool use_elf_symbolizer = true;
 
+  // Memory budget (in KB) for symbols kept across collections by the
+  // ELF symbolizer. A value of 0 disables the cache, symbols are then
+  // parsed again for every collection.
+  uint32_t symbolizer_cache_size = 4096;
+
   // If true, use libz to compress the output proto.
   bool compress = true;
 
+  // The zlib compression level (0-9) used when compressing.
+  uint32_t compression_level = 6;
+
+  // Number of threads compressing the output proto. With more than one
+  // thread, independent blocks are compressed in parallel and concatenated
+  // into a single gzip stream, at a small cost in compression ratio.
+  uint32_t compression_threads = 1;
+
+  // If non-zero, merge profiles into an on-disk aggregate in the destination
+  // directory, and hand out one aggregated profile every aggregation_cycles
+  // collections instead of one profile per collection.
+  uint32_t aggregation_cycles = 0;
+
+  // Size budget (in KB) of the on-disk aggregate. The least sampled stacks
+  // are dropped when it is exceeded.
+  uint32_t aggregation_max_size_in_kb = 2048;
+
+  // If true, time collections by system load: defer them while the
+  // system is idle, back off (doubling the collection interval, up to
+  // 8x) under memory pressure or thermal throttling, and scale the
+  // sampling rate so that collections stay within the overhead budget.
+  bool adaptive_scheduling = false;
+  // Minimum CPU utilization (in percent) for a collection to be
+  // worthwhile, unless tasks are waiting for CPU.
+  uint32_t min_cpu_utilization = 10;
+  // Memory pressure (percent of time some task stalled on memory over
+  // the last 10 seconds) above which collections back off.
+  uint32_t max_memory_pressure = 10;
+  // CPU time budget of a collection (perf record and encoding), in
+  // permille of the CPU time available during the sampling window.
+  uint32_t overhead_budget_permille = 20;
+
   // If true, send the proto to dropbox instead to a file.
   bool send_to_dropbox = false;
 
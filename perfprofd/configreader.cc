@@ -137,9 +137,41 @@ void ConfigReader::addDefaultEntries()
   // If true, use an ELF symbolizer to on-device symbolize.
   addUnsignedEntry("use_elf_symbolizer", config.use_elf_symbolizer ? 1 : 0, 0, 1);
 
+  // Memory budget (in KB) for symbols kept across collections by the
+  // ELF symbolizer. A value of 0 disables the cache.
+  addUnsignedEntry("symbolizer_cache_size", config.symbolizer_cache_size, 0, UINT32_MAX);
+
   // If true, use libz to compress the output proto.
   addUnsignedEntry("compress", config.compress ? 1 : 0, 0, 1);
 
+  // The zlib compression level used when compressing.
+  addUnsignedEntry("compression_level", config.compression_level, 0, 9);
+
+  // Number of threads compressing the output proto in independent blocks.
+  addUnsignedEntry("compression_threads", config.compression_threads, 1, 16);
+
+  // If non-zero, aggregate profiles on-device and hand out one aggregated
+  // profile every 'aggregation_cycles' collections.
+  addUnsignedEntry("aggregation_cycles", config.aggregation_cycles, 0, UINT32_MAX);
+
+  // Size budget (in KB) of the on-disk aggregate.
+  addUnsignedEntry("aggregation_max_size", config.aggregation_max_size_in_kb, 64, UINT32_MAX);
+
+  // If true, time collections by system load and adapt the sampling
+  // rate to the overhead budget.
+  addUnsignedEntry("adaptive_scheduling", config.adaptive_scheduling ? 1 : 0, 0, 1);
+
+  // Minimum CPU utilization (in percent) for a collection to be worthwhile.
+  addUnsignedEntry("min_cpu_utilization", config.min_cpu_utilization, 0, 100);
+
+  // Memory pressure (PSI 'some' avg10, in percent) above which
+  // collections back off.
+  addUnsignedEntry("max_memory_pressure", config.max_memory_pressure, 0, 100);
+
+  // CPU time budget of a collection, in permille of the CPU time
+  // available during the sampling window.
+  addUnsignedEntry("overhead_budget", config.overhead_budget_permille, 1, 1000);
+
   // If true, send the proto to dropbox instead of to a file.
   addUnsignedEntry("dropbox", config.send_to_dropbox ? 1 : 0, 0, 1);
 
@@ -359,6 +391,15 @@ void ConfigReader::FillConfig(Config* config) {
 
   config->process = static_cast<int32_t>(getUnsignedValue("process"));
   config->use_elf_symbolizer = getBoolValue("use_elf_symbolizer");
+  config->symbolizer_cache_size = getUnsignedValue("symbolizer_cache_size");
   config->compress = getBoolValue("compress");
+  config->compression_level = getUnsignedValue("compression_level");
+  config->compression_threads = getUnsignedValue("compression_threads");
+  config->aggregation_cycles = getUnsignedValue("aggregation_cycles");
+  config->aggregation_max_size_in_kb = getUnsignedValue("aggregation_max_size");
+  config->adaptive_scheduling = getBoolValue("adaptive_scheduling");
+  config->min_cpu_utilization = getUnsignedValue("min_cpu_utilization");
+  config->max_memory_pressure = getUnsignedValue("max_memory_pressure");
+  config->overhead_budget_permille = getUnsignedValue("overhead_budget");
   config->send_to_dropbox = getBoolValue("dropbox");
 }
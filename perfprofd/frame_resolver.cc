@@ -0,0 +1,167 @@
+/*
+ *
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "frame_resolver.h"
+
+#include <inttypes.h>
+
+#include <limits>
+
+#include <android-base/stringprintf.h>
+
+#include "perfprofd_record.pb.h"
+
+#include "map_utils.h"
+
+namespace android {
+namespace perfprofd {
+
+namespace {
+
+// Callchain entries at or above this are context markers, not addresses.
+constexpr uint64_t kPerfContextMax = static_cast<uint64_t>(-4095);
+// Kernel mappings are recorded with pid -1.
+constexpr uint32_t kKernelPid = std::numeric_limits<uint32_t>::max();
+constexpr char kUnknownDso[] = "[unknown]";
+
+}  // namespace
+
+void PutVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+bool GetVarint(const char** pos, const char* end, uint64_t* value) {
+  *value = 0;
+  for (unsigned shift = 0; *pos < end && shift < 64; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*(*pos)++);
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void EncodeFrames(const std::vector<Frame>& frames, std::string* key) {
+  for (const Frame& frame : frames) {
+    PutVarint(frame.dso, key);
+    PutVarint(frame.offset, key);
+    PutVarint(frame.symbol, key);
+  }
+}
+
+bool DecodeFrames(const char* pos, const char* end, std::vector<Frame>* frames) {
+  frames->clear();
+  while (pos < end) {
+    uint64_t dso, offset, symbol;
+    if (!GetVarint(&pos, end, &dso) ||
+        !GetVarint(&pos, end, &offset) ||
+        !GetVarint(&pos, end, &symbol)) {
+      return false;
+    }
+    frames->push_back(Frame { static_cast<uint32_t>(dso), offset, static_cast<uint32_t>(symbol) });
+  }
+  return true;
+}
+
+FrameResolver::FrameResolver(const PerfprofdRecord& record, const InternFn& intern)
+    : intern_(intern) {
+  for (const auto& symbol_info : record.symbol_info()) {
+    SymbolMap& dso_symbols = symbols_[intern_(symbol_info.filename())];
+    for (const auto& symbol : symbol_info.symbols()) {
+      dso_symbols.emplace(symbol.addr(), &symbol);
+    }
+  }
+  unknown_dso_ = intern_(kUnknownDso);
+}
+
+void FrameResolver::ProcessEvent(const quipper::PerfDataProto_PerfEvent& event) {
+  if (event.has_mmap_event()) {
+    const auto& mmap_event = event.mmap_event();
+    std::string filename = mmap_event.filename();
+    if (filename.empty()) {
+      filename = android::base::StringPrintf("%016" PRIx64, mmap_event.filename_md5_prefix());
+    }
+    Mapping mapping = { mmap_event.start() + mmap_event.len(),
+                        mmap_event.pgoff(),
+                        intern_(filename) };
+    MappingMap& pid_mappings = mappings_[mmap_event.pid()];
+    // Replace the mappings the new one covers.
+    auto it = pid_mappings.lower_bound(mmap_event.start());
+    while (it != pid_mappings.end() && it->first < mapping.end) {
+      it = pid_mappings.erase(it);
+    }
+    pid_mappings.emplace(mmap_event.start(), mapping);
+  } else if (event.has_fork_event()) {
+    const auto& fork_event = event.fork_event();
+    if (fork_event.pid() != fork_event.ppid()) {
+      auto parent_it = mappings_.find(fork_event.ppid());
+      if (parent_it != mappings_.end()) {
+        MappingMap copy = parent_it->second;
+        mappings_[fork_event.pid()] = std::move(copy);
+      }
+    }
+  }
+}
+
+void FrameResolver::ResolveSample(const quipper::PerfDataProto_SampleEvent& sample,
+                                  std::vector<Frame>* frames) {
+  frames->clear();
+  if (sample.callchain_size() > 0) {
+    for (uint64_t ip : sample.callchain()) {
+      if (ip < kPerfContextMax) {
+        frames->push_back(Resolve(sample.pid(), ip));
+      }
+    }
+  } else if (sample.has_ip()) {
+    frames->push_back(Resolve(sample.pid(), sample.ip()));
+  }
+}
+
+Frame FrameResolver::Resolve(uint32_t pid, uint64_t ip) {
+  Frame frame = { unknown_dso_, 0, 0 };
+  for (uint32_t map_pid : { pid, kKernelPid }) {
+    auto pid_it = mappings_.find(map_pid);
+    if (pid_it == mappings_.end()) {
+      continue;
+    }
+    auto map_it = GetLeqIterator(pid_it->second, ip);
+    if (map_it == pid_it->second.end() || ip >= map_it->second.end) {
+      continue;
+    }
+    frame.dso = map_it->second.dso;
+    frame.offset = ip - map_it->first + map_it->second.pgoff;
+
+    auto symbols_it = symbols_.find(frame.dso);
+    if (symbols_it != symbols_.end()) {
+      auto symbol_it = GetLeqIterator(symbols_it->second, frame.offset);
+      if (symbol_it != symbols_it->second.end() &&
+          frame.offset < symbol_it->first + symbol_it->second->size()) {
+        frame.symbol = intern_(symbol_it->second->name()) + 1;
+      }
+    }
+    break;
+  }
+  return frame;
+}
+
+}  // namespace perfprofd
+}  // namespace android
@@ -0,0 +1,95 @@
+/*
+ *
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_EXTRAS_PERFPROFD_FRAME_RESOLVER_H_
+#define SYSTEM_EXTRAS_PERFPROFD_FRAME_RESOLVER_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "perfprofd_record-fwd.h"
+
+namespace quipper {
+class PerfDataProto_PerfEvent;
+class PerfDataProto_SampleEvent;
+}  // namespace quipper
+
+namespace android {
+namespace perfprofd {
+
+class PerfprofdRecord_SymbolInfo_Symbol;
+
+// A frame of a stack, with interned strings. Symbols are string id + 1, 0 if
+// unknown.
+struct Frame {
+  uint32_t dso;
+  uint64_t offset;
+  uint32_t symbol;
+};
+
+void PutVarint(uint64_t value, std::string* out);
+bool GetVarint(const char** pos, const char* end, uint64_t* value);
+
+// Append the varint encoding of frames to key.
+void EncodeFrames(const std::vector<Frame>& frames, std::string* key);
+// Decode the frames encoded in [pos, end).
+bool DecodeFrames(const char* pos, const char* end, std::vector<Frame>* frames);
+
+// Resolves the samples of a profile to frames: the dso mapped at each address
+// and the offset into it, named with the on-device symbols of the profile
+// (SymbolInfo) when there are some. Mappings follow the mmap and fork events
+// seen so far, so events are to be passed in order.
+class FrameResolver {
+ public:
+  using InternFn = std::function<uint32_t(const std::string&)>;
+
+  FrameResolver(const PerfprofdRecord& record, const InternFn& intern);
+
+  // Track the mappings of an mmap or fork event, other events are ignored.
+  void ProcessEvent(const quipper::PerfDataProto_PerfEvent& event);
+
+  // The frames of a sample's callchain, or of its ip without callchain.
+  void ResolveSample(const quipper::PerfDataProto_SampleEvent& sample,
+                     std::vector<Frame>* frames);
+
+ private:
+  struct Mapping {
+    uint64_t end;
+    uint64_t pgoff;
+    uint32_t dso;
+  };
+  using MappingMap = std::map<uint64_t, Mapping>;
+  // Symbols of dsos without build id, by interned dso name.
+  using SymbolMap = std::map<uint64_t, const PerfprofdRecord_SymbolInfo_Symbol*>;
+
+  Frame Resolve(uint32_t pid, uint64_t ip);
+
+  InternFn intern_;
+  uint32_t unknown_dso_;
+  std::unordered_map<uint32_t, SymbolMap> symbols_;
+  std::unordered_map<uint32_t, MappingMap> mappings_;
+};
+
+}  // namespace perfprofd
+}  // namespace android
+
+#endif  // SYSTEM_EXTRAS_PERFPROFD_FRAME_RESOLVER_H_
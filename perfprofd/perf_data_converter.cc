@@ -2,11 +2,15 @@
 #include "perf_data_converter.h"
 
 #include <algorithm>
+#include <atomic>
 #include <limits>
 #include <map>
 #include <memory>
 #include <set>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/macros.h>
@@ -29,17 +33,28 @@ namespace perfprofd {
 
 namespace {
 
-void AddSymbolInfo(PerfprofdRecord* record,
-                   ::quipper::PerfParser& perf_parser,
-                   ::perfprofd::Symbolizer* symbolizer) {
+struct Dso {
+  uint64_t min_vaddr;
+  RangeMap<std::string, uint64_t> symbols;
+  explicit Dso(uint64_t min_vaddr_in) : min_vaddr(min_vaddr_in) {
+  }
+};
+
+// Upper bound of threads decoding symbols, perfprofd shouldn't take over the device.
+constexpr size_t kMaxSymbolizerThreads = 4;
+
+void CollectSymbolInfo(const ::quipper::PerfDataProto& perf_data,
+                       const ::quipper::PerfParser& perf_parser,
+                       ::perfprofd::Symbolizer* symbolizer,
+                       std::unordered_map<std::string, Dso>* files) {
   std::unordered_set<std::string> filenames_w_build_id;
-  for (auto& perf_build_id : record->perf_data().build_ids()) {
+  for (auto& perf_build_id : perf_data.build_ids()) {
     filenames_w_build_id.insert(perf_build_id.filename());
   }
 
   std::unordered_set<std::string> files_wo_build_id;
   {
-    quipper::MmapEventIterator it(record->perf_data());
+    quipper::MmapEventIterator it(perf_data);
     for (; it != it.end(); ++it) {
       const ::quipper::PerfDataProto_MMapEvent* mmap_event = &it->mmap_event();
       if (!mmap_event->has_filename() || !mmap_event->has_start() || !mmap_event->has_len()) {
@@ -55,16 +70,28 @@ void AddSymbolInfo(PerfprofdRecord* record,
     return;
   }
 
-  struct Dso {
-    uint64_t min_vaddr;
-    RangeMap<std::string, uint64_t> symbols;
-    explicit Dso(uint64_t min_vaddr_in) : min_vaddr(min_vaddr_in) {
+  // Phase one: collect the unique offsets hit in each dso without build id.
+  // Lookups are keyed by the parser's DSOInfo, which is unique per dso name, to
+  // avoid hashing the name for every frame.
+  std::unordered_map<std::string, std::unordered_set<uint64_t>> offsets_by_dso;
+  std::unordered_map<const ::quipper::DSOInfo*, std::unordered_set<uint64_t>*> dso_offsets;
+  auto check_address = [&](const ::quipper::DSOInfo* dso_info, uint64_t offset) {
+    auto dso_it = dso_offsets.find(dso_info);
+    if (dso_it == dso_offsets.end()) {
+      std::unordered_set<uint64_t>* offsets = nullptr;
+      if (files_wo_build_id.count(dso_info->name) != 0) {
+        // OK, that's a hit in the mmap segment (w/o build id).
+        offsets = &offsets_by_dso[dso_info->name];
+      }
+      dso_it = dso_offsets.emplace(dso_info, offsets).first;
+    }
+    if (dso_it->second != nullptr) {
+      dso_it->second->insert(offset);
     }
   };
-  std::unordered_map<std::string, Dso> files;
 
-  auto it = record->perf_data().events().begin();
-  auto end = record->perf_data().events().end();
+  auto it = perf_data.events().begin();
+  auto end = perf_data.events().end();
   auto parsed_it = perf_parser.parsed_events().begin();
   auto parsed_end = perf_parser.parsed_events().end();
   for (; it != end; ++it, ++parsed_it) {
@@ -80,85 +107,114 @@ void AddSymbolInfo(PerfprofdRecord* record,
       CHECK_EQ(parsed_it->callchain.size(), sample_event.callchain_size());
     }
 
-    auto check_address = [&](const std::string& dso_name, uint64_t offset) {
-      if (files_wo_build_id.count(dso_name) == 0) {
-        return;
-      }
-
-      // OK, that's a hit in the mmap segment (w/o build id).
-
-      Dso* dso_data;
-      {
-        auto dso_it = files.find(dso_name);
-        constexpr uint64_t kNoMinAddr = std::numeric_limits<uint64_t>::max();
-        if (dso_it == files.end()) {
-          uint64_t min_vaddr;
-          bool has_min_vaddr = symbolizer->GetMinExecutableVAddr(dso_name, &min_vaddr);
-          if (!has_min_vaddr) {
-            min_vaddr = kNoMinAddr;
-          }
-          auto it = files.emplace(dso_name, Dso(min_vaddr));
-          dso_data = &it.first->second;
-        } else {
-          dso_data = &dso_it->second;
-        }
-        if (dso_data->min_vaddr == kNoMinAddr) {
-          return;
-        }
-      }
-
-      // TODO: Is min_vaddr necessary here?
-      const uint64_t file_addr = offset;
-
-      std::string symbol = symbolizer->Decode(dso_name, file_addr);
-      if (symbol.empty()) {
-        return;
-      }
-
-      dso_data->symbols.Insert(symbol, file_addr);
-    };
     if (sample_event.has_ip() && parsed_it->dso_and_offset.dso_info_ != nullptr) {
-      check_address(parsed_it->dso_and_offset.dso_info_->name, parsed_it->dso_and_offset.offset_);
+      check_address(parsed_it->dso_and_offset.dso_info_, parsed_it->dso_and_offset.offset_);
     }
     if (sample_event.callchain_size() > 0) {
       for (auto& callchain_data: parsed_it->callchain) {
         if (callchain_data.dso_info_ == nullptr) {
           continue;
         }
-        check_address(callchain_data.dso_info_->name, callchain_data.offset_);
+        check_address(callchain_data.dso_info_, callchain_data.offset_);
       }
     }
   }
+  if (offsets_by_dso.empty()) {
+    return;
+  }
 
-  if (!files.empty()) {
-    // We have extra symbol info, create proto messages now.
-    for (auto& file_data : files) {
-      const std::string& filename = file_data.first;
-      const Dso& dso = file_data.second;
-      if (dso.symbols.empty()) {
-        continue;
+  // Phase two: symbolize each dso's sorted offsets in one batch. Dsos are
+  // independent, so batches run in parallel if the symbolizer allows it.
+  struct Batch {
+    const std::string* dso_name;
+    std::vector<uint64_t> offsets;
+    bool has_min_vaddr = false;
+    uint64_t min_vaddr = 0;
+    std::vector<std::string> symbols;
+  };
+  std::vector<Batch> batches(offsets_by_dso.size());
+  {
+    size_t i = 0;
+    for (auto& dso_entry : offsets_by_dso) {
+      Batch& batch = batches[i++];
+      batch.dso_name = &dso_entry.first;
+      batch.offsets.assign(dso_entry.second.begin(), dso_entry.second.end());
+      std::unordered_set<uint64_t>().swap(dso_entry.second);
+      std::sort(batch.offsets.begin(), batch.offsets.end());
+    }
+  }
+  std::atomic<size_t> next_batch(0);
+  auto symbolize = [&]() {
+    for (size_t i = next_batch++; i < batches.size(); i = next_batch++) {
+      Batch& batch = batches[i];
+      batch.has_min_vaddr = symbolizer->GetMinExecutableVAddr(*batch.dso_name, &batch.min_vaddr);
+      if (batch.has_min_vaddr) {
+        // TODO: Is min_vaddr necessary here?
+        symbolizer->DecodeBatch(*batch.dso_name, batch.offsets, &batch.symbols);
       }
+    }
+  };
+  size_t thread_count = 0;
+  if (symbolizer->IsThreadSafe()) {
+    thread_count = std::min<size_t>(batches.size(), kMaxSymbolizerThreads) - 1;
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back(symbolize);
+  }
+  symbolize();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
 
-      PerfprofdRecord_SymbolInfo* symbol_info = record->add_symbol_info();
-      symbol_info->set_filename(filename);
-      symbol_info->set_filename_md5_prefix(::quipper::Md5Prefix(filename));
-      symbol_info->set_min_vaddr(dso.min_vaddr);
-      for (auto& aggr_sym : dso.symbols) {
-        PerfprofdRecord_SymbolInfo_Symbol* symbol = symbol_info->add_symbols();
-        symbol->set_addr(*aggr_sym.second.offsets.begin());
-        symbol->set_size(*aggr_sym.second.offsets.rbegin() - *aggr_sym.second.offsets.begin() + 1);
-        symbol->set_name(aggr_sym.second.symbol);
-        symbol->set_name_md5_prefix(::quipper::Md5Prefix(aggr_sym.second.symbol));
+  for (Batch& batch : batches) {
+    constexpr uint64_t kNoMinAddr = std::numeric_limits<uint64_t>::max();
+    Dso* dso_data = &files->emplace(*batch.dso_name,
+                                    Dso(batch.has_min_vaddr ? batch.min_vaddr : kNoMinAddr))
+                         .first->second;
+    for (size_t i = 0; i < batch.symbols.size(); ++i) {
+      if (!batch.symbols[i].empty()) {
+        dso_data->symbols.Insert(batch.symbols[i], batch.offsets[i]);
       }
     }
   }
 }
 
+void AddSymbolInfo(PerfprofdRecord* record, const std::unordered_map<std::string, Dso>& files) {
+  // We have extra symbol info, create proto messages now.
+  for (auto& file_data : files) {
+    const std::string& filename = file_data.first;
+    const Dso& dso = file_data.second;
+    if (dso.symbols.empty()) {
+      continue;
+    }
+
+    PerfprofdRecord_SymbolInfo* symbol_info = record->add_symbol_info();
+    symbol_info->set_filename(filename);
+    symbol_info->set_filename_md5_prefix(::quipper::Md5Prefix(filename));
+    symbol_info->set_min_vaddr(dso.min_vaddr);
+    for (auto& aggr_sym : dso.symbols) {
+      PerfprofdRecord_SymbolInfo_Symbol* symbol = symbol_info->add_symbols();
+      symbol->set_addr(*aggr_sym.second.offsets.begin());
+      symbol->set_size(*aggr_sym.second.offsets.rbegin() - *aggr_sym.second.offsets.begin() + 1);
+      symbol->set_name(aggr_sym.second.symbol);
+      symbol->set_name_md5_prefix(::quipper::Md5Prefix(aggr_sym.second.symbol));
+    }
+  }
+}
+
 }  // namespace
 
 PerfprofdRecord*
 RawPerfDataToAndroidPerfProfile(const string &perf_file,
-                                ::perfprofd::Symbolizer* symbolizer) {
+                                ::perfprofd::Symbolizer* symbolizer,
+                                const ConversionStageFn& stage_fn) {
+  auto end_stage = [&stage_fn](const char* stage) {
+    if (stage_fn) {
+      stage_fn(stage);
+    }
+  };
+
   std::unique_ptr<PerfprofdRecord> ret(new PerfprofdRecord());
   ret->set_id(0);  // TODO.
 
@@ -171,19 +227,28 @@ RawPerfDataToAndroidPerfProfile(const string &perf_file,
 
   ::quipper::PerfReader reader;
   if (!reader.ReadFile(perf_file)) return nullptr;
+  end_stage("read");
 
   ::quipper::PerfParser parser(&reader, options);
   if (!parser.ParseRawEvents()) return nullptr;
+  end_stage("parse");
 
   if (!reader.Serialize(perf_data)) return nullptr;
 
   // Append parser stats to protobuf.
   ::quipper::PerfSerializer::SerializeParserStats(parser.stats(), perf_data);
+  end_stage("serialize");
 
-  // TODO: Symbolization.
+  std::unordered_map<std::string, Dso> files;
   if (symbolizer != nullptr) {
-    AddSymbolInfo(ret.get(), parser, symbolizer);
+    CollectSymbolInfo(*perf_data, parser, symbolizer, &files);
+  }
+  end_stage("symbolize");
+
+  if (!files.empty()) {
+    AddSymbolInfo(ret.get(), files);
   }
+  end_stage("add_symbol_info");
 
   return ret.release();
 }
@@ -1,6 +1,7 @@
 #ifndef WIRELESS_ANDROID_LOGGING_AWP_PERF_DATA_CONVERTER_H_
 #define WIRELESS_ANDROID_LOGGING_AWP_PERF_DATA_CONVERTER_H_
 
+#include <functional>
 #include <string>
 
 #include "perfprofd_record-fwd.h"
@@ -12,9 +13,14 @@ struct Symbolizer;
 namespace android {
 namespace perfprofd {
 
+// Called at the end of each conversion stage ("read", "parse", "serialize",
+// "symbolize", "add_symbol_info"), e.g. to measure the stages.
+using ConversionStageFn = std::function<void(const char* stage)>;
+
 PerfprofdRecord*
 RawPerfDataToAndroidPerfProfile(const std::string &perf_file,
-                                ::perfprofd::Symbolizer* symbolizer);
+                                ::perfprofd::Symbolizer* symbolizer,
+                                const ConversionStageFn& stage_fn = nullptr);
 
 }  // namespace perfprofd
 }  // namespace android
@@ -238,7 +238,11 @@ int perfprofd_main(int argc, char** argv, Config* config)
       data_file_path += "/";
       data_file_path += PERF_OUTPUT;
       std::string path = android::base::StringPrintf("%s.encoded.%d", data_file_path.c_str(), seq);
-      if (!android::perfprofd::SerializeProtobuf(proto, path.c_str(), handler_config->compress)) {
+      if (!android::perfprofd::SerializeProtobuf(proto,
+                                                 path.c_str(),
+                                                 handler_config->compress,
+                                                 handler_config->compression_level,
+                                                 handler_config->compression_threads)) {
         return false;
       }
       if (!post_process(*handler_config, seq)) {
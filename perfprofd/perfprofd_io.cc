@@ -18,9 +18,16 @@
 #include "perfprofd_io.h"
 
 #include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -61,6 +68,7 @@ class GzipOutputStream : public ZeroCopyOutputStream {
   ~GzipOutputStream();
 
   static std::unique_ptr<GzipOutputStream> Create(ZeroCopyOutputStream* next,
+                                                  int compression_level,
                                                   std::string* error_msg);
 
   bool Next(void** data, int* size) override;
@@ -123,6 +131,7 @@ google::protobuf::int64 GzipOutputStream::ByteCount() const {
 }
 
 std::unique_ptr<GzipOutputStream> GzipOutputStream::Create(ZeroCopyOutputStream* next,
+                                                           int compression_level,
                                                            std::string* error_msg) {
   std::unique_ptr<z_stream> stream(new z_stream);
 
@@ -140,7 +149,7 @@ std::unique_ptr<GzipOutputStream> GzipOutputStream::Create(ZeroCopyOutputStream*
     constexpr int kGzipEncoding = 16;
     constexpr int kMemLevel = 8;  // Default.
     int init_result = deflateInit2(stream.get(),
-                                   Z_DEFAULT_COMPRESSION,
+                                   compression_level,
                                    Z_DEFLATED,
                                    kWindowBits | kGzipEncoding,
                                    kMemLevel,
@@ -255,20 +264,344 @@ bool GzipOutputStream::Close() {
   return res == Z_OK;
 }
 
+// Compresses the input in independent blocks on worker threads, pigz-style.
+// Each block is a raw deflate stream primed with the tail of the previous
+// block as dictionary, and all but the last end in a sync flush, so that the
+// concatenated blocks form a single deflate stream. The gzip header and
+// trailer are written around it, with the CRC combined from the blocks' CRCs.
+class ParallelGzipOutputStream : public ZeroCopyOutputStream {
+ public:
+  ParallelGzipOutputStream(ZeroCopyOutputStream* next, int compression_level, size_t threads);
+  ~ParallelGzipOutputStream();
+
+  bool Next(void** data, int* size) override;
+
+  void BackUp(int count) override;
+
+  google::protobuf::int64 ByteCount() const override;
+
+  bool WriteAliasedRaw(const void* data, int size) override;
+  bool AllowsAliasing() const override;
+
+  bool Flush();
+  bool Close();
+
+ private:
+  struct Block {
+    std::vector<uint8_t> dictionary;
+    std::vector<uint8_t> input;
+    size_t input_size = 0;
+    std::vector<uint8_t> output;
+    uLong crc = 0;
+    bool last = false;
+    bool done = false;
+    bool ok = false;
+  };
+
+  void WorkerLoop();
+  bool Compress(Block* block);
+  bool SubmitBlock(bool last);
+  bool WriteOldestBlock();
+  bool WriteRaw(const uint8_t* data, size_t size);
+
+  ZeroCopyOutputStream* next_;
+  const int compression_level_;
+  const size_t max_pending_blocks_;
+
+  // The block being filled by the caller.
+  std::unique_ptr<Block> current_;
+  size_t current_size_;
+  // The last window of the previously submitted block, the next dictionary.
+  std::vector<uint8_t> window_;
+
+  // Submitted blocks in stream order. Only the caller's thread adds or
+  // removes blocks, workers only fill in submitted blocks.
+  std::deque<std::unique_ptr<Block>> pending_;
+  uint64_t submitted_bytes_;
+  uLong crc_;
+  bool header_written_;
+  bool had_error_;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::deque<Block*> work_;  // Guarded by mutex_, as are the blocks' done/ok.
+  bool shutdown_;
+  std::vector<std::thread> workers_;
+};
+
+// Large enough that the sync flush and dictionary overhead per block is
+// negligible. Same as pigz.
+constexpr size_t kParallelBlockSize = 128u * 1024u;
+constexpr size_t kDeflateWindowSize = 32u * 1024u;
+
+ParallelGzipOutputStream::ParallelGzipOutputStream(ZeroCopyOutputStream* next,
+                                                   int compression_level,
+                                                   size_t threads)
+    : next_(next),
+      compression_level_(compression_level),
+      max_pending_blocks_(2 * threads),
+      current_(nullptr),
+      current_size_(0),
+      submitted_bytes_(0),
+      crc_(crc32(0, Z_NULL, 0)),
+      header_written_(false),
+      had_error_(false),
+      shutdown_(false) {
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back(&ParallelGzipOutputStream::WorkerLoop, this);
+  }
+}
+
+ParallelGzipOutputStream::~ParallelGzipOutputStream() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  work_cv_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+bool ParallelGzipOutputStream::WriteAliasedRaw(const void* data ATTRIBUTE_UNUSED,
+                                               int size ATTRIBUTE_UNUSED) {
+  LOG(FATAL) << "Not supported";
+  __builtin_unreachable();
+}
+bool ParallelGzipOutputStream::AllowsAliasing() const {
+  return false;
+}
+
+google::protobuf::int64 ParallelGzipOutputStream::ByteCount() const {
+  return submitted_bytes_ + current_size_;
+}
+
+void ParallelGzipOutputStream::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    work_cv_.wait(lock, [this]() { return shutdown_ || !work_.empty(); });
+    if (shutdown_) {
+      return;
+    }
+    Block* block = work_.front();
+    work_.pop_front();
+
+    lock.unlock();
+    bool ok = Compress(block);
+    lock.lock();
+
+    block->ok = ok;
+    block->done = true;
+    done_cv_.notify_all();
+  }
+}
+
+bool ParallelGzipOutputStream::Compress(Block* block) {
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  stream.msg = nullptr;
+
+  constexpr int kRawWindowBits = -15;
+  constexpr int kMemLevel = 8;  // Default.
+  int res = deflateInit2(&stream,
+                         compression_level_,
+                         Z_DEFLATED,
+                         kRawWindowBits,
+                         kMemLevel,
+                         Z_DEFAULT_STRATEGY);
+  if (res != Z_OK) {
+    LOG(ERROR) << "Could not initialize compression: " << res;
+    return false;
+  }
+  if (!block->dictionary.empty()) {
+    res = deflateSetDictionary(&stream, block->dictionary.data(), block->dictionary.size());
+    if (res != Z_OK) {
+      deflateEnd(&stream);
+      LOG(ERROR) << "Could not set compression dictionary: " << res;
+      return false;
+    }
+  }
+
+  stream.next_in = block->input.data();
+  stream.avail_in = block->input_size;
+  block->output.resize(deflateBound(&stream, block->input_size) + 16);
+  stream.next_out = block->output.data();
+  stream.avail_out = block->output.size();
+
+  const int flush_flags = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+  do {
+    if (stream.avail_out == 0) {
+      size_t used = block->output.size();
+      block->output.resize(2 * used);
+      stream.next_out = block->output.data() + used;
+      stream.avail_out = block->output.size() - used;
+    }
+    res = deflate(&stream, flush_flags);
+  } while (res == Z_OK && stream.avail_out == 0);
+  block->output.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  block->crc = crc32(0, block->input.data(), block->input_size);
+  // Only the sizes are needed from here on.
+  std::vector<uint8_t>().swap(block->input);
+  std::vector<uint8_t>().swap(block->dictionary);
+
+  return block->last ? res == Z_STREAM_END : res == Z_OK;
+}
+
+bool ParallelGzipOutputStream::SubmitBlock(bool last) {
+  // Bound memory use: wait for the oldest block before getting too far ahead.
+  while (pending_.size() >= max_pending_blocks_) {
+    if (!WriteOldestBlock()) {
+      return false;
+    }
+  }
+
+  std::unique_ptr<Block> block = std::move(current_);
+  if (block == nullptr) {
+    block.reset(new Block());
+  }
+  block->input_size = current_size_;
+  block->last = last;
+  block->dictionary = std::move(window_);
+  size_t window_size = std::min(current_size_, kDeflateWindowSize);
+  window_.assign(block->input.begin() + (current_size_ - window_size),
+                 block->input.begin() + current_size_);
+  submitted_bytes_ += current_size_;
+  current_size_ = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    work_.push_back(block.get());
+    pending_.push_back(std::move(block));
+  }
+  work_cv_.notify_one();
+  return true;
+}
+
+bool ParallelGzipOutputStream::WriteOldestBlock() {
+  std::unique_ptr<Block> block;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    CHECK(!pending_.empty());
+    Block* oldest = pending_.front().get();
+    done_cv_.wait(lock, [oldest]() { return oldest->done; });
+    block = std::move(pending_.front());
+    pending_.pop_front();
+  }
+  if (!block->ok) {
+    return false;
+  }
+
+  if (!header_written_) {
+    // Minimal gzip header: deflate, no flags, no mtime, Unix.
+    constexpr uint8_t kGzipHeader[] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    if (!WriteRaw(kGzipHeader, sizeof(kGzipHeader))) {
+      return false;
+    }
+    header_written_ = true;
+  }
+  crc_ = crc32_combine(crc_, block->crc, block->input_size);
+  return WriteRaw(block->output.data(), block->output.size());
+}
+
+bool ParallelGzipOutputStream::WriteRaw(const uint8_t* data, size_t size) {
+  while (size > 0) {
+    void* out;
+    int out_size;
+    if (!next_->Next(&out, &out_size)) {
+      return false;
+    }
+    size_t amount = std::min(size, static_cast<size_t>(out_size));
+    memcpy(out, data, amount);
+    if (amount < static_cast<size_t>(out_size)) {
+      next_->BackUp(out_size - amount);
+    }
+    data += amount;
+    size -= amount;
+  }
+  return true;
+}
+
+bool ParallelGzipOutputStream::Next(void** data, int* size) {
+  if (had_error_) {
+    return false;
+  }
+
+  if (current_ != nullptr && current_size_ == kParallelBlockSize) {
+    if (!SubmitBlock(false)) {
+      had_error_ = true;
+      return false;
+    }
+  }
+  if (current_ == nullptr) {
+    current_.reset(new Block());
+    current_->input.resize(kParallelBlockSize);
+  }
+
+  *data = current_->input.data() + current_size_;
+  *size = kParallelBlockSize - current_size_;
+  current_size_ = kParallelBlockSize;
+  return true;
+}
+
+void ParallelGzipOutputStream::BackUp(int count) {
+  CHECK_GE(current_size_, static_cast<size_t>(count));
+  current_size_ -= count;
+}
+
+bool ParallelGzipOutputStream::Flush() {
+  // Blocks are only cut when full, flushing early would cost ratio.
+  return !had_error_;
+}
+
+bool ParallelGzipOutputStream::Close() {
+  if (had_error_) {
+    return false;
+  }
+  had_error_ = true;  // Pretend an error so no other operations succeed.
+
+  if (!SubmitBlock(true)) {
+    return false;
+  }
+  while (!pending_.empty()) {
+    if (!WriteOldestBlock()) {
+      return false;
+    }
+  }
+
+  // Trailer: CRC32 and input size modulo 2^32, little endian.
+  uint8_t trailer[8];
+  for (size_t i = 0; i < 4; ++i) {
+    trailer[i] = static_cast<uint8_t>(crc_ >> (8 * i));
+    trailer[4 + i] = static_cast<uint8_t>(submitted_bytes_ >> (8 * i));
+  }
+  return WriteRaw(trailer, sizeof(trailer));
+}
+
 }  // namespace
 
 bool SerializeProtobuf(android::perfprofd::PerfprofdRecord* encodedProfile,
                        android::base::unique_fd&& fd,
-                       bool compress) {
+                       bool compress,
+                       int compression_level,
+                       size_t compression_threads) {
   FileCopyingOutputStream fcos(std::move(fd));
   google::protobuf::io::CopyingOutputStreamAdaptor cosa(&fcos);
 
   ZeroCopyOutputStream* out;
 
   std::unique_ptr<GzipOutputStream> gzip;
-  if (compress) {
+  std::unique_ptr<ParallelGzipOutputStream> parallel_gzip;
+  if (compress && compression_threads > 1) {
+    parallel_gzip.reset(new ParallelGzipOutputStream(&cosa, compression_level, compression_threads));
+    out = parallel_gzip.get();
+  } else if (compress) {
     std::string error_msg;
-    gzip = GzipOutputStream::Create(&cosa, &error_msg);
+    gzip = GzipOutputStream::Create(&cosa, compression_level, &error_msg);
     if (gzip == nullptr) {
       LOG(ERROR) << error_msg;
       return false;
@@ -289,13 +622,19 @@ bool SerializeProtobuf(android::perfprofd::PerfprofdRecord* encodedProfile,
     zip_ok = gzip->Flush();
     zip_ok = gzip->Close() && zip_ok;
   }
+  if (parallel_gzip != nullptr) {
+    zip_ok = parallel_gzip->Flush();
+    zip_ok = parallel_gzip->Close() && zip_ok;
+  }
   cosa.Flush();
   return zip_ok;
 }
 
 bool SerializeProtobuf(PerfprofdRecord* encodedProfile,
                        const char* encoded_file_path,
-                       bool compress) {
+                       bool compress,
+                       int compression_level,
+                       size_t compression_threads) {
   unlink(encoded_file_path);  // Attempt to unlink for a clean slate.
   constexpr int kFlags = O_CREAT | O_WRONLY | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
   unique_fd fd(open(encoded_file_path, kFlags, 0664));
@@ -303,7 +642,11 @@ bool SerializeProtobuf(PerfprofdRecord* encodedProfile,
     PLOG(WARNING) << "Could not open " << encoded_file_path << " for serialization";
     return false;
   }
-  return SerializeProtobuf(encodedProfile, std::move(fd), compress);
+  return SerializeProtobuf(encodedProfile,
+                           std::move(fd),
+                           compress,
+                           compression_level,
+                           compression_threads);
 }
 
 }  // namespace perfprofd
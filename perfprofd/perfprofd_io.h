@@ -18,6 +18,8 @@
 #ifndef SYSTEM_EXTRAS_PERFPROFD_PERFPROFD_IO_H_
 #define SYSTEM_EXTRAS_PERFPROFD_PERFPROFD_IO_H_
 
+#include <stddef.h>
+
 #include <android-base/unique_fd.h>
 
 #include "perfprofd_record-fwd.h"
@@ -25,12 +27,22 @@
 namespace android {
 namespace perfprofd {
 
+// The zlib default.
+constexpr int kDefaultCompressionLevel = 6;
+
+// Serialize the record, gzip-compressed if compress is set. With more than one
+// compression thread, the output is a single gzip stream made of independently
+// compressed blocks.
 bool SerializeProtobuf(android::perfprofd::PerfprofdRecord* encodedProfile,
                        const char* encoded_file_path,
-                       bool compress = true);
+                       bool compress = true,
+                       int compression_level = kDefaultCompressionLevel,
+                       size_t compression_threads = 1);
 bool SerializeProtobuf(android::perfprofd::PerfprofdRecord* encodedProfile,
                        android::base::unique_fd&& fd,
-                       bool compress = true);
+                       bool compress = true,
+                       int compression_level = kDefaultCompressionLevel,
+                       size_t compression_threads = 1);
 
 }  // namespace perfprofd
 }  // namespace android
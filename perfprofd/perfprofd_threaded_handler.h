@@ -162,7 +162,11 @@ class ThreadedHandler  {
     std::string data_file_path(config->destination_directory);
     data_file_path += "/perf.data";
     std::string path = android::base::StringPrintf("%s.encoded.%d", data_file_path.c_str(), seq_);
-    if (!SerializeProtobuf(encodedProfile, path.c_str(), config->compress)) {
+    if (!SerializeProtobuf(encodedProfile,
+                           path.c_str(),
+                           config->compress,
+                           config->compression_level,
+                           config->compression_threads)) {
       return false;
     }
 
@@ -23,12 +23,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -38,6 +41,8 @@
 #include <android-base/macros.h>
 #include <android-base/scopeguard.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 
 #ifdef __BIONIC__
 #include <android-base/properties.h>
@@ -50,6 +55,7 @@
 #include "perf_data_converter.h"
 #include "perfprofdcore.h"
 #include "perfprofd_io.h"
+#include "profile_aggregator.h"
 #include "symbolizer.h"
 
 //
@@ -69,31 +75,6 @@ using ProtoUniquePtr = std::unique_ptr<android::perfprofd::PerfprofdRecord>;
 //
 #define PERF_OUTPUT "perf.data"
 
-//
-// This enum holds the results of the "should we profile" configuration check.
-//
-typedef enum {
-
-  // All systems go for profile collection.
-  DO_COLLECT_PROFILE,
-
-  // The selected configuration directory doesn't exist.
-  DONT_PROFILE_MISSING_CONFIG_DIR,
-
-  // Destination directory does not contain the semaphore file that
-  // the perf profile uploading service creates when it determines
-  // that the user has opted "in" for usage data collection. No
-  // semaphore -> no user approval -> no profiling.
-  DONT_PROFILE_MISSING_SEMAPHORE,
-
-  // No perf executable present
-  DONT_PROFILE_MISSING_PERF_EXECUTABLE,
-
-  // We're running in the emulator, perf won't be able to do much
-  DONT_PROFILE_RUNNING_IN_EMULATOR
-
-} CKPROFILE_RESULT;
-
 static bool common_initialized = false;
 
 //
@@ -128,6 +109,12 @@ static const char *ckprofile_result_to_string(CKPROFILE_RESULT result)
       return "missing 'perf' executable";
     case DONT_PROFILE_RUNNING_IN_EMULATOR:
       return "running in emulator";
+    case DONT_PROFILE_SYSTEM_IDLE:
+      return "system idle";
+    case DONT_PROFILE_MEMORY_PRESSURE:
+      return "memory pressure";
+    case DONT_PROFILE_THERMAL_THROTTLING:
+      return "thermal throttling";
     default:
       return "unknown";
   }
@@ -354,6 +341,65 @@ unsigned collect_cpu_utilization()
   return busy_delta * 100 / total_delta;
 }
 
+//
+// Read the 10-second average of the pressure-stall information for
+// 'resource' ("cpu", "memory" or "io"): the percentage of time at
+// least one task was stalled on it. Returns false if the kernel
+// doesn't provide PSI.
+//
+bool get_pressure(const char* resource, double* avg10)
+{
+  std::string path = android::base::StringPrintf("/proc/pressure/%s", resource);
+  std::string contents;
+  if (!android::base::ReadFileToString(path, &contents)) {
+    return false;
+  }
+  return sscanf(contents.c_str(), "some avg10=%lf", avg10) == 1;
+}
+
+//
+// Are any CPUs thermally throttled? Checks whether a CPU cooling
+// device under 'thermal_dir' is in a non-zero (i.e. throttling) state.
+//
+bool get_thermal_throttling(const std::string& thermal_dir)
+{
+  DIR* dir = opendir(thermal_dir.c_str());
+  if (dir == NULL) {
+    return false;
+  }
+  struct dirent* e;
+  bool result = false;
+  while ((e = readdir(dir)) != 0) {
+    if (strncmp(e->d_name, "cooling_device", strlen("cooling_device")) != 0) {
+      continue;
+    }
+    std::string device_dir = thermal_dir + "/" + e->d_name;
+    std::string type;
+    std::string state;
+    unsigned value = 0;
+    if (android::base::ReadFileToString(device_dir + "/type", &type) &&
+        type.find("cpu") != std::string::npos &&
+        android::base::ReadFileToString(device_dir + "/cur_state", &state) &&
+        sscanf(state.c_str(), "%u", &value) == 1 && value > 0) {
+      result = true;
+      break;
+    }
+  }
+  closedir(dir);
+  return result;
+}
+
+//
+// The 1-minute load average: runnable and uninterruptible tasks,
+// averaged over all CPUs' runqueues.
+//
+bool get_load_average(double* load_average)
+{
+  std::string load;
+  return android::base::ReadFileToString("/proc/loadavg", &load) &&
+      sscanf(load.c_str(), "%lf", load_average) == 1;
+}
+
 static void annotate_encoded_perf_profile(android::perfprofd::PerfprofdRecord* profile,
                                           const Config& config,
                                           unsigned cpu_utilization)
@@ -368,10 +414,8 @@ static void annotate_encoded_perf_profile(android::perfprofd::PerfprofdRecord* p
   //
   // Load average as reported by the kernel
   //
-  std::string load;
   double fload = 0.0;
-  if (android::base::ReadFileToString("/proc/loadavg", &load) &&
-      sscanf(load.c_str(), "%lf", &fload) == 1) {
+  if (get_load_average(&fload)) {
     int iload = static_cast<int>(fload * 100.0);
     profile->set_sys_load_average(iload);
   } else {
@@ -413,12 +457,24 @@ static ProtoUniquePtr encode_to_proto(const std::string &data_file_path,
   //
   // Open and read perf.data file
   //
+  if (symbolizer != nullptr) {
+    symbolizer->StartConversion();
+  }
   ProtoUniquePtr encodedProfile(
       android::perfprofd::RawPerfDataToAndroidPerfProfile(data_file_path, symbolizer));
   if (encodedProfile == nullptr) {
     return nullptr;
   }
 
+  perfprofd::Symbolizer::CacheStats cache_stats;
+  if (symbolizer != nullptr && symbolizer->GetCacheStats(&cache_stats)) {
+    auto* stats = encodedProfile->mutable_symbolizer_cache_stats();
+    stats->set_hits(cache_stats.hits);
+    stats->set_misses(cache_stats.misses);
+    stats->set_evictions(cache_stats.evictions);
+    stats->set_cached_bytes(cache_stats.bytes);
+  }
+
   // All of the info in 'encodedProfile' is derived from the perf.data file;
   // here we tack display status, cpu utilization, system load, etc.
   annotate_encoded_perf_profile(encodedProfile.get(), config, cpu_utilization);
@@ -446,22 +502,257 @@ PROFILE_RESULT encode_to_proto(const std::string &data_file_path,
 
   return android::perfprofd::SerializeProtobuf(encodedProfile.get(),
                                                encoded_file_path,
-                                               config.compress)
+                                               config.compress,
+                                               config.compression_level,
+                                               config.compression_threads)
       ? OK_PROFILE_COLLECTION
       : ERR_WRITE_ENCODED_FILE_FAILED;
 }
 
+//
+// Create an in-memory file to receive perf.data from 'perf record', so that
+// the profile never round-trips through flash. Returns -1 if the kernel
+// doesn't support memfd, in which case perf.data is written to a file.
+//
+static int create_perf_data_memfd()
+{
+#if defined(__NR_memfd_create)
+  constexpr unsigned int kMfdCloexec = 1u;  // MFD_CLOEXEC
+  int fd = static_cast<int>(syscall(__NR_memfd_create, PERF_OUTPUT, kMfdCloexec));
+  if (fd == -1) {
+    PLOG(WARNING) << "memfd_create failed, writing " << PERF_OUTPUT << " to disk";
+  }
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+//
+// State of the adaptive scheduler. Only used from the profiling loop.
+//
+static SchedulerState scheduler;
+
+// Sampling frequency simpleperf uses if none is given.
+static constexpr uint32_t kDefaultSamplingFrequency = 4000;
+static constexpr uint32_t kMinSamplingFrequency = 10;
+static constexpr double kMinSamplingScale = 1.0 / 64;
+
+uint32_t get_collection_interval(const Config& config, const SchedulerState& state)
+{
+  if (!config.adaptive_scheduling) {
+    return config.collection_interval_in_s;
+  }
+  uint64_t interval = static_cast<uint64_t>(config.collection_interval_in_s) <<
+      state.backoff_level;
+  return static_cast<uint32_t>(std::min<uint64_t>(interval, UINT32_MAX));
+}
+
+//
+// Sampling frequency and period to pass to perf (0 if unset), after
+// scaling to the overhead budget.
+//
+void get_sampling_rate(const Config& config,
+                       const SchedulerState& state,
+                       uint32_t* frequency,
+                       uint32_t* period)
+{
+  *frequency = config.sampling_frequency;
+  *period = config.sampling_period;
+  if (!config.adaptive_scheduling || state.sampling_scale >= 1.0) {
+    return;
+  }
+  if (*frequency > 0 || *period == 0) {
+    uint32_t base = *frequency > 0 ? *frequency : kDefaultSamplingFrequency;
+    *frequency = std::max(kMinSamplingFrequency,
+                          static_cast<uint32_t>(base * state.sampling_scale));
+  } else {
+    *period = static_cast<uint32_t>(
+        std::min<double>(*period / state.sampling_scale, UINT32_MAX));
+  }
+}
+
+CKPROFILE_RESULT check_load(const Config& config, const LoadSignals& signals)
+{
+  if (signals.thermal_throttling) {
+    return DONT_PROFILE_THERMAL_THROTTLING;
+  }
+  if (signals.have_memory_pressure && signals.memory_pressure > config.max_memory_pressure) {
+    return DONT_PROFILE_MEMORY_PRESSURE;
+  }
+
+  // Busy CPUs, tasks waiting for CPU, or at least as many runnable tasks
+  // as CPUs on average are what profiles are for.
+  if (signals.cpu_utilization >= config.min_cpu_utilization ||
+      (signals.have_cpu_pressure && signals.cpu_pressure >= 1.0) ||
+      (signals.have_load_average && signals.load_average >= signals.online_cpus)) {
+    return DO_COLLECT_PROFILE;
+  }
+  return DONT_PROFILE_SYSTEM_IDLE;
+}
+
+void update_backoff(CKPROFILE_RESULT result, SchedulerState* state)
+{
+  if (result == DONT_PROFILE_MEMORY_PRESSURE || result == DONT_PROFILE_THERMAL_THROTTLING) {
+    state->backoff_level = std::min(state->backoff_level + 1, kMaxBackoffLevel);
+  } else if (result == DO_COLLECT_PROFILE) {
+    state->backoff_level = 0;
+  }
+}
+
+static LoadSignals read_load_signals()
+{
+  LoadSignals signals;
+  signals.thermal_throttling = get_thermal_throttling();
+  signals.have_memory_pressure = get_pressure("memory", &signals.memory_pressure);
+  signals.cpu_utilization = collect_cpu_utilization();
+  signals.have_cpu_pressure = get_pressure("cpu", &signals.cpu_pressure);
+  signals.have_load_average = get_load_average(&signals.load_average);
+  signals.online_cpus = static_cast<unsigned>(std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L));
+  return signals;
+}
+
+//
+// Wait, within the current collection interval, for load that is
+// worth profiling. Rechecks every eighth of the interval, consuming
+// 'sleep_after_collect'. Backs off instead while the system is
+// memory constrained or thermally throttled.
+//
+static CKPROFILE_RESULT wait_for_interesting_load(Config& config,
+                                                  unsigned* sleep_after_collect)
+{
+  for (;;) {
+    LoadSignals signals = read_load_signals();
+    scheduler.cpu_utilization = signals.cpu_utilization;
+    scheduler.have_cpu_utilization = true;
+    CKPROFILE_RESULT result = check_load(config, signals);
+    if (result != DONT_PROFILE_SYSTEM_IDLE) {
+      return result;
+    }
+
+    unsigned retry = std::min(*sleep_after_collect,
+                              std::max(1u, config.collection_interval_in_s / 8));
+    if (retry == 0) {
+      return DONT_PROFILE_SYSTEM_IDLE;
+    }
+    LOG(INFO) << "system idle (cpu utilization " << signals.cpu_utilization
+              << "%, load average " << signals.load_average << " on " << signals.online_cpus
+              << " CPUs), retrying in " << retry << " s";
+    config.Sleep(retry);
+    *sleep_after_collect -= retry;
+    if (config.ShouldStopProfiling()) {
+      return DONT_PROFILE_SYSTEM_IDLE;
+    }
+  }
+}
+
+void update_sampling_scale(const Config& config,
+                           unsigned overhead_permille,
+                           SchedulerState* state)
+{
+  double ratio = static_cast<double>(config.overhead_budget_permille) /
+      std::max(overhead_permille, 1u);
+  if (overhead_permille > config.overhead_budget_permille) {
+    state->sampling_scale = std::max(kMinSamplingScale, state->sampling_scale * ratio);
+  } else if (overhead_permille * 2 < config.overhead_budget_permille) {
+    // Recover slowly, well within budget.
+    state->sampling_scale = std::min(1.0, state->sampling_scale * std::min(ratio, 2.0));
+  }
+}
+
+//
+// Report the CPU overhead of a collection and, with adaptive
+// scheduling, scale the sampling rate so that the next collection
+// stays within the overhead budget.
+//
+static void account_overhead(const Config& config,
+                             unsigned duration,
+                             double cpu_seconds,
+                             android::perfprofd::PerfprofdRecord* profile)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  double available_seconds = static_cast<double>(std::max(duration, 1u)) * std::max(cpus, 1L);
+  unsigned overhead_permille = static_cast<unsigned>(cpu_seconds * 1000 / available_seconds);
+
+  uint32_t frequency, period;
+  get_sampling_rate(config, scheduler, &frequency, &period);
+  if (profile != nullptr) {
+    profile->set_collection_cpu_time_ms(static_cast<uint64_t>(cpu_seconds * 1000));
+    profile->set_collection_overhead_permille(overhead_permille);
+    profile->set_sampling_frequency(frequency);
+    profile->set_sampling_period(period);
+  }
+  LOG(INFO) << "collection overhead: " << cpu_seconds << " s CPU, " << overhead_permille
+            << " permille of " << cpus << " CPUs over " << duration << " s";
+
+  if (!config.adaptive_scheduling) {
+    return;
+  }
+  update_sampling_scale(config, overhead_permille, &scheduler);
+  get_sampling_rate(config, scheduler, &frequency, &period);
+  LOG(INFO) << "next sampling rate: frequency " << frequency << ", period " << period;
+}
+
+static double get_elapsed_seconds(const struct timespec& start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static double get_cpu_seconds(const struct rusage& usage)
+{
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+//
+// Reset the peak RSS (VmHWM) of perfprofd to its current RSS, so that
+// the peak of a single step can be measured. Needs Linux 4.0 or later.
+//
+static bool reset_peak_rss()
+{
+  return android::base::WriteStringToFile("5", "/proc/self/clear_refs");
+}
+
+//
+// Return the value of a "<field>: <value> kB" line of /proc/self/status,
+// or 0 if it can't be read.
+//
+static uint64_t read_proc_status_kb(const std::string& field)
+{
+  std::string status;
+  if (!android::base::ReadFileToString("/proc/self/status", &status)) {
+    return 0;
+  }
+  for (const std::string& line : android::base::Split(status, "\n")) {
+    unsigned long long value;
+    if (android::base::StartsWith(line, (field + ":").c_str()) &&
+        sscanf(line.c_str() + field.size() + 1, "%llu", &value) == 1) {
+      return value;
+    }
+  }
+  return 0;
+}
+
 //
 // Invoke "perf record". Return value is OK_PROFILE_COLLECTION for
-// success, or some other error code if something went wrong.
+// success, or some other error code if something went wrong. If
+// data_fd is not -1, perf.data is written to it instead of to
+// data_file_path.
 //
 static PROFILE_RESULT invoke_perf(Config& config,
                                   const std::string &perf_path,
                                   const char *stack_profile_opt,
                                   unsigned duration,
                                   const std::string &data_file_path,
-                                  const std::string &perf_stderr_path)
+                                  int data_fd,
+                                  const std::string &perf_stderr_path,
+                                  double* perf_cpu_seconds)
 {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   pid_t pid = fork();
 
   if (pid == -1) {
@@ -481,7 +772,7 @@ static PROFILE_RESULT invoke_perf(Config& config,
     }
 
     // marshall arguments
-    constexpr unsigned max_args = 17;
+    constexpr unsigned max_args = 19;
     const char *argv[max_args];
     unsigned slot = 0;
     argv[slot++] = perf_path.c_str();
@@ -491,15 +782,29 @@ static PROFILE_RESULT invoke_perf(Config& config,
     argv[slot++] = "-o";
     argv[slot++] = data_file_path.c_str();
 
+    // --out-fd N (the fd is created close-on-exec, let perf inherit it)
+    std::string fd_str;
+    if (data_fd != -1) {
+      if (fcntl(data_fd, F_SETFD, 0) != 0) {
+        fprintf(stderr, "unable to pass perf.data fd: %s\n", strerror(errno));
+        exit(1);
+      }
+      argv[slot++] = "--out-fd";
+      fd_str = std::to_string(data_fd);
+      argv[slot++] = fd_str.c_str();
+    }
+
     // -c/f N
     std::string p_str;
-    if (config.sampling_frequency > 0) {
+    uint32_t sampling_frequency, sampling_period;
+    get_sampling_rate(config, scheduler, &sampling_frequency, &sampling_period);
+    if (sampling_frequency > 0) {
       argv[slot++] = "-f";
-      p_str = android::base::StringPrintf("%u", config.sampling_frequency);
+      p_str = android::base::StringPrintf("%u", sampling_frequency);
       argv[slot++] = p_str.c_str();
-    } else if (config.sampling_period > 0) {
+    } else if (sampling_period > 0) {
       argv[slot++] = "-c";
-      p_str = android::base::StringPrintf("%u", config.sampling_period);
+      p_str = android::base::StringPrintf("%u", sampling_period);
       argv[slot++] = p_str.c_str();
     }
 
@@ -560,7 +865,16 @@ static PROFILE_RESULT invoke_perf(Config& config,
 
     // Wait for the child, so it's reaped correctly.
     int st = 0;
-    pid_t reaped = TEMP_FAILURE_RETRY(waitpid(pid, &st, 0));
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    pid_t reaped = TEMP_FAILURE_RETRY(wait4(pid, &st, 0, &usage));
+
+    // Record the cost of the collection: the number of blocks perf
+    // wrote. perf's ru_maxrss isn't logged, as it starts from our own
+    // RSS at the time of the fork.
+    LOG(INFO) << "perf record took " << get_elapsed_seconds(start) << " s, "
+              << usage.ru_oublock << " block writes";
+    *perf_cpu_seconds = get_cpu_seconds(usage);
 
     if (reaped == -1) {
       PLOG(WARNING) << "waitpid failed";
@@ -581,7 +895,75 @@ static PROFILE_RESULT invoke_perf(Config& config,
 }
 
 //
-// Remove all files in the destination directory during initialization
+// ELF symbolizer kept for the lifetime of the daemon (when enabled via
+// 'symbolizer_cache_size'), so that symbols of system libraries are
+// not parsed again for every collection. Only used from the profiling
+// loop.
+//
+static std::unique_ptr<perfprofd::Symbolizer> cached_symbolizer;
+static uint32_t cached_symbolizer_size_in_kb = 0;
+
+static perfprofd::Symbolizer* get_cached_symbolizer(const Config& config)
+{
+  if (cached_symbolizer == nullptr ||
+      cached_symbolizer_size_in_kb != config.symbolizer_cache_size) {
+    cached_symbolizer_size_in_kb = config.symbolizer_cache_size;
+    cached_symbolizer = perfprofd::CreateCachingELFSymbolizer(
+        static_cast<size_t>(cached_symbolizer_size_in_kb) * 1024u);
+  }
+  return cached_symbolizer.get();
+}
+
+//
+// On-disk aggregate of profiles (when enabled via 'aggregation_cycles'),
+// kept open for the lifetime of the daemon. Only used from the profiling loop.
+//
+static std::unique_ptr<android::perfprofd::ProfileAggregator> aggregator;
+static std::string aggregator_dir;
+
+//
+// Merge a collected profile into the aggregate. Returns false if the
+// profile was absorbed and nothing is to be handed out yet. Once
+// 'aggregation_cycles' collections have been merged, 'proto' is replaced
+// by the aggregated profile (with the annotations of the latest
+// collection) and true is returned. If aggregation fails, the collected
+// profile is left as is, so that it is not lost.
+//
+static bool aggregate_profile(ProtoUniquePtr& proto, const Config& config)
+{
+  if (aggregator == nullptr || aggregator_dir != config.destination_directory) {
+    aggregator.reset();
+    aggregator_dir = config.destination_directory;
+    std::string error_msg;
+    aggregator = android::perfprofd::ProfileAggregator::Open(
+        aggregator_dir,
+        static_cast<size_t>(config.aggregation_max_size_in_kb) * 1024u,
+        &error_msg);
+    if (aggregator == nullptr) {
+      LOG(WARNING) << "unable to open profile aggregate: " << error_msg;
+      return true;
+    }
+  }
+
+  if (!aggregator->Add(*proto)) {
+    LOG(WARNING) << "unable to add profile to aggregate";
+    return true;
+  }
+  if (aggregator->collections() < config.aggregation_cycles) {
+    return false;
+  }
+
+  proto->clear_perf_data();
+  proto->clear_symbol_info();
+  if (!aggregator->Emit(proto.get())) {
+    LOG(WARNING) << "unable to emit aggregated profile";
+    proto.reset();
+  }
+  return true;
+}
+
+// Remove all files in the destination directory during initialization,
+// except for the profile aggregate, which survives restarts.
 //
 static void cleanup_destination_dir(const std::string& dest_dir)
 {
@@ -589,7 +971,8 @@ static void cleanup_destination_dir(const std::string& dest_dir)
   if (dir != NULL) {
     struct dirent* e;
     while ((e = readdir(dir)) != 0) {
-      if (e->d_name[0] != '.') {
+      if (e->d_name[0] != '.' &&
+          !android::perfprofd::ProfileAggregator::IsStoreFile(e->d_name)) {
         std::string file_path = dest_dir + "/" + e->d_name;
         remove(file_path.c_str());
       }
@@ -612,8 +995,10 @@ static ProtoUniquePtr collect_profile(Config& config)
   //
   unsigned cpu_utilization = 0;
   if (config.collect_cpu_utilization) {
-    cpu_utilization = collect_cpu_utilization();
+    cpu_utilization = scheduler.have_cpu_utilization ? scheduler.cpu_utilization
+                                                     : collect_cpu_utilization();
   }
+  scheduler.have_cpu_utilization = false;
 
   //
   // Form perf.data file name, perf error output file name
@@ -657,6 +1042,8 @@ static ProtoUniquePtr collect_profile(Config& config)
   auto scope_guard = android::base::make_scope_guard(
       [&data_file_path]() { unlink(data_file_path.c_str()); });
 
+  android::base::unique_fd data_fd(create_perf_data_memfd());
+
   //
   // Invoke perf
   //
@@ -664,25 +1051,58 @@ static ProtoUniquePtr collect_profile(Config& config)
       (config.stack_profile ? "-g" : nullptr);
   const std::string& perf_path = config.perf_path;
 
+  double perf_cpu_seconds = 0.0;
   PROFILE_RESULT ret = invoke_perf(config,
                                    perf_path.c_str(),
                                    stack_profile_opt,
                                    duration,
                                    data_file_path,
-                                   perf_stderr_path);
+                                   data_fd.get(),
+                                   perf_stderr_path,
+                                   &perf_cpu_seconds);
   if (ret != OK_PROFILE_COLLECTION) {
     return nullptr;
   }
+  std::string input_path = data_file_path;
+  if (data_fd.get() != -1) {
+    input_path = android::base::StringPrintf("/proc/self/fd/%d", data_fd.get());
+  }
 
   //
   // Read the resulting perf.data file, encode into protocol buffer, then write
   // the result to the file perf.data.encoded
   //
   std::unique_ptr<perfprofd::Symbolizer> symbolizer;
+  perfprofd::Symbolizer* symbolizer_ptr = nullptr;
   if (config.use_elf_symbolizer) {
-    symbolizer = perfprofd::CreateELFSymbolizer();
+    if (config.symbolizer_cache_size > 0) {
+      symbolizer_ptr = get_cached_symbolizer(config);
+    } else {
+      symbolizer = perfprofd::CreateELFSymbolizer();
+      symbolizer_ptr = symbolizer.get();
+    }
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct rusage usage_before;
+  memset(&usage_before, 0, sizeof(usage_before));
+  getrusage(RUSAGE_SELF, &usage_before);
+  bool measure_rss = reset_peak_rss();
+  uint64_t rss_before_kb = read_proc_status_kb("VmRSS");
+  ProtoUniquePtr result = encode_to_proto(input_path, config, cpu_utilization, symbolizer_ptr);
+  if (measure_rss) {
+    uint64_t peak_rss_kb = read_proc_status_kb("VmHWM");
+    LOG(INFO) << "encoding took " << get_elapsed_seconds(start) << " s, peak RSS grew by "
+              << (peak_rss_kb > rss_before_kb ? peak_rss_kb - rss_before_kb : 0) << " KB";
+  } else {
+    LOG(INFO) << "encoding took " << get_elapsed_seconds(start) << " s";
+  }
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    double encode_cpu_seconds = get_cpu_seconds(usage) - get_cpu_seconds(usage_before);
+    account_overhead(config, duration, perf_cpu_seconds + encode_cpu_seconds, result.get());
   }
-  return encode_to_proto(data_file_path, config, cpu_utilization, symbolizer.get());
+  return result;
 }
 
 //
@@ -775,7 +1195,7 @@ static void ProfilingLoopImpl(ConfigFn config, UpdateFn update, HandlerFn handle
     unsigned sleep_after_collect = 0;
     determine_before_after(sleep_before_collect,
                            sleep_after_collect,
-                           config()->collection_interval_in_s);
+                           get_collection_interval(*config(), scheduler));
     if (sleep_before_collect > 0) {
       config()->Sleep(sleep_before_collect);
     }
@@ -789,6 +1209,10 @@ static void ProfilingLoopImpl(ConfigFn config, UpdateFn update, HandlerFn handle
 
     // Check for profiling enabled...
     CKPROFILE_RESULT ckresult = check_profiling_enabled(*config());
+    if (ckresult == DO_COLLECT_PROFILE && config()->adaptive_scheduling) {
+      ckresult = wait_for_interesting_load(*config(), &sleep_after_collect);
+      update_backoff(ckresult, &scheduler);
+    }
     if (ckresult != DO_COLLECT_PROFILE) {
       LOG(INFO) << "profile collection skipped (" << ckprofile_result_to_string(ckresult) << ")";
     } else {
@@ -799,12 +1223,18 @@ static void ProfilingLoopImpl(ConfigFn config, UpdateFn update, HandlerFn handle
         LOG(WARNING) << "profile collection failed";
       }
 
-      // Always report, even a null result.
-      bool handle_result = handler(proto.get(), config());
-      if (handle_result) {
-        LOG(INFO) << "profile collection complete";
-      } else if (proto != nullptr) {
-        LOG(WARNING) << "profile handling failed";
+      if (proto != nullptr && config()->aggregation_cycles > 0 &&
+          !aggregate_profile(proto, *config())) {
+        // Nothing to hand out until the aggregate is due.
+        LOG(INFO) << "profile collection aggregated";
+      } else {
+        // Always report, even a null result.
+        bool handle_result = handler(proto.get(), config());
+        if (handle_result) {
+          LOG(INFO) << "profile collection complete";
+        } else if (proto != nullptr) {
+          LOG(WARNING) << "profile handling failed";
+        }
       }
     }
 
@@ -20,6 +20,7 @@
 
 #include <functional>
 #include <memory>
+#include <string>
 
 #include "perfprofd_record-fwd.h"
 
@@ -56,6 +57,42 @@ typedef enum {
   ERR_WRITE_ENCODED_FILE_FAILED
 } PROFILE_RESULT;
 
+//
+// This enum holds the results of the "should we profile" configuration check.
+//
+typedef enum {
+
+  // All systems go for profile collection.
+  DO_COLLECT_PROFILE,
+
+  // The selected configuration directory doesn't exist.
+  DONT_PROFILE_MISSING_CONFIG_DIR,
+
+  // Destination directory does not contain the semaphore file that
+  // the perf profile uploading service creates when it determines
+  // that the user has opted "in" for usage data collection. No
+  // semaphore -> no user approval -> no profiling.
+  DONT_PROFILE_MISSING_SEMAPHORE,
+
+  // No perf executable present
+  DONT_PROFILE_MISSING_PERF_EXECUTABLE,
+
+  // We're running in the emulator, perf won't be able to do much
+  DONT_PROFILE_RUNNING_IN_EMULATOR,
+
+  // Adaptive scheduling: the system stayed idle for the whole
+  // collection interval, a profile would show little of interest.
+  DONT_PROFILE_SYSTEM_IDLE,
+
+  // Adaptive scheduling: tasks are stalling on memory, profiling
+  // would add to the pressure.
+  DONT_PROFILE_MEMORY_PRESSURE,
+
+  // Adaptive scheduling: CPUs are thermally throttled.
+  DONT_PROFILE_THERMAL_THROTTLING
+
+} CKPROFILE_RESULT;
+
 //
 // Given a full path to a perf.data file specified by "data_file_path",
 // read/summarize/encode the contents into a new file specified
@@ -83,6 +120,60 @@ extern unsigned collect_cpu_utilization();
 extern bool get_booting();
 extern bool get_charging();
 extern bool get_camera_active();
+extern bool get_pressure(const char* resource, double* avg10);
+extern bool get_thermal_throttling(const std::string& thermal_dir = "/sys/class/thermal");
+extern bool get_load_average(double* load_average);
+
+//
+// Adaptive scheduling (enabled via 'adaptive_scheduling'), exposed
+// for unit testing.
+//
+
+// Load signals read before a collection.
+struct LoadSignals {
+  bool thermal_throttling = false;
+  bool have_memory_pressure = false;
+  double memory_pressure = 0.0;
+  unsigned cpu_utilization = 0;
+  bool have_cpu_pressure = false;
+  double cpu_pressure = 0.0;
+  bool have_load_average = false;
+  double load_average = 0.0;
+  unsigned online_cpus = 1;
+};
+
+// State of the scheduler, kept across collections.
+struct SchedulerState {
+  // The collection interval is stretched by 2^backoff_level while the
+  // system is constrained.
+  unsigned backoff_level = 0;
+
+  // Scale applied to the sampling rate to meet the overhead budget.
+  double sampling_scale = 1.0;
+
+  // CPU utilization measured while scheduling, reused to annotate the
+  // profile instead of measuring again.
+  bool have_cpu_utilization = false;
+  unsigned cpu_utilization = 0;
+};
+
+constexpr unsigned kMaxBackoffLevel = 3;
+
+// Whether the load is worth profiling: DO_COLLECT_PROFILE, or why not.
+extern CKPROFILE_RESULT check_load(const Config& config, const LoadSignals& signals);
+// Back off after a skip for memory pressure or thermal throttling, and
+// reset once a profile is collected.
+extern void update_backoff(CKPROFILE_RESULT result, SchedulerState* state);
+extern uint32_t get_collection_interval(const Config& config, const SchedulerState& state);
+// Scale the sampling rate by how far the last collection was from the
+// overhead budget.
+extern void update_sampling_scale(const Config& config,
+                                  unsigned overhead_permille,
+                                  SchedulerState* state);
+extern void get_sampling_rate(const Config& config,
+                              const SchedulerState& state,
+                              uint32_t* frequency,
+                              uint32_t* period);
 
 bool IsDebugBuild();
 
@@ -0,0 +1,681 @@
+/*
+ *
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "profile_aggregator.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+
+#include <android-base/logging.h>
+#include <android-base/macros.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "perfprofd_record.pb.h"
+
+#include "frame_resolver.h"
+
+namespace android {
+namespace perfprofd {
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+
+namespace {
+
+constexpr char kStoreFilePrefix[] = "perfprofd.aggregate.";
+constexpr char kDataFile[] = "perfprofd.aggregate.data";
+constexpr char kIndexFile[] = "perfprofd.aggregate.index";
+constexpr char kStringsFile[] = "perfprofd.aggregate.strings";
+
+constexpr char kDataMagic[8] = { 'P', 'P', 'D', 'A', 'G', 'G', 'D', '2' };
+constexpr char kIndexMagic[8] = { 'P', 'P', 'D', 'A', 'G', 'G', 'I', '1' };
+constexpr char kStringsMagic[8] = { 'P', 'P', 'D', 'A', 'G', 'G', 'S', '1' };
+
+constexpr uint64_t kInitialSlotCount = 1024;
+
+// Header of a stack in the data file, followed by key_size bytes of key.
+struct StackRecordHeader {
+  uint64_t hash;
+  uint64_t count;
+  uint32_t key_size;
+  uint32_t reserved;
+};
+
+struct StringsHeader {
+  char magic[8];
+  uint64_t generation;
+};
+
+// Stacks are keyed by the encoding of their frames.
+bool DecodeKey(const std::string& key, std::vector<Frame>* frames) {
+  return DecodeFrames(key.data(), key.data() + key.size(), frames);
+}
+
+// FNV-1a.
+uint64_t HashKey(const std::string& key) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : key) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+bool PreadFully(int fd, void* data, size_t size, uint64_t offset) {
+  uint8_t* pos = static_cast<uint8_t*>(data);
+  while (size > 0) {
+    ssize_t n = TEMP_FAILURE_RETRY(pread(fd, pos, size, offset));
+    if (n <= 0) {
+      return false;
+    }
+    pos += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+bool PwriteFully(int fd, const void* data, size_t size, uint64_t offset) {
+  const uint8_t* pos = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    ssize_t n = TEMP_FAILURE_RETRY(pwrite(fd, pos, size, offset));
+    if (n <= 0) {
+      PLOG(WARNING) << "Could not write profile aggregate";
+      return false;
+    }
+    pos += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// Smallest index keeping the load factor at or below one half.
+uint64_t SlotCountFor(size_t stacks) {
+  uint64_t slot_count = kInitialSlotCount;
+  while (slot_count < 2 * stacks) {
+    slot_count *= 2;
+  }
+  return slot_count;
+}
+
+uint64_t GetFileSize(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return 0;
+  }
+  return st.st_size;
+}
+
+}  // namespace
+
+struct ProfileAggregator::DataHeader {
+  char magic[8];
+  uint64_t generation;
+  uint64_t samples;
+  // Samples of stacks dropped by compaction.
+  uint64_t dropped_samples;
+  // Size of the data file as of this header. Stacks appended after it are
+  // dropped on Load, see Add.
+  uint64_t data_size;
+  uint32_t collections;
+  uint32_t reserved;
+};
+
+struct ProfileAggregator::IndexHeader {
+  char magic[8];
+  uint64_t generation;
+  uint64_t slot_count;  // A power of two.
+  uint64_t used;
+};
+
+struct ProfileAggregator::IndexSlot {
+  uint64_t hash;
+  uint64_t offset;  // Of the stack in the data file, 0 if the slot is empty.
+};
+
+struct ProfileAggregator::StackRecord {
+  uint64_t hash;
+  uint64_t count;
+  uint64_t offset;
+  std::string key;
+};
+
+ProfileAggregator::ProfileAggregator(const std::string& dir, size_t max_size)
+    : dir_(dir),
+      max_size_(max_size),
+      header_(new DataHeader()),
+      data_size_(0),
+      strings_size_(0),
+      index_map_(nullptr),
+      index_map_size_(0),
+      io_error_(false) {
+}
+
+ProfileAggregator::~ProfileAggregator() {
+  UnmapIndex();
+}
+
+bool ProfileAggregator::IsStoreFile(const std::string& name) {
+  return android::base::StartsWith(name, kStoreFilePrefix);
+}
+
+std::unique_ptr<ProfileAggregator> ProfileAggregator::Open(const std::string& dir,
+                                                           size_t max_size,
+                                                           std::string* error_msg) {
+  std::unique_ptr<ProfileAggregator> aggregator(new ProfileAggregator(dir, max_size));
+  auto open_file = [&](const char* name, unique_fd* fd) {
+    std::string path = dir + "/" + name;
+    fd->reset(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600)));
+    if (fd->get() == -1) {
+      *error_msg = StringPrintf("Could not open %s: %s", path.c_str(), strerror(errno));
+      return false;
+    }
+    return true;
+  };
+  if (!open_file(kDataFile, &aggregator->data_fd_) ||
+      !open_file(kIndexFile, &aggregator->index_fd_) ||
+      !open_file(kStringsFile, &aggregator->strings_fd_)) {
+    return nullptr;
+  }
+
+  if (!aggregator->Load()) {
+    // Missing, from an older format, or torn by a crash during compaction.
+    LOG(INFO) << "Starting new profile aggregate in " << dir;
+    if (!aggregator->Reset(1)) {
+      *error_msg = "Could not initialize profile aggregate in " + dir;
+      return nullptr;
+    }
+  }
+  return aggregator;
+}
+
+bool ProfileAggregator::Load() {
+  const uint64_t file_size = GetFileSize(data_fd_.get());
+  if (file_size < sizeof(DataHeader) ||
+      !PreadFully(data_fd_.get(), header_.get(), sizeof(DataHeader), 0) ||
+      memcmp(header_->magic, kDataMagic, sizeof(kDataMagic)) != 0 ||
+      header_->data_size < sizeof(DataHeader) ||
+      header_->data_size > file_size) {
+    return false;
+  }
+  data_size_ = header_->data_size;
+
+  std::string strings(GetFileSize(strings_fd_.get()), '\0');
+  StringsHeader strings_header;
+  if (strings.size() < sizeof(strings_header) ||
+      !PreadFully(strings_fd_.get(), &strings[0], strings.size(), 0)) {
+    return false;
+  }
+  memcpy(&strings_header, strings.data(), sizeof(strings_header));
+  if (memcmp(strings_header.magic, kStringsMagic, sizeof(kStringsMagic)) != 0 ||
+      strings_header.generation != header_->generation) {
+    return false;
+  }
+  strings_.clear();
+  string_ids_.clear();
+  size_t pos = sizeof(strings_header);
+  while (pos + sizeof(uint32_t) <= strings.size()) {
+    uint32_t size;
+    memcpy(&size, strings.data() + pos, sizeof(size));
+    if (size > strings.size() - pos - sizeof(size)) {
+      break;
+    }
+    pos += sizeof(size);
+    string_ids_.emplace(strings.substr(pos, size), strings_.size());
+    strings_.push_back(strings.substr(pos, size));
+    pos += size;
+  }
+  // Drop a string torn by a crash.
+  strings_size_ = pos;
+
+  IndexHeader index_header;
+  uint64_t index_size = GetFileSize(index_fd_.get());
+  if (file_size == data_size_ &&
+      index_size >= sizeof(index_header) &&
+      PreadFully(index_fd_.get(), &index_header, sizeof(index_header), 0) &&
+      memcmp(index_header.magic, kIndexMagic, sizeof(kIndexMagic)) == 0 &&
+      index_header.generation == header_->generation &&
+      index_header.slot_count != 0 &&
+      (index_header.slot_count & (index_header.slot_count - 1)) == 0 &&
+      index_size == sizeof(IndexHeader) + index_header.slot_count * sizeof(IndexSlot)) {
+    return MapIndex();
+  }
+
+  // A crash left stacks past the last data header, which the index may point
+  // to, or a partly written index. Drop the former and index the committed
+  // stacks again.
+  LOG(INFO) << "Rebuilding profile aggregate index";
+  std::vector<StackRecord> records;
+  return ftruncate(data_fd_.get(), data_size_) == 0 &&
+      ReadStacks(&records) &&
+      WriteIndex(SlotCountFor(records.size()), header_->generation, records);
+}
+
+bool ProfileAggregator::Reset(uint64_t generation) {
+  UnmapIndex();
+  strings_.clear();
+  string_ids_.clear();
+  io_error_ = false;
+
+  StringsHeader strings_header;
+  memcpy(strings_header.magic, kStringsMagic, sizeof(kStringsMagic));
+  strings_header.generation = generation;
+  if (ftruncate(strings_fd_.get(), 0) != 0 ||
+      !PwriteFully(strings_fd_.get(), &strings_header, sizeof(strings_header), 0)) {
+    return false;
+  }
+  strings_size_ = sizeof(strings_header);
+
+  if (!WriteIndex(kInitialSlotCount, generation, std::vector<StackRecord>())) {
+    return false;
+  }
+
+  *header_ = DataHeader();
+  memcpy(header_->magic, kDataMagic, sizeof(kDataMagic));
+  header_->generation = generation;
+  if (ftruncate(data_fd_.get(), 0) != 0) {
+    return false;
+  }
+  data_size_ = sizeof(DataHeader);
+  return WriteDataHeader();
+}
+
+bool ProfileAggregator::MapIndex() {
+  index_map_size_ = GetFileSize(index_fd_.get());
+  void* map = mmap(nullptr, index_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   index_fd_.get(), 0);
+  if (map == MAP_FAILED) {
+    PLOG(WARNING) << "Could not map profile aggregate index";
+    index_map_size_ = 0;
+    return false;
+  }
+  index_map_ = map;
+  return true;
+}
+
+void ProfileAggregator::UnmapIndex() {
+  if (index_map_ != nullptr) {
+    munmap(index_map_, index_map_size_);
+    index_map_ = nullptr;
+    index_map_size_ = 0;
+  }
+}
+
+bool ProfileAggregator::WriteIndex(uint64_t slot_count,
+                                   uint64_t generation,
+                                   const std::vector<StackRecord>& records) {
+  UnmapIndex();
+  // Truncating first zeroes all slots, and the magic, which is written last
+  // so that Load doesn't take a partly written index.
+  if (ftruncate(index_fd_.get(), 0) != 0 ||
+      ftruncate(index_fd_.get(), sizeof(IndexHeader) + slot_count * sizeof(IndexSlot)) != 0 ||
+      !MapIndex()) {
+    return false;
+  }
+
+  IndexHeader* index = static_cast<IndexHeader*>(index_map_);
+  IndexSlot* slots = reinterpret_cast<IndexSlot*>(index + 1);
+  const uint64_t mask = slot_count - 1;
+  for (const StackRecord& record : records) {
+    uint64_t i = record.hash & mask;
+    while (slots[i].offset != 0) {
+      i = (i + 1) & mask;
+    }
+    slots[i].hash = record.hash;
+    slots[i].offset = record.offset;
+  }
+  index->generation = generation;
+  index->slot_count = slot_count;
+  index->used = records.size();
+  memcpy(index->magic, kIndexMagic, sizeof(kIndexMagic));
+  return true;
+}
+
+bool ProfileAggregator::WriteDataHeader() {
+  header_->data_size = data_size_;
+  return PwriteFully(data_fd_.get(), header_.get(), sizeof(DataHeader), 0);
+}
+
+uint32_t ProfileAggregator::InternString(const std::string& str) {
+  auto it = string_ids_.find(str);
+  if (it != string_ids_.end()) {
+    return it->second;
+  }
+  uint32_t size = static_cast<uint32_t>(str.size());
+  std::string entry(reinterpret_cast<const char*>(&size), sizeof(size));
+  entry += str;
+  if (!PwriteFully(strings_fd_.get(), entry.data(), entry.size(), strings_size_)) {
+    io_error_ = true;
+  }
+  strings_size_ += entry.size();
+  uint32_t id = static_cast<uint32_t>(strings_.size());
+  strings_.push_back(str);
+  string_ids_.emplace(str, id);
+  return id;
+}
+
+uint32_t ProfileAggregator::collections() const {
+  return header_->collections;
+}
+
+bool ProfileAggregator::AddStack(const std::string& key, uint64_t count) {
+  const uint64_t hash = HashKey(key);
+  IndexHeader* index = static_cast<IndexHeader*>(index_map_);
+  IndexSlot* slots = reinterpret_cast<IndexSlot*>(index + 1);
+  const uint64_t mask = index->slot_count - 1;
+
+  uint64_t i = hash & mask;
+  std::string stored_key;
+  for (; slots[i].offset != 0; i = (i + 1) & mask) {
+    const IndexSlot& slot = slots[i];
+    if (slot.hash != hash || slot.offset + sizeof(StackRecordHeader) + key.size() > data_size_) {
+      continue;
+    }
+    StackRecordHeader record;
+    if (!PreadFully(data_fd_.get(), &record, sizeof(record), slot.offset)) {
+      return false;
+    }
+    if (record.key_size != key.size()) {
+      continue;
+    }
+    stored_key.resize(key.size());
+    if (!PreadFully(data_fd_.get(), &stored_key[0], key.size(), slot.offset + sizeof(record))) {
+      return false;
+    }
+    if (stored_key != key) {
+      continue;
+    }
+    // Known stack, update its count in place.
+    record.count += count;
+    return PwriteFully(data_fd_.get(), &record.count, sizeof(record.count),
+                       slot.offset + offsetof(StackRecordHeader, count));
+  }
+
+  // New stack, append it.
+  StackRecordHeader record = { hash, count, static_cast<uint32_t>(key.size()), 0 };
+  std::string entry(reinterpret_cast<const char*>(&record), sizeof(record));
+  entry += key;
+  const uint64_t offset = data_size_;
+  if (!PwriteFully(data_fd_.get(), entry.data(), entry.size(), offset)) {
+    return false;
+  }
+  data_size_ += entry.size();
+  slots[i].hash = hash;
+  slots[i].offset = offset;
+  index->used++;
+
+  // Keep the load factor at or below one half.
+  if (index->used * 2 > index->slot_count) {
+    std::vector<StackRecord> records;
+    return ReadStacks(&records) &&
+        WriteIndex(index->slot_count * 2, header_->generation, records);
+  }
+  return true;
+}
+
+bool ProfileAggregator::ReadStacks(std::vector<StackRecord>* records) {
+  records->clear();
+  std::string data(data_size_ - sizeof(DataHeader), '\0');
+  if (!data.empty() && !PreadFully(data_fd_.get(), &data[0], data.size(), sizeof(DataHeader))) {
+    return false;
+  }
+  size_t pos = 0;
+  while (pos + sizeof(StackRecordHeader) <= data.size()) {
+    StackRecordHeader header;
+    memcpy(&header, data.data() + pos, sizeof(header));
+    if (header.key_size > data.size() - pos - sizeof(header)) {
+      break;
+    }
+    StackRecord record;
+    record.hash = header.hash;
+    record.count = header.count;
+    record.offset = sizeof(DataHeader) + pos;
+    record.key = data.substr(pos + sizeof(header), header.key_size);
+    records->push_back(std::move(record));
+    pos += sizeof(header) + header.key_size;
+  }
+  return true;
+}
+
+bool ProfileAggregator::RemapStrings(std::vector<StackRecord>* records,
+                                     std::vector<std::string>* strings) {
+  constexpr uint32_t kUnmapped = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> new_ids(strings_.size(), kUnmapped);
+  auto remap = [&](uint32_t id) {
+    if (new_ids[id] == kUnmapped) {
+      new_ids[id] = static_cast<uint32_t>(strings->size());
+      strings->push_back(strings_[id]);
+    }
+    return new_ids[id];
+  };
+
+  strings->clear();
+  std::vector<Frame> frames;
+  for (StackRecord& record : *records) {
+    if (!DecodeKey(record.key, &frames)) {
+      return false;
+    }
+    for (Frame& frame : frames) {
+      if (frame.dso >= strings_.size() || frame.symbol > strings_.size()) {
+        return false;
+      }
+      frame.dso = remap(frame.dso);
+      if (frame.symbol != 0) {
+        frame.symbol = remap(frame.symbol - 1) + 1;
+      }
+    }
+    record.key.clear();
+    EncodeFrames(frames, &record.key);
+    record.hash = HashKey(record.key);
+  }
+  return true;
+}
+
+bool ProfileAggregator::Compact() {
+  std::vector<StackRecord> records;
+  if (!ReadStacks(&records)) {
+    return false;
+  }
+
+  // Keep the most sampled stacks in half the budget, so that compaction
+  // doesn't run again right away. The budget covers the whole store: the
+  // stacks, the strings they reference once renumbered and the index.
+  std::stable_sort(records.begin(), records.end(), [](const StackRecord& a, const StackRecord& b) {
+    return a.count > b.count;
+  });
+  auto index_size = [](size_t stacks) {
+    return sizeof(IndexHeader) + SlotCountFor(stacks) * sizeof(IndexSlot);
+  };
+  const size_t budget = max_size_ / 2;
+  size_t size = sizeof(DataHeader) + sizeof(StringsHeader) + index_size(0);
+
+  // Strings are renumbered in order of first use by the kept stacks, as
+  // RemapStrings does, so that each stack is measured as it will be written.
+  constexpr uint32_t kUnmapped = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> new_ids(strings_.size(), kUnmapped);
+  std::vector<std::string> strings;
+  // Strings first used by the stack being measured.
+  std::vector<uint32_t> added;
+  std::vector<Frame> frames;
+  std::string key;
+  size_t kept = 0;
+  for (; kept < records.size(); ++kept) {
+    StackRecord& record = records[kept];
+    if (!DecodeKey(record.key, &frames)) {
+      return false;
+    }
+    size_t stack_size = index_size(kept + 1) - index_size(kept);
+    added.clear();
+    auto remap = [&](uint32_t id) {
+      if (new_ids[id] == kUnmapped) {
+        new_ids[id] = static_cast<uint32_t>(strings.size() + added.size());
+        added.push_back(id);
+        stack_size += sizeof(uint32_t) + strings_[id].size();
+      }
+      return new_ids[id];
+    };
+    for (Frame& frame : frames) {
+      if (frame.dso >= strings_.size() || frame.symbol > strings_.size()) {
+        return false;
+      }
+      frame.dso = remap(frame.dso);
+      if (frame.symbol != 0) {
+        frame.symbol = remap(frame.symbol - 1) + 1;
+      }
+    }
+    key.clear();
+    EncodeFrames(frames, &key);
+    stack_size += sizeof(StackRecordHeader) + key.size();
+    if (size + stack_size > budget) {
+      break;
+    }
+    size += stack_size;
+    for (uint32_t id : added) {
+      strings.push_back(strings_[id]);
+    }
+    record.key = key;
+    record.hash = HashKey(key);
+  }
+  for (size_t i = kept; i < records.size(); ++i) {
+    header_->dropped_samples += records[i].count;
+  }
+  records.resize(kept);
+  LOG(INFO) << "Compacted profile aggregate to " << kept << " stacks and " << strings.size()
+            << " strings, " << header_->dropped_samples << " samples dropped so far";
+
+  // Rewrite the store with a new generation. A crash in between leaves an
+  // empty store: the data header of the new generation is only committed
+  // with its stacks, after the strings and the index.
+  const uint64_t generation = header_->generation + 1;
+  DataHeader header = *header_;
+  if (!Reset(generation)) {
+    return false;
+  }
+  for (const std::string& str : strings) {
+    InternString(str);
+  }
+  std::string data;
+  for (StackRecord& record : records) {
+    record.offset = sizeof(DataHeader) + data.size();
+    StackRecordHeader record_header = { record.hash, record.count,
+                                        static_cast<uint32_t>(record.key.size()), 0 };
+    data.append(reinterpret_cast<const char*>(&record_header), sizeof(record_header));
+    data += record.key;
+  }
+  if (io_error_ ||
+      !PwriteFully(data_fd_.get(), data.data(), data.size(), sizeof(DataHeader)) ||
+      !WriteIndex(SlotCountFor(records.size()), generation, records)) {
+    return false;
+  }
+  data_size_ = sizeof(DataHeader) + data.size();
+  header.generation = generation;
+  *header_ = header;
+  return WriteDataHeader();
+}
+
+bool ProfileAggregator::Add(const PerfprofdRecord& record) {
+  FrameResolver resolver(record, [this](const std::string& str) { return InternString(str); });
+
+  // Count the stacks of this profile in memory first, so that the store is
+  // touched once per distinct stack.
+  std::unordered_map<std::string, uint64_t> stacks;
+  uint64_t samples = 0;
+  std::vector<Frame> frames;
+  std::string key;
+  for (const auto& event : record.perf_data().events()) {
+    if (!event.has_sample_event()) {
+      resolver.ProcessEvent(event);
+      continue;
+    }
+    resolver.ResolveSample(event.sample_event(), &frames);
+    if (frames.empty()) {
+      continue;
+    }
+    key.clear();
+    EncodeFrames(frames, &key);
+    stacks[key]++;
+    samples++;
+  }
+
+  for (const auto& stack : stacks) {
+    if (!AddStack(stack.first, stack.second)) {
+      io_error_ = true;
+      break;
+    }
+  }
+  if (io_error_) {
+    // The store can't be trusted anymore, start over.
+    Reset(header_->generation + 1);
+    return false;
+  }
+
+  // Commit the collection. A crash before this drops the stacks appended
+  // since the last commit, but keeps the counts already added in place to
+  // known stacks.
+  header_->collections++;
+  header_->samples += samples;
+  if (!WriteDataHeader()) {
+    return false;
+  }
+  if (data_size_ + strings_size_ + index_map_size_ > max_size_) {
+    return Compact();
+  }
+  return true;
+}
+
+bool ProfileAggregator::Emit(PerfprofdRecord* record) {
+  std::vector<StackRecord> records;
+  std::vector<std::string> strings;
+  if (!ReadStacks(&records) || !RemapStrings(&records, &strings)) {
+    return false;
+  }
+
+  PerfprofdRecord_AggregatedProfile* aggregate = record->mutable_aggregated_profile();
+  for (const std::string& str : strings) {
+    aggregate->add_strings(str);
+  }
+  std::vector<Frame> frames;
+  for (const StackRecord& stack_record : records) {
+    DecodeKey(stack_record.key, &frames);
+    PerfprofdRecord_AggregatedProfile_Stack* stack = aggregate->add_stacks();
+    stack->set_count(stack_record.count);
+    for (const Frame& frame : frames) {
+      PerfprofdRecord_AggregatedProfile_Frame* out_frame = stack->add_frames();
+      out_frame->set_dso(frame.dso);
+      out_frame->set_offset(frame.offset);
+      if (frame.symbol != 0) {
+        out_frame->set_symbol(frame.symbol);
+      }
+    }
+  }
+  aggregate->set_collections(header_->collections);
+  aggregate->set_samples(header_->samples);
+  aggregate->set_dropped_samples(header_->dropped_samples);
+
+  return Reset(header_->generation + 1);
+}
+
+}  // namespace perfprofd
+}  // namespace android
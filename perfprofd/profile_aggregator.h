@@ -0,0 +1,116 @@
+/*
+ *
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_EXTRAS_PERFPROFD_PROFILE_AGGREGATOR_H_
+#define SYSTEM_EXTRAS_PERFPROFD_PROFILE_AGGREGATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "perfprofd_record-fwd.h"
+
+namespace android {
+namespace perfprofd {
+
+// Aggregates profiles of successive collections on disk, so that one compact
+// profile can be handed out for many collections.
+//
+// Samples are counted per stack, a sequence of (dso, file offset, symbol)
+// frames with interned strings. Stacks live in an append-only data file and
+// are found through an open-addressing hash index file, so that neither grows
+// the daemon's memory. When the data outgrows its size budget, the store is
+// compacted by dropping the least sampled stacks and unreferenced strings.
+//
+// The data header records the size of the data file at the end of each Add.
+// After a crash, Open drops the stacks appended past it and rebuilds the
+// index, so that no stack is seen twice or left out of the index.
+class ProfileAggregator {
+ public:
+  static std::unique_ptr<ProfileAggregator> Open(const std::string& dir,
+                                                 size_t max_size,
+                                                 std::string* error_msg);
+  ~ProfileAggregator();
+
+  // Merge the samples of a collected profile into the aggregate.
+  bool Add(const PerfprofdRecord& record);
+
+  // Number of collections merged since the last Emit.
+  uint32_t collections() const;
+
+  // Store the aggregated profile in record and start a new aggregate.
+  bool Emit(PerfprofdRecord* record);
+
+  // Whether a file in the destination directory belongs to the store.
+  static bool IsStoreFile(const std::string& name);
+
+ private:
+  struct DataHeader;
+  struct IndexHeader;
+  struct IndexSlot;
+  struct StackRecord;
+
+  ProfileAggregator(const std::string& dir, size_t max_size);
+
+  bool Load();
+  bool Reset(uint64_t generation);
+  bool MapIndex();
+  void UnmapIndex();
+  bool WriteIndex(uint64_t slot_count,
+                  uint64_t generation,
+                  const std::vector<StackRecord>& records);
+  bool WriteDataHeader();
+
+  uint32_t InternString(const std::string& str);
+  bool AddStack(const std::string& key, uint64_t count);
+  bool ReadStacks(std::vector<StackRecord>* records);
+  // Renumber the strings used by records, dropping unused ones.
+  bool RemapStrings(std::vector<StackRecord>* records, std::vector<std::string>* strings);
+  bool Compact();
+
+  const std::string dir_;
+  const size_t max_size_;
+
+  android::base::unique_fd data_fd_;
+  android::base::unique_fd index_fd_;
+  android::base::unique_fd strings_fd_;
+
+  std::unique_ptr<DataHeader> header_;
+  uint64_t data_size_;
+  uint64_t strings_size_;
+
+  // The index file, mapped.
+  void* index_map_;
+  size_t index_map_size_;
+
+  std::vector<std::string> strings_;
+  std::unordered_map<std::string, uint32_t> string_ids_;
+
+  // Set when a write failed, the store is then started over.
+  bool io_error_;
+};
+
+}  // namespace perfprofd
+}  // namespace android
+
+#endif  // SYSTEM_EXTRAS_PERFPROFD_PROFILE_AGGREGATOR_H_
@@ -133,9 +133,19 @@ class SqliteReader(object):
                 kernel_sym_id = i
                 break
 
+        # Databases written by perfprofd_aggregate have one sample per distinct
+        # stack, weighted by samples.count.
+        self._c.execute('pragma table_info(samples)')
+        has_count = any(row[1] == 'count' for row in self._c.fetchall())
+
         print 'Reading samples'
-        self._c.execute('''select sample_id, depth, dso_id, sym_id from stacks
-                           order by sample_id asc, depth desc''')
+        if has_count:
+            self._c.execute('''select sample_id, depth, dso_id, sym_id, count
+                               from stacks join samples on stacks.sample_id = samples.id
+                               order by sample_id asc, depth desc''')
+        else:
+            self._c.execute('''select sample_id, depth, dso_id, sym_id, 1 from stacks
+                               order by sample_id asc, depth desc''')
 
         last_sample_id = None
         chain = None
@@ -153,7 +163,7 @@ class SqliteReader(object):
                     last_sample_id = row[0]
                     chain = self.root
                 chain = chain.add(row[2], row[3])
-                chain.count = chain.count + 1
+                chain.count = chain.count + row[4]
 
             count = count + len(rows)
             if limit is not None and count >= limit:
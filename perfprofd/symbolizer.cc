@@ -17,9 +17,15 @@
 
 #include "symbolizer.h"
 
-#include <map>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <limits>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include <android-base/logging.h>
 
@@ -30,62 +36,288 @@ namespace perfprofd {
 
 namespace {
 
-struct SimpleperfSymbolizer : public Symbolizer {
-  // For simplicity, we assume non-overlapping symbols.
+// Symbols of a dso, in sorted flat arrays instead of map nodes, so that caching
+// them is cheap. For simplicity, we assume non-overlapping symbols.
+struct DsoSymbols {
+  std::vector<uint64_t> addrs;
+  std::vector<uint32_t> lengths;
+  std::vector<uint32_t> name_offsets;
+  std::string names;  // Concatenated, NUL-terminated symbol names.
+
+  // Return the name of the symbol covering address, or nullptr.
+  const char* Find(uint64_t address) const {
+    auto upper_bound = std::upper_bound(addrs.begin(), addrs.end(), address);
+    if (upper_bound == addrs.begin()) {
+      // Nope, not in the map.
+      return nullptr;
+    }
+    size_t index = (upper_bound - addrs.begin()) - 1;
+    if (addrs[index] + lengths[index] > address) {
+      // This element covers the given address, return its name.
+      return names.c_str() + name_offsets[index];
+    }
+    return nullptr;
+  }
+
+  // Look up sorted addresses in one sweep. Instead of a binary search over all
+  // symbols for each address, gallop forward from the previous match.
+  void FindSorted(const std::vector<uint64_t>& addresses, std::vector<std::string>* names_out) const {
+    names_out->clear();
+    names_out->reserve(addresses.size());
+    size_t pos = 0;  // All symbols before pos start at or below the current address.
+    for (uint64_t address : addresses) {
+      size_t lo = pos;
+      size_t hi = lo;
+      for (size_t step = 1; hi < addrs.size() && addrs[hi] <= address; step *= 2) {
+        lo = hi + 1;
+        hi = lo + step;
+      }
+      hi = std::min(hi, addrs.size());
+      pos = std::upper_bound(addrs.begin() + lo, addrs.begin() + hi, address) - addrs.begin();
+      if (pos > 0 && addrs[pos - 1] + lengths[pos - 1] > address) {
+        names_out->emplace_back(names.c_str() + name_offsets[pos - 1]);
+      } else {
+        names_out->emplace_back();
+      }
+    }
+  }
+
+  size_t MemoryUsage() const {
+    return addrs.capacity() * sizeof(uint64_t) + lengths.capacity() * sizeof(uint32_t) +
+        name_offsets.capacity() * sizeof(uint32_t) + names.capacity();
+  }
+};
+
+DsoSymbols LoadDsoSymbols(const std::string& dso) {
   struct Symbol {
-    std::string name;
-    uint64_t length;
+    uint64_t addr;
+    uint32_t length;
+    uint32_t name_offset;
+  };
+  std::vector<Symbol> symbols;
+  DsoSymbols data;
+  auto callback = [&](const ElfFileSymbol& sym) {
+    Symbol symbol;
+    symbol.addr = sym.vaddr;
+    symbol.length = static_cast<uint32_t>(
+        std::min<uint64_t>(sym.len, std::numeric_limits<uint32_t>::max()));
+    symbol.name_offset = static_cast<uint32_t>(data.names.size());
+    data.names.append(sym.name);
+    data.names.push_back('\0');
+    symbols.push_back(symbol);
   };
-  using SymbolMap = std::map<uint64_t, Symbol>;
+  ElfStatus status = ParseSymbolsFromElfFile(dso, BuildId(), callback);
+  if (status != ElfStatus::NO_ERROR) {
+    LOG(WARNING) << "Could not parse dso " << dso << ": " << status;
+  }
+
+  // Like inserting into a map, the first symbol at an address wins.
+  std::stable_sort(symbols.begin(), symbols.end(), [](const Symbol& a, const Symbol& b) {
+    return a.addr < b.addr;
+  });
+  auto last = std::unique(symbols.begin(), symbols.end(), [](const Symbol& a, const Symbol& b) {
+    return a.addr == b.addr;
+  });
+  symbols.erase(last, symbols.end());
 
+  data.addrs.reserve(symbols.size());
+  data.lengths.reserve(symbols.size());
+  data.name_offsets.reserve(symbols.size());
+  for (const Symbol& symbol : symbols) {
+    data.addrs.push_back(symbol.addr);
+    data.lengths.push_back(symbol.length);
+    data.name_offsets.push_back(symbol.name_offset);
+  }
+  data.names.shrink_to_fit();
+  return data;
+}
+
+struct SimpleperfSymbolizer : public Symbolizer {
   std::string Decode(const std::string& dso, uint64_t address) override {
-    auto it = dsos.find(dso);
-    if (it == dsos.end()) {
-      LoadDso(dso);
-      it = dsos.find(dso);
-      DCHECK(it != dsos.end());
+    const char* name = GetDsoSymbols(dso).Find(address);
+    return name != nullptr ? name : "";
+  }
+
+  void DecodeBatch(const std::string& dso,
+                   const std::vector<uint64_t>& addresses,
+                   std::vector<std::string>* symbols) override {
+    GetDsoSymbols(dso).FindSorted(addresses, symbols);
+  }
+
+  bool IsThreadSafe() const override {
+    return true;
+  }
+
+  const DsoSymbols& GetDsoSymbols(const std::string& dso) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = dsos.find(dso);
+      if (it != dsos.end()) {
+        return it->second;
+      }
     }
+    // Parse without holding the lock, so that different dsos load in parallel.
+    // Entries are never removed, so references stay valid.
+    DsoSymbols symbols = LoadDsoSymbols(dso);
+    std::lock_guard<std::mutex> lock(mutex);
+    return dsos.emplace(dso, std::move(symbols)).first->second;
+  }
+
+  bool GetMinExecutableVAddr(const std::string& dso, uint64_t* addr) override {
+    ElfStatus status = ReadMinExecutableVirtualAddressFromElfFile(dso, BuildId(), addr);
+    return status == ElfStatus::NO_ERROR;
+  }
+
+  std::mutex mutex;
+  std::unordered_map<std::string, DsoSymbols> dsos;
+};
 
-    const SymbolMap& map = it->second;
-    if (map.empty()) {
-      return "";
+struct CachingSimpleperfSymbolizer : public Symbolizer {
+  // Identifies the version of a file a cache entry was loaded from.
+  struct FileStamp {
+    uint64_t ino = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+
+    bool operator==(const FileStamp& other) const {
+      return ino == other.ino && size == other.size && mtime_ns == other.mtime_ns;
     }
-    auto upper_bound = map.upper_bound(address);
-    if (upper_bound == map.begin()) {
-      // Nope, not in the map.
-      return "";
+  };
+
+  // What lookups need from an entry. The symbols are shared, so that a dso
+  // evicted by one thread stays alive while another thread still sweeps it.
+  struct DsoInfo {
+    bool has_min_vaddr = false;
+    uint64_t min_vaddr = 0;
+    std::shared_ptr<const DsoSymbols> symbols;
+  };
+
+  struct Entry {
+    FileStamp stamp;
+    DsoInfo info;
+    size_t bytes = 0;
+    uint64_t checked_generation = 0;
+    std::list<std::string>::iterator lru_it;
+  };
+
+  explicit CachingSimpleperfSymbolizer(size_t memory_budget_in) : memory_budget(memory_budget_in) {
+  }
+
+  std::string Decode(const std::string& dso, uint64_t address) override {
+    const char* name = GetDsoInfo(dso).symbols->Find(address);
+    return name != nullptr ? name : "";
+  }
+
+  void DecodeBatch(const std::string& dso,
+                   const std::vector<uint64_t>& addresses,
+                   std::vector<std::string>* symbols) override {
+    GetDsoInfo(dso).symbols->FindSorted(addresses, symbols);
+  }
+
+  bool GetMinExecutableVAddr(const std::string& dso, uint64_t* addr) override {
+    DsoInfo info = GetDsoInfo(dso);
+    *addr = info.min_vaddr;
+    return info.has_min_vaddr;
+  }
+
+  bool IsThreadSafe() const override {
+    return true;
+  }
+
+  void StartConversion() override {
+    std::lock_guard<std::mutex> lock(mutex);
+    // Files are checked for changes once per conversion.
+    generation++;
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.evictions = 0;
+  }
+
+  bool GetCacheStats(CacheStats* out) const override {
+    std::lock_guard<std::mutex> lock(mutex);
+    *out = stats;
+    out->bytes = total_bytes;
+    return true;
+  }
+
+  static FileStamp GetFileStamp(const std::string& dso) {
+    FileStamp stamp;
+    struct stat st;
+    if (stat(dso.c_str(), &st) == 0) {
+      stamp.ino = st.st_ino;
+      stamp.size = st.st_size;
+      stamp.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
     }
+    return stamp;
+  }
 
-    upper_bound--;
-    if (upper_bound->first + upper_bound->second.length > address) {
-      // This element covers the given address, return its name.
-      return upper_bound->second.name;
+  DsoInfo GetDsoInfo(const std::string& dso) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(dso);
+      if (it != entries.end()) {
+        Entry* entry = &it->second;
+        lru.splice(lru.begin(), lru, entry->lru_it);
+        if (entry->checked_generation == generation) {
+          return entry->info;
+        }
+        entry->checked_generation = generation;
+        if (GetFileStamp(dso) == entry->stamp) {
+          stats.hits++;
+          return entry->info;
+        }
+        // The file changed since it was cached.
+        Remove(it);
+      }
+      stats.misses++;
     }
 
-    return "";
-  }
+    // Parse without holding the lock, so that different dsos load in parallel.
+    Entry entry;
+    entry.stamp = GetFileStamp(dso);
+    entry.info.has_min_vaddr =
+        ReadMinExecutableVirtualAddressFromElfFile(dso, BuildId(), &entry.info.min_vaddr) ==
+        ElfStatus::NO_ERROR;
+    auto symbols = std::make_shared<DsoSymbols>(LoadDsoSymbols(dso));
+    entry.bytes = symbols->MemoryUsage() + dso.size() * 2 + sizeof(Entry);
+    entry.info.symbols = std::move(symbols);
 
-  void LoadDso(const std::string& dso) {
-    SymbolMap data;
-    auto callback = [&data](const ElfFileSymbol& sym) {
-      Symbol symbol;
-      symbol.name = sym.name;
-      symbol.length = sym.len;
-      data.emplace(sym.vaddr, std::move(symbol));
-    };
-    ElfStatus status = ParseSymbolsFromElfFile(dso, BuildId(), callback);
-    if (status != ElfStatus::NO_ERROR) {
-      LOG(WARNING) << "Could not parse dso " << dso << ": " << status;
+    std::lock_guard<std::mutex> lock(mutex);
+    entry.checked_generation = generation;
+    auto it = entries.find(dso);
+    if (it != entries.end()) {
+      // Another thread loaded the same dso meanwhile.
+      return it->second.info;
     }
-    dsos.emplace(dso, std::move(data));
+    lru.push_front(dso);
+    entry.lru_it = lru.begin();
+    total_bytes += entry.bytes;
+    DsoInfo result = entry.info;
+    entries.emplace(dso, std::move(entry));
+
+    // Evict least recently used dsos, but always keep the one just loaded.
+    while (total_bytes > memory_budget && lru.size() > 1) {
+      Remove(entries.find(lru.back()));
+      stats.evictions++;
+    }
+    return result;
   }
 
-  bool GetMinExecutableVAddr(const std::string& dso, uint64_t* addr) override {
-    ElfStatus status = ReadMinExecutableVirtualAddressFromElfFile(dso, BuildId(), addr);
-    return status == ElfStatus::NO_ERROR;
+  void Remove(std::unordered_map<std::string, Entry>::iterator it) {
+    total_bytes -= it->second.bytes;
+    lru.erase(it->second.lru_it);
+    entries.erase(it);
   }
 
-  std::unordered_map<std::string, SymbolMap> dsos;
+  const size_t memory_budget;
+  // Guards all members below.
+  mutable std::mutex mutex;
+  uint64_t generation = 1;
+  size_t total_bytes = 0;
+  CacheStats stats;
+  // Most recently used dso first.
+  std::list<std::string> lru;
+  std::unordered_map<std::string, Entry> entries;
 };
 
 }  // namespace
@@ -94,5 +326,8 @@ std::unique_ptr<Symbolizer> CreateELFSymbolizer() {
   return std::unique_ptr<Symbolizer>(new SimpleperfSymbolizer());
 }
 
-}  // namespace perfprofd
+std::unique_ptr<Symbolizer> CreateCachingELFSymbolizer(size_t memory_budget) {
+  return std::unique_ptr<Symbolizer>(new CachingSimpleperfSymbolizer(memory_budget));
+}
 
+}  // namespace perfprofd
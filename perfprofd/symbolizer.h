@@ -19,17 +19,57 @@
 #define SYSTEM_EXTRAS_PERFPROFD_SYMBOLIZER_H_
 
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace perfprofd {
 
 struct Symbolizer {
+  // Statistics of a symbolizer caching symbols across conversions. Counters
+  // are for the current conversion, bytes is the memory used by the cache.
+  struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes = 0;
+  };
+
   virtual ~Symbolizer() {}
   virtual std::string Decode(const std::string& dso, uint64_t address) = 0;
   virtual bool GetMinExecutableVAddr(const std::string& dso, uint64_t* addr) = 0;
+
+  // Decode sorted addresses of a dso, filling symbols with one (possibly empty)
+  // name per address.
+  virtual void DecodeBatch(const std::string& dso,
+                           const std::vector<uint64_t>& addresses,
+                           std::vector<std::string>* symbols) {
+    symbols->clear();
+    symbols->reserve(addresses.size());
+    for (uint64_t address : addresses) {
+      symbols->push_back(Decode(dso, address));
+    }
+  }
+  // Returns true if all functions may be called concurrently from multiple threads.
+  virtual bool IsThreadSafe() const {
+    return false;
+  }
+
+  // Called before each conversion using this symbolizer.
+  virtual void StartConversion() {}
+  // Returns false if the symbolizer doesn't cache symbols.
+  virtual bool GetCacheStats(CacheStats*) const {
+    return false;
+  }
 };
 
 std::unique_ptr<Symbolizer> CreateELFSymbolizer();
 
+// Create an ELF symbolizer meant to live as long as the daemon. Parsed symbols
+// are kept across conversions, keyed by path and checked against the file's
+// inode, size and mtime once per conversion. Least recently used dsos are
+// dropped when the cache grows over memory_budget bytes.
+std::unique_ptr<Symbolizer> CreateCachingELFSymbolizer(size_t memory_budget);
+
 }  // namespace perfprofd
 
 #endif  // SYSTEM_EXTRAS_PERFPROFD_SYMBOLIZER_H_
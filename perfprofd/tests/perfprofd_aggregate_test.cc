@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+#include <sqlite3.h>
+#include <zlib.h>
+
+#include "aggregate_profiles.h"
+
+#include "perfprofd_record.pb.h"
+
+using android::perfprofd::Aggregate;
+using android::perfprofd::AggregateFiles;
+using android::perfprofd::AggregateOptions;
+using android::perfprofd::PerfprofdRecord;
+
+class AggregateProfilesTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    std::string data = MakeProfile().SerializeAsString();
+    ASSERT_TRUE(android::base::WriteStringToFile(data, Path("profile")));
+    gzFile gz = gzopen(Path("profile.gz").c_str(), "wb");
+    ASSERT_TRUE(gz != nullptr);
+    ASSERT_EQ(static_cast<int>(data.size()), gzwrite(gz, data.data(), data.size()));
+    ASSERT_EQ(Z_OK, gzclose(gz));
+  }
+
+  // A profile of an app with two threads and a forked child, with kernel
+  // frames, frames in libfoo.so whose symbol 'foo' covers the mapped
+  // addresses 0x1000-0x10ff, frames in libbar.so without symbols, an
+  // unmapped frame, and stacks aggregated on the device.
+  static PerfprofdRecord MakeProfile() {
+    PerfprofdRecord record;
+    auto* perf_data = record.mutable_perf_data();
+    auto add_mmap = [&](uint32_t pid, uint64_t start, uint64_t pgoff, const char* filename) {
+      auto* mmap_event = perf_data->add_events()->mutable_mmap_event();
+      mmap_event->set_pid(pid);
+      mmap_event->set_start(start);
+      mmap_event->set_len(0x1000);
+      mmap_event->set_pgoff(pgoff);
+      mmap_event->set_filename(filename);
+    };
+    auto add_comm = [&](uint32_t tid, const char* comm) {
+      auto* comm_event = perf_data->add_events()->mutable_comm_event();
+      comm_event->set_pid(10);
+      comm_event->set_tid(tid);
+      comm_event->set_comm(comm);
+    };
+    auto add_sample = [&](uint32_t pid, uint32_t tid, std::vector<uint64_t> callchain) {
+      auto* sample_event = perf_data->add_events()->mutable_sample_event();
+      sample_event->set_pid(pid);
+      sample_event->set_tid(tid);
+      for (uint64_t ip : callchain) {
+        sample_event->add_callchain(ip);
+      }
+    };
+    constexpr uint64_t kContextKernel = static_cast<uint64_t>(-128);
+    constexpr uint64_t kContextUser = static_cast<uint64_t>(-512);
+
+    add_mmap(static_cast<uint32_t>(-1), 0xffff0000, 0, "[kernel.kallsyms]");
+    add_mmap(10, 0x1000, 0x200, "/system/lib/libfoo.so");
+    add_mmap(10, 0x3000, 0, "/system/lib/libbar.so");
+    add_comm(10, "app");
+    add_comm(11, "worker");
+    auto* fork_event = perf_data->add_events()->mutable_fork_event();
+    fork_event->set_pid(12);
+    fork_event->set_ppid(10);
+
+    for (size_t i = 0; i < 3; ++i) {
+      add_sample(10, 10, { kContextKernel, 0xffff0010, kContextUser, 0x1010, 0x3020 });
+    }
+    add_sample(10, 11, { kContextUser, 0x1010, 0x3020 });
+    add_sample(10, 11, { kContextUser, 0x1020, 0x3020 });
+    add_sample(10, 10, { kContextUser, 0x9000 });
+    auto* sample_event = perf_data->add_events()->mutable_sample_event();
+    sample_event->set_pid(12);
+    sample_event->set_tid(12);
+    sample_event->set_ip(0x3040);
+
+    auto* symbol_info = record.add_symbol_info();
+    symbol_info->set_filename("/system/lib/libfoo.so");
+    auto* symbol = symbol_info->add_symbols();
+    symbol->set_addr(0x200);
+    symbol->set_size(0x100);
+    symbol->set_name("foo");
+
+    auto* profile = record.mutable_aggregated_profile();
+    profile->add_strings("libbaz.so");
+    profile->add_strings("baz");
+    auto* stack = profile->add_stacks();
+    stack->set_count(5);
+    auto* frame = stack->add_frames();
+    frame->set_dso(0);
+    frame->set_offset(0x40);
+    frame->set_symbol(2);
+    frame = stack->add_frames();
+    frame->set_dso(0);
+    frame->set_offset(0x4000);
+    return record;
+  }
+
+  std::string Path(const char* name) {
+    return std::string(dir_.path) + "/" + name;
+  }
+
+  std::vector<std::string> Folded(const Aggregate& aggregate) {
+    EXPECT_TRUE(WriteFolded(aggregate, Path("folded")));
+    std::string folded;
+    EXPECT_TRUE(android::base::ReadFileToString(Path("folded"), &folded));
+    std::vector<std::string> lines = android::base::Split(android::base::Trim(folded), "\n");
+    std::sort(lines.begin(), lines.end());
+    return lines;
+  }
+
+  // Each sample of the database as "count pid tid frame...", with frames as
+  // "sym@dso+offset", innermost first.
+  std::vector<std::string> SqliteSamples(const Aggregate& aggregate) {
+    std::vector<std::string> samples;
+    EXPECT_TRUE(WriteSqlite(aggregate, Path("db")));
+    sqlite3* db = nullptr;
+    EXPECT_EQ(SQLITE_OK, sqlite3_open(Path("db").c_str(), &db));
+    sqlite3_stmt* stmt = nullptr;
+    EXPECT_EQ(SQLITE_OK, sqlite3_prepare_v2(db,
+        "SELECT samples.id, samples.count, pids.name, tids.name FROM samples "
+        "JOIN pids ON pids.id = samples.pid_id JOIN tids ON tids.id = samples.tid_id",
+        -1, &stmt, nullptr));
+    std::vector<int64_t> ids;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      ids.push_back(sqlite3_column_int64(stmt, 0));
+      samples.push_back(android::base::StringPrintf("%" PRId64 " %s %s",
+          static_cast<int64_t>(sqlite3_column_int64(stmt, 1)), sqlite3_column_text(stmt, 2),
+          sqlite3_column_text(stmt, 3)));
+    }
+    sqlite3_finalize(stmt);
+    EXPECT_EQ(SQLITE_OK, sqlite3_prepare_v2(db,
+        "SELECT syms.name, dsos.name, stacks.offset FROM stacks "
+        "JOIN syms ON syms.id = stacks.sym_id JOIN dsos ON dsos.id = stacks.dso_id "
+        "WHERE stacks.sample_id = ? ORDER BY stacks.depth",
+        -1, &stmt, nullptr));
+    for (size_t i = 0; i < ids.size(); ++i) {
+      sqlite3_bind_int64(stmt, 1, ids[i]);
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+        samples[i] += android::base::StringPrintf(" %s@%s+%" PRId64,
+            sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1),
+            static_cast<int64_t>(sqlite3_column_int64(stmt, 2)));
+      }
+      sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    std::sort(samples.begin(), samples.end());
+    return samples;
+  }
+
+  TemporaryDir dir_;
+};
+
+TEST_F(AggregateProfilesTest, Folded) {
+  Aggregate aggregate = AggregateFiles({ Path("profile") }, AggregateOptions());
+  EXPECT_EQ(1u, aggregate.files);
+  EXPECT_EQ(0u, aggregate.errors);
+  EXPECT_EQ(12u, aggregate.samples);
+  std::vector<std::string> expected = {
+      "[aggregated];libbaz.so+0x4000;baz 5",
+      "[unknown];/system/lib/libbar.so+0x40 1",
+      "app;/system/lib/libbar.so+0x20;foo 2",
+      "app;/system/lib/libbar.so+0x20;foo;[kernel.kallsyms]+0x10 3",
+      "app;[unknown]+0x0 1",
+  };
+  EXPECT_EQ(expected, Folded(aggregate));
+}
+
+TEST_F(AggregateProfilesTest, FoldedByThreadWithoutKernelTop) {
+  AggregateOptions options;
+  options.by_thread = true;
+  options.skip_kernel_top = true;
+  Aggregate aggregate = AggregateFiles({ Path("profile") }, options);
+  std::vector<std::string> expected = {
+      "[aggregated];[aggregated];libbaz.so+0x4000;baz 5",
+      "[unknown];[unknown];/system/lib/libbar.so+0x40 1",
+      "app;app;/system/lib/libbar.so+0x20;foo 3",
+      "app;app;[unknown]+0x0 1",
+      "app;worker;/system/lib/libbar.so+0x20;foo 2",
+  };
+  EXPECT_EQ(expected, Folded(aggregate));
+}
+
+TEST_F(AggregateProfilesTest, MergeCompressedAndMissing) {
+  AggregateOptions options;
+  options.jobs = 3;
+  Aggregate aggregate = AggregateFiles(
+      { Path("profile"), Path("profile.gz"), Path("missing") }, options);
+  EXPECT_EQ(2u, aggregate.files);
+  EXPECT_EQ(1u, aggregate.errors);
+  EXPECT_EQ(24u, aggregate.samples);
+  std::vector<std::string> expected = {
+      "[aggregated];libbaz.so+0x4000;baz 10",
+      "[unknown];/system/lib/libbar.so+0x40 2",
+      "app;/system/lib/libbar.so+0x20;foo 4",
+      "app;/system/lib/libbar.so+0x20;foo;[kernel.kallsyms]+0x10 6",
+      "app;[unknown]+0x0 2",
+  };
+  EXPECT_EQ(expected, Folded(aggregate));
+}
+
+TEST_F(AggregateProfilesTest, Sqlite) {
+  Aggregate aggregate = AggregateFiles({ Path("profile") }, AggregateOptions());
+  std::vector<std::string> expected = {
+      "1 [unknown] [unknown] /system/lib/libbar.so@/system/lib/libbar.so+64",
+      "1 app app [unknown]@[unknown]+0",
+      "2 app app foo@/system/lib/libfoo.so+0 /system/lib/libbar.so@/system/lib/libbar.so+32",
+      "3 app app [kernel.kallsyms]@[kernel.kallsyms]+16 foo@/system/lib/libfoo.so+0 "
+          "/system/lib/libbar.so@/system/lib/libbar.so+32",
+      "5 [aggregated] [aggregated] baz@libbaz.so+0 libbaz.so@libbaz.so+16384",
+  };
+  EXPECT_EQ(expected, SqliteSamples(aggregate));
+
+  // Writing to an existing database replaces its tables.
+  AggregateOptions options;
+  options.by_thread = true;
+  options.skip_kernel_top = true;
+  aggregate = AggregateFiles({ Path("profile") }, options);
+  expected = {
+      "1 [unknown] [unknown] /system/lib/libbar.so@/system/lib/libbar.so+64",
+      "1 app app [unknown]@[unknown]+0",
+      "2 app worker foo@/system/lib/libfoo.so+0 /system/lib/libbar.so@/system/lib/libbar.so+32",
+      "3 app app foo@/system/lib/libfoo.so+0 /system/lib/libbar.so@/system/lib/libbar.so+32",
+      "5 [aggregated] [aggregated] baz@libbaz.so+0 libbaz.so@libbaz.so+16384",
+  };
+  EXPECT_EQ(expected, SqliteSamples(aggregate));
+}
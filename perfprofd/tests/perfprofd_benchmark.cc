@@ -0,0 +1,628 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark of the perfprofd encode pipeline: converts a corpus of perf.data
+// files to PerfprofdRecords and serializes them, reporting wall time,
+// allocations and peak RSS per stage.
+//
+// Usage: perfprofd_benchmark [options] [perf.data files or directories]
+//
+// Without inputs, the canned perf.data files next to the binary are used. For
+// every input, a synthetic input with --scale times the samples is benchmarked
+// as well. Results can be saved with --output and compared against a previous
+// run with --baseline; the exit status is then non-zero on a regression.
+// --compression-sweep also reports the compression ratio and throughput of
+// each zlib level and compression thread count.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parsedouble.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <perf_reader.h>
+
+#include "perf_data.pb.h"
+#include "perfprofd_record.pb.h"
+
+#include "perf_data_converter.h"
+#include "perfprofd_io.h"
+#include "symbolizer.h"
+
+//
+// Allocation accounting. All allocations of the process go through these.
+//
+
+static std::atomic<uint64_t> alloc_count(0);
+static std::atomic<uint64_t> alloc_bytes(0);
+
+void* operator new(size_t size) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  void* ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  return malloc(size == 0 ? 1 : size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+  return operator new(size, tag);
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+namespace {
+
+// Resource usage at a point in time.
+struct Snapshot {
+  uint64_t time_ns;
+  uint64_t allocs;
+  uint64_t alloc_bytes;
+};
+
+// Resource usage of one stage.
+struct StageResult {
+  double wall_ms = 0;
+  uint64_t allocs = 0;
+  uint64_t alloc_kb = 0;
+  uint64_t peak_rss_kb = 0;
+};
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+Snapshot TakeSnapshot() {
+  Snapshot s;
+  s.allocs = alloc_count.load(std::memory_order_relaxed);
+  s.alloc_bytes = alloc_bytes.load(std::memory_order_relaxed);
+  s.time_ns = NowNs();
+  return s;
+}
+
+// Reset the peak RSS of the process, so that it can be measured per stage.
+// Needs Linux 4.0 or later, the peak of the process is reported otherwise.
+void ResetPeakRss() {
+  android::base::WriteStringToFile("5", "/proc/self/clear_refs");
+}
+
+uint64_t GetPeakRssKb() {
+  std::string status;
+  if (!android::base::ReadFileToString("/proc/self/status", &status)) {
+    return 0;
+  }
+  for (const std::string& line : android::base::Split(status, "\n")) {
+    unsigned long long value;
+    if (sscanf(line.c_str(), "VmHWM: %llu kB", &value) == 1) {
+      return value;
+    }
+  }
+  return 0;
+}
+
+// Measures consecutive stages.
+class StageTimer {
+ public:
+  explicit StageTimer(std::map<std::string, StageResult>* results) : results_(results) {
+    Start();
+  }
+
+  void Start() {
+    ResetPeakRss();
+    start_ = TakeSnapshot();
+  }
+
+  void End(const std::string& stage) {
+    Snapshot end = TakeSnapshot();
+    StageResult& result = (*results_)[stage];
+    result.wall_ms = (end.time_ns - start_.time_ns) / 1e6;
+    result.allocs = end.allocs - start_.allocs;
+    result.alloc_kb = (end.alloc_bytes - start_.alloc_bytes) / 1024;
+    result.peak_rss_kb = GetPeakRssKb();
+    Start();
+  }
+
+ private:
+  std::map<std::string, StageResult>* results_;
+  Snapshot start_;
+};
+
+// The dsos of the corpus are usually not present on the machine running the
+// benchmark. Make up one symbol per 64 bytes, for a realistic number of
+// symbols to aggregate.
+struct SyntheticSymbolizer : public perfprofd::Symbolizer {
+  std::string Decode(const std::string& dso, uint64_t address) override {
+    return android::base::StringPrintf("%s@%" PRIx64, dso.c_str(),
+                                       static_cast<uint64_t>(address & ~0x3f));
+  }
+  bool GetMinExecutableVAddr(const std::string&, uint64_t* addr) override {
+    *addr = 0;
+    return true;
+  }
+  bool IsThreadSafe() const override {
+    return true;
+  }
+};
+
+struct Options {
+  std::vector<std::string> inputs;
+  size_t iterations = 5;
+  size_t scale = 16;
+  bool compress = true;
+  int compression_level = android::perfprofd::kDefaultCompressionLevel;
+  size_t compression_threads = 1;
+  bool compression_sweep = false;
+  std::string output;
+  std::string baseline;
+  // Allowed increase over the baseline, in percent.
+  double threshold = 10;
+  std::string tmp_dir;
+};
+
+void Usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [options] [perf.data files or directories]\n"
+          "  --iterations N         runs per input, the median is reported (default 5)\n"
+          "  --scale N              also run a synthetic input with N times the samples\n"
+          "                         of each input, 0 to disable (default 16)\n"
+          "  --no-compress          serialize without compression\n"
+          "  --compression-level N  zlib level (default %d)\n"
+          "  --compression-threads N\n"
+          "  --compression-sweep    also report ratio and throughput of levels 1, 6 and 9\n"
+          "                         with 1, 2 and 4 compression threads\n"
+          "  --output FILE          save the results\n"
+          "  --baseline FILE        compare against saved results, fail on regressions\n"
+          "  --threshold PERCENT    allowed regression over the baseline (default 10)\n"
+          "  --tmp-dir DIR          where to put synthetic inputs (default $TMPDIR)\n",
+          argv0, android::perfprofd::kDefaultCompressionLevel);
+}
+
+bool ParseArgs(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto next = [&]() -> const char* {
+      return i + 1 < argc ? argv[++i] : "";
+    };
+    bool ok = true;
+    if (arg == "--iterations") {
+      ok = android::base::ParseUint(next(), &options->iterations) && options->iterations > 0;
+    } else if (arg == "--scale") {
+      ok = android::base::ParseUint(next(), &options->scale);
+    } else if (arg == "--no-compress") {
+      options->compress = false;
+    } else if (arg == "--compression-level") {
+      ok = android::base::ParseInt(next(), &options->compression_level, 0, 9);
+    } else if (arg == "--compression-threads") {
+      ok = android::base::ParseUint(next(), &options->compression_threads) &&
+          options->compression_threads > 0;
+    } else if (arg == "--compression-sweep") {
+      options->compression_sweep = true;
+    } else if (arg == "--output") {
+      options->output = next();
+    } else if (arg == "--baseline") {
+      options->baseline = next();
+    } else if (arg == "--threshold") {
+      ok = android::base::ParseDouble(next(), &options->threshold, 0.0);
+    } else if (arg == "--tmp-dir") {
+      options->tmp_dir = next();
+    } else if (!arg.empty() && arg[0] == '-') {
+      ok = false;
+    } else {
+      options->inputs.push_back(arg);
+    }
+    if (!ok) {
+      fprintf(stderr, "invalid argument '%s'\n", arg.c_str());
+      return false;
+    }
+  }
+  if (options->tmp_dir.empty()) {
+    const char* tmp = getenv("TMPDIR");
+    options->tmp_dir = tmp != nullptr ? tmp : "/data/local/tmp";
+  }
+  return true;
+}
+
+// Expand directories to the perf.data files in them.
+std::vector<std::string> CollectInputs(const std::vector<std::string>& paths) {
+  std::vector<std::string> result;
+  for (const std::string& path : paths) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      PLOG(WARNING) << "Skipping " << path;
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      result.push_back(path);
+      continue;
+    }
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(path.c_str()), closedir);
+    if (dir == nullptr) {
+      PLOG(WARNING) << "Skipping " << path;
+      continue;
+    }
+    std::vector<std::string> files;
+    struct dirent* e;
+    while ((e = readdir(dir.get())) != nullptr) {
+      if (android::base::EndsWith(e->d_name, "perf.data")) {
+        files.push_back(path + "/" + e->d_name);
+      }
+    }
+    std::sort(files.begin(), files.end());
+    result.insert(result.end(), files.begin(), files.end());
+  }
+  return result;
+}
+
+// Write a perf.data file with the samples of input repeated scale times, each
+// copy shifted in time after the previous one.
+bool MakeSyntheticInput(const std::string& input, size_t scale, const std::string& output) {
+  quipper::PerfReader reader;
+  if (!reader.ReadFile(input)) {
+    return false;
+  }
+  quipper::PerfDataProto proto;
+  if (!reader.Serialize(&proto)) {
+    return false;
+  }
+  uint64_t min_time = UINT64_MAX;
+  uint64_t max_time = 0;
+  std::vector<int> samples;
+  for (int i = 0; i < proto.events_size(); ++i) {
+    const quipper::PerfDataProto_PerfEvent& event = proto.events(i);
+    if (!event.has_sample_event()) {
+      continue;
+    }
+    samples.push_back(i);
+    min_time = std::min(min_time, event.timestamp());
+    max_time = std::max(max_time, event.timestamp());
+  }
+  if (samples.empty()) {
+    return false;
+  }
+  uint64_t span = max_time - min_time + 1;
+  for (size_t copy = 1; copy < scale; ++copy) {
+    for (int index : samples) {
+      quipper::PerfDataProto_PerfEvent* event = proto.add_events();
+      *event = proto.events(index);
+      uint64_t shift = span * copy;
+      event->set_timestamp(event->timestamp() + shift);
+      quipper::PerfDataProto_SampleEvent* sample = event->mutable_sample_event();
+      if (sample->has_sample_time_ns()) {
+        sample->set_sample_time_ns(sample->sample_time_ns() + shift);
+      }
+    }
+  }
+  quipper::PerfReader writer;
+  return writer.Deserialize(proto) && writer.WriteFile(output);
+}
+
+// Run the pipeline once over input.
+bool RunOnce(const Options& options,
+             const std::string& input,
+             std::map<std::string, StageResult>* results) {
+  SyntheticSymbolizer symbolizer;
+  StageTimer timer(results);
+  uint64_t start_ns = NowNs();
+  std::unique_ptr<android::perfprofd::PerfprofdRecord> record(
+      android::perfprofd::RawPerfDataToAndroidPerfProfile(
+          input, &symbolizer, [&timer](const char* stage) { timer.End(stage); }));
+  if (record == nullptr) {
+    LOG(ERROR) << "Failed to convert " << input;
+    return false;
+  }
+
+  android::base::unique_fd fd(open("/dev/null", O_WRONLY | O_CLOEXEC));
+  if (!android::perfprofd::SerializeProtobuf(record.get(),
+                                             std::move(fd),
+                                             options.compress,
+                                             options.compression_level,
+                                             options.compression_threads)) {
+    LOG(ERROR) << "Failed to serialize " << input;
+    return false;
+  }
+  timer.End("SerializeProtobuf");
+  record.reset();
+  timer.End("free");
+
+  // The total is sequential, its RSS peak is the largest of the stages.
+  StageResult& total = (*results)["total"];
+  total = StageResult();
+  total.wall_ms = (NowNs() - start_ns) / 1e6;
+  for (const auto& it : *results) {
+    if (it.first != "total") {
+      total.allocs += it.second.allocs;
+      total.alloc_kb += it.second.alloc_kb;
+      total.peak_rss_kb = std::max(total.peak_rss_kb, it.second.peak_rss_kb);
+    }
+  }
+  return true;
+}
+
+template <typename T>
+T Median(std::vector<T> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+// Run the pipeline the given number of times, reporting medians.
+bool Run(const Options& options,
+         const std::string& input,
+         std::map<std::string, StageResult>* results) {
+  std::vector<std::map<std::string, StageResult>> runs(options.iterations);
+  for (auto& run : runs) {
+    if (!RunOnce(options, input, &run)) {
+      return false;
+    }
+  }
+  for (const auto& stage : runs[0]) {
+    const std::string& name = stage.first;
+    std::vector<double> wall_ms;
+    std::vector<uint64_t> allocs, alloc_kb, peak_rss_kb;
+    for (auto& run : runs) {
+      const StageResult& r = run[name];
+      wall_ms.push_back(r.wall_ms);
+      allocs.push_back(r.allocs);
+      alloc_kb.push_back(r.alloc_kb);
+      peak_rss_kb.push_back(r.peak_rss_kb);
+    }
+    StageResult& result = (*results)[name];
+    result.wall_ms = Median(wall_ms);
+    result.allocs = Median(allocs);
+    result.alloc_kb = Median(alloc_kb);
+    result.peak_rss_kb = Median(peak_rss_kb);
+  }
+  return true;
+}
+
+// Serialize the record of input with each compression level and thread
+// count, reporting the compression ratio and the median throughput.
+bool CompressionSweep(const Options& options, const std::string& input) {
+  SyntheticSymbolizer symbolizer;
+  std::unique_ptr<android::perfprofd::PerfprofdRecord> record(
+      android::perfprofd::RawPerfDataToAndroidPerfProfile(input, &symbolizer));
+  if (record == nullptr) {
+    LOG(ERROR) << "Failed to convert " << input;
+    return false;
+  }
+  const size_t size = record->ByteSize();
+  std::string output = android::base::StringPrintf("%s/perfprofd_benchmark.%d.gz",
+                                                   options.tmp_dir.c_str(), getpid());
+  printf("%s compression of %zu bytes\n", input.c_str(), size);
+  printf("  %-6s %8s %8s %12s\n", "level", "threads", "ratio", "MiB/s");
+  for (int level : { 1, 6, 9 }) {
+    for (size_t threads : { 1, 2, 4 }) {
+      std::vector<double> wall_ms;
+      bool ok = true;
+      for (size_t i = 0; ok && i < options.iterations; ++i) {
+        uint64_t start_ns = NowNs();
+        ok = android::perfprofd::SerializeProtobuf(record.get(), output.c_str(), true, level,
+                                                   threads);
+        wall_ms.push_back((NowNs() - start_ns) / 1e6);
+      }
+      struct stat st;
+      if (!ok || stat(output.c_str(), &st) != 0 || st.st_size == 0) {
+        LOG(ERROR) << "Failed to serialize " << input << " at level " << level << " with "
+                   << threads << " thread(s)";
+        unlink(output.c_str());
+        return false;
+      }
+      printf("  %-6d %8zu %8.2f %12.1f\n", level, threads,
+             static_cast<double>(size) / st.st_size,
+             size / (Median(wall_ms) / 1e3) / (1024 * 1024));
+    }
+  }
+  unlink(output.c_str());
+  return true;
+}
+
+// Results are saved as lines of "input stage wall_ms allocs alloc_kb peak_rss_kb".
+using Results = std::map<std::string, std::map<std::string, StageResult>>;
+
+bool SaveResults(const Results& results, const std::string& path) {
+  std::ostringstream out;
+  for (const auto& input : results) {
+    for (const auto& stage : input.second) {
+      const StageResult& r = stage.second;
+      out << input.first << " " << stage.first << " " << r.wall_ms << " " << r.allocs << " "
+          << r.alloc_kb << " " << r.peak_rss_kb << "\n";
+    }
+  }
+  return android::base::WriteStringToFile(out.str(), path);
+}
+
+bool LoadResults(const std::string& path, Results* results) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  std::string input, stage;
+  StageResult r;
+  while (in >> input >> stage >> r.wall_ms >> r.allocs >> r.alloc_kb >> r.peak_rss_kb) {
+    (*results)[input][stage] = r;
+  }
+  return true;
+}
+
+// Report stages that got worse than the baseline by more than the threshold.
+// Small absolute changes are ignored as noise.
+size_t CompareResults(const Results& results, const Results& baseline, double threshold) {
+  size_t regressions = 0;
+  auto check = [&](const std::string& what, double value, double base, double noise) {
+    if (value > base * (1 + threshold / 100) && value - base > noise) {
+      printf("REGRESSION %s: %.2f -> %.2f (%+.1f%%)\n", what.c_str(), base, value,
+             (value - base) * 100 / std::max(base, 1e-9));
+      ++regressions;
+    }
+  };
+  for (const auto& input : results) {
+    auto base_input = baseline.find(input.first);
+    if (base_input == baseline.end()) {
+      continue;
+    }
+    for (const auto& stage : input.second) {
+      auto base_stage = base_input->second.find(stage.first);
+      if (base_stage == base_input->second.end()) {
+        continue;
+      }
+      const StageResult& r = stage.second;
+      const StageResult& b = base_stage->second;
+      std::string name = android::base::Basename(input.first) + " " + stage.first;
+      check(name + " wall_ms", r.wall_ms, b.wall_ms, 1.0);
+      check(name + " allocs", r.allocs, b.allocs, 16);
+      check(name + " alloc_kb", r.alloc_kb, b.alloc_kb, 64);
+      check(name + " peak_rss_kb", r.peak_rss_kb, b.peak_rss_kb, 1024);
+    }
+  }
+  return regressions;
+}
+
+void PrintResults(const std::string& input, const std::map<std::string, StageResult>& results) {
+  printf("%s\n", input.c_str());
+  printf("  %-20s %12s %12s %12s %12s\n", "stage", "wall ms", "allocs", "alloc KB",
+         "peak RSS KB");
+  // Print in pipeline order rather than by name.
+  static const char* kOrder[] = {
+      "read", "parse", "serialize", "symbolize", "add_symbol_info", "SerializeProtobuf",
+      "free", "total",
+  };
+  for (const char* name : kOrder) {
+    auto it = results.find(name);
+    if (it == results.end()) {
+      continue;
+    }
+    const StageResult& r = it->second;
+    printf("  %-20s %12.2f %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n", name, r.wall_ms,
+           r.allocs, r.alloc_kb, r.peak_rss_kb);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv, android::base::StderrLogger);
+
+  Options options;
+  if (!ParseArgs(argc, argv, &options)) {
+    Usage(argv[0]);
+    return 1;
+  }
+  if (options.inputs.empty()) {
+    std::string dir = android::base::Dirname(android::base::GetExecutablePath());
+    options.inputs.push_back(dir + "/canned.perf.data");
+    options.inputs.push_back(dir + "/callchain.canned.perf.data");
+  }
+  std::vector<std::string> inputs = CollectInputs(options.inputs);
+  if (inputs.empty()) {
+    LOG(ERROR) << "No inputs";
+    return 1;
+  }
+
+  Results results;
+  std::vector<std::string> synthetic_files;
+  bool ok = true;
+  for (const std::string& input : inputs) {
+    ok = Run(options, input, &results[input]) && ok;
+    PrintResults(input, results[input]);
+    if (options.compression_sweep) {
+      ok = CompressionSweep(options, input) && ok;
+    }
+
+    if (options.scale > 1) {
+      std::string synthetic = android::base::StringPrintf(
+          "%s/perfprofd_benchmark.%d.%zu.%s", options.tmp_dir.c_str(), getpid(),
+          synthetic_files.size(), android::base::Basename(input).c_str());
+      if (!MakeSyntheticInput(input, options.scale, synthetic)) {
+        LOG(ERROR) << "Failed to create synthetic input from " << input;
+        ok = false;
+        continue;
+      }
+      synthetic_files.push_back(synthetic);
+      // Name results after the source, so that they can be compared across runs.
+      std::string name = android::base::StringPrintf("%s.x%zu", input.c_str(), options.scale);
+      ok = Run(options, synthetic, &results[name]) && ok;
+      PrintResults(name, results[name]);
+    }
+  }
+  for (const std::string& file : synthetic_files) {
+    unlink(file.c_str());
+  }
+
+  if (!options.output.empty() && !SaveResults(results, options.output)) {
+    PLOG(ERROR) << "Failed to save results to " << options.output;
+    ok = false;
+  }
+  if (!options.baseline.empty()) {
+    Results baseline;
+    if (!LoadResults(options.baseline, &baseline)) {
+      PLOG(ERROR) << "Failed to load baseline " << options.baseline;
+      return 1;
+    }
+    size_t regressions = CompareResults(results, baseline, options.threshold);
+    printf("%zu regressions over %.1f%%\n", regressions, options.threshold);
+    if (regressions > 0) {
+      return 2;
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -21,6 +21,7 @@
 #include <memory>
 #include <mutex>
 #include <regex>
+#include <set>
 #include <string>
 
 #include <fcntl.h>
@@ -44,7 +45,9 @@
 #include "map_utils.h"
 #include "perfprofdcore.h"
 #include "perfprofd_cmdline.h"
+#include "perfprofd_io.h"
 #include "perfprofd_threaded_handler.h"
+#include "profile_aggregator.h"
 #include "quipper_helper.h"
 #include "symbolizer.h"
 
@@ -632,6 +635,15 @@ TEST_F(PerfProfdTest, ConfigFileParsing)
 
   // check to make sure log excerpt matches
   CompareLogMessages(expected, "ConfigFileParsing");
+
+  // The symbolizer cache budget is in KB.
+  ConfigReader reader;
+  ASSERT_TRUE(reader.Read("symbolizer_cache_size=1024\n", /* fail_on_error */ true));
+  PerfProfdRunner::LoggingConfig config;
+  reader.FillConfig(&config);
+  EXPECT_EQ(1024u, config.symbolizer_cache_size);
+  EXPECT_FALSE(ConfigReader().Read("symbolizer_cache_size_in_kb=1024\n",
+                                   /* fail_on_error */ true));
 }
 
 TEST_F(PerfProfdTest, ProfileCollectionAnnotations)
@@ -650,6 +662,176 @@ TEST_F(PerfProfdTest, ProfileCollectionAnnotations)
   EXPECT_FALSE(get_camera_active());
 }
 
+TEST_F(PerfProfdTest, LoadSignals)
+{
+  // Pressure-stall information is optional, but when present is a
+  // percentage.
+  double avg10 = -1.0;
+  if (get_pressure("cpu", &avg10)) {
+    EXPECT_GE(avg10, 0.0);
+    EXPECT_LE(avg10, 100.0);
+  }
+  EXPECT_FALSE(get_pressure("nonexistent", &avg10));
+
+  // Thermal throttling is read from a fake sysfs, the state of the
+  // device running the test doesn't matter.
+  TemporaryDir thermal_dir;
+  auto add_cooling_device = [&](const char* name, const char* type, const char* state) {
+    std::string device_dir = std::string(thermal_dir.path) + "/" + name;
+    ASSERT_EQ(0, mkdir(device_dir.c_str(), 0755));
+    ASSERT_TRUE(android::base::WriteStringToFile(type, device_dir + "/type"));
+    ASSERT_TRUE(android::base::WriteStringToFile(state, device_dir + "/cur_state"));
+  };
+  EXPECT_FALSE(get_thermal_throttling(thermal_dir.path));
+  add_cooling_device("cooling_device0", "thermal-cpufreq-0\n", "0\n");
+  add_cooling_device("cooling_device1", "battery\n", "2\n");
+  EXPECT_FALSE(get_thermal_throttling(thermal_dir.path));
+  add_cooling_device("cooling_device2", "thermal-cpufreq-1\n", "3\n");
+  EXPECT_TRUE(get_thermal_throttling(thermal_dir.path));
+  EXPECT_FALSE(get_thermal_throttling(std::string(thermal_dir.path) + "/nonexistent"));
+
+  // The real sysfs can be in any state, just read it.
+  get_thermal_throttling();
+
+  double load_average = -1.0;
+  if (get_load_average(&load_average)) {
+    EXPECT_GE(load_average, 0.0);
+  }
+}
+
+class SchedulerTest : public testing::Test {
+ protected:
+  struct TestConfig : public Config {
+    TestConfig() {
+      adaptive_scheduling = true;
+      collection_interval_in_s = 600;
+      min_cpu_utilization = 10;
+      max_memory_pressure = 10;
+      overhead_budget_permille = 20;
+    }
+    void Sleep(size_t seconds ATTRIBUTE_UNUSED) override {
+    }
+    bool IsProfilingEnabled() const override {
+      return true;
+    }
+  };
+
+  TestConfig config_;
+};
+
+TEST_F(SchedulerTest, CheckLoad) {
+  LoadSignals signals;
+  signals.online_cpus = 4;
+  EXPECT_EQ(DONT_PROFILE_SYSTEM_IDLE, check_load(config_, signals));
+
+  // A load average of one task per CPU is interesting on its own.
+  signals.have_load_average = true;
+  signals.load_average = 3.9;
+  EXPECT_EQ(DONT_PROFILE_SYSTEM_IDLE, check_load(config_, signals));
+  signals.load_average = 4.0;
+  EXPECT_EQ(DO_COLLECT_PROFILE, check_load(config_, signals));
+  signals.have_load_average = false;
+  EXPECT_EQ(DONT_PROFILE_SYSTEM_IDLE, check_load(config_, signals));
+
+  signals.cpu_utilization = 10;
+  EXPECT_EQ(DO_COLLECT_PROFILE, check_load(config_, signals));
+  signals.cpu_utilization = 9;
+  signals.have_cpu_pressure = true;
+  signals.cpu_pressure = 1.0;
+  EXPECT_EQ(DO_COLLECT_PROFILE, check_load(config_, signals));
+
+  // Constraints win over load.
+  signals.have_memory_pressure = true;
+  signals.memory_pressure = 10.0;
+  EXPECT_EQ(DO_COLLECT_PROFILE, check_load(config_, signals));
+  signals.memory_pressure = 10.5;
+  EXPECT_EQ(DONT_PROFILE_MEMORY_PRESSURE, check_load(config_, signals));
+  signals.thermal_throttling = true;
+  EXPECT_EQ(DONT_PROFILE_THERMAL_THROTTLING, check_load(config_, signals));
+}
+
+TEST_F(SchedulerTest, Backoff) {
+  SchedulerState state;
+  EXPECT_EQ(600u, get_collection_interval(config_, state));
+
+  for (unsigned i = 1; i <= kMaxBackoffLevel + 2; ++i) {
+    update_backoff(i % 2 != 0 ? DONT_PROFILE_THERMAL_THROTTLING : DONT_PROFILE_MEMORY_PRESSURE,
+                   &state);
+    EXPECT_EQ(std::min(i, kMaxBackoffLevel), state.backoff_level);
+  }
+  EXPECT_EQ(600u << kMaxBackoffLevel, get_collection_interval(config_, state));
+
+  // Skips for other reasons keep the level.
+  update_backoff(DONT_PROFILE_SYSTEM_IDLE, &state);
+  update_backoff(DONT_PROFILE_MISSING_SEMAPHORE, &state);
+  EXPECT_EQ(kMaxBackoffLevel, state.backoff_level);
+
+  update_backoff(DO_COLLECT_PROFILE, &state);
+  EXPECT_EQ(0u, state.backoff_level);
+  EXPECT_EQ(600u, get_collection_interval(config_, state));
+
+  config_.adaptive_scheduling = false;
+  state.backoff_level = 2;
+  EXPECT_EQ(600u, get_collection_interval(config_, state));
+}
+
+TEST_F(SchedulerTest, SamplingScale) {
+  config_.sampling_frequency = 1000;
+  SchedulerState state;
+  auto frequency = [&]() {
+    uint32_t frequency, period;
+    get_sampling_rate(config_, state, &frequency, &period);
+    EXPECT_EQ(0u, period);
+    return frequency;
+  };
+
+  // Within budget.
+  update_sampling_scale(config_, 15, &state);
+  EXPECT_DOUBLE_EQ(1.0, state.sampling_scale);
+  EXPECT_EQ(1000u, frequency());
+
+  // Over budget, scaled by the ratio to the budget.
+  update_sampling_scale(config_, 40, &state);
+  EXPECT_DOUBLE_EQ(0.5, state.sampling_scale);
+  EXPECT_EQ(500u, frequency());
+  update_sampling_scale(config_, 80, &state);
+  EXPECT_DOUBLE_EQ(0.125, state.sampling_scale);
+
+  // Between half the budget and the budget, kept.
+  update_sampling_scale(config_, 12, &state);
+  EXPECT_DOUBLE_EQ(0.125, state.sampling_scale);
+
+  // Well within budget, recovering at most 2x per collection up to 1.
+  update_sampling_scale(config_, 0, &state);
+  EXPECT_DOUBLE_EQ(0.25, state.sampling_scale);
+  update_sampling_scale(config_, 5, &state);
+  EXPECT_DOUBLE_EQ(0.5, state.sampling_scale);
+  update_sampling_scale(config_, 5, &state);
+  update_sampling_scale(config_, 5, &state);
+  EXPECT_DOUBLE_EQ(1.0, state.sampling_scale);
+
+  // Down to 1/64, and not under the minimum frequency.
+  update_sampling_scale(config_, 1000, &state);
+  update_sampling_scale(config_, 1000, &state);
+  EXPECT_DOUBLE_EQ(1.0 / 64, state.sampling_scale);
+  EXPECT_EQ(15u, frequency());
+  config_.sampling_frequency = 100;
+  EXPECT_EQ(10u, frequency());
+
+  // A sampling period is stretched instead.
+  config_.sampling_frequency = 0;
+  config_.sampling_period = 100000;
+  uint32_t frequency_out, period_out;
+  get_sampling_rate(config_, state, &frequency_out, &period_out);
+  EXPECT_EQ(0u, frequency_out);
+  EXPECT_EQ(6400000u, period_out);
+
+  // Without adaptive scheduling, perf gets the configured rate.
+  config_.adaptive_scheduling = false;
+  get_sampling_rate(config_, state, &frequency_out, &period_out);
+  EXPECT_EQ(100000u, period_out);
+}
+
 namespace {
 
 template <typename Iterator>
@@ -900,6 +1082,71 @@ TEST_F(BasicRunWithCannedPerf, Compressed)
   VerifyBasicCannedProfile(encodedProfile);
 }
 
+TEST_F(BasicRunWithCannedPerf, CompressedParallel)
+{
+  std::string input_perf_data(test_dir);
+  input_perf_data += "/canned.perf.data";
+
+  // Set up config to avoid these annotations (they are tested elsewhere)
+  ConfigReader config_reader;
+  config_reader.overrideUnsignedEntry("collect_cpu_utilization", 0);
+  config_reader.overrideUnsignedEntry("collect_charging_state", 0);
+  config_reader.overrideUnsignedEntry("collect_camera_active", 0);
+
+  // Enable block-parallel compression.
+  config_reader.overrideUnsignedEntry("compress", 1);
+  config_reader.overrideUnsignedEntry("compression_threads", 4);
+
+  PerfProfdRunner::LoggingConfig config;
+  config_reader.FillConfig(&config);
+
+  // Kick off encoder and check return code
+  PROFILE_RESULT result =
+      encode_to_proto(input_perf_data, encoded_file_path(dest_dir, 0).c_str(), config, 0, nullptr);
+  ASSERT_EQ(OK_PROFILE_COLLECTION, result) << test_logger.JoinTestLog(" ");
+
+  // Read and decode the resulting perf.data.encoded file
+  android::perfprofd::PerfprofdRecord encodedProfile;
+  readEncodedProfile(dest_dir, true, encodedProfile);
+
+  VerifyBasicCannedProfile(encodedProfile);
+}
+
+TEST_F(PerfProfdTest, CompressedParallelMultipleBlocks)
+{
+  //
+  // Compress a record spanning many 128 KiB compression blocks, so that
+  // each block is primed with the end of the previous one as dictionary
+  // and the gzip trailer carries a CRC combined across blocks. Symbol
+  // names repeat every 300 symbols (about 20 KiB), so back-references
+  // cross block boundaries.
+  //
+  android::perfprofd::PerfprofdRecord record;
+  android::perfprofd::PerfprofdRecord_SymbolInfo* symbol_info = record.add_symbol_info();
+  symbol_info->set_filename("/system/lib64/libperfprofd_test.so");
+  for (unsigned i = 0; i < 32768; ++i) {
+    android::perfprofd::PerfprofdRecord_SymbolInfo_Symbol* symbol = symbol_info->add_symbols();
+    symbol->set_addr(i * 64);
+    symbol->set_size(64);
+    symbol->set_name(android::base::StringPrintf("android::perfprofd::test::Function%u()",
+                                                 i % 300));
+  }
+  const std::string expected = record.SerializeAsString();
+  ASSERT_GT(expected.size(), 8u * 128u * 1024u);
+
+  for (size_t threads : { 1, 2, 4 }) {
+    ASSERT_TRUE(android::perfprofd::SerializeProtobuf(&record,
+                                                      encoded_file_path(dest_dir, 0).c_str(),
+                                                      true,
+                                                      android::perfprofd::kDefaultCompressionLevel,
+                                                      threads));
+    // Inflating checks the CRC and length in the gzip trailer.
+    android::perfprofd::PerfprofdRecord decoded;
+    readEncodedProfile(dest_dir, true, decoded);
+    EXPECT_EQ(expected, decoded.SerializeAsString()) << threads << " thread(s)";
+  }
+}
+
 TEST_F(BasicRunWithCannedPerf, WithSymbolizer)
 {
   //
@@ -1295,6 +1542,262 @@ TEST_F(RangeMapTest, TestRangeMap) {
   EXPECT_STREQ("1#a[1,2,10,]50#c[50,]100#a[100,]199#b[199,200,]", print().c_str());
 }
 
+class CachingSymbolizerTest : public testing::Test {
+};
+
+TEST_F(CachingSymbolizerTest, ReuseAcrossConversions) {
+  std::unique_ptr<perfprofd::Symbolizer> symbolizer =
+      perfprofd::CreateCachingELFSymbolizer(64 * 1024 * 1024);
+  perfprofd::Symbolizer::CacheStats stats;
+
+  symbolizer->StartConversion();
+  uint64_t first_vaddr = 0;
+  bool first_found = symbolizer->GetMinExecutableVAddr(gExecutableRealpath, &first_vaddr);
+  symbolizer->Decode(gExecutableRealpath, first_vaddr);
+  ASSERT_TRUE(symbolizer->GetCacheStats(&stats));
+  EXPECT_EQ(0u, stats.hits);
+  EXPECT_EQ(1u, stats.misses);
+  EXPECT_EQ(0u, stats.evictions);
+  EXPECT_LT(0u, stats.bytes);
+
+  // A second conversion must not parse the unchanged file again.
+  symbolizer->StartConversion();
+  uint64_t second_vaddr = 0;
+  EXPECT_EQ(first_found, symbolizer->GetMinExecutableVAddr(gExecutableRealpath, &second_vaddr));
+  EXPECT_EQ(first_vaddr, second_vaddr);
+  ASSERT_TRUE(symbolizer->GetCacheStats(&stats));
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(0u, stats.misses);
+}
+
+TEST_F(CachingSymbolizerTest, EvictOverBudget) {
+  // A budget of one byte only leaves room for the most recently used dso.
+  std::unique_ptr<perfprofd::Symbolizer> symbolizer = perfprofd::CreateCachingELFSymbolizer(1);
+  perfprofd::Symbolizer::CacheStats stats;
+  uint64_t vaddr;
+
+  symbolizer->StartConversion();
+  symbolizer->GetMinExecutableVAddr(gExecutableRealpath, &vaddr);
+  symbolizer->GetMinExecutableVAddr("/does/not/exist", &vaddr);
+  symbolizer->GetMinExecutableVAddr(gExecutableRealpath, &vaddr);
+  ASSERT_TRUE(symbolizer->GetCacheStats(&stats));
+  EXPECT_EQ(3u, stats.misses);
+  EXPECT_EQ(2u, stats.evictions);
+}
+
+TEST_F(CachingSymbolizerTest, DecodeBatchMatchesDecode) {
+  std::unique_ptr<perfprofd::Symbolizer> symbolizers[] = {
+      perfprofd::CreateELFSymbolizer(),
+      perfprofd::CreateCachingELFSymbolizer(64 * 1024 * 1024),
+  };
+  for (auto& symbolizer : symbolizers) {
+    symbolizer->StartConversion();
+    uint64_t min_vaddr;
+    ASSERT_TRUE(symbolizer->GetMinExecutableVAddr(gExecutableRealpath, &min_vaddr));
+    std::vector<uint64_t> addresses = { 0 };
+    for (uint64_t i = 0; i < 4096; i += 1 + i / 16) {
+      addresses.push_back(min_vaddr + i * 16);
+    }
+    std::vector<std::string> symbols;
+    symbolizer->DecodeBatch(gExecutableRealpath, addresses, &symbols);
+    ASSERT_EQ(addresses.size(), symbols.size());
+    size_t found = 0;
+    for (size_t i = 0; i < addresses.size(); ++i) {
+      EXPECT_EQ(symbolizer->Decode(gExecutableRealpath, addresses[i]), symbols[i]) << i;
+      found += symbols[i].empty() ? 0 : 1;
+    }
+    EXPECT_LT(0u, found);
+  }
+}
+
+class ProfileAggregatorTest : public testing::Test {
+ protected:
+  // A profile of one process with samples spread over 'distinct' stacks in
+  // libfoo.so, whose first 0x100 bytes are symbol 'foo'.
+  static android::perfprofd::PerfprofdRecord MakeProfile(size_t samples, size_t distinct) {
+    android::perfprofd::PerfprofdRecord record;
+    auto* perf_data = record.mutable_perf_data();
+    auto* mmap_event = perf_data->add_events()->mutable_mmap_event();
+    mmap_event->set_pid(10);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x100000);
+    mmap_event->set_pgoff(0x200);
+    mmap_event->set_filename("/system/lib/libfoo.so");
+    auto* symbol_info = record.add_symbol_info();
+    symbol_info->set_filename("/system/lib/libfoo.so");
+    auto* symbol = symbol_info->add_symbols();
+    symbol->set_addr(0x200);
+    symbol->set_size(0x100);
+    symbol->set_name("foo");
+    for (size_t i = 0; i < samples; ++i) {
+      auto* sample_event = perf_data->add_events()->mutable_sample_event();
+      sample_event->set_pid(10);
+      sample_event->set_ip(0x1000 + (i % distinct) * 8);
+      sample_event->add_callchain(static_cast<uint64_t>(-512));  // PERF_CONTEXT_USER
+      sample_event->add_callchain(0x1000 + (i % distinct) * 8);
+      sample_event->add_callchain(0x10000000);  // Unmapped.
+    }
+    return record;
+  }
+
+  static uint64_t CountSamples(const android::perfprofd::PerfprofdRecord& record) {
+    uint64_t total = 0;
+    for (const auto& stack : record.aggregated_profile().stacks()) {
+      total += stack.count();
+    }
+    return total;
+  }
+
+  std::string StorePath(const char* name) {
+    return std::string(store_dir_.path) + "/perfprofd.aggregate." + name;
+  }
+
+  size_t StoreSize() {
+    size_t size = 0;
+    for (const char* name : { "data", "index", "strings" }) {
+      struct stat st;
+      EXPECT_EQ(0, stat(StorePath(name).c_str(), &st)) << name;
+      size += st.st_size;
+    }
+    return size;
+  }
+
+  TemporaryDir store_dir_;
+};
+
+TEST_F(ProfileAggregatorTest, AggregateAcrossCollections) {
+  using android::perfprofd::ProfileAggregator;
+  std::string error_msg;
+  {
+    auto aggregator = ProfileAggregator::Open(store_dir_.path, 1024 * 1024, &error_msg);
+    ASSERT_TRUE(aggregator != nullptr) << error_msg;
+    for (size_t i = 0; i < 3; ++i) {
+      ASSERT_TRUE(aggregator->Add(MakeProfile(1000, 100)));
+    }
+    EXPECT_EQ(3u, aggregator->collections());
+  }
+
+  // The aggregate survives reopening.
+  auto aggregator = ProfileAggregator::Open(store_dir_.path, 1024 * 1024, &error_msg);
+  ASSERT_TRUE(aggregator != nullptr) << error_msg;
+  EXPECT_EQ(3u, aggregator->collections());
+
+  android::perfprofd::PerfprofdRecord record;
+  ASSERT_TRUE(aggregator->Emit(&record));
+  const auto& aggregate = record.aggregated_profile();
+  EXPECT_EQ(3u, aggregate.collections());
+  EXPECT_EQ(3000u, aggregate.samples());
+  EXPECT_EQ(0u, aggregate.dropped_samples());
+  EXPECT_EQ(3000u, CountSamples(record));
+  ASSERT_EQ(100, aggregate.stacks_size());
+  EXPECT_EQ(3, aggregate.strings_size());
+  for (const auto& stack : aggregate.stacks()) {
+    EXPECT_EQ(30u, stack.count());
+    ASSERT_EQ(2, stack.frames_size());
+    const auto& frame = stack.frames(0);
+    EXPECT_EQ("/system/lib/libfoo.so", aggregate.strings(frame.dso()));
+    EXPECT_LE(0x200u, frame.offset());
+    if (frame.offset() < 0x300) {
+      ASSERT_NE(0u, frame.symbol());
+      EXPECT_EQ("foo", aggregate.strings(frame.symbol() - 1));
+    } else {
+      EXPECT_EQ(0u, frame.symbol());
+    }
+    EXPECT_EQ("[unknown]", aggregate.strings(stack.frames(1).dso()));
+  }
+
+  // Emitting starts a new aggregate.
+  EXPECT_EQ(0u, aggregator->collections());
+}
+
+TEST_F(ProfileAggregatorTest, CompactWithinBudget) {
+  using android::perfprofd::ProfileAggregator;
+  constexpr size_t kMaxSize = 64 * 1024;
+  std::string error_msg;
+  auto aggregator = ProfileAggregator::Open(store_dir_.path, kMaxSize, &error_msg);
+  ASSERT_TRUE(aggregator != nullptr) << error_msg;
+
+  uint64_t samples = 0;
+  for (size_t i = 0; i < 5; ++i) {
+    ASSERT_TRUE(aggregator->Add(MakeProfile(20000 + i, 20000)));
+    samples += 20000 + i;
+
+    // Storage stays bounded, index and strings included.
+    EXPECT_GE(kMaxSize, StoreSize());
+  }
+
+  android::perfprofd::PerfprofdRecord record;
+  ASSERT_TRUE(aggregator->Emit(&record));
+  const auto& aggregate = record.aggregated_profile();
+  EXPECT_LT(0u, aggregate.dropped_samples());
+  EXPECT_EQ(samples, aggregate.samples());
+  EXPECT_EQ(samples, CountSamples(record) + aggregate.dropped_samples());
+}
+
+TEST_F(ProfileAggregatorTest, CompactDropsUnreferencedStrings) {
+  using android::perfprofd::ProfileAggregator;
+  constexpr size_t kMaxSize = 64 * 1024;
+  std::string error_msg;
+  auto aggregator = ProfileAggregator::Open(store_dir_.path, kMaxSize, &error_msg);
+  ASSERT_TRUE(aggregator != nullptr) << error_msg;
+
+  // Symbols of a dso no sample hits still have their file name interned, and
+  // take almost all the budget.
+  auto profile = MakeProfile(1000, 100);
+  profile.add_symbol_info()->set_filename("/system/lib/" + std::string(62 * 1024, 'x') + ".so");
+  ASSERT_TRUE(aggregator->Add(profile));
+  EXPECT_GE(kMaxSize, StoreSize());
+
+  // Compaction made room by dropping the string rather than the stacks.
+  android::perfprofd::PerfprofdRecord record;
+  ASSERT_TRUE(aggregator->Emit(&record));
+  const auto& aggregate = record.aggregated_profile();
+  EXPECT_EQ(0u, aggregate.dropped_samples());
+  EXPECT_EQ(1000u, CountSamples(record));
+  EXPECT_EQ(100, aggregate.stacks_size());
+  EXPECT_EQ(3, aggregate.strings_size());
+}
+
+TEST_F(ProfileAggregatorTest, RecoverFromCrashDuringAdd) {
+  using android::perfprofd::ProfileAggregator;
+  std::string error_msg;
+  std::string committed_data;
+  {
+    auto aggregator = ProfileAggregator::Open(store_dir_.path, 1024 * 1024, &error_msg);
+    ASSERT_TRUE(aggregator != nullptr) << error_msg;
+    ASSERT_TRUE(aggregator->Add(MakeProfile(1000, 100)));
+    ASSERT_TRUE(android::base::ReadFileToString(StorePath("data"), &committed_data));
+    ASSERT_TRUE(aggregator->Add(MakeProfile(2000, 200)));
+  }
+
+  // Crash during the second Add: its new stacks were appended and indexed,
+  // but the data header wasn't written.
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(StorePath("data"), &data));
+  ASSERT_LT(committed_data.size(), data.size());
+  committed_data += data.substr(committed_data.size());
+  ASSERT_TRUE(android::base::WriteStringToFile(committed_data, StorePath("data")));
+
+  auto aggregator = ProfileAggregator::Open(store_dir_.path, 1024 * 1024, &error_msg);
+  ASSERT_TRUE(aggregator != nullptr) << error_msg;
+  EXPECT_EQ(1u, aggregator->collections());
+  ASSERT_TRUE(aggregator->Add(MakeProfile(2000, 200)));
+
+  // Each stack is counted once, with the samples of both committed profiles.
+  android::perfprofd::PerfprofdRecord record;
+  ASSERT_TRUE(aggregator->Emit(&record));
+  const auto& aggregate = record.aggregated_profile();
+  EXPECT_EQ(2u, aggregate.collections());
+  EXPECT_EQ(3000u, aggregate.samples());
+  EXPECT_EQ(3000u, CountSamples(record));
+  ASSERT_EQ(200, aggregate.stacks_size());
+  std::set<std::string> stacks;
+  for (const auto& stack : aggregate.stacks()) {
+    EXPECT_EQ(stack.frames(0).offset() < 0x200 + 100 * 8 ? 20u : 10u, stack.count());
+    EXPECT_TRUE(stacks.insert(stack.frames(0).SerializeAsString()).second);
+  }
+}
+
 class ThreadedHandlerTest : public PerfProfdTest {
  public:
   void SetUp() override {
@@ -0,0 +1,494 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "aggregate_profiles.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <sqlite3.h>
+#include <zlib.h>
+
+#include "perfprofd_record.pb.h"
+
+#include "frame_resolver.h"
+
+namespace android {
+namespace perfprofd {
+
+namespace {
+
+using android::base::StringPrintf;
+
+constexpr char kUnknown[] = "[unknown]";
+constexpr char kKernel[] = "[kernel]";
+constexpr char kAggregated[] = "[aggregated]";
+
+// Rows per INSERT statement, within SQLite's limit of 999 parameters.
+constexpr size_t kRowsPerInsert = 100;
+
+// A stack is keyed by the varint encoding of the process name id, the thread
+// name id + 1 (0 if not aggregating by thread) and its frames. Frames with a
+// symbol have their offset dropped.
+struct Stack {
+  uint32_t process;
+  uint32_t thread;
+  std::vector<Frame> frames;
+
+  void Encode(std::string* key) const {
+    key->clear();
+    PutVarint(process, key);
+    PutVarint(thread, key);
+    EncodeFrames(frames, key);
+  }
+
+  // Keys are only made by Encode, they always decode.
+  void Decode(const std::string& key) {
+    const char* pos = key.data();
+    const char* end = pos + key.size();
+    uint64_t value;
+    GetVarint(&pos, end, &value);
+    process = value;
+    GetVarint(&pos, end, &value);
+    thread = value;
+    DecodeFrames(pos, end, &frames);
+  }
+};
+
+bool ReadRecord(const std::string& path, PerfprofdRecord* record) {
+  std::string data;
+  if (!android::base::ReadFileToString(path, &data)) {
+    PLOG(ERROR) << "Failed to read " << path;
+    return false;
+  }
+  if (data.size() >= 2 && static_cast<uint8_t>(data[0]) == 0x1f &&
+      static_cast<uint8_t>(data[1]) == 0x8b) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+      return false;
+    }
+    std::string out;
+    std::vector<char> buffer(1 << 20);
+    stream.next_in = reinterpret_cast<Bytef*>(&data[0]);
+    stream.avail_in = data.size();
+    int ret;
+    do {
+      stream.next_out = reinterpret_cast<Bytef*>(buffer.data());
+      stream.avail_out = buffer.size();
+      ret = inflate(&stream, Z_NO_FLUSH);
+      out.append(buffer.data(), buffer.size() - stream.avail_out);
+    } while (ret == Z_OK);
+    inflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+      LOG(ERROR) << "Failed to decompress " << path;
+      return false;
+    }
+    data.swap(out);
+  }
+  if (!record->ParseFromString(data)) {
+    LOG(ERROR) << "Failed to parse " << path;
+    return false;
+  }
+  return true;
+}
+
+// Count the stacks of one profile into aggregate.
+void AddRecord(const AggregateOptions& options,
+               const PerfprofdRecord& record,
+               Aggregate* aggregate) {
+  StringTable& strings = aggregate->strings;
+  const uint32_t unknown = strings.Intern(kUnknown);
+
+  FrameResolver resolver(record, [&](const std::string& str) { return strings.Intern(str); });
+  std::unordered_map<uint32_t, uint32_t> names;
+
+  auto get_name = [&](uint32_t tid) {
+    auto it = names.find(tid);
+    if (it != names.end()) {
+      return it->second;
+    }
+    return strings.Intern(tid == 0 ? kKernel : kUnknown);
+  };
+
+  // Names are only known once the comm events have been seen, so resolve the
+  // frames first and name the stacks in a second pass.
+  struct PendingStack {
+    uint32_t pid;
+    uint32_t tid;
+    std::vector<Frame> frames;
+  };
+  std::vector<PendingStack> pending;
+  std::unordered_map<std::string, size_t> pending_ids;
+  std::vector<uint64_t> pending_counts;
+  Stack stack;
+  std::string key;
+  for (const auto& event : record.perf_data().events()) {
+    if (event.has_comm_event()) {
+      names[event.comm_event().tid()] = strings.Intern(event.comm_event().comm());
+    } else if (event.has_sample_event()) {
+      const auto& sample_event = event.sample_event();
+      resolver.ResolveSample(sample_event, &stack.frames);
+      for (Frame& frame : stack.frames) {
+        if (frame.symbol != 0) {
+          frame.offset = 0;
+        }
+      }
+      if (options.skip_kernel_top) {
+        auto user = std::find_if(stack.frames.begin(), stack.frames.end(), [&](const Frame& f) {
+          return !android::base::StartsWith(strings.Get(f.dso), "[kernel");
+        });
+        if (user != stack.frames.end()) {
+          stack.frames.erase(stack.frames.begin(), user);
+        }
+      }
+      if (stack.frames.empty()) {
+        continue;
+      }
+      stack.process = sample_event.pid();
+      stack.thread = options.by_thread ? sample_event.tid() : 0;
+      stack.Encode(&key);
+      auto inserted = pending_ids.emplace(key, pending.size());
+      if (inserted.second) {
+        pending.push_back(PendingStack{ stack.process, stack.thread, stack.frames });
+        pending_counts.push_back(0);
+      }
+      pending_counts[inserted.first->second]++;
+      aggregate->samples++;
+    } else {
+      resolver.ProcessEvent(event);
+    }
+  }
+
+  for (size_t i = 0; i < pending.size(); ++i) {
+    stack.process = get_name(pending[i].pid);
+    stack.thread = options.by_thread ? get_name(pending[i].tid) + 1 : 0;
+    stack.frames = std::move(pending[i].frames);
+    stack.Encode(&key);
+    aggregate->stacks[key] += pending_counts[i];
+  }
+
+  // Profiles aggregated on the device come with resolved stacks.
+  if (record.has_aggregated_profile()) {
+    const auto& profile = record.aggregated_profile();
+    std::vector<uint32_t> remap;
+    for (const std::string& str : profile.strings()) {
+      remap.push_back(strings.Intern(str));
+    }
+    auto get_string = [&](uint32_t index) {
+      return index < remap.size() ? remap[index] : unknown;
+    };
+    stack.process = strings.Intern(kAggregated);
+    stack.thread = options.by_thread ? stack.process + 1 : 0;
+    for (const auto& aggregated_stack : profile.stacks()) {
+      stack.frames.clear();
+      for (const auto& aggregated_frame : aggregated_stack.frames()) {
+        Frame frame = { get_string(aggregated_frame.dso()), aggregated_frame.offset(), 0 };
+        if (aggregated_frame.symbol() != 0) {
+          frame.symbol = get_string(aggregated_frame.symbol() - 1) + 1;
+          frame.offset = 0;
+        }
+        stack.frames.push_back(frame);
+      }
+      stack.Encode(&key);
+      aggregate->stacks[key] += aggregated_stack.count();
+      aggregate->samples += aggregated_stack.count();
+    }
+  }
+}
+
+const std::string& FrameName(const StringTable& strings, const Frame& frame) {
+  return strings.Get(frame.symbol != 0 ? frame.symbol - 1 : frame.dso);
+}
+
+// Writes rows through multi-row INSERTs prepared once per table.
+class SqliteTableWriter {
+ public:
+  SqliteTableWriter(sqlite3* db, const char* table, size_t columns)
+      : db_(db), table_(table), columns_(columns) {
+  }
+
+  ~SqliteTableWriter() {
+    sqlite3_finalize(full_stmt_);
+  }
+
+  bool AddRow(const std::vector<int64_t>& ints, const std::string* text = nullptr) {
+    rows_.push_back(Row{ ints, text });
+    return rows_.size() < kRowsPerInsert || Flush();
+  }
+
+  bool Flush() {
+    if (rows_.empty()) {
+      return true;
+    }
+    sqlite3_stmt* stmt = nullptr;
+    bool full = rows_.size() == kRowsPerInsert;
+    if (full && full_stmt_ != nullptr) {
+      stmt = full_stmt_;
+    } else if (!Prepare(rows_.size(), &stmt)) {
+      return false;
+    }
+    int index = 1;
+    for (const Row& row : rows_) {
+      for (int64_t value : row.ints) {
+        sqlite3_bind_int64(stmt, index++, value);
+      }
+      if (row.text != nullptr) {
+        sqlite3_bind_text(stmt, index++, row.text->data(), row.text->size(), SQLITE_STATIC);
+      }
+    }
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    if (!ok) {
+      LOG(ERROR) << "Failed to insert into " << table_ << ": " << sqlite3_errmsg(db_);
+    }
+    sqlite3_reset(stmt);
+    if (full) {
+      full_stmt_ = stmt;
+    } else {
+      sqlite3_finalize(stmt);
+    }
+    rows_.clear();
+    return ok;
+  }
+
+ private:
+  struct Row {
+    std::vector<int64_t> ints;
+    const std::string* text;
+  };
+
+  bool Prepare(size_t rows, sqlite3_stmt** stmt) {
+    std::string row = "(" + android::base::Join(std::vector<std::string>(columns_, "?"), ",") + ")";
+    std::string sql = StringPrintf("INSERT INTO %s VALUES ", table_) +
+        android::base::Join(std::vector<std::string>(rows, row), ",");
+    if (sqlite3_prepare_v2(db_, sql.c_str(), -1, stmt, nullptr) != SQLITE_OK) {
+      LOG(ERROR) << "Failed to prepare insert into " << table_ << ": " << sqlite3_errmsg(db_);
+      return false;
+    }
+    return true;
+  }
+
+  sqlite3* db_;
+  const char* table_;
+  size_t columns_;
+  sqlite3_stmt* full_stmt_ = nullptr;
+  std::vector<Row> rows_;
+};
+
+}  // namespace
+
+uint32_t StringTable::Intern(const std::string& str) {
+  auto it = ids_.find(str);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+  uint32_t id = strings_.size();
+  strings_.push_back(str);
+  ids_.emplace(str, id);
+  return id;
+}
+
+void Aggregate::Merge(const Aggregate& other) {
+  std::vector<uint32_t> remap(other.strings.size());
+  for (size_t i = 0; i < remap.size(); ++i) {
+    remap[i] = strings.Intern(other.strings.Get(i));
+  }
+  Stack stack;
+  std::string key;
+  for (const auto& it : other.stacks) {
+    stack.Decode(it.first);
+    stack.process = remap[stack.process];
+    if (stack.thread != 0) {
+      stack.thread = remap[stack.thread - 1] + 1;
+    }
+    for (Frame& frame : stack.frames) {
+      frame.dso = remap[frame.dso];
+      if (frame.symbol != 0) {
+        frame.symbol = remap[frame.symbol - 1] + 1;
+      }
+    }
+    stack.Encode(&key);
+    stacks[key] += it.second;
+  }
+  samples += other.samples;
+  files += other.files;
+  errors += other.errors;
+}
+
+// The files are read and aggregated on a number of threads, each aggregating on
+// its own, and the results are merged.
+Aggregate AggregateFiles(const std::vector<std::string>& files, const AggregateOptions& options) {
+  size_t jobs = options.jobs != 0 ? options.jobs : std::thread::hardware_concurrency();
+  jobs = std::max<size_t>(1, std::min(jobs, files.size()));
+  std::vector<Aggregate> aggregates(jobs);
+  std::atomic<size_t> next(0);
+  auto worker = [&](Aggregate* aggregate) {
+    for (size_t i = next++; i < files.size(); i = next++) {
+      PerfprofdRecord record;
+      if (!ReadRecord(files[i], &record)) {
+        aggregate->errors++;
+        continue;
+      }
+      AddRecord(options, record, aggregate);
+      aggregate->files++;
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < jobs; ++i) {
+    threads.emplace_back(worker, &aggregates[i]);
+  }
+  worker(&aggregates[0]);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 1; i < jobs; ++i) {
+    aggregates[0].Merge(aggregates[i]);
+    aggregates[i] = Aggregate();
+  }
+  return std::move(aggregates[0]);
+}
+
+bool WriteFolded(const Aggregate& aggregate, const std::string& path) {
+  std::unique_ptr<FILE, decltype(&fclose)> out(fopen(path.c_str(), "we"), fclose);
+  if (out == nullptr) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  Stack stack;
+  for (const auto& it : aggregate.stacks) {
+    stack.Decode(it.first);
+    std::string line = aggregate.strings.Get(stack.process);
+    if (stack.thread != 0) {
+      line += ";" + aggregate.strings.Get(stack.thread - 1);
+    }
+    for (auto frame = stack.frames.rbegin(); frame != stack.frames.rend(); ++frame) {
+      line += ";";
+      line += FrameName(aggregate.strings, *frame);
+      if (frame->symbol == 0) {
+        line += StringPrintf("+0x%" PRIx64, frame->offset);
+      }
+    }
+    fprintf(out.get(), "%s %" PRIu64 "\n", line.c_str(), it.second);
+  }
+  return !ferror(out.get());
+}
+
+bool WriteSqlite(const Aggregate& aggregate, const std::string& path) {
+  sqlite3* db_ptr = nullptr;
+  if (sqlite3_open(path.c_str(), &db_ptr) != SQLITE_OK) {
+    LOG(ERROR) << "Failed to open " << path << ": " << sqlite3_errmsg(db_ptr);
+    sqlite3_close(db_ptr);
+    return false;
+  }
+  std::unique_ptr<sqlite3, decltype(&sqlite3_close)> db(db_ptr, sqlite3_close);
+  auto exec = [&](const char* sql) {
+    char* error = nullptr;
+    if (sqlite3_exec(db.get(), sql, nullptr, nullptr, &error) != SQLITE_OK) {
+      LOG(ERROR) << "Failed to execute '" << sql << "': " << error;
+      sqlite3_free(error);
+      return false;
+    }
+    return true;
+  };
+  if (!exec("PRAGMA journal_mode = OFF") || !exec("PRAGMA synchronous = OFF") ||
+      !exec("DROP TABLE IF EXISTS pids") || !exec("DROP TABLE IF EXISTS tids") ||
+      !exec("DROP TABLE IF EXISTS syms") || !exec("DROP TABLE IF EXISTS dsos") ||
+      !exec("DROP TABLE IF EXISTS samples") || !exec("DROP TABLE IF EXISTS stacks") ||
+      !exec("CREATE TABLE pids (id integer PRIMARY KEY, name text)") ||
+      !exec("CREATE TABLE tids (id integer PRIMARY KEY, name text)") ||
+      !exec("CREATE TABLE syms (id integer PRIMARY KEY, name text)") ||
+      !exec("CREATE TABLE dsos (id integer PRIMARY KEY, name text)") ||
+      !exec("CREATE TABLE samples (id integer PRIMARY KEY, pid_id int not null, "
+            "tid_id int not null, count int not null)") ||
+      !exec("CREATE TABLE stacks (sample_id int not null, depth int not null, "
+            "dso_id int not null, sym_id int not null, offset int not null, "
+            "primary key (sample_id, depth))") ||
+      !exec("BEGIN TRANSACTION")) {
+    return false;
+  }
+
+  // Name tables share the ids of the string table, only the strings used in
+  // each role are written.
+  const StringTable& strings = aggregate.strings;
+  std::vector<uint8_t> roles(strings.size());
+  enum Role : uint8_t { kPid = 1, kTid = 2, kSym = 4, kDso = 8 };
+  Stack stack;
+  for (const auto& it : aggregate.stacks) {
+    stack.Decode(it.first);
+    roles[stack.process] |= kPid;
+    roles[stack.thread != 0 ? stack.thread - 1 : stack.process] |= kTid;
+    for (const Frame& frame : stack.frames) {
+      roles[frame.dso] |= kDso;
+      roles[frame.symbol != 0 ? frame.symbol - 1 : frame.dso] |= kSym;
+    }
+  }
+  SqliteTableWriter pids(db.get(), "pids", 2);
+  SqliteTableWriter tids(db.get(), "tids", 2);
+  SqliteTableWriter syms(db.get(), "syms", 2);
+  SqliteTableWriter dsos(db.get(), "dsos", 2);
+  bool ok = true;
+  for (size_t id = 0; id < strings.size() && ok; ++id) {
+    std::vector<int64_t> row = { static_cast<int64_t>(id) };
+    const std::string* name = &strings.Get(id);
+    ok = (!(roles[id] & kPid) || pids.AddRow(row, name)) &&
+        (!(roles[id] & kTid) || tids.AddRow(row, name)) &&
+        (!(roles[id] & kSym) || syms.AddRow(row, name)) &&
+        (!(roles[id] & kDso) || dsos.AddRow(row, name));
+  }
+  ok = ok && pids.Flush() && tids.Flush() && syms.Flush() && dsos.Flush();
+
+  // Samples and stacks, most sampled first.
+  std::vector<std::pair<const std::string*, uint64_t>> sorted;
+  sorted.reserve(aggregate.stacks.size());
+  for (const auto& it : aggregate.stacks) {
+    sorted.emplace_back(&it.first, it.second);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+    return a.second > b.second;
+  });
+  SqliteTableWriter samples(db.get(), "samples", 4);
+  SqliteTableWriter stacks(db.get(), "stacks", 5);
+  for (size_t id = 0; id < sorted.size() && ok; ++id) {
+    stack.Decode(*sorted[id].first);
+    int64_t sample_id = id;
+    int64_t tid = stack.thread != 0 ? stack.thread - 1 : stack.process;
+    ok = samples.AddRow({ sample_id, stack.process, tid, static_cast<int64_t>(sorted[id].second) });
+    for (size_t depth = 0; depth < stack.frames.size() && ok; ++depth) {
+      const Frame& frame = stack.frames[depth];
+      int64_t sym = frame.symbol != 0 ? frame.symbol - 1 : frame.dso;
+      ok = stacks.AddRow({ sample_id, static_cast<int64_t>(depth), frame.dso, sym,
+                           static_cast<int64_t>(frame.offset) });
+    }
+  }
+  ok = ok && samples.Flush() && stacks.Flush();
+  return ok && exec("COMMIT");
+}
+
+}  // namespace perfprofd
+}  // namespace android
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_EXTRAS_PERFPROFD_TOOLS_AGGREGATE_PROFILES_H_
+#define SYSTEM_EXTRAS_PERFPROFD_TOOLS_AGGREGATE_PROFILES_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace android {
+namespace perfprofd {
+
+struct AggregateOptions {
+  // Parallel jobs, 0 for the number of CPUs.
+  size_t jobs = 0;
+  bool by_thread = false;
+  bool skip_kernel_top = false;
+};
+
+class StringTable {
+ public:
+  uint32_t Intern(const std::string& str);
+
+  const std::string& Get(uint32_t id) const {
+    return strings_[id];
+  }
+
+  size_t size() const {
+    return strings_.size();
+  }
+
+ private:
+  std::vector<std::string> strings_;
+  std::unordered_map<std::string, uint32_t> ids_;
+};
+
+// Stack counts of a set of profiles. Stacks are keyed by an encoding of their
+// process and thread names and of their frames.
+struct Aggregate {
+  StringTable strings;
+  std::unordered_map<std::string, uint64_t> stacks;
+  uint64_t samples = 0;
+  size_t files = 0;
+  size_t errors = 0;
+
+  // Add the stacks of other, renumbering its strings.
+  void Merge(const Aggregate& other);
+};
+
+// Read and aggregate the stacks of PerfprofdRecord files, compressed or not.
+Aggregate AggregateFiles(const std::vector<std::string>& files, const AggregateOptions& options);
+
+// Stacks in the format of flamegraph.pl: outermost frame first, separated by
+// semicolons, followed by the count.
+bool WriteFolded(const Aggregate& aggregate, const std::string& path);
+
+// A database with the schema of scripts/perf_proto_json2sqlite.py, with a
+// sample row per distinct stack and its number of samples in samples.count.
+bool WriteSqlite(const Aggregate& aggregate, const std::string& path);
+
+}  // namespace perfprofd
+}  // namespace android
+
+#endif  // SYSTEM_EXTRAS_PERFPROFD_TOOLS_AGGREGATE_PROFILES_H_
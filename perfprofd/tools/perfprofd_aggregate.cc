@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Aggregates the stacks of many perfprofd profiles (PerfprofdRecord files,
+// compressed or not) into a SQLite database and/or folded stacks, as a fast
+// replacement of scripts/perf_proto_stack.py and perf_proto_json2sqlite.py.
+//
+// Files are read and symbolized in parallel. Frames are resolved with the
+// mmap events of the profile and named with its on-device symbols
+// (SymbolInfo); frames without symbol are named after their dso and keep
+// their offset. Stacks are counted per process (and thread, with
+// --by-thread), so the output is proportional to the number of distinct
+// stacks rather than samples.
+//
+// The SQLite schema is the one of perf_proto_json2sqlite.py, with a sample
+// row per distinct stack and its number of samples in samples.count.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+
+#include "aggregate_profiles.h"
+
+namespace {
+
+using android::perfprofd::Aggregate;
+using android::perfprofd::AggregateFiles;
+using android::perfprofd::AggregateOptions;
+using android::perfprofd::WriteFolded;
+using android::perfprofd::WriteSqlite;
+
+struct Options {
+  std::vector<std::string> files;
+  AggregateOptions aggregate;
+  std::string sqlite_out;
+  std::string folded_out;
+};
+
+void Usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [options] file...\n"
+          "  -j N                parallel jobs (default: number of CPUs)\n"
+          "  --sqlite-out FILE   write a SQLite database\n"
+          "  --folded-out FILE   write folded stacks for flamegraph.pl\n"
+          "  --by-thread         aggregate per thread, not only per process\n"
+          "  --skip-kernel-top   drop kernel frames at the top of stacks\n",
+          argv0);
+}
+
+bool ParseArgs(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto next = [&]() -> std::string {
+      return i + 1 < argc ? argv[++i] : "";
+    };
+    if (arg == "-j") {
+      if (!android::base::ParseUint(next(), &options->aggregate.jobs)) {
+        return false;
+      }
+    } else if (arg == "--sqlite-out") {
+      options->sqlite_out = next();
+    } else if (arg == "--folded-out") {
+      options->folded_out = next();
+    } else if (arg == "--by-thread") {
+      options->aggregate.by_thread = true;
+    } else if (arg == "--skip-kernel-top") {
+      options->aggregate.skip_kernel_top = true;
+    } else if (!arg.empty() && arg[0] == '-') {
+      return false;
+    } else {
+      options->files.push_back(arg);
+    }
+  }
+  return !options->files.empty();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv, android::base::StderrLogger);
+
+  Options options;
+  if (!ParseArgs(argc, argv, &options)) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  Aggregate aggregate = AggregateFiles(options.files, options.aggregate);
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%zu files (%zu failed), %" PRIu64 " samples, %zu stacks in %.2f s\n",
+         aggregate.files, aggregate.errors, aggregate.samples, aggregate.stacks.size(), seconds);
+
+  bool ok = aggregate.errors == 0;
+  if (!options.sqlite_out.empty()) {
+    ok = WriteSqlite(aggregate, options.sqlite_out) && ok;
+  }
+  if (!options.folded_out.empty()) {
+    ok = WriteFolded(aggregate, options.folded_out) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -122,6 +122,7 @@ libsimpleperf_src_files_linux := \
   perf_clock.cpp \
   read_dex_file.cpp \
   record_file_writer.cpp \
+  SchedLatencyAnalyzer.cpp \
   UnixSocket.cpp \
   workload.cpp \
 
@@ -382,6 +383,7 @@ simpleperf_unit_test_src_files_linux := \
   IOEventLoop_test.cpp \
   read_dex_file_test.cpp \
   record_file_test.cpp \
+  SchedLatencyAnalyzer_test.cpp \
   UnixSocket_test.cpp \
   workload_test.cpp \
 
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SchedLatencyAnalyzer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace simpleperf {
+
+void LatencyHistogram::Add(uint64_t latency_in_ns) {
+  if (buckets_.empty()) {
+    buckets_.resize(BUCKET_COUNT, 0);
+  }
+  buckets_[GetBucketIndex(latency_in_ns)]++;
+  count_++;
+  max_ = std::max(max_, latency_in_ns);
+}
+
+uint64_t LatencyHistogram::GetPercentile(double percentile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  uint64_t target = std::max<uint64_t>(1, std::ceil(count_ * percentile / 100));
+  uint64_t sum = 0;
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    sum += buckets_[i];
+    if (sum >= target) {
+      return std::min(max_, GetBucketUpperBound(i));
+    }
+  }
+  return max_;
+}
+
+size_t LatencyHistogram::GetBucketIndex(uint64_t value) {
+  if (value < SUB_BUCKET_COUNT) {
+    return value;
+  }
+  size_t shift = (63 - __builtin_clzll(value)) - SUB_BUCKET_BITS;
+  return (shift + 1) * SUB_BUCKET_COUNT + ((value >> shift) & (SUB_BUCKET_COUNT - 1));
+}
+
+uint64_t LatencyHistogram::GetBucketUpperBound(size_t index) {
+  if (index < SUB_BUCKET_COUNT) {
+    return index;
+  }
+  size_t shift = index / SUB_BUCKET_COUNT - 1;
+  uint64_t lower = (SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT) << shift;
+  return lower + (1ULL << shift) - 1;
+}
+
+void SchedLatencyAnalyzer::ProcessWakeup(uint64_t timestamp, pid_t tid, uint32_t target_cpu) {
+  // A thread already waiting in a runqueue can be woken up again, keep the earliest wakeup.
+  if (tid != 0 && runnable_threads_.find(tid) == runnable_threads_.end()) {
+    AddRunnableThread(tid, target_cpu, timestamp, true);
+  }
+}
+
+void SchedLatencyAnalyzer::ProcessSwitch(uint64_t timestamp, uint32_t cpu, pid_t prev_tid,
+                                         uint64_t prev_state, pid_t next_tid,
+                                         const char* next_comm) {
+  // Bits of prev_state other than the task states below TASK_PARKED only mark a preemption, and
+  // a preempted thread stays in the runqueue.
+  constexpr uint64_t TASK_STATE_MASK = 0x7f;
+  if (prev_tid != 0) {
+    if ((prev_state & TASK_STATE_MASK) == 0) {
+      AddRunnableThread(prev_tid, cpu, timestamp, false);
+    } else {
+      // A wakeup can hit a thread that is still running, before it goes to sleep. The thread
+      // left the runqueue, so drop that wakeup and wait for the next one.
+      auto it = runnable_threads_.find(prev_tid);
+      if (it != runnable_threads_.end()) {
+        UpdateRunqueueDepth(it->second.cpu, timestamp, -1);
+        runnable_threads_.erase(it);
+      }
+    }
+  }
+  if (next_tid == 0) {
+    return;
+  }
+  auto it = runnable_threads_.find(next_tid);
+  if (it == runnable_threads_.end()) {
+    return;
+  }
+  const RunnableInfo& runnable = it->second;
+  // The thread may have migrated to this cpu, but it waited in the runqueue it was added to.
+  UpdateRunqueueDepth(runnable.cpu, timestamp, -1);
+  if (runnable.is_wakeup && timestamp >= runnable.wakeup_timestamp) {
+    ThreadLatencyInfo& thread = latency_map_[next_tid];
+    if (thread.name.empty()) {
+      thread.name = next_comm;
+    }
+    thread.wakeup_latency.Add(timestamp - runnable.wakeup_timestamp);
+  }
+  runnable_threads_.erase(it);
+}
+
+void SchedLatencyAnalyzer::Finish() {
+  if (runqueue_interval_start_ == 0) {
+    return;
+  }
+  uint64_t end_timestamp = 0;
+  for (auto& runqueue : runqueues_) {
+    end_timestamp = std::max(end_timestamp, runqueue.last_update_timestamp);
+  }
+  UpdateRunqueueTime(end_timestamp);
+  if (end_timestamp > runqueue_interval_start_) {
+    FlushRunqueueInterval(end_timestamp);
+  }
+}
+
+void SchedLatencyAnalyzer::AddRunnableThread(pid_t tid, uint32_t cpu, uint64_t timestamp,
+                                             bool is_wakeup) {
+  auto it = runnable_threads_.find(tid);
+  if (it != runnable_threads_.end()) {
+    UpdateRunqueueDepth(it->second.cpu, timestamp, -1);
+  }
+  RunnableInfo& runnable = runnable_threads_[tid];
+  runnable.cpu = cpu;
+  runnable.wakeup_timestamp = timestamp;
+  runnable.is_wakeup = is_wakeup;
+  UpdateRunqueueDepth(cpu, timestamp, 1);
+}
+
+// Move time of all runqueues forward to timestamp, reporting a depth sample for each runqueue
+// interval passed.
+void SchedLatencyAnalyzer::UpdateRunqueueTime(uint64_t timestamp) {
+  if (runqueue_interval_start_ == 0) {
+    runqueue_interval_start_ = timestamp;
+  }
+  while (timestamp >= runqueue_interval_start_ + runqueue_interval_in_ns_) {
+    FlushRunqueueInterval(runqueue_interval_start_ + runqueue_interval_in_ns_);
+  }
+  for (auto& runqueue : runqueues_) {
+    // Records from different cpus may be slightly out of order.
+    if (timestamp > runqueue.last_update_timestamp) {
+      uint64_t start = std::max(runqueue.last_update_timestamp, runqueue_interval_start_);
+      runqueue.depth_time_in_interval += runqueue.depth * (timestamp - start);
+      runqueue.last_update_timestamp = timestamp;
+    }
+  }
+}
+
+void SchedLatencyAnalyzer::FlushRunqueueInterval(uint64_t interval_end) {
+  std::vector<RunqueueDepthSample> samples(runqueues_.size());
+  uint64_t interval_in_ns = interval_end - runqueue_interval_start_;
+  for (size_t cpu = 0; cpu < runqueues_.size(); ++cpu) {
+    RunqueueInfo& runqueue = runqueues_[cpu];
+    if (interval_end > runqueue.last_update_timestamp) {
+      uint64_t start = std::max(runqueue.last_update_timestamp, runqueue_interval_start_);
+      runqueue.depth_time_in_interval += runqueue.depth * (interval_end - start);
+      runqueue.last_update_timestamp = interval_end;
+    }
+    if (interval_in_ns != 0) {
+      samples[cpu].avg_depth = static_cast<double>(runqueue.depth_time_in_interval) /
+          interval_in_ns;
+    }
+    samples[cpu].max_depth = std::max(runqueue.max_depth_in_interval, runqueue.depth);
+    runqueue.depth_time_in_interval = 0;
+    runqueue.max_depth_in_interval = runqueue.depth;
+  }
+  interval_callback_(runqueue_interval_start_, samples);
+  runqueue_interval_start_ = interval_end;
+}
+
+void SchedLatencyAnalyzer::UpdateRunqueueDepth(uint32_t cpu, uint64_t timestamp, int delta) {
+  UpdateRunqueueTime(timestamp);
+  if (cpu >= runqueues_.size()) {
+    size_t old_size = runqueues_.size();
+    runqueues_.resize(cpu + 1);
+    for (size_t i = old_size; i < runqueues_.size(); ++i) {
+      runqueues_[i].last_update_timestamp = timestamp;
+    }
+  }
+  RunqueueInfo& runqueue = runqueues_[cpu];
+  if (delta < 0 && runqueue.depth == 0) {
+    // The thread was added to the runqueue before recording started.
+    return;
+  }
+  runqueue.depth += delta;
+  runqueue.max_depth_in_interval = std::max(runqueue.max_depth_in_interval, runqueue.depth);
+}
+
+}  // namespace simpleperf
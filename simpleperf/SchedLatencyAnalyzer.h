@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SIMPLE_PERF_SCHED_LATENCY_ANALYZER_H_
+#define SIMPLE_PERF_SCHED_LATENCY_ANALYZER_H_
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace simpleperf {
+
+// LatencyHistogram keeps a log-linear histogram of latencies in ns. Each power-of-two range is
+// split into 16 buckets, so percentiles have less than 1/16 relative error, and the memory used
+// doesn't depend on how many latencies are added.
+class LatencyHistogram {
+ public:
+  void Add(uint64_t latency_in_ns);
+
+  uint64_t Count() const { return count_; }
+  uint64_t Max() const { return max_; }
+
+  // Return the upper bound of the bucket containing the given percentile.
+  uint64_t GetPercentile(double percentile) const;
+
+ private:
+  static constexpr size_t SUB_BUCKET_BITS = 4;
+  static constexpr size_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+  static constexpr size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+  static size_t GetBucketIndex(uint64_t value);
+  static uint64_t GetBucketUpperBound(size_t index);
+
+  std::vector<uint32_t> buckets_;
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+};
+
+struct ThreadLatencyInfo {
+  std::string name;
+  LatencyHistogram wakeup_latency;
+};
+
+struct RunqueueDepthSample {
+  double avg_depth = 0;
+  uint32_t max_depth = 0;
+};
+
+// SchedLatencyAnalyzer computes wakeup-to-run latency of each thread and runqueue depth of each
+// cpu from sched:sched_wakeup and sched:sched_switch events. Runqueue depth is reported through
+// a callback when each interval ends, so memory used is bounded by the count of threads and cpus
+// rather than by the trace length.
+class SchedLatencyAnalyzer {
+ public:
+  // Called with the start time of an interval and a depth sample for each cpu seen so far.
+  using IntervalCallback =
+      std::function<void(uint64_t interval_start, const std::vector<RunqueueDepthSample>&)>;
+
+  SchedLatencyAnalyzer(uint64_t runqueue_interval_in_ns, IntervalCallback interval_callback)
+      : runqueue_interval_in_ns_(runqueue_interval_in_ns),
+        interval_callback_(interval_callback),
+        runqueue_interval_start_(0) {}
+
+  void ProcessWakeup(uint64_t timestamp, pid_t tid, uint32_t target_cpu);
+  void ProcessSwitch(uint64_t timestamp, uint32_t cpu, pid_t prev_tid, uint64_t prev_state,
+                     pid_t next_tid, const char* next_comm);
+  // Report the last, partial runqueue interval.
+  void Finish();
+
+  // Latencies of threads that were woken up and then switched in. Idle threads (tid 0) are
+  // never added.
+  const std::unordered_map<pid_t, ThreadLatencyInfo>& GetThreadLatencies() const {
+    return latency_map_;
+  }
+
+ private:
+  // A thread waiting in a runqueue, either after being woken up or after being preempted.
+  struct RunnableInfo {
+    uint32_t cpu;
+    uint64_t wakeup_timestamp;
+    bool is_wakeup;  // false if the thread was preempted
+  };
+
+  struct RunqueueInfo {
+    uint32_t depth = 0;  // threads waiting to run, not counting the running one
+    uint64_t last_update_timestamp = 0;
+    uint64_t depth_time_in_interval = 0;  // sum of depth * ns in current interval
+    uint32_t max_depth_in_interval = 0;
+  };
+
+  void AddRunnableThread(pid_t tid, uint32_t cpu, uint64_t timestamp, bool is_wakeup);
+  void UpdateRunqueueTime(uint64_t timestamp);
+  void UpdateRunqueueDepth(uint32_t cpu, uint64_t timestamp, int delta);
+  void FlushRunqueueInterval(uint64_t interval_end);
+
+  const uint64_t runqueue_interval_in_ns_;
+  IntervalCallback interval_callback_;
+  std::unordered_map<pid_t, ThreadLatencyInfo> latency_map_;
+  std::unordered_map<pid_t, RunnableInfo> runnable_threads_;
+  std::vector<RunqueueInfo> runqueues_;
+  uint64_t runqueue_interval_start_;
+};
+
+}  // namespace simpleperf
+
+#endif  // SIMPLE_PERF_SCHED_LATENCY_ANALYZER_H_
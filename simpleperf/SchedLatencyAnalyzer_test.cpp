@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SchedLatencyAnalyzer.h"
+
+#include <gtest/gtest.h>
+
+#include <utility>
+#include <vector>
+
+using namespace simpleperf;
+
+// Task state of a thread going to sleep in sched:sched_switch.
+static constexpr uint64_t TASK_INTERRUPTIBLE = 1;
+
+TEST(SchedLatencyAnalyzer, latency_and_runqueue_depth) {
+  std::vector<std::pair<uint64_t, std::vector<RunqueueDepthSample>>> intervals;
+  auto interval_callback = [&](uint64_t start, const std::vector<RunqueueDepthSample>& samples) {
+    intervals.emplace_back(start, samples);
+  };
+  SchedLatencyAnalyzer analyzer(1000, interval_callback);
+  // Two threads are woken up on cpu 0, and run one after the other.
+  analyzer.ProcessWakeup(10000, 1, 0);
+  analyzer.ProcessWakeup(10000, 2, 0);
+  analyzer.ProcessSwitch(10500, 0, 0, 0, 1, "t1");
+  analyzer.ProcessSwitch(11500, 0, 1, TASK_INTERRUPTIBLE, 2, "t2");
+  // Thread 1 is woken up twice more on cpu 1, while cpu 1 switches to and from idle.
+  analyzer.ProcessWakeup(12000, 1, 1);
+  analyzer.ProcessSwitch(13010, 1, 0, 0, 1, "t1");
+  analyzer.ProcessSwitch(13100, 1, 1, TASK_INTERRUPTIBLE, 0, "swapper/1");
+  analyzer.ProcessWakeup(14000, 1, 1);
+  analyzer.ProcessSwitch(17000, 1, 0, 0, 1, "t1");
+  analyzer.Finish();
+
+  const auto& latencies = analyzer.GetThreadLatencies();
+  ASSERT_EQ(latencies.size(), 2u);
+  ASSERT_EQ(latencies.count(0), 0u);
+  const ThreadLatencyInfo& t1 = latencies.at(1);
+  ASSERT_EQ(t1.name, "t1");
+  // Latencies of thread 1 are 500, 1010 and 3000 ns. 1010 is in bucket [992, 1023], and 3000 is
+  // in bucket [2944, 3071], capped by the max latency.
+  ASSERT_EQ(t1.wakeup_latency.Count(), 3u);
+  ASSERT_EQ(t1.wakeup_latency.GetPercentile(50), 1023u);
+  ASSERT_EQ(t1.wakeup_latency.GetPercentile(99), 3000u);
+  ASSERT_EQ(t1.wakeup_latency.Max(), 3000u);
+  const ThreadLatencyInfo& t2 = latencies.at(2);
+  ASSERT_EQ(t2.wakeup_latency.Count(), 1u);
+  ASSERT_EQ(t2.wakeup_latency.GetPercentile(50), 1500u);
+
+  // Intervals start at the first event, and the last one ends at the last event.
+  ASSERT_EQ(intervals.size(), 7u);
+  // [10000, 11000): two threads wait for 500 ns, then one waits for 500 ns.
+  ASSERT_EQ(intervals[0].first, 10000u);
+  ASSERT_EQ(intervals[0].second.size(), 1u);
+  ASSERT_DOUBLE_EQ(intervals[0].second[0].avg_depth, 1.5);
+  ASSERT_EQ(intervals[0].second[0].max_depth, 2u);
+  // [11000, 12000): one thread waits for 500 ns.
+  ASSERT_EQ(intervals[1].first, 11000u);
+  ASSERT_DOUBLE_EQ(intervals[1].second[0].avg_depth, 0.5);
+  ASSERT_EQ(intervals[1].second[0].max_depth, 1u);
+  // [12000, 13000): cpu 1 shows up, with one thread waiting all the time.
+  ASSERT_EQ(intervals[2].first, 12000u);
+  ASSERT_EQ(intervals[2].second.size(), 2u);
+  ASSERT_DOUBLE_EQ(intervals[2].second[0].avg_depth, 0);
+  ASSERT_EQ(intervals[2].second[0].max_depth, 0u);
+  ASSERT_DOUBLE_EQ(intervals[2].second[1].avg_depth, 1);
+  ASSERT_EQ(intervals[2].second[1].max_depth, 1u);
+  // [13000, 14000): the thread waits for 10 ns.
+  ASSERT_DOUBLE_EQ(intervals[3].second[1].avg_depth, 0.01);
+  ASSERT_EQ(intervals[3].second[1].max_depth, 1u);
+  // [16000, 17000): the thread waits until the end.
+  ASSERT_EQ(intervals[6].first, 16000u);
+  ASSERT_DOUBLE_EQ(intervals[6].second[1].avg_depth, 1);
+  ASSERT_EQ(intervals[6].second[1].max_depth, 1u);
+}
+
+TEST(SchedLatencyAnalyzer, wakeup_before_sleep) {
+  std::vector<std::pair<uint64_t, std::vector<RunqueueDepthSample>>> intervals;
+  auto interval_callback = [&](uint64_t start, const std::vector<RunqueueDepthSample>& samples) {
+    intervals.emplace_back(start, samples);
+  };
+  SchedLatencyAnalyzer analyzer(1000, interval_callback);
+  // Thread 1 is woken up while still running, then goes to sleep.
+  analyzer.ProcessWakeup(1000, 1, 0);
+  analyzer.ProcessSwitch(1100, 0, 1, TASK_INTERRUPTIBLE, 0, "swapper/0");
+  // Its next wakeup is the one it waits for.
+  analyzer.ProcessWakeup(5000, 1, 0);
+  analyzer.ProcessSwitch(5200, 0, 0, 0, 1, "t1");
+  analyzer.Finish();
+
+  const ThreadLatencyInfo& t1 = analyzer.GetThreadLatencies().at(1);
+  ASSERT_EQ(t1.wakeup_latency.Count(), 1u);
+  ASSERT_EQ(t1.wakeup_latency.Max(), 200u);
+
+  ASSERT_EQ(intervals.size(), 5u);
+  // [1000, 2000): the early wakeup counts until the thread goes to sleep.
+  ASSERT_DOUBLE_EQ(intervals[0].second[0].avg_depth, 0.1);
+  // [2000, 5000): the sleeping thread isn't in the runqueue.
+  for (size_t i = 1; i < 4; ++i) {
+    ASSERT_DOUBLE_EQ(intervals[i].second[0].avg_depth, 0);
+    ASSERT_EQ(intervals[i].second[0].max_depth, 0u);
+  }
+  // [5000, 5200): the thread waits until it runs.
+  ASSERT_DOUBLE_EQ(intervals[4].second[0].avg_depth, 1);
+}
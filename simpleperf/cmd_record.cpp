@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
 #include <signal.h>
@@ -31,6 +32,7 @@
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
 #if defined(__ANDROID__)
 #include <android-base/properties.h>
 #endif
@@ -186,6 +188,10 @@ class RecordCommand : public Command {
 "                        dumped in perf.data, to support reporting in another\n"
 "                        environment.\n"
 "-o record_file_name    Set record file name, default is perf.data.\n"
+"--out-fd fd_no         Write perf.data to file descriptor <fd_no> instead of\n"
+"                       record_file_name, which is then only used to decide the\n"
+"                       directory of temporary files. The fd should be seekable,\n"
+"                       like a memfd, and is truncated before writing.\n"
 "--exit-with-parent            Stop recording when the process starting\n"
 "                              simpleperf dies.\n"
 "--size-limit SIZE[K|M|G]      Stop recording after SIZE bytes of records.\n"
@@ -221,6 +227,7 @@ class RecordCommand : public Command {
         sample_record_count_(0),
         lost_record_count_(0),
         start_profiling_fd_(-1),
+        out_fd_(-1),
         in_app_context_(false),
         trace_offcpu_(false),
         exclude_kernel_callchain_(false),
@@ -261,6 +268,7 @@ class RecordCommand : public Command {
 
   void UpdateRecordForEmbeddedElfPath(Record* record);
   bool UnwindRecord(SampleRecord& r);
+  bool MoveRecordFileToTempFile(const std::string& tmp_path);
   bool PostUnwindRecords();
   bool JoinCallChains();
   bool DumpAdditionalFeatures(const std::vector<std::string>& args);
@@ -297,6 +305,7 @@ class RecordCommand : public Command {
   uint64_t sample_record_count_;
   uint64_t lost_record_count_;
   int start_profiling_fd_;
+  int out_fd_;
   std::string app_package_name_;
   bool in_app_context_;
   bool trace_offcpu_;
@@ -724,6 +733,10 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
         return false;
       }
       record_filename_ = args[i];
+    } else if (args[i] == "--out-fd") {
+      if (!GetUintOption(args, &i, &out_fd_)) {
+        return false;
+      }
     } else if (args[i] == "-p") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -891,8 +904,18 @@ bool RecordCommand::CreateAndInitRecordFile() {
 
 std::unique_ptr<RecordFileWriter> RecordCommand::CreateRecordFile(
     const std::string& filename) {
-  std::unique_ptr<RecordFileWriter> writer =
-      RecordFileWriter::CreateInstance(filename);
+  std::unique_ptr<RecordFileWriter> writer;
+  if (out_fd_ != -1) {
+    // The writer closes the fd it is given, but out_fd_ may be rewritten after post processing.
+    int fd = dup(out_fd_);
+    if (fd == -1) {
+      PLOG(ERROR) << "failed to dup out_fd " << out_fd_;
+      return nullptr;
+    }
+    writer = RecordFileWriter::CreateInstance(fd);
+  } else {
+    writer = RecordFileWriter::CreateInstance(filename);
+  }
   if (writer == nullptr) {
     return nullptr;
   }
@@ -1217,6 +1240,36 @@ bool RecordCommand::UnwindRecord(SampleRecord& r) {
   return true;
 }
 
+bool RecordCommand::MoveRecordFileToTempFile(const std::string& tmp_path) {
+  if (out_fd_ == -1) {
+    return Workload::RunCmd({"mv", record_filename_, tmp_path});
+  }
+  // The content of out_fd_ is copied instead, and replaced when the record file is written again.
+  android::base::unique_fd tmp_fd(open(tmp_path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC));
+  if (tmp_fd == -1) {
+    PLOG(ERROR) << "failed to open " << tmp_path;
+    return false;
+  }
+  std::vector<char> buf(64 * 1024);
+  off_t offset = 0;
+  while (true) {
+    ssize_t n = TEMP_FAILURE_RETRY(pread(out_fd_, buf.data(), buf.size(), offset));
+    if (n < 0) {
+      PLOG(ERROR) << "failed to read out_fd " << out_fd_;
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    if (!android::base::WriteFully(tmp_fd, buf.data(), n)) {
+      PLOG(ERROR) << "failed to write " << tmp_path;
+      return false;
+    }
+    offset += n;
+  }
+  return true;
+}
+
 bool RecordCommand::PostUnwindRecords() {
   // 1. Move records from record_filename_ to a temporary file.
   if (!record_file_writer_->Close()) {
@@ -1224,7 +1277,7 @@ bool RecordCommand::PostUnwindRecords() {
   }
   record_file_writer_.reset();
   std::unique_ptr<TemporaryFile> tmp_file = ScopedTempFiles::CreateTempFile();
-  if (!Workload::RunCmd({"mv", record_filename_, tmp_file->path})) {
+  if (!MoveRecordFileToTempFile(tmp_file->path)) {
     return false;
   }
   std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmp_file->path);
@@ -1256,7 +1309,7 @@ bool RecordCommand::JoinCallChains() {
   }
   record_file_writer_.reset();
   std::unique_ptr<TemporaryFile> tmp_file = ScopedTempFiles::CreateTempFile();
-  if (!Workload::RunCmd({"mv", record_filename_, tmp_file->path})) {
+  if (!MoveRecordFileToTempFile(tmp_file->path)) {
     return false;
   }
 
@@ -117,6 +117,16 @@ TEST(record_cmd, output_file_option) {
   ASSERT_TRUE(RecordCmd()->Run({"-o", tmpfile.path, "sleep", SLEEP_SEC}));
 }
 
+TEST(record_cmd, out_fd_option) {
+  TemporaryFile tmpfile;
+  TemporaryDir tmpdir;
+  std::string unused_file = std::string(tmpdir.path) + "/perf.data";
+  ASSERT_TRUE(RecordCmd()->Run({"-f", "99", "-o", unused_file, "--out-fd",
+                                std::to_string(tmpfile.fd), "sleep", SLEEP_SEC}));
+  ASSERT_NE(access(unused_file.c_str(), F_OK), 0);
+  CheckEventType(tmpfile.path, "cpu-cycles", 0, 99u);
+}
+
 TEST(record_cmd, dump_kernel_mmap) {
   TemporaryFile tmpfile;
   ASSERT_TRUE(RunRecordCmd({}, tmpfile.path));
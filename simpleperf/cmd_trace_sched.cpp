@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <memory>
 #include <queue>
 #include <string>
@@ -29,10 +30,12 @@
 #include "record.h"
 #include "record_file.h"
 #include "SampleDisplayer.h"
+#include "SchedLatencyAnalyzer.h"
 #include "tracing.h"
 #include "utils.h"
 
 using android::base::StringPrintf;
+using namespace simpleperf;
 
 namespace {
 
@@ -60,6 +63,17 @@ struct ThreadInfo {
   SpinInfo spin_info;
 };
 
+enum SchedEvent {
+  SCHED_STAT_RUNTIME,
+  SCHED_WAKEUP,
+  SCHED_SWITCH,
+  SCHED_UNKNOWN,
+};
+
+constexpr const char* SCHED_EVENT_NAMES[] = {
+    "sched:sched_stat_runtime", "sched:sched_wakeup", "sched:sched_switch",
+};
+
 struct ProcessInfo {
   pid_t process_id = 0;
   std::string name;
@@ -85,13 +99,23 @@ class TraceSchedCommand : public Command {
 "        [spin-rate] can be set by --spin-rate. Default check_period is 1 sec.\n"
 "--spin-rate spin-rate   Default is 0.8. Vaild range is (0, 1].\n"
 "--show-threads          Show runtime of each thread.\n"
+"--show-latency          Also record sched:sched_wakeup and sched:sched_switch events,\n"
+"                        report wakeup-to-run latency (p50/p99/max) of each thread,\n"
+"                        and runqueue depth of each cpu over time.\n"
+"--runqueue-interval time_in_ms\n"
+"        Report runqueue depth of each cpu for every time_in_ms milliseconds\n"
+"        when --show-latency is used, as each interval ends. Default is 1000.\n"
 "--record-file file_path   Read records from file_path.\n"
                 // clang-format on
                 ),
         duration_in_sec_(10.0),
         spinloop_check_period_in_sec_(1.0),
         spinloop_check_rate_(0.8),
-        show_threads_(false) {
+        show_threads_(false),
+        show_latency_(false),
+        runqueue_interval_in_ms_(1000),
+        first_interval_start_(0),
+        reported_cpu_count_(0) {
   }
 
   bool Run(const std::vector<std::string>& args);
@@ -102,18 +126,40 @@ class TraceSchedCommand : public Command {
   bool ParseSchedEvents(const std::string& record_file_path);
   void ProcessRecord(Record& record);
   void ProcessSampleRecord(const SampleRecord& record);
+  void ProcessWakeupRecord(const SampleRecord& record);
+  void ProcessSwitchRecord(const SampleRecord& record);
+  void ReportRunqueueDepth(uint64_t interval_start,
+                           const std::vector<RunqueueDepthSample>& samples);
   std::vector<ProcessInfo> BuildProcessInfo();
   void ReportProcessInfo(const std::vector<ProcessInfo>& processes);
+  void ReportLatencyInfo();
 
   double duration_in_sec_;
   double spinloop_check_period_in_sec_;
   double spinloop_check_rate_;
   bool show_threads_;
+  bool show_latency_;
+  uint64_t runqueue_interval_in_ms_;
   std::string record_file_;
+  std::unique_ptr<RecordFileReader> record_file_reader_;
+  // Map from attr index in the record file to the sched event it records.
+  std::vector<SchedEvent> attr_events_;
 
   StringTracingFieldPlace tracing_field_comm_;
   TracingFieldPlace tracing_field_runtime_;
+  TracingFieldPlace tracing_field_wakeup_pid_;
+  TracingFieldPlace tracing_field_wakeup_target_cpu_;
+  TracingFieldPlace tracing_field_switch_prev_pid_;
+  TracingFieldPlace tracing_field_switch_prev_state_;
+  TracingFieldPlace tracing_field_switch_next_pid_;
+  StringTracingFieldPlace tracing_field_switch_next_comm_;
   std::unordered_map<pid_t, ThreadInfo> thread_map_;
+
+  // Used by --show-latency. Runqueue depth is printed as each interval ends, with the header
+  // printed again when a new cpu shows up.
+  std::unique_ptr<SchedLatencyAnalyzer> latency_analyzer_;
+  uint64_t first_interval_start_;
+  size_t reported_cpu_count_;
 };
 
 bool TraceSchedCommand::Run(const std::vector<std::string>& args) {
@@ -132,6 +178,9 @@ bool TraceSchedCommand::Run(const std::vector<std::string>& args) {
   }
   std::vector<ProcessInfo> processes = BuildProcessInfo();
   ReportProcessInfo(processes);
+  if (show_latency_) {
+    ReportLatencyInfo();
+  }
   return true;
 }
 
@@ -152,6 +201,12 @@ bool TraceSchedCommand::ParseOptions(const std::vector<std::string>& args) {
       }
     } else if (args[i] == "--show-threads") {
       show_threads_ = true;
+    } else if (args[i] == "--show-latency") {
+      show_latency_ = true;
+    } else if (args[i] == "--runqueue-interval") {
+      if (!GetUintOption(args, &i, &runqueue_interval_in_ms_, 1)) {
+        return false;
+      }
     } else if (args[i] == "--record-file") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -172,7 +227,12 @@ bool TraceSchedCommand::RecordSchedEvents(const std::string& record_file_path) {
   }
   std::unique_ptr<Command> record_cmd = CreateCommandInstance("record");
   CHECK(record_cmd);
-  std::vector<std::string> record_args = {"-e", "sched:sched_stat_runtime", "-a",
+  std::string events = SCHED_EVENT_NAMES[SCHED_STAT_RUNTIME];
+  if (show_latency_) {
+    events += std::string(",") + SCHED_EVENT_NAMES[SCHED_WAKEUP] + "," +
+        SCHED_EVENT_NAMES[SCHED_SWITCH];
+  }
+  std::vector<std::string> record_args = {"-e", events, "-a",
                                           "--duration", std::to_string(duration_in_sec_),
                                           "-o", record_file_path};
   if (IsSettingClockIdSupported()) {
@@ -183,14 +243,14 @@ bool TraceSchedCommand::RecordSchedEvents(const std::string& record_file_path) {
 }
 
 bool TraceSchedCommand::ParseSchedEvents(const std::string& record_file_path) {
-  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(record_file_path);
-  if (!reader) {
+  record_file_reader_ = RecordFileReader::CreateInstance(record_file_path);
+  if (!record_file_reader_) {
     return false;
   }
   std::unique_ptr<ScopedEventTypes> scoped_event_types;
-  if (reader->HasFeature(PerfFileFormat::FEAT_META_INFO)) {
+  if (record_file_reader_->HasFeature(PerfFileFormat::FEAT_META_INFO)) {
     std::unordered_map<std::string, std::string> meta_info;
-    if (!reader->ReadMetaInfoFeature(&meta_info)) {
+    if (!record_file_reader_->ReadMetaInfoFeature(&meta_info)) {
       return false;
     }
     auto it = meta_info.find("event_type_info");
@@ -198,25 +258,64 @@ bool TraceSchedCommand::ParseSchedEvents(const std::string& record_file_path) {
       scoped_event_types.reset(new ScopedEventTypes(it->second));
     }
   }
-  const EventType* event = FindEventTypeByName("sched:sched_stat_runtime");
-  std::vector<EventAttrWithId> attrs = reader->AttrSection();
-  if (attrs.size() != 1u || attrs[0].attr->type != event->type ||
-      attrs[0].attr->config != event->config) {
-    LOG(ERROR) << "sched:sched_stat_runtime isn't recorded in " << record_file_path;
-    return false;
+  std::vector<bool> event_recorded(SCHED_UNKNOWN, false);
+  attr_events_.clear();
+  for (const auto& attr_with_id : record_file_reader_->AttrSection()) {
+    SchedEvent sched_event = SCHED_UNKNOWN;
+    for (int i = 0; i < SCHED_UNKNOWN; ++i) {
+      const EventType* event = FindEventTypeByName(SCHED_EVENT_NAMES[i]);
+      if (event != nullptr && attr_with_id.attr->type == event->type &&
+          attr_with_id.attr->config == event->config) {
+        sched_event = static_cast<SchedEvent>(i);
+        event_recorded[i] = true;
+        break;
+      }
+    }
+    attr_events_.push_back(sched_event);
+  }
+  int required_events = show_latency_ ? SCHED_UNKNOWN : SCHED_STAT_RUNTIME + 1;
+  for (int i = 0; i < required_events; ++i) {
+    if (!event_recorded[i]) {
+      LOG(ERROR) << SCHED_EVENT_NAMES[i] << " isn't recorded in " << record_file_path;
+      return false;
+    }
+  }
+  if (show_latency_) {
+    auto interval_callback = [this](uint64_t interval_start,
+                                    const std::vector<RunqueueDepthSample>& samples) {
+      ReportRunqueueDepth(interval_start, samples);
+    };
+    latency_analyzer_.reset(
+        new SchedLatencyAnalyzer(runqueue_interval_in_ms_ * 1000000, interval_callback));
   }
 
   auto callback = [this](std::unique_ptr<Record> record) {
     ProcessRecord(*record);
     return true;
   };
-  return reader->ReadDataSection(callback);
+  if (!record_file_reader_->ReadDataSection(callback)) {
+    return false;
+  }
+  if (latency_analyzer_) {
+    latency_analyzer_->Finish();
+  }
+  return true;
 }
 
 void TraceSchedCommand::ProcessRecord(Record& record) {
   switch (record.type()) {
     case PERF_RECORD_SAMPLE: {
-      ProcessSampleRecord(*static_cast<SampleRecord*>(&record));
+      size_t attr_index = record_file_reader_->GetAttrIndexOfRecord(&record);
+      SchedEvent event = attr_index < attr_events_.size() ? attr_events_[attr_index]
+                                                          : SCHED_UNKNOWN;
+      const SampleRecord& r = *static_cast<SampleRecord*>(&record);
+      if (event == SCHED_STAT_RUNTIME) {
+        ProcessSampleRecord(r);
+      } else if (show_latency_ && event == SCHED_WAKEUP) {
+        ProcessWakeupRecord(r);
+      } else if (show_latency_ && event == SCHED_SWITCH) {
+        ProcessSwitchRecord(r);
+      }
       break;
     }
     case PERF_RECORD_COMM: {
@@ -242,11 +341,25 @@ void TraceSchedCommand::ProcessRecord(Record& record) {
     case SIMPLE_PERF_RECORD_TRACING_DATA: {
       const TracingDataRecord& r = *static_cast<const TracingDataRecord*>(&record);
       Tracing tracing(std::vector<char>(r.data, r.data + r.data_size));
-      const EventType* event = FindEventTypeByName("sched:sched_stat_runtime");
+      const EventType* event = FindEventTypeByName(SCHED_EVENT_NAMES[SCHED_STAT_RUNTIME]);
       CHECK(event != nullptr);
       TracingFormat format = tracing.GetTracingFormatHavingId(event->config);
       format.GetField("comm", tracing_field_comm_);
       format.GetField("runtime", tracing_field_runtime_);
+      if (show_latency_) {
+        event = FindEventTypeByName(SCHED_EVENT_NAMES[SCHED_WAKEUP]);
+        CHECK(event != nullptr);
+        format = tracing.GetTracingFormatHavingId(event->config);
+        format.GetField("pid", tracing_field_wakeup_pid_);
+        format.GetField("target_cpu", tracing_field_wakeup_target_cpu_);
+        event = FindEventTypeByName(SCHED_EVENT_NAMES[SCHED_SWITCH]);
+        CHECK(event != nullptr);
+        format = tracing.GetTracingFormatHavingId(event->config);
+        format.GetField("prev_pid", tracing_field_switch_prev_pid_);
+        format.GetField("prev_state", tracing_field_switch_prev_state_);
+        format.GetField("next_pid", tracing_field_switch_next_pid_);
+        format.GetField("next_comm", tracing_field_switch_next_comm_);
+      }
       break;
     }
   }
@@ -294,6 +407,45 @@ void TraceSchedCommand::ProcessSampleRecord(const SampleRecord& record) {
   }
 }
 
+void TraceSchedCommand::ProcessWakeupRecord(const SampleRecord& record) {
+  const char* raw_data = record.raw_data.data;
+  pid_t tid = static_cast<pid_t>(tracing_field_wakeup_pid_.ReadFromData(raw_data));
+  uint32_t target_cpu =
+      static_cast<uint32_t>(tracing_field_wakeup_target_cpu_.ReadFromData(raw_data));
+  latency_analyzer_->ProcessWakeup(record.Timestamp(), tid, target_cpu);
+}
+
+void TraceSchedCommand::ProcessSwitchRecord(const SampleRecord& record) {
+  const char* raw_data = record.raw_data.data;
+  pid_t prev_tid = static_cast<pid_t>(tracing_field_switch_prev_pid_.ReadFromData(raw_data));
+  uint64_t prev_state = tracing_field_switch_prev_state_.ReadFromData(raw_data);
+  pid_t next_tid = static_cast<pid_t>(tracing_field_switch_next_pid_.ReadFromData(raw_data));
+  std::string next_comm = tracing_field_switch_next_comm_.ReadFromData(raw_data);
+  latency_analyzer_->ProcessSwitch(record.Timestamp(), record.cpu_data.cpu, prev_tid, prev_state,
+                                   next_tid, next_comm.c_str());
+}
+
+void TraceSchedCommand::ReportRunqueueDepth(uint64_t interval_start,
+                                            const std::vector<RunqueueDepthSample>& samples) {
+  if (reported_cpu_count_ == 0) {
+    first_interval_start_ = interval_start;
+  }
+  if (samples.size() > reported_cpu_count_) {
+    reported_cpu_count_ = samples.size();
+    printf("\nRunqueue Depth (avg/max per %" PRIu64 " ms):\n", runqueue_interval_in_ms_);
+    printf("%10s", "Time");
+    for (size_t cpu = 0; cpu < samples.size(); ++cpu) {
+      printf("  %10s", StringPrintf("cpu%zu", cpu).c_str());
+    }
+    printf("\n");
+  }
+  printf("%8.3f s", (interval_start - first_interval_start_) / 1e9);
+  for (auto& sample : samples) {
+    printf("  %10s", StringPrintf("%.2f/%u", sample.avg_depth, sample.max_depth).c_str());
+  }
+  printf("\n");
+}
+
 std::vector<ProcessInfo> TraceSchedCommand::BuildProcessInfo() {
   std::unordered_map<pid_t, ProcessInfo> process_map;
   for (auto& pair : thread_map_) {
@@ -422,6 +574,66 @@ void TraceSchedCommand::ReportProcessInfo(const std::vector<ProcessInfo>& proces
   }
 }
 
+void TraceSchedCommand::ReportLatencyInfo() {
+  struct LatencyEntry {
+    pid_t tid;
+    std::string name;
+    uint64_t wakeups;
+    uint64_t p50_in_ns;
+    uint64_t p99_in_ns;
+    uint64_t max_in_ns;
+  };
+  std::vector<LatencyEntry> entries;
+  for (auto& pair : latency_analyzer_->GetThreadLatencies()) {
+    const ThreadLatencyInfo& thread = pair.second;
+    if (thread.name == "simpleperf") {
+      continue;
+    }
+    LatencyEntry entry;
+    entry.tid = pair.first;
+    entry.name = thread.name;
+    entry.wakeups = thread.wakeup_latency.Count();
+    entry.p50_in_ns = thread.wakeup_latency.GetPercentile(50);
+    entry.p99_in_ns = thread.wakeup_latency.GetPercentile(99);
+    entry.max_in_ns = thread.wakeup_latency.Max();
+    entries.push_back(entry);
+  }
+  std::sort(entries.begin(), entries.end(), [](const LatencyEntry& e1, const LatencyEntry& e2) {
+    if (e1.p99_in_ns != e2.p99_in_ns) {
+      return e1.p99_in_ns > e2.p99_in_ns;
+    }
+    return e1.tid < e2.tid;
+  });
+
+  printf("\nWakeup Latency:\n");
+  SampleDisplayer<LatencyEntry, uint64_t> displayer;
+  displayer.AddDisplayFunction("Wakeups", [](const LatencyEntry* entry) {
+    return StringPrintf("%" PRIu64, entry->wakeups);
+  });
+  displayer.AddDisplayFunction("P50", [](const LatencyEntry* entry) {
+    return StringPrintf("%.3f ms", entry->p50_in_ns / 1e6);
+  });
+  displayer.AddDisplayFunction("P99", [](const LatencyEntry* entry) {
+    return StringPrintf("%.3f ms", entry->p99_in_ns / 1e6);
+  });
+  displayer.AddDisplayFunction("Max", [](const LatencyEntry* entry) {
+    return StringPrintf("%.3f ms", entry->max_in_ns / 1e6);
+  });
+  displayer.AddDisplayFunction("Tid", [](const LatencyEntry* entry) {
+    return StringPrintf("%d", entry->tid);
+  });
+  displayer.AddDisplayFunction("Name", [](const LatencyEntry* entry) {
+    return entry->name;
+  });
+  for (auto& entry : entries) {
+    displayer.AdjustWidth(&entry);
+  }
+  displayer.PrintNames(stdout);
+  for (auto& entry : entries) {
+    displayer.PrintSample(stdout, &entry);
+  }
+}
+
 }  // namespace
 
 void RegisterTraceSchedCommand() {
@@ -62,3 +62,13 @@ TEST(trace_sched_cmd, report_smoke) {
                       "BusyThread (8615),\nmax rate at [326962.439095 s - 326963.442418 s], "
                       "taken 997.813 ms / 1003.323 ms (99.45%)."), std::string::npos);
 }
+
+TEST(trace_sched_cmd, show_latency_option) {
+  TEST_IN_ROOT({
+    ASSERT_TRUE(TraceSchedCmd()->Run({"--duration", "1", "--show-latency",
+                                      "--runqueue-interval", "100"}));
+  });
+  // sched:sched_wakeup and sched:sched_switch aren't recorded in the record file.
+  ASSERT_FALSE(TraceSchedCmd()->Run({"--record-file", GetTestData(PERF_DATA_SCHED_STAT_RUNTIME),
+                                     "--show-latency"}));
+}
@@ -41,6 +41,8 @@
 class RecordFileWriter {
  public:
   static std::unique_ptr<RecordFileWriter> CreateInstance(const std::string& filename);
+  // Write to an opened and seekable fd, which is truncated first and owned by the writer.
+  static std::unique_ptr<RecordFileWriter> CreateInstance(int fd);
 
   ~RecordFileWriter();
 
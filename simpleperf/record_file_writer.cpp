@@ -53,6 +53,21 @@ std::unique_ptr<RecordFileWriter> RecordFileWriter::CreateInstance(const std::st
   return std::unique_ptr<RecordFileWriter>(new RecordFileWriter(filename, fp));
 }
 
+std::unique_ptr<RecordFileWriter> RecordFileWriter::CreateInstance(int fd) {
+  if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+    PLOG(ERROR) << "failed to truncate record file fd " << fd;
+    close(fd);
+    return nullptr;
+  }
+  FILE* fp = fdopen(fd, "w+");
+  if (fp == nullptr) {
+    PLOG(ERROR) << "failed to open record file fd " << fd;
+    close(fd);
+    return nullptr;
+  }
+  return std::unique_ptr<RecordFileWriter>(new RecordFileWriter("", fp));
+}
+
 RecordFileWriter::RecordFileWriter(const std::string& filename, FILE* fp)
     : filename_(filename),
       record_fp_(fp),
@@ -67,7 +82,9 @@ RecordFileWriter::RecordFileWriter(const std::string& filename, FILE* fp)
 RecordFileWriter::~RecordFileWriter() {
   if (record_fp_ != nullptr) {
     fclose(record_fp_);
-    unlink(filename_.c_str());
+    if (!filename_.empty()) {
+      unlink(filename_.c_str());
+    }
   }
 }
 
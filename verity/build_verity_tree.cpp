@@ -14,20 +14,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+
+#include <algorithm>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 
-struct sparse_hash_ctx {
-    unsigned char *hashes;
-    const unsigned char *salt;
-    uint64_t salt_size;
-    uint64_t hash_size;
-    uint64_t block_size;
-    const unsigned char *zero_block_hash;
-    const EVP_MD *md;
-};
-
 #define div_round_up(x,y) (((x) + (y) - 1)/(y))
 
 #define round_up(x,y) (div_round_up(x,y)*(y))
@@ -37,6 +30,40 @@ struct sparse_hash_ctx {
     exit(1); \
 }
 
+/* level 0 is only split between threads in chunks of at least this many
+   blocks */
+#define MIN_BLOCKS_PER_THREAD 256
+
+/* blocks of one tree level that have not been written yet */
+struct verity_level {
+    std::vector<unsigned char> block;
+    size_t used;
+    uint64_t offset;
+    uint64_t end;
+};
+
+/* writes the tree level by level as hashes arrive, so that only the last
+   block of each level is kept in memory */
+struct verity_tree_writer {
+    int fd;
+    size_t block_size;
+    size_t hash_size;
+    const EVP_MD_CTX *salted;
+    EVP_MD_CTX *mdctx;
+    std::vector<verity_level> levels;
+    unsigned char *root_hash;
+};
+
+struct sparse_hash_ctx {
+    verity_tree_writer *tree;
+    const EVP_MD_CTX *salted;
+    uint64_t hash_size;
+    uint64_t block_size;
+    const unsigned char *zero_block_hash;
+    int threads;
+    std::vector<unsigned char> hashes;
+};
+
 size_t verity_tree_blocks(uint64_t data_size, size_t block_size, size_t hash_size,
                           int level)
 {
@@ -50,22 +77,32 @@ size_t verity_tree_blocks(uint64_t data_size, size_t block_size, size_t hash_siz
     return level_blocks;
 }
 
-int hash_block(const EVP_MD *md,
+/* returns a digest context with `salt' already hashed, which hash_block
+   copies instead of hashing the salt again for each block */
+EVP_MD_CTX *create_salted_ctx(const EVP_MD *md, const unsigned char *salt,
+                              size_t salt_len)
+{
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_create();
+    assert(mdctx);
+
+    int ret = 1;
+    ret &= EVP_DigestInit_ex(mdctx, md, NULL);
+    ret &= EVP_DigestUpdate(mdctx, salt, salt_len);
+    assert(ret == 1);
+
+    return mdctx;
+}
+
+int hash_block(const EVP_MD_CTX *salted, EVP_MD_CTX *mdctx,
                const unsigned char *block, size_t len,
-               const unsigned char *salt, size_t salt_len,
                unsigned char *out, size_t *out_size)
 {
-    EVP_MD_CTX *mdctx;
     unsigned int s;
     int ret = 1;
 
-    mdctx = EVP_MD_CTX_create();
-    assert(mdctx);
-    ret &= EVP_DigestInit_ex(mdctx, md, NULL);
-    ret &= EVP_DigestUpdate(mdctx, salt, salt_len);
+    ret &= EVP_MD_CTX_copy_ex(mdctx, salted);
     ret &= EVP_DigestUpdate(mdctx, block, len);
     ret &= EVP_DigestFinal_ex(mdctx, out, &s);
-    EVP_MD_CTX_destroy(mdctx);
     assert(ret == 1);
     if (out_size) {
         *out_size = s;
@@ -73,52 +110,409 @@ int hash_block(const EVP_MD *md,
     return 0;
 }
 
-int hash_blocks(const EVP_MD *md,
+int hash_blocks(const EVP_MD_CTX *salted,
                 const unsigned char *in, size_t in_size,
                 unsigned char *out, size_t *out_size,
-                const unsigned char *salt, size_t salt_size,
                 size_t block_size)
 {
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_create();
+    assert(mdctx);
+
     size_t s;
     *out_size = 0;
     for (size_t i = 0; i < in_size; i += block_size) {
-        hash_block(md, in + i, block_size, salt, salt_size, out, &s);
+        hash_block(salted, mdctx, in + i, block_size, out, &s);
         out += s;
         *out_size += s;
     }
 
+    EVP_MD_CTX_destroy(mdctx);
     return 0;
 }
 
+/* hashes `in' like hash_blocks, splitting the blocks between `threads'
+   threads */
+void hash_blocks_parallel(const EVP_MD_CTX *salted,
+                          const unsigned char *in, size_t in_size,
+                          unsigned char *out, size_t hash_size,
+                          size_t block_size, int threads)
+{
+    size_t blocks = in_size / block_size;
+    size_t max_threads = div_round_up(blocks, MIN_BLOCKS_PER_THREAD);
+
+    if ((size_t)threads > max_threads) {
+        threads = (int)max_threads;
+    }
+
+    if (threads <= 1) {
+        size_t s;
+        hash_blocks(salted, in, in_size, out, &s, block_size);
+        return;
+    }
+
+    size_t blocks_per_thread = div_round_up(blocks, threads);
+    std::vector<std::thread> workers;
+
+    for (size_t start = 0; start < blocks; start += blocks_per_thread) {
+        size_t count = std::min(blocks_per_thread, blocks - start);
+
+        workers.emplace_back([=]() {
+            size_t s;
+            hash_blocks(salted, in + start * block_size, count * block_size,
+                        out + start * hash_size, &s, block_size);
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void write_level_block(verity_tree_writer *tree, size_t level);
+
+/* appends `size' bytes of hashes to `level', writing out every block that
+   fills up */
+void add_hashes(verity_tree_writer *tree, size_t level,
+                const unsigned char *hashes, size_t size)
+{
+    verity_level *l = &tree->levels[level];
+
+    while (size > 0) {
+        size_t n = std::min(size, tree->block_size - l->used);
+        memcpy(&l->block[l->used], hashes, n);
+        l->used += n;
+        hashes += n;
+        size -= n;
+
+        if (l->used == tree->block_size) {
+            write_level_block(tree, level);
+        }
+    }
+}
+
+/* pads the current block of `level' with zeros, writes it to the output and
+   adds its hash to the level above it */
+void write_level_block(verity_tree_writer *tree, size_t level)
+{
+    verity_level *l = &tree->levels[level];
+
+    memset(&l->block[l->used], 0, tree->block_size - l->used);
+    if (l->offset + tree->block_size > l->end) {
+        FATAL("verity tree level %zu is larger than expected\n", level);
+    }
+
+    if (lseek(tree->fd, l->offset, SEEK_SET) < 0 ||
+            !android::base::WriteFully(tree->fd, l->block.data(),
+                                       tree->block_size)) {
+        FATAL("failed to write verity tree: %s\n", strerror(errno));
+    }
+
+    l->offset += tree->block_size;
+    l->used = 0;
+
+    unsigned char hash[tree->hash_size];
+    hash_block(tree->salted, tree->mdctx, l->block.data(), tree->block_size,
+               hash, NULL);
+
+    if (level + 1 == tree->levels.size()) {
+        memcpy(tree->root_hash, hash, tree->hash_size);
+    } else {
+        add_hashes(tree, level + 1, hash, tree->hash_size);
+    }
+}
+
 int hash_chunk(void *priv, const void *data, size_t len)
 {
     struct sparse_hash_ctx *ctx = (struct sparse_hash_ctx *)priv;
     assert(len % ctx->block_size == 0);
     if (data) {
-        size_t s;
-        hash_blocks(ctx->md, (const unsigned char *)data, len,
-                    ctx->hashes, &s,
-                    ctx->salt, ctx->salt_size, ctx->block_size);
-        ctx->hashes += s;
+        size_t blocks = len / ctx->block_size;
+        ctx->hashes.resize(blocks * ctx->hash_size);
+        hash_blocks_parallel(ctx->salted, (const unsigned char *)data, len,
+                             ctx->hashes.data(), ctx->hash_size,
+                             ctx->block_size, ctx->threads);
+        add_hashes(ctx->tree, 0, ctx->hashes.data(), ctx->hashes.size());
     } else {
         for (size_t i = 0; i < len; i += ctx->block_size) {
-            memcpy(ctx->hashes, ctx->zero_block_hash, ctx->hash_size);
-            ctx->hashes += ctx->hash_size;
+            add_hashes(ctx->tree, 0, ctx->zero_block_hash, ctx->hash_size);
+        }
+    }
+    return 0;
+}
+
+/* a range of data blocks [first, end) */
+typedef std::pair<uint64_t, uint64_t> block_range;
+
+/* parses a comma separated list of inclusive block ranges, such as
+   "0-15,200,4096-4100" */
+void parse_block_ranges(const char *arg, std::vector<block_range>& ranges)
+{
+    const char *p = arg;
+
+    while (*p) {
+        char *endptr;
+        errno = 0;
+        unsigned long long first = strtoull(p, &endptr, 0);
+        unsigned long long last = first;
+        if (endptr == p || errno != 0) {
+            FATAL("invalid block range list '%s'\n", arg);
+        }
+        p = endptr;
+        if (*p == '-') {
+            const char *q = p + 1;
+            last = strtoull(q, &endptr, 0);
+            if (endptr == q || errno != 0 || last < first) {
+                FATAL("invalid block range list '%s'\n", arg);
+            }
+            p = endptr;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            FATAL("invalid block range list '%s'\n", arg);
+        }
+        ranges.push_back(block_range(first, (uint64_t)last + 1));
+    }
+}
+
+/* compares `fd' against the same sized image in `prev_fd' and adds the
+   blocks that differ to `ranges' */
+void find_changed_blocks(int prev_fd, int fd, uint64_t len, size_t block_size,
+                         std::vector<block_range>& ranges)
+{
+    const size_t batch_blocks = 256;
+    std::vector<unsigned char> prev(batch_blocks * block_size);
+    std::vector<unsigned char> curr(batch_blocks * block_size);
+
+    for (uint64_t offset = 0; offset < len; offset += prev.size()) {
+        size_t size = (size_t)std::min<uint64_t>(prev.size(), len - offset);
+        if (lseek(prev_fd, offset, SEEK_SET) < 0 ||
+                lseek(fd, offset, SEEK_SET) < 0 ||
+                !android::base::ReadFully(prev_fd, prev.data(), size) ||
+                !android::base::ReadFully(fd, curr.data(), size)) {
+            FATAL("failed to read images for comparison: %s\n",
+                  strerror(errno));
+        }
+
+        for (size_t i = 0; i < size; i += block_size) {
+            if (!memcmp(&prev[i], &curr[i], block_size)) {
+                continue;
+            }
+            uint64_t block = (offset + i) / block_size;
+            if (!ranges.empty() && ranges.back().second == block) {
+                ranges.back().second++;
+            } else {
+                ranges.push_back(block_range(block, block + 1));
+            }
+        }
+    }
+}
+
+struct sparse_update_ctx {
+    const std::vector<block_range> *ranges;
+    size_t next_range;
+    uint64_t pos;
+    unsigned char *hashes;
+    const EVP_MD_CTX *salted;
+    uint64_t hash_size;
+    uint64_t block_size;
+    const unsigned char *zero_block_hash;
+    int threads;
+};
+
+/* hashes the blocks of a sparse image chunk that are in the changed
+   ranges */
+int update_chunk(void *priv, const void *data, size_t len)
+{
+    struct sparse_update_ctx *ctx = (struct sparse_update_ctx *)priv;
+    assert(len % ctx->block_size == 0);
+
+    uint64_t chunk_start = ctx->pos;
+    uint64_t chunk_end = ctx->pos + len / ctx->block_size;
+    const std::vector<block_range>& ranges = *ctx->ranges;
+
+    for (size_t i = ctx->next_range; i < ranges.size() &&
+            ranges[i].first < chunk_end; i++) {
+        uint64_t first = std::max(ranges[i].first, chunk_start);
+        uint64_t end = std::min(ranges[i].second, chunk_end);
+
+        if (first >= end) {
+            continue;
         }
+        if (data) {
+            hash_blocks_parallel(ctx->salted,
+                    (const unsigned char *)data +
+                        (first - chunk_start) * ctx->block_size,
+                    (end - first) * ctx->block_size,
+                    ctx->hashes + first * ctx->hash_size, ctx->hash_size,
+                    ctx->block_size, ctx->threads);
+        } else {
+            for (uint64_t b = first; b < end; b++) {
+                memcpy(ctx->hashes + b * ctx->hash_size, ctx->zero_block_hash,
+                       ctx->hash_size);
+            }
+        }
+    }
+
+    while (ctx->next_range < ranges.size() &&
+            ranges[ctx->next_range].second <= chunk_end) {
+        ctx->next_range++;
     }
+
+    ctx->pos = chunk_end;
     return 0;
 }
 
+/* recomputes the hashes of the data blocks in `ranges' and every tree block
+   above them in the existing tree in `verity_fd', writing only the tree
+   blocks that were recomputed */
+void update_verity_tree(int verity_fd, int data_fd, struct sparse_file *file,
+                        uint64_t len, std::vector<block_range>& ranges,
+                        const EVP_MD_CTX *salted, size_t hash_size,
+                        size_t block_size, int threads,
+                        unsigned char *root_hash)
+{
+    uint64_t data_blocks = len / block_size;
+    size_t hashes_per_block = div_round_up(block_size, hash_size);
+
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<block_range> merged;
+    for (auto& r : ranges) {
+        if (r.first >= data_blocks || r.second > data_blocks) {
+            FATAL("block range %" PRIu64 "-%" PRIu64 " is outside the image\n",
+                  r.first, r.second - 1);
+        }
+        if (!merged.empty() && r.first <= merged.back().second) {
+            merged.back().second = std::max(merged.back().second, r.second);
+        } else {
+            merged.push_back(r);
+        }
+    }
+
+    int levels = 0;
+    size_t verity_blocks = 0;
+    size_t level_blocks;
+    do {
+        level_blocks = verity_tree_blocks(len, block_size, hash_size, levels);
+        levels++;
+        verity_blocks += level_blocks;
+    } while (level_blocks > 1);
+
+    std::vector<unsigned char> tree((uint64_t)verity_blocks * block_size);
+    off_t tree_size = lseek(verity_fd, 0, SEEK_END);
+    if (tree_size != (off_t)tree.size()) {
+        FATAL("existing verity tree is %" PRId64 " bytes, expected %zu\n",
+              (int64_t)tree_size, tree.size());
+    }
+    if (lseek(verity_fd, 0, SEEK_SET) < 0 ||
+            !android::base::ReadFully(verity_fd, tree.data(), tree.size())) {
+        FATAL("failed to read existing verity tree: %s\n", strerror(errno));
+    }
+
+    std::vector<uint64_t> level_offset(levels);
+    std::vector<std::vector<bool>> dirty(levels);
+    uint64_t offset = 0;
+    for (int i = levels - 1; i >= 0; i--) {
+        level_offset[i] = offset;
+        level_blocks = verity_tree_blocks(len, block_size, hash_size, i);
+        dirty[i].resize(level_blocks);
+        offset += (uint64_t)level_blocks * block_size;
+    }
+
+    unsigned char *hashes = &tree[level_offset[0]];
+    unsigned char zero_block_hash[hash_size];
+    unsigned char zero_block[block_size];
+    memset(zero_block, 0, block_size);
+    size_t s;
+    hash_blocks(salted, zero_block, block_size, zero_block_hash, &s, block_size);
+
+    if (file) {
+        struct sparse_update_ctx ctx;
+        ctx.ranges = &merged;
+        ctx.next_range = 0;
+        ctx.pos = 0;
+        ctx.hashes = hashes;
+        ctx.salted = salted;
+        ctx.hash_size = hash_size;
+        ctx.block_size = block_size;
+        ctx.zero_block_hash = zero_block_hash;
+        ctx.threads = threads;
+        sparse_file_callback(file, false, false, update_chunk, &ctx);
+    } else {
+        const uint64_t batch_blocks = 1024;
+        std::vector<unsigned char> data(batch_blocks * block_size);
+
+        for (auto& r : merged) {
+            for (uint64_t b = r.first; b < r.second; b += batch_blocks) {
+                size_t n = (size_t)std::min(batch_blocks, r.second - b);
+                if (lseek(data_fd, b * block_size, SEEK_SET) < 0 ||
+                        !android::base::ReadFully(data_fd, data.data(),
+                                                  n * block_size)) {
+                    FATAL("failed to read data: %s\n", strerror(errno));
+                }
+                hash_blocks_parallel(salted, data.data(), n * block_size,
+                                     hashes + b * hash_size, hash_size,
+                                     block_size, threads);
+            }
+        }
+    }
+
+    for (auto& r : merged) {
+        for (uint64_t b = r.first / hashes_per_block;
+                b <= (r.second - 1) / hashes_per_block; b++) {
+            dirty[0][b] = true;
+        }
+    }
+
+    /* the root hash is always recomputed, even if nothing changed */
+    dirty[levels - 1][0] = true;
+
+    /* rehash the dirty blocks of each level into the level above it, and
+       write them back */
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_create();
+    assert(mdctx);
+    for (int i = 0; i < levels; i++) {
+        for (size_t b = 0; b < dirty[i].size(); b++) {
+            if (!dirty[i][b]) {
+                continue;
+            }
+            uint64_t block_offset = level_offset[i] + b * block_size;
+            unsigned char *out = (i + 1 < levels) ?
+                    &tree[level_offset[i + 1] + b * hash_size] : root_hash;
+            hash_block(salted, mdctx, &tree[block_offset], block_size, out,
+                       NULL);
+            if (i + 1 < levels) {
+                dirty[i + 1][b / hashes_per_block] = true;
+            }
+
+            if (lseek(verity_fd, block_offset, SEEK_SET) < 0 ||
+                    !android::base::WriteFully(verity_fd, &tree[block_offset],
+                                               block_size)) {
+                FATAL("failed to write verity tree: %s\n", strerror(errno));
+            }
+        }
+    }
+    EVP_MD_CTX_destroy(mdctx);
+}
+
 void usage(void)
 {
     printf("usage: build_verity_tree [ <options> ] -s <size> | <data> <verity>\n"
            "options:\n"
+           "  -c,--changed-blocks=<ranges> with -u, the data blocks that changed,\n"
+           "                               e.g. 0-15,200\n"
+           "  -p,--previous=<data>         with -u, find the changed blocks by\n"
+           "                               comparing <data> to the image <verity>\n"
+           "                               was built for\n"
            "  -a,--salt-str=<string>       set salt to <string>\n"
            "  -A,--salt-hex=<hex digits>   set salt to <hex digits>\n"
            "  -h                           show this help\n"
+           "  -j,--threads=<threads>       number of threads to hash with\n"
            "  -s,--verity-size=<data size> print the size of the verity tree\n"
            "  -v,                          enable verbose logging\n"
            "  -S                           treat <data image> as a sparse file\n"
+           "  -u,--update                  update the existing tree in <verity> in\n"
+           "                               place; needs the salt it was built with\n"
         );
 }
 
@@ -131,18 +525,26 @@ int main(int argc, char **argv)
     size_t block_size = 4096;
     uint64_t calculate_size = 0;
     bool verbose = false;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool update = false;
+    std::vector<block_range> changed;
+    char *previous_filename = NULL;
 
     while (1) {
         const static struct option long_options[] = {
             {"salt-str", required_argument, 0, 'a'},
             {"salt-hex", required_argument, 0, 'A'},
+            {"changed-blocks", required_argument, 0, 'c'},
             {"help", no_argument, 0, 'h'},
+            {"threads", required_argument, 0, 'j'},
+            {"previous", required_argument, 0, 'p'},
             {"sparse", no_argument, 0, 'S'},
             {"verity-size", required_argument, 0, 's'},
+            {"update", no_argument, 0, 'u'},
             {"verbose", no_argument, 0, 'v'},
             {NULL, 0, 0, 0}
         };
-        int c = getopt_long(argc, argv, "a:A:hSs:v", long_options, NULL);
+        int c = getopt_long(argc, argv, "a:A:c:hj:p:Ss:uv", long_options, NULL);
         if (c < 0) {
             break;
         }
@@ -164,9 +566,26 @@ int main(int argc, char **argv)
                 }
             }
             break;
+        case 'c':
+            parse_block_ranges(optarg, changed);
+            break;
         case 'h':
             usage();
             return 1;
+        case 'j': {
+                char* endptr;
+                errno = 0;
+                long value = strtol(optarg, &endptr, 0);
+                if (optarg[0] == '\0' || *endptr != '\0' || errno != 0 ||
+                        value < 1 || value > INT_MAX) {
+                    FATAL("invalid value of threads\n");
+                }
+                threads = (int)value;
+            }
+            break;
+        case 'p':
+            previous_filename = optarg;
+            break;
         case 'S':
             sparse = true;
             break;
@@ -184,6 +603,9 @@ int main(int argc, char **argv)
                 calculate_size = (uint64_t)inSize;
             }
             break;
+        case 'u':
+            update = true;
+            break;
         case 'v':
             verbose = true;
             break;
@@ -206,6 +628,16 @@ int main(int argc, char **argv)
     size_t hash_size = EVP_MD_size(md);
     assert(hash_size * 2 < block_size);
 
+    if (update && salt.empty()) {
+        FATAL("updating a tree needs the salt it was built with\n");
+    }
+    if (update && changed.empty() && !previous_filename) {
+        FATAL("updating a tree needs --changed-blocks or --previous\n");
+    }
+    if (!update && (!changed.empty() || previous_filename)) {
+        FATAL("--changed-blocks and --previous can only be used with --update\n");
+    }
+
     if (salt.empty()) {
         salt.resize(hash_size);
 
@@ -252,6 +684,75 @@ int main(int argc, char **argv)
         FATAL("failed to open %s\n", data_filename);
     }
 
+    if (update) {
+        /* raw images are read one changed range at a time */
+        struct sparse_file *file = sparse_file_import(fd, false, false);
+        int64_t len;
+        if (file) {
+            len = sparse_file_len(file, false, false);
+        } else if (sparse) {
+            FATAL("failed to read file %s\n", data_filename);
+        } else {
+            len = lseek(fd, 0, SEEK_END);
+        }
+        if (len <= 0 || len % block_size != 0) {
+            FATAL("file size %" PRId64 " is not a multiple of %zu bytes\n",
+                    len, block_size);
+        }
+
+        if (previous_filename) {
+            if (file) {
+                FATAL("--previous needs raw images\n");
+            }
+            int prev_fd = open(previous_filename, O_RDONLY);
+            if (prev_fd < 0) {
+                FATAL("failed to open %s\n", previous_filename);
+            }
+            if (lseek(prev_fd, 0, SEEK_END) != len) {
+                FATAL("%s and %s differ in size\n", previous_filename,
+                      data_filename);
+            }
+            find_changed_blocks(prev_fd, fd, len, block_size, changed);
+            close(prev_fd);
+        }
+
+        int verity_fd = open(verity_filename, O_RDWR);
+        if (verity_fd < 0) {
+            FATAL("failed to open verity tree '%s'\n", verity_filename);
+        }
+
+        if (verbose) {
+            uint64_t count = 0;
+            for (auto& r : changed) {
+                count += r.second - r.first;
+            }
+            fprintf(stderr, "updating the hashes of %" PRIu64 " blocks\n",
+                    count);
+        }
+
+        EVP_MD_CTX *salted = create_salted_ctx(md, salt.data(), salt.size());
+        unsigned char root_hash[hash_size];
+        update_verity_tree(verity_fd, fd, file, len, changed, salted,
+                           hash_size, block_size, threads, root_hash);
+        EVP_MD_CTX_destroy(salted);
+
+        if (file) {
+            sparse_file_destroy(file);
+        }
+        close(fd);
+        close(verity_fd);
+
+        for (size_t i = 0; i < hash_size; i++) {
+            printf("%02x", root_hash[i]);
+        }
+        printf(" ");
+        for (size_t i = 0; i < salt.size(); i++) {
+            printf("%02x", salt[i]);
+        }
+        printf("\n");
+        return 0;
+    }
+
     struct sparse_file *file;
     if (sparse) {
         file = sparse_file_import(fd, false, false);
@@ -279,55 +780,81 @@ int main(int argc, char **argv)
         verity_blocks += level_blocks;
     } while (level_blocks > 1);
 
-    unsigned char *verity_tree = new unsigned char[verity_blocks * block_size]();
-    unsigned char **verity_tree_levels = new unsigned char *[levels + 1]();
-    size_t *verity_tree_level_blocks = new size_t[levels]();
-    if (verity_tree == NULL || verity_tree_levels == NULL || verity_tree_level_blocks == NULL) {
-        FATAL("failed to allocate memory for verity tree\n");
+    if (threads < 1) {
+        threads = 1;
     }
 
-    unsigned char *ptr = verity_tree;
-    for (int i = levels - 1; i >= 0; i--) {
-        verity_tree_levels[i] = ptr;
-        verity_tree_level_blocks[i] = verity_tree_blocks(len, block_size, hash_size, i);
-        ptr += verity_tree_level_blocks[i] * block_size;
-    }
-    assert(ptr == verity_tree + verity_blocks * block_size);
-    assert(verity_tree_level_blocks[levels - 1] == 1);
+    EVP_MD_CTX *salted = create_salted_ctx(md, salt.data(), salt.size());
 
     unsigned char zero_block_hash[hash_size];
     unsigned char zero_block[block_size];
     memset(zero_block, 0, block_size);
-    hash_block(md, zero_block, block_size, salt.data(), salt.size(), zero_block_hash, NULL);
+    size_t s;
+    hash_blocks(salted, zero_block, block_size, zero_block_hash, &s, block_size);
+
+    int out_fd = open(verity_filename, O_WRONLY|O_CREAT, 0666);
+    if (out_fd < 0) {
+        FATAL("failed to open output file '%s'\n", verity_filename);
+    }
 
     unsigned char root_hash[hash_size];
-    verity_tree_levels[levels] = root_hash;
+
+    /* the top level is written first, followed by the levels below it */
+    verity_tree_writer tree;
+    tree.fd = out_fd;
+    tree.block_size = block_size;
+    tree.hash_size = hash_size;
+    tree.salted = salted;
+    tree.mdctx = EVP_MD_CTX_create();
+    tree.levels.resize(levels);
+    tree.root_hash = root_hash;
+    assert(tree.mdctx);
+
+    uint64_t offset = 0;
+    for (int i = levels - 1; i >= 0; i--) {
+        level_blocks = verity_tree_blocks(len, block_size, hash_size, i);
+        tree.levels[i].block.resize(block_size);
+        tree.levels[i].used = 0;
+        tree.levels[i].offset = offset;
+        offset += (uint64_t)level_blocks * block_size;
+        tree.levels[i].end = offset;
+    }
+    assert(offset == (uint64_t)verity_blocks * block_size);
+    assert(verity_tree_blocks(len, block_size, hash_size, levels - 1) == 1);
 
     struct sparse_hash_ctx ctx;
-    ctx.hashes = verity_tree_levels[0];
-    ctx.salt = salt.data();
-    ctx.salt_size = salt.size();
+    ctx.tree = &tree;
+    ctx.salted = salted;
     ctx.hash_size = hash_size;
     ctx.block_size = block_size;
     ctx.zero_block_hash = zero_block_hash;
-    ctx.md = md;
+    ctx.threads = threads;
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
 
     sparse_file_callback(file, false, false, hash_chunk, &ctx);
 
     sparse_file_destroy(file);
     close(fd);
 
+    /* flush the partial last block of each level, which also completes the
+       levels above it */
     for (int i = 0; i < levels; i++) {
-        size_t out_size;
-        hash_blocks(md,
-                verity_tree_levels[i], verity_tree_level_blocks[i] * block_size,
-                verity_tree_levels[i + 1], &out_size,
-                salt.data(), salt.size(), block_size);
-          if (i < levels - 1) {
-              assert(div_round_up(out_size, block_size) == verity_tree_level_blocks[i + 1]);
-          } else {
-              assert(out_size == hash_size);
-          }
+        if (tree.levels[i].used > 0) {
+            write_level_block(&tree, i);
+        }
+        assert(tree.levels[i].offset == tree.levels[i].end);
+    }
+
+    if (verbose) {
+        struct timespec end_time;
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double elapsed = (end_time.tv_sec - start_time.tv_sec) +
+                         (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+        fprintf(stderr, "hashed %" PRId64 " bytes in %.3f s (%.1f MB/s) "
+                "with %d threads\n", len, elapsed,
+                elapsed > 0 ? len / elapsed / 1e6 : 0.0, threads);
     }
 
     for (size_t i = 0; i < hash_size; i++) {
@@ -339,16 +866,8 @@ int main(int argc, char **argv)
     }
     printf("\n");
 
-    fd = open(verity_filename, O_WRONLY|O_CREAT, 0666);
-    if (fd < 0) {
-        FATAL("failed to open output file '%s'\n", verity_filename);
-    }
-    if (!android::base::WriteFully(fd, verity_tree, verity_blocks * block_size)) {
-        FATAL("failed to write '%s'\n", verity_filename);
-    }
-    close(fd);
+    close(out_fd);
 
-    delete[] verity_tree_levels;
-    delete[] verity_tree_level_blocks;
-    delete[] verity_tree;
+    EVP_MD_CTX_destroy(tree.mdctx);
+    EVP_MD_CTX_destroy(salted);
 }
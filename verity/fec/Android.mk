@@ -5,7 +5,7 @@ ifeq ($(HOST_OS),linux)
 LOCAL_SANITIZE := integer
 endif
 LOCAL_MODULE := fec
-LOCAL_SRC_FILES := main.cpp image.cpp
+LOCAL_SRC_FILES := main.cpp image.cpp gf.cpp
 LOCAL_MODULE_TAGS := optional
 LOCAL_STATIC_LIBRARIES := \
     libsparse \
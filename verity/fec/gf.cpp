@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+extern "C" {
+    #include <fec.h>
+}
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <tmmintrin.h>
+#elif defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
+
+#include "gf.h"
+
+/* the field generator polynomial in FEC_PARAMS */
+#define GF_POLY 0x11d
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    uint8_t p = 0;
+
+    while (b) {
+        if (b & 1) {
+            p ^= a;
+        }
+
+        a = (uint8_t)((a << 1) ^ ((a & 0x80) ? (GF_POLY & 0xff) : 0));
+        b >>= 1;
+    }
+
+    return p;
+}
+
+static void gf_table_init(gf_mul_table *table, uint8_t c)
+{
+    for (int i = 0; i < 256; ++i) {
+        table->full[i] = gf_mul((uint8_t)i, c);
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        table->lo[i] = table->full[i];
+        table->hi[i] = table->full[i << 4];
+    }
+}
+
+/* dst = c * src */
+static void mul_region(uint8_t *dst, const uint8_t *src, size_t size,
+        const gf_mul_table *table)
+{
+    for (size_t i = 0; i < size; ++i) {
+        dst[i] = table->full[src[i]];
+    }
+}
+
+/* dst ^= c * src */
+static void mul_add_region(uint8_t *dst, const uint8_t *src, size_t size,
+        const gf_mul_table *table)
+{
+    for (size_t i = 0; i < size; ++i) {
+        dst[i] ^= table->full[src[i]];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("ssse3")))
+static inline __m128i mul_ssse3(__m128i x, __m128i lo, __m128i hi)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    return _mm_xor_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+            _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+}
+
+__attribute__((target("ssse3")))
+static void mul_region_ssse3(uint8_t *dst, const uint8_t *src, size_t size,
+        const gf_mul_table *table)
+{
+    __m128i lo = _mm_loadu_si128((const __m128i *)table->lo);
+    __m128i hi = _mm_loadu_si128((const __m128i *)table->hi);
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_si128((__m128i *)&dst[i], mul_ssse3(x, lo, hi));
+    }
+
+    mul_region(&dst[i], &src[i], size - i, table);
+}
+
+__attribute__((target("ssse3")))
+static void mul_add_region_ssse3(uint8_t *dst, const uint8_t *src, size_t size,
+        const gf_mul_table *table)
+{
+    __m128i lo = _mm_loadu_si128((const __m128i *)table->lo);
+    __m128i hi = _mm_loadu_si128((const __m128i *)table->hi);
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)&src[i]);
+        __m128i d = _mm_loadu_si128((const __m128i *)&dst[i]);
+        _mm_storeu_si128((__m128i *)&dst[i],
+            _mm_xor_si128(d, mul_ssse3(x, lo, hi)));
+    }
+
+    mul_add_region(&dst[i], &src[i], size - i, table);
+}
+
+#elif defined(__aarch64__)
+
+static void mul_region_neon(uint8_t *dst, const uint8_t *src, size_t size,
+        const gf_mul_table *table)
+{
+    uint8x16_t lo = vld1q_u8(table->lo);
+    uint8x16_t hi = vld1q_u8(table->hi);
+    uint8x16_t mask = vdupq_n_u8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t x = vld1q_u8(&src[i]);
+        vst1q_u8(&dst[i], veorq_u8(vqtbl1q_u8(lo, vandq_u8(x, mask)),
+                                   vqtbl1q_u8(hi, vshrq_n_u8(x, 4))));
+    }
+
+    mul_region(&dst[i], &src[i], size - i, table);
+}
+
+static void mul_add_region_neon(uint8_t *dst, const uint8_t *src, size_t size,
+        const gf_mul_table *table)
+{
+    uint8x16_t lo = vld1q_u8(table->lo);
+    uint8x16_t hi = vld1q_u8(table->hi);
+    uint8x16_t mask = vdupq_n_u8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t x = vld1q_u8(&src[i]);
+        uint8x16_t p = veorq_u8(vqtbl1q_u8(lo, vandq_u8(x, mask)),
+                                vqtbl1q_u8(hi, vshrq_n_u8(x, 4)));
+        vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&dst[i]), p));
+    }
+
+    mul_add_region(&dst[i], &src[i], size - i, table);
+}
+
+#endif
+
+static void xor_region(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        dst[i] ^= src[i];
+    }
+}
+
+/* encodes `count' codewords, reading byte j of each from `columns[j]' and
+   writing `roots' parity bytes for each to `parity'; `work' must have room
+   for `roots * count' bytes */
+void gf_encode_tile(const gf_encoder *enc, const uint8_t **columns,
+        size_t count, uint8_t *parity, uint8_t *work)
+{
+    int roots = enc->roots;
+    int head = 0;
+
+    /* the shift register of every codeword, one row per parity byte; rows
+       rotate instead of being shifted */
+    memset(work, 0, roots * count);
+
+    for (int j = 0; j < enc->rs_n; ++j) {
+        uint8_t *feedback = &work[head * count];
+        xor_region(feedback, columns[j], count);
+
+        for (int m = 0; m < roots - 1; ++m) {
+            int row = (head + 1 + m) % roots;
+            enc->mul_add(&work[row * count], feedback, count,
+                &enc->tables[m]);
+        }
+
+        enc->mul(feedback, feedback, count, &enc->tables[roots - 1]);
+        head = (head + 1) % roots;
+    }
+
+    for (int m = 0; m < roots; ++m) {
+        const uint8_t *row = &work[((head + m) % roots) * count];
+
+        for (size_t i = 0; i < count; ++i) {
+            parity[i * roots + m] = row[i];
+        }
+    }
+}
+
+/* initializes `enc' for the code used by `rs', returns false if the result
+   would not match encode_rs_char */
+bool gf_encoder_init(gf_encoder *enc, void *rs, int roots)
+{
+    enc->roots = roots;
+    enc->rs_n = FEC_RSM - roots;
+    enc->mul = mul_region;
+    enc->mul_add = mul_add_region;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3")) {
+        enc->mul = mul_region_ssse3;
+        enc->mul_add = mul_add_region_ssse3;
+    }
+#elif defined(__aarch64__)
+    enc->mul = mul_region_neon;
+    enc->mul_add = mul_add_region_neon;
+#endif
+
+    /* the parity of a codeword with only the last data byte set holds the
+       coefficients that multiply the feedback into each parity byte */
+    uint8_t data[FEC_RSM];
+    uint8_t parity[FEC_RSM];
+
+    memset(data, 0, sizeof(data));
+    data[enc->rs_n - 1] = 1;
+    encode_rs_char(rs, data, parity);
+
+    for (int m = 0; m < roots; ++m) {
+        gf_table_init(&enc->tables[m], parity[m]);
+    }
+
+    /* compare against the reference encoder with an arbitrary codeword */
+    const uint8_t *columns[FEC_RSM];
+    uint8_t expected[FEC_RSM];
+    uint8_t work[FEC_RSM];
+    uint32_t seed = 1;
+
+    for (int j = 0; j < enc->rs_n; ++j) {
+        seed = seed * 1103515245 + 12345;
+        data[j] = (uint8_t)(seed >> 16);
+        columns[j] = &data[j];
+    }
+
+    encode_rs_char(rs, data, expected);
+    gf_encode_tile(enc, columns, 1, parity, work);
+
+    return !memcmp(expected, parity, roots);
+}
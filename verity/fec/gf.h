@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __FEC_GF_H__
+#define __FEC_GF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <fec/ecc.h>
+
+/* products of a constant and every element of GF(2^8) */
+struct gf_mul_table {
+    uint8_t full[256];
+    /* products of the low and high nibbles, for table lookups with vector
+       shuffle instructions */
+    uint8_t lo[16];
+    uint8_t hi[16];
+};
+
+typedef void (*gf_region_func)(uint8_t *dst, const uint8_t *src, size_t size,
+        const gf_mul_table *table);
+
+/* encodes a tile of consecutive RS codewords at once; because of
+   interleaving, byte j of each codeword in the tile comes from a contiguous
+   run of the input, which the encoder processes as a vector */
+struct gf_encoder {
+    int roots;
+    int rs_n;
+    /* multiplies the feedback into each parity position */
+    gf_mul_table tables[FEC_RSM];
+    gf_region_func mul;
+    gf_region_func mul_add;
+};
+
+extern bool gf_encoder_init(gf_encoder *enc, void *rs, int roots);
+
+extern void gf_encode_tile(const gf_encoder *enc, const uint8_t **columns,
+        size_t count, uint8_t *parity, uint8_t *work);
+
+#endif // __FEC_GF_H__
@@ -21,6 +21,7 @@ extern "C" {
     #include <fec.h>
 }
 
+#include <algorithm>
 #include <assert.h>
 #include <android-base/file.h>
 #include <errno.h>
@@ -43,6 +44,10 @@ extern "C" {
     #define O_LARGEFILE 0
 #endif
 
+#ifndef SPARSE_HEADER_MAGIC
+    #define SPARSE_HEADER_MAGIC 0xed26ff3a
+#endif
+
 void image_init(image *ctx)
 {
     memset(ctx, 0, sizeof(*ctx));
@@ -60,6 +65,10 @@ void image_free(image *ctx)
         delete[] ctx->fec;
     }
 
+    if (ctx->window) {
+        delete[] ctx->window;
+    }
+
     image_init(ctx);
 }
 
@@ -288,7 +297,9 @@ bool image_ecc_load(const std::string& filename, image *ctx)
     return true;
 }
 
-bool image_ecc_save(image *ctx)
+/* writes the padding and the header that follow ecc data with the SHA-256
+   digest `hash' to `fd' */
+static void ecc_write_trailer(int fd, image *ctx, const uint8_t *hash)
 {
     assert(2 * sizeof(fec_header) <= FEC_BLOCKSIZE);
 
@@ -303,26 +314,12 @@ bool image_ecc_save(image *ctx)
     f->fec_size = ctx->fec_size;
     f->inp_size = ctx->inp_size;
 
-    SHA256(ctx->fec, ctx->fec_size, f->hash);
+    memcpy(f->hash, hash, SHA256_DIGEST_LENGTH);
 
     /* store a copy of the fec_header at the end of the header block */
     memcpy(&header[sizeof(header) - sizeof(fec_header)], header,
         sizeof(fec_header));
 
-    assert(ctx->fec_filename);
-
-    int fd = TEMP_FAILURE_RETRY(open(ctx->fec_filename,
-                O_WRONLY | O_CREAT | O_TRUNC, 0666));
-
-    if (fd < 0) {
-        FATAL("failed to open file '%s': %s\n", ctx->fec_filename,
-            strerror(errno));
-    }
-
-    if (!android::base::WriteFully(fd, ctx->fec, ctx->fec_size)) {
-        FATAL("failed to write to output: %s\n", strerror(errno));
-    }
-
     if (ctx->padding > 0) {
         uint8_t padding[FEC_BLOCKSIZE] = {0};
 
@@ -336,7 +333,28 @@ bool image_ecc_save(image *ctx)
     if (!android::base::WriteFully(fd, header, sizeof(header))) {
         FATAL("failed to write to header: %s\n", strerror(errno));
     }
+}
+
+bool image_ecc_save(image *ctx)
+{
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    SHA256(ctx->fec, ctx->fec_size, hash);
+
+    assert(ctx->fec_filename);
+
+    int fd = TEMP_FAILURE_RETRY(open(ctx->fec_filename,
+                O_WRONLY | O_CREAT | O_TRUNC, 0666));
 
+    if (fd < 0) {
+        FATAL("failed to open file '%s': %s\n", ctx->fec_filename,
+            strerror(errno));
+    }
+
+    if (!android::base::WriteFully(fd, ctx->fec, ctx->fec_size)) {
+        FATAL("failed to write to output: %s\n", strerror(errno));
+    }
+
+    ecc_write_trailer(fd, ctx, hash);
     close(fd);
 
     return true;
@@ -363,6 +381,16 @@ bool image_process(image_proc_func func, image *ctx)
 
     assert(ctx->rounds > 0);
 
+    /* with a window, only its codewords are processed, and ctx->fec holds
+       just their parity */
+    uint64_t first = 0;
+    uint64_t codewords = ctx->rounds * FEC_BLOCKSIZE;
+
+    if (ctx->window) {
+        first = ctx->window_start;
+        codewords = ctx->window_codewords;
+    }
+
     if ((uint64_t)threads > ctx->rounds) {
         threads = (int)ctx->rounds;
     }
@@ -378,10 +406,12 @@ bool image_process(image_proc_func func, image *ctx)
     pthread_t pthreads[threads];
     image_proc_ctx args[threads];
 
-    uint64_t current = 0;
-    uint64_t end = ctx->rounds * ctx->rs_n * FEC_BLOCKSIZE;
-    uint64_t rs_blocks_per_thread =
-        fec_div_round_up(ctx->rounds * FEC_BLOCKSIZE, threads);
+    uint64_t current = first;
+    uint64_t end = (first + codewords) * ctx->rs_n;
+    uint64_t rs_blocks_per_thread = fec_div_round_up(codewords, threads);
+
+    /* a small window may not have enough codewords for every thread */
+    threads = (int)fec_div_round_up(codewords, rs_blocks_per_thread);
 
     if (ctx->verbose) {
         INFO("computing %" PRIu64 " codes per thread\n", rs_blocks_per_thread);
@@ -392,7 +422,7 @@ bool image_process(image_proc_func func, image *ctx)
         args[i].id = i;
         args[i].ctx = ctx;
         args[i].rv = 0;
-        args[i].fec_pos = current * ctx->roots;
+        args[i].fec_pos = (current - first) * ctx->roots;
         args[i].start = current * ctx->rs_n;
         args[i].end = (current + rs_blocks_per_thread) * ctx->rs_n;
 
@@ -441,3 +471,168 @@ bool image_process(image_proc_func func, image *ctx)
 
     return true;
 }
+
+/* reads `size' bytes from `offset' in the concatenation of `fds', whose
+   sizes are in `sizes' */
+static void stream_read(const std::vector<int>& fds,
+        const std::vector<uint64_t>& sizes, uint64_t offset, uint8_t *data,
+        size_t size)
+{
+    uint64_t start = 0;
+
+    for (size_t i = 0; i < fds.size() && size > 0; ++i) {
+        if (offset >= start + sizes[i]) {
+            start += sizes[i];
+            continue;
+        }
+
+        size_t n = (size_t)std::min<uint64_t>(size, start + sizes[i] - offset);
+
+        if (lseek64(fds[i], offset - start, SEEK_SET) < 0 ||
+                !android::base::ReadFully(fds[i], data, n)) {
+            FATAL("failed to read input: %s\n", strerror(errno));
+        }
+
+        data += n;
+        offset += n;
+        size -= n;
+        start += sizes[i];
+    }
+
+    assert(size == 0);
+}
+
+/* encodes raw input files to `fec_filename' a window of codewords at a
+   time, writing parity as it is computed; returns false without writing
+   anything if an input is a sparse image, which must be loaded instead */
+bool image_stream_encode(const std::vector<std::string>& filenames,
+        const std::string& fec_filename, image_proc_func func, image *ctx)
+{
+    assert(ctx->roots > 0 && ctx->roots < FEC_RSM);
+    assert(ctx->window_size > 0);
+    ctx->rs_n = FEC_RSM - ctx->roots;
+
+    if (ctx->sparse) {
+        return false;
+    }
+
+    std::vector<int> fds;
+    std::vector<uint64_t> sizes;
+    uint64_t size = 0;
+    bool sparse = false;
+
+    for (const auto& fn : filenames) {
+        int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY | O_LARGEFILE));
+
+        if (fd < 0) {
+            FATAL("failed to open file '%s': %s\n", fn.c_str(), strerror(errno));
+        }
+
+        uint32_t magic = 0;
+
+        if (android::base::ReadFully(fd, &magic, sizeof(magic)) &&
+                magic == SPARSE_HEADER_MAGIC) {
+            sparse = true;
+        }
+
+        off64_t len = lseek64(fd, 0, SEEK_END);
+
+        if (len < 0) {
+            FATAL("failed to get the size of '%s': %s\n", fn.c_str(),
+                strerror(errno));
+        }
+
+        fds.push_back(fd);
+        sizes.push_back((uint64_t)len);
+        size += (uint64_t)len;
+    }
+
+    if (sparse) {
+        for (auto fd : fds) {
+            close(fd);
+        }
+
+        return false;
+    }
+
+    calculate_rounds(size, ctx);
+
+    ctx->fec_filename = fec_filename.c_str();
+    ctx->fec_size = ctx->rounds * ctx->roots * FEC_BLOCKSIZE;
+
+    /* each codeword in the window takes rs_n bytes of input */
+    uint64_t codewords = ctx->rounds * FEC_BLOCKSIZE;
+    uint64_t window = ctx->window_size / ctx->rs_n;
+
+    window -= window % IMAGE_TILE_CODEWORDS;
+    window = std::max<uint64_t>(window, IMAGE_TILE_CODEWORDS);
+    window = std::min(window, codewords);
+
+    if (ctx->verbose) {
+        INFO("\traw fec size: %u\n", ctx->fec_size);
+        INFO("\tblocks: %" PRIu64 "\n", ctx->blocks);
+        INFO("\trounds: %" PRIu64 "\n", ctx->rounds);
+        INFO("\twindow: %" PRIu64 " codewords, %" PRIu64 " bytes\n", window,
+            window * ctx->rs_n);
+    }
+
+    ctx->window = new uint8_t[window * ctx->rs_n];
+    ctx->fec = new uint8_t[window * ctx->roots];
+
+    int fd = TEMP_FAILURE_RETRY(open(ctx->fec_filename,
+                O_WRONLY | O_CREAT | O_TRUNC, 0666));
+
+    if (fd < 0) {
+        FATAL("failed to open file '%s': %s\n", ctx->fec_filename,
+            strerror(errno));
+    }
+
+    SHA256_CTX sha;
+    SHA256_Init(&sha);
+
+    uint64_t column_size = ctx->rounds * FEC_BLOCKSIZE;
+
+    for (uint64_t c = 0; c < codewords; c += window) {
+        ctx->window_start = c;
+        ctx->window_codewords = std::min(window, codewords - c);
+
+        /* codewords are interleaved so that byte j of consecutive codewords
+           is in consecutive bytes of column j */
+        for (int j = 0; j < ctx->rs_n; ++j) {
+            uint8_t *data = &ctx->window[j * ctx->window_codewords];
+            uint64_t offset = j * column_size + c;
+            size_t n = 0;
+
+            if (offset < ctx->inp_size) {
+                n = (size_t)std::min(ctx->window_codewords,
+                        ctx->inp_size - offset);
+                stream_read(fds, sizes, offset, data, n);
+            }
+
+            memset(&data[n], 0, ctx->window_codewords - n);
+        }
+
+        if (!image_process(func, ctx)) {
+            FATAL("failed to process input\n");
+        }
+
+        size_t fec_size = ctx->window_codewords * ctx->roots;
+        SHA256_Update(&sha, ctx->fec, fec_size);
+
+        if (!android::base::WriteFully(fd, ctx->fec, fec_size)) {
+            FATAL("failed to write to output: %s\n", strerror(errno));
+        }
+    }
+
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    SHA256_Final(hash, &sha);
+
+    ecc_write_trailer(fd, ctx, hash);
+    close(fd);
+
+    for (auto fd : fds) {
+        close(fd);
+    }
+
+    return true;
+}
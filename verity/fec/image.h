@@ -25,6 +25,11 @@
 
 #define IMAGE_MIN_THREADS     1
 #define IMAGE_MAX_THREADS     128
+/* codewords encoded at once; a tile reads this many bytes from each of the
+   rs_n interleaved columns */
+#define IMAGE_TILE_CODEWORDS  1024
+/* default memory used for input data when encoding raw images */
+#define IMAGE_DEFAULT_WINDOW  (64 * 1024 * 1024)
 
 #define INFO(x...) \
     fprintf(stderr, x);
@@ -34,6 +39,7 @@
 }
 
 #define unlikely(x)    __builtin_expect(!!(x), 0)
+#define likely(x)      __builtin_expect(!!(x), 1)
 
 struct image {
     /* if true, decode file in place instead of creating a new output file */
@@ -61,6 +67,14 @@ struct image {
     uint8_t *fec;
     uint8_t *input;
     uint8_t *output;
+    /* if nonzero, raw input files are encoded using at most this many bytes
+       of input data at a time instead of being loaded into memory */
+    uint64_t window_size;
+    /* the codewords in the current window; byte j of each codeword is in
+       the j:th run of `window_codewords' bytes in `window' */
+    uint64_t window_start;
+    uint64_t window_codewords;
+    uint8_t *window;
 };
 
 struct image_proc_ctx;
@@ -85,12 +99,24 @@ extern bool image_ecc_load(const std::string& filename, image *ctx);
 extern bool image_ecc_save(image *ctx);
 
 extern bool image_process(image_proc_func f, image *ctx);
+extern bool image_stream_encode(const std::vector<std::string>& filenames,
+        const std::string& fec_filename, image_proc_func f, image *ctx);
 
 extern void image_init(image *ctx);
 extern void image_free(image *ctx);
 
 inline uint8_t image_get_interleaved_byte(uint64_t i, image *ctx)
 {
+    if (ctx->window) {
+        uint64_t c = i / ctx->rs_n;
+
+        assert(c >= ctx->window_start &&
+            c < ctx->window_start + ctx->window_codewords);
+
+        return ctx->window[(i % ctx->rs_n) * ctx->window_codewords +
+                    (c - ctx->window_start)];
+    }
+
     uint64_t offset = fec_ecc_interleave(i, ctx->rs_n, ctx->rounds);
 
     if (unlikely(offset >= ctx->inp_size)) {
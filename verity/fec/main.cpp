@@ -28,7 +28,11 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <memory>
+
 #include <android-base/file.h>
+#include "gf.h"
 #include "image.h"
 
 enum {
@@ -39,6 +43,38 @@ enum {
     MODE_GETVERITYSTART
 };
 
+/* points `columns' to the bytes of the `count' codewords starting from
+   codeword `c', using `zero' and `partial' for bytes past the end of the
+   input, which are zero */
+static void get_tile_columns(struct image *fcx, uint64_t c, size_t count,
+        const uint8_t **columns, const uint8_t *zero, uint8_t *partial)
+{
+    if (fcx->window) {
+        for (int j = 0; j < fcx->rs_n; ++j) {
+            columns[j] = &fcx->window[j * fcx->window_codewords +
+                            (c - fcx->window_start)];
+        }
+
+        return;
+    }
+
+    for (int j = 0; j < fcx->rs_n; ++j) {
+        uint64_t offset = fec_ecc_interleave(c * fcx->rs_n + j, fcx->rs_n,
+                            fcx->rounds);
+
+        if (likely(offset + count <= fcx->inp_size)) {
+            columns[j] = &fcx->input[offset];
+        } else if (offset >= fcx->inp_size) {
+            columns[j] = zero;
+        } else {
+            size_t size = (size_t)(fcx->inp_size - offset);
+            memcpy(partial, &fcx->input[offset], size);
+            memset(&partial[size], 0, count - size);
+            columns[j] = partial;
+        }
+    }
+}
+
 static void encode_rs(struct image_proc_ctx *ctx)
 {
     struct image *fcx = ctx->ctx;
@@ -46,6 +82,36 @@ static void encode_rs(struct image_proc_ctx *ctx)
     uint8_t data[fcx->rs_n];
     uint64_t i;
 
+    std::unique_ptr<gf_encoder> enc(new gf_encoder);
+
+    if (gf_encoder_init(enc.get(), ctx->rs, fcx->roots)) {
+        std::vector<uint8_t> work(fcx->roots * IMAGE_TILE_CODEWORDS);
+        std::vector<uint8_t> zero(IMAGE_TILE_CODEWORDS);
+        std::vector<uint8_t> partial(IMAGE_TILE_CODEWORDS);
+        const uint8_t *columns[fcx->rs_n];
+
+        uint64_t end = ctx->end / fcx->rs_n;
+
+        for (uint64_t c = ctx->start / fcx->rs_n; c < end;) {
+            size_t count = (size_t)std::min<uint64_t>(end - c,
+                                IMAGE_TILE_CODEWORDS);
+
+            get_tile_columns(fcx, c, count, columns, zero.data(),
+                partial.data());
+            gf_encode_tile(enc.get(), columns, count,
+                &fcx->fec[ctx->fec_pos], work.data());
+
+            ctx->fec_pos += count * fcx->roots;
+            c += count;
+        }
+
+        return;
+    }
+
+    if (ctx->id == 0) {
+        INFO("using the byte-at-a-time encoder\n");
+    }
+
     for (i = ctx->start; i < ctx->end; i += fcx->rs_n) {
         for (j = 0; j < fcx->rs_n; ++j) {
             data[j] = image_get_interleaved_byte(i + j, fcx);
@@ -56,36 +122,80 @@ static void encode_rs(struct image_proc_ctx *ctx)
     }
 }
 
-static void decode_rs(struct image_proc_ctx *ctx)
+/* decodes the codeword starting from byte `i', with parity at `fec_pos' */
+static void decode_codeword(struct image_proc_ctx *ctx, uint64_t i,
+        uint64_t fec_pos)
 {
     struct image *fcx = ctx->ctx;
     int j, rv;
     uint8_t data[fcx->rs_n + fcx->roots];
-    uint64_t i;
 
     assert(sizeof(data) == FEC_RSM);
 
-    for (i = ctx->start; i < ctx->end; i += fcx->rs_n) {
+    for (j = 0; j < fcx->rs_n; ++j) {
+        data[j] = image_get_interleaved_byte(i + j, fcx);
+    }
+
+    memcpy(&data[fcx->rs_n], &fcx->fec[fec_pos], fcx->roots);
+    rv = decode_rs_char(ctx->rs, data, NULL, 0);
+
+    if (rv < 0) {
+        FATAL("failed to recover [%" PRIu64 ", %" PRIu64 ")\n",
+            i, i + fcx->rs_n);
+    } else if (rv > 0) {
+        /* copy corrected data to output */
         for (j = 0; j < fcx->rs_n; ++j) {
-            data[j] = image_get_interleaved_byte(i + j, fcx);
+            image_set_interleaved_byte(i + j, fcx, data[j]);
         }
 
-        memcpy(&data[fcx->rs_n], &fcx->fec[ctx->fec_pos], fcx->roots);
-        rv = decode_rs_char(ctx->rs, data, NULL, 0);
+        ctx->rv += rv;
+    }
+}
 
-        if (rv < 0) {
-            FATAL("failed to recover [%" PRIu64 ", %" PRIu64 ")\n",
-                i, i + fcx->rs_n);
-        } else if (rv > 0) {
-            /* copy corrected data to output */
-            for (j = 0; j < fcx->rs_n; ++j) {
-                image_set_interleaved_byte(i + j, fcx, data[j]);
-            }
+static void decode_rs(struct image_proc_ctx *ctx)
+{
+    struct image *fcx = ctx->ctx;
+    uint64_t i;
+
+    std::unique_ptr<gf_encoder> enc(new gf_encoder);
 
-            ctx->rv += rv;
+    if (!gf_encoder_init(enc.get(), ctx->rs, fcx->roots)) {
+        for (i = ctx->start; i < ctx->end; i += fcx->rs_n) {
+            decode_codeword(ctx, i, ctx->fec_pos);
+            ctx->fec_pos += fcx->roots;
         }
 
-        ctx->fec_pos += fcx->roots;
+        return;
+    }
+
+    /* re-encode the data a tile at a time, and only decode the codewords
+       whose parity differs */
+    std::vector<uint8_t> work(fcx->roots * IMAGE_TILE_CODEWORDS);
+    std::vector<uint8_t> parity(fcx->roots * IMAGE_TILE_CODEWORDS);
+    std::vector<uint8_t> zero(IMAGE_TILE_CODEWORDS);
+    std::vector<uint8_t> partial(IMAGE_TILE_CODEWORDS);
+    const uint8_t *columns[fcx->rs_n];
+
+    uint64_t end = ctx->end / fcx->rs_n;
+
+    for (uint64_t c = ctx->start / fcx->rs_n; c < end;) {
+        size_t count = (size_t)std::min<uint64_t>(end - c,
+                            IMAGE_TILE_CODEWORDS);
+
+        get_tile_columns(fcx, c, count, columns, zero.data(), partial.data());
+        gf_encode_tile(enc.get(), columns, count, parity.data(), work.data());
+
+        for (size_t n = 0; n < count; ++n) {
+            uint64_t fec_pos = ctx->fec_pos + n * fcx->roots;
+
+            if (memcmp(&parity[n * fcx->roots], &fcx->fec[fec_pos],
+                    fcx->roots)) {
+                decode_codeword(ctx, (c + n) * fcx->rs_n, fec_pos);
+            }
+        }
+
+        ctx->fec_pos += count * fcx->roots;
+        c += count;
     }
 }
 
@@ -108,6 +218,10 @@ static int usage()
            "  -S                                treat data as a sparse file\n"
            "encoding options:\n"
            "  -p, --padding=<bytes>             add padding after ECC data\n"
+           "  -w, --window=<bytes>              encode raw images using at most\n"
+           "                                    <bytes> of memory for input data\n"
+           "                                    (default 64 MiB); 0 loads the\n"
+           "                                    entire image\n"
            "decoding options:\n"
            "  -i, --inplace                     correct <data> in place\n"
         );
@@ -176,6 +290,22 @@ static int encode(image& ctx, const std::vector<std::string>& inp_filenames,
         FATAL("invalid parameters: inplace can only used when decoding\n");
     }
 
+    INFO("encoding RS(255, %d) to '%s' for input files:\n",
+        FEC_RSM - ctx.roots, fec_filename.c_str());
+
+    size_t n = 1;
+
+    for (const auto& fn : inp_filenames) {
+        INFO("\t%zu: '%s'\n", n++, fn.c_str());
+    }
+
+    /* raw images are read and encoded a window at a time */
+    if (ctx.window_size > 0 &&
+            image_stream_encode(inp_filenames, fec_filename, encode_rs, &ctx)) {
+        image_free(&ctx);
+        return 0;
+    }
+
     if (!image_load(inp_filenames, &ctx)) {
         FATAL("failed to read input\n");
     }
@@ -184,15 +314,6 @@ static int encode(image& ctx, const std::vector<std::string>& inp_filenames,
         FATAL("failed to allocate ecc\n");
     }
 
-    INFO("encoding RS(255, %d) to '%s' for input files:\n", ctx.rs_n,
-        fec_filename.c_str());
-
-    size_t n = 1;
-
-    for (const auto& fn : inp_filenames) {
-        INFO("\t%zu: '%s'\n", n++, fn.c_str());
-    }
-
     if (ctx.verbose) {
         INFO("\traw fec size: %u\n", ctx.fec_size);
         INFO("\tblocks: %" PRIu64 "\n", ctx.blocks);
@@ -276,6 +397,7 @@ int main(int argc, char **argv)
 
     image_init(&ctx);
     ctx.roots = FEC_DEFAULT_ROOTS;
+    ctx.window_size = IMAGE_DEFAULT_WINDOW;
 
     while (1) {
         const static struct option long_options[] = {
@@ -291,9 +413,10 @@ int main(int argc, char **argv)
             {"get-verity-start", required_argument, 0, 'V'},
             {"padding", required_argument, 0, 'p'},
             {"verbose", no_argument, 0, 'v'},
+            {"window", required_argument, 0, 'w'},
             {NULL, 0, 0, 0}
         };
-        int c = getopt_long(argc, argv, "hedSr:ij:s:E:V:p:v", long_options, NULL);
+        int c = getopt_long(argc, argv, "hedSr:ij:s:E:V:p:vw:", long_options, NULL);
         if (c < 0) {
             break;
         }
@@ -354,6 +477,9 @@ int main(int argc, char **argv)
         case 'v':
             ctx.verbose = true;
             break;
+        case 'w':
+            ctx.window_size = parse_arg(optarg, "window", UINT64_MAX);
+            break;
         case '?':
             return usage();
         default: